@@ -0,0 +1,475 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "server.h"
+#include "history.h"
+#include "request.h"
+#include "plan.h"
+#include "action.h"
+
+#if !ENABLE_TRACE_ACTION
+#include "trace_undef.h"
+#endif
+
+#define CFG_ACTION_MAX              4096
+#define CFG_ACTION_WRITES           64       // writes waiting for the bus
+#define CFG_ACTION_RETRY            100      // ms, timer write refused by the bus queue
+#define ACTION_DAY_MS               86400000LL
+
+// Write of target queued as bus job of the write class
+typedef struct
+{
+   uint8_t used;
+   action_target_t target;
+   uint16_t interlock;        // coil switched off before target is switched on
+   int on;
+   int result;
+
+} action_write_t;
+
+static action_t actions[CFG_ACTION_MAX];
+static uint16_t free_list[CFG_ACTION_MAX];
+static int free_cnt = 0;
+static int config_cnt = 0;            // configured actions in use
+static action_write_t writes[CFG_ACTION_WRITES];
+static profile_read_t toggle_op;
+static int bus_sd = -1;
+
+
+// Next occurrence of local time of day 'at' repeated every period, as monotonic time
+static int64_t action_next_aligned(uint32_t period, int32_t at)
+{
+   struct tm tm;
+   time_t sec;
+   int64_t wall, base, k, step;
+
+   wall = systime_wall_ms();
+   sec = wall / 1000;
+   localtime_r(&sec, &tm);
+   tm.tm_hour = 0;
+   tm.tm_min = 0;
+   tm.tm_sec = 0;
+   tm.tm_isdst = -1;
+
+   base = (int64_t)mktime(&tm) * 1000 + (int64_t)at * 1000;
+   step = (period > 0) ? period : ACTION_DAY_MS;
+
+   // Smallest base + k * step later than now
+   k = (wall - base) / step;
+   if (wall - base < 0 && (wall - base) % step != 0)
+      k--;
+   k++;
+
+   return systime_ms() + (base + k * step - wall);
+}
+
+static int action_target_equal(const action_target_t *a, const action_target_t *b)
+{
+   return a->type == b->type && a->op == b->op && a->unit == b->unit && a->addr == b->addr && a->value == b->value;
+}
+
+// Slots of configured timers are not taken by actions of clients and rules, so
+// that reload always finds room for them
+static action_t *action_alloc(int config)
+{
+   action_t *action;
+
+   if (free_cnt <= (config ? 0 : ACTION_MAX_CONFIG - config_cnt))
+   {
+      TRACE_ERROR("No free action");
+      return NULL;
+   }
+
+   action = &actions[free_list[--free_cnt]];
+   action->used = 1;
+   action->config = config;
+   config_cnt += config;
+
+   return action;
+}
+
+static void action_free(action_t *action)
+{
+   timer_del(&action->timer);
+   config_cnt -= action->config;
+   action->used = 0;
+   action->config = 0;
+   action->done = 0;
+   action->next = 0;
+   free_list[free_cnt++] = action - actions;
+}
+
+static void action_timer_cb(wheel_timer_t *timer, void *arg)
+{
+   action_t *action = arg;
+   action_target_t target;
+   int64_t next;
+
+   (void)timer;
+
+   TRACE("Action %d fired, unit 0x%X addr %d", action->id, action->target.unit, action->target.addr);
+
+   switch(action->kind)
+   {
+      case ACTION_ONCE:
+         if (action_submit_write(&action->target, ACTION_NO_INTERLOCK) < 0)
+         {
+            timer_add(&action->timer, systime_ms() + CFG_ACTION_RETRY);
+            break;
+         }
+         // Configured action is kept so that reload does not fire it again
+         if (action->config)
+            action->done = 1;
+         else
+            action_free(action);
+         break;
+
+      case ACTION_PERIODIC:
+         // Retries of refused write do not shift the period
+         if ((next = action->next) == 0)
+            next = (action->at >= 0) ? action_next_aligned(action->period, action->at) : action->timer.expires + action->period;
+         action->next = 0;
+
+         if (action_submit_write(&action->target, ACTION_NO_INTERLOCK) < 0 && systime_ms() + CFG_ACTION_RETRY < next)
+         {
+            action->next = next;
+            timer_add(&action->timer, systime_ms() + CFG_ACTION_RETRY);
+         }
+         else
+         {
+            timer_add(&action->timer, next);
+         }
+         break;
+
+      case ACTION_STAIRCASE:
+         target = action->target;
+         target.op = ACTION_OP_SET;
+         target.value = 0;
+         // Light is not left on when the bus queue is full
+         if (action_submit_write(&target, ACTION_NO_INTERLOCK) < 0)
+            timer_add(&action->timer, systime_ms() + CFG_ACTION_RETRY);
+         else
+            action_free(action);
+         break;
+   }
+}
+
+int action_init(int sd)
+{
+   int ix;
+
+   bus_sd = sd;
+   free_cnt = 0;
+   config_cnt = 0;
+   memset(writes, 0, sizeof(writes));
+
+   for (ix = CFG_ACTION_MAX - 1; ix >= 0; ix--)
+   {
+      memset(&actions[ix], 0, sizeof(action_t));
+      actions[ix].id = ix + 1;
+      timer_init(&actions[ix].timer, action_timer_cb, &actions[ix]);
+      free_list[free_cnt++] = ix;
+   }
+
+   return 0;
+}
+
+static uint32_t action_write_cost(const action_write_t *w)
+{
+   const action_target_t *target = &w->target;
+   uint32_t cost = plan_transaction_cost(target->unit, 8, 8);
+
+   if (target->type == MODBUS_FUNC_WRITE_COIL && target->op == ACTION_OP_TOGGLE && server_find_cached(target->unit) == NULL)
+      cost += plan_read_cost(target->unit, MODBUS_FUNC_READ_COILS, 1);
+
+   if (w->interlock != ACTION_NO_INTERLOCK)
+      cost += plan_transaction_cost(target->unit, 8, 8);
+
+   return cost;
+}
+
+// Toggle reads state of the coil first, cached servers know it without bus access
+static int action_write_job(request_t *req, modbus_txn_t *txn)
+{
+   action_write_t *w = req->arg;
+   const action_target_t *target = &w->target;
+   modbus_server_t *server;
+
+   CORO_BEGIN(&req->coro);
+
+   if (target->type == MODBUS_FUNC_WRITE_SINGLE_REGISTER)
+   {
+      if (modbus_txn_write_register(txn, bus_sd, target->unit, target->addr, target->value) == 0)
+      {
+         MODBUS_TXN_AWAIT(&req->coro, txn);
+      }
+      else
+      {
+         txn->result = -1;
+      }
+
+      if (txn->result < 0)
+         TRACE_ERROR("Action write of register 0x%X/%d failed", target->unit, target->addr);
+
+      w->used = 0;
+      CORO_EXIT(&req->coro);
+   }
+
+   w->on = (target->value != 0);
+   w->result = 0;
+
+   if (target->op == ACTION_OP_TOGGLE)
+   {
+      if ((server = server_find_cached(target->unit)) != NULL)
+      {
+         w->result = (target->addr < server->profile.coils) ? 0 : -1;
+         w->on = !bitset_get(&server->coils_state, target->addr);
+      }
+      else
+      {
+         if (profile_read_init(&toggle_op, bus_sd, server_profile(target->unit), target->unit, MODBUS_FUNC_READ_COILS, target->addr, 1) == 0)
+            CORO_AWAIT_CALL(&req->coro, &toggle_op.coro, profile_read_step(&toggle_op, txn));
+
+         w->result = toggle_op.result;
+         w->on = !bitset_get(&toggle_op.state, 0);
+      }
+   }
+
+   // Interlocked coil have to be off before target is switched on
+   if (w->result == 0 && w->on && w->interlock != ACTION_NO_INTERLOCK)
+   {
+      if (server_txn_write_coil(txn, bus_sd, target->unit, w->interlock, 0) == 0)
+      {
+         MODBUS_TXN_AWAIT(&req->coro, txn);
+      }
+      else
+      {
+         txn->result = -1;
+      }
+
+      if ((w->result = txn->result) == 0)
+         server_coil_written(target->unit, w->interlock, 0);
+      else
+         TRACE_ERROR("Interlock coil 0x%X/%d switch off failed", target->unit, w->interlock);
+   }
+
+   if (w->result == 0)
+   {
+      if (server_txn_write_coil(txn, bus_sd, target->unit, target->addr, w->on) == 0)
+      {
+         MODBUS_TXN_AWAIT(&req->coro, txn);
+      }
+      else
+      {
+         txn->result = -1;
+      }
+
+      if ((w->result = txn->result) == 0)
+      {
+         server_coil_written(target->unit, target->addr, w->on);
+         history_record(target->unit, MODBUS_FUNC_READ_COILS, target->addr, w->on);
+      }
+   }
+
+   if (w->result < 0)
+      TRACE_ERROR("Action write of coil 0x%X/%d failed", target->unit, target->addr);
+
+   w->used = 0;
+
+   CORO_END(&req->coro);
+}
+
+// Queue write of target for the bus, interlock coil (ACTION_NO_INTERLOCK none) is
+// switched off before the target is switched on. Returns -1 when the write is refused.
+int action_submit_write(const action_target_t *target, uint16_t interlock)
+{
+   action_write_t *w;
+   int ix;
+
+   for (ix = 0; ix < CFG_ACTION_WRITES && writes[ix].used; ix++);
+
+   if (ix == CFG_ACTION_WRITES)
+   {
+      TRACE_ERROR("No free action write");
+      return -1;
+   }
+
+   w = &writes[ix];
+   w->target = *target;
+   w->interlock = interlock;
+
+   if (request_submit_job(REQUEST_CLASS_WRITE, action_write_cost(w), action_write_job, w) < 0)
+   {
+      TRACE_ERROR("Action write 0x%X/%d refused", target->unit, target->addr);
+      return -1;
+   }
+
+   w->used = 1;
+
+   return 0;
+}
+
+// Switch coil on now and off after delay, running staircase of the coil is retriggered
+int action_add_staircase(const action_target_t *target, uint32_t delay, uint16_t interlock)
+{
+   action_t *action;
+   int ix;
+
+   if (target->type != MODBUS_FUNC_WRITE_COIL)
+      return -1;
+
+   // Retrigger running staircase timer of the same coil, no bus traffic unless interlocked
+   for (ix = 0; ix < CFG_ACTION_MAX; ix++)
+   {
+      action = &actions[ix];
+      if (action->used && action->kind == ACTION_STAIRCASE && action->target.unit == target->unit &&
+          action->target.addr == target->addr)
+      {
+         if (interlock != ACTION_NO_INTERLOCK && action_submit_write(&action->target, interlock) < 0)
+            return -1;
+
+         timer_add(&action->timer, systime_ms() + delay);
+         return action->id;
+      }
+   }
+
+   if ((action = action_alloc(0)) == NULL)
+      return -1;
+
+   action->kind = ACTION_STAIRCASE;
+   action->target = *target;
+   action->target.op = ACTION_OP_SET;
+   action->delay = delay;
+   action->period = 0;
+   action->at = -1;
+
+   if (action_submit_write(&action->target, interlock) < 0)
+   {
+      action_free(action);
+      return -1;
+   }
+
+   timer_add(&action->timer, systime_ms() + delay);
+
+   TRACE("Action %d added, staircase expires in %u ms", action->id, delay);
+
+   return action->id;
+}
+
+static void action_start(action_t *action, uint8_t kind, const action_target_t *target, uint32_t delay, uint32_t period, int32_t at)
+{
+   int64_t expires;
+
+   action->kind = kind;
+   action->target = *target;
+   action->delay = delay;
+   action->period = period;
+   action->at = at;
+   action->next = 0;
+
+   if (at >= 0)
+      expires = action_next_aligned(period, at);
+   else
+      expires = systime_ms() + ((kind == ACTION_PERIODIC && delay == 0) ? period : delay);
+
+   timer_add(&action->timer, expires);
+
+   TRACE("Action %d added, kind %d expires in %lld ms", action->id, kind, (long long)(expires - systime_ms()));
+}
+
+int action_add(uint8_t kind, const action_target_t *target, uint32_t delay, uint32_t period, int32_t at)
+{
+   action_t *action;
+
+   if (kind == ACTION_STAIRCASE)
+      return action_add_staircase(target, delay, ACTION_NO_INTERLOCK);
+
+   if (kind == ACTION_PERIODIC && period == 0 && at < 0)
+      return -1;
+
+   if ((action = action_alloc(0)) == NULL)
+      return -1;
+
+   action_start(action, kind, target, delay, period, at);
+
+   return action->id;
+}
+
+int action_cancel(uint16_t id)
+{
+   if (id == 0 || id > CFG_ACTION_MAX || !actions[id - 1].used)
+      return -1;
+
+   action_free(&actions[id - 1]);
+
+   return 0;
+}
+
+int action_count(void)
+{
+   return CFG_ACTION_MAX - free_cnt;
+}
+
+void action_mark_config(void)
+{
+   int ix;
+
+   for (ix = 0; ix < CFG_ACTION_MAX; ix++)
+      actions[ix].mark = actions[ix].used && actions[ix].config;
+}
+
+// Unchanged configured action keeps running with its phase, returns 1 when it is kept
+int action_keep_config(uint8_t kind, const action_target_t *target, uint32_t delay, uint32_t period, int32_t at)
+{
+   action_t *action;
+   int ix;
+
+   for (ix = 0; ix < CFG_ACTION_MAX; ix++)
+   {
+      action = &actions[ix];
+      if (action->used && action->config && action->mark && action->kind == kind && action->delay == delay &&
+          action->period == period && action->at == at && action_target_equal(&action->target, target))
+      {
+         action->mark = 0;
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+// New configured action, added after sweep of removed ones into reserved slots
+int action_add_config(uint8_t kind, const action_target_t *target, uint32_t delay, uint32_t period, int32_t at)
+{
+   action_t *action;
+
+   if (kind == ACTION_STAIRCASE || (kind == ACTION_PERIODIC && period == 0 && at < 0))
+      return -1;
+
+   if ((action = action_alloc(1)) == NULL)
+      return -1;
+
+   action_start(action, kind, target, delay, period, at);
+
+   return action->id;
+}
+
+void action_sweep_config(void)
+{
+   int ix;
+
+   for (ix = 0; ix < CFG_ACTION_MAX; ix++)
+   {
+      if (actions[ix].used && actions[ix].mark)
+      {
+         TRACE("Action %d removed", actions[ix].id);
+         action_free(&actions[ix]);
+      }
+   }
+}
@@ -0,0 +1,60 @@
+#ifndef __ACTION_H
+#define __ACTION_H
+
+#include <stdint.h>
+
+#include "timerwheel.h"
+
+#define ACTION_ONCE                 0        // write target once after delay
+#define ACTION_PERIODIC             1        // write target every period, optionally aligned to time of day
+#define ACTION_STAIRCASE            2        // switch coil on now and off after delay, retrigger extends
+
+#define ACTION_OP_SET               0
+#define ACTION_OP_TOGGLE            1
+
+#define ACTION_NO_INTERLOCK         0xFFFF
+#define ACTION_MAX_CONFIG           256      // slots reserved for timers of configuration file
+
+typedef struct
+{
+   uint8_t type;              // MODBUS_FUNC_WRITE_COIL or MODBUS_FUNC_WRITE_SINGLE_REGISTER
+   uint8_t op;
+   uint8_t unit;
+   uint16_t addr;
+   uint16_t value;
+
+} action_target_t;
+
+typedef struct
+{
+   wheel_timer_t timer;
+   uint16_t id;
+   uint8_t kind;
+   uint8_t used;
+   uint8_t config;            // defined in configuration file, subject of reload
+   uint8_t mark;              // reload sweep mark
+   uint8_t done;              // configured one shot action already fired
+   action_target_t target;
+   uint32_t delay;            // ms
+   uint32_t period;           // ms
+   int32_t at;                // alignment, seconds after local midnight, -1 when not aligned
+   int64_t next;              // regular expiry of periodic action retrying refused write, 0 otherwise
+
+} action_t;
+
+
+int action_init(int sd);
+
+int action_add(uint8_t kind, const action_target_t *target, uint32_t delay, uint32_t period, int32_t at);
+int action_add_staircase(const action_target_t *target, uint32_t delay, uint16_t interlock);
+int action_cancel(uint16_t id);
+int action_count(void);
+
+void action_mark_config(void);
+int action_keep_config(uint8_t kind, const action_target_t *target, uint32_t delay, uint32_t period, int32_t at);
+int action_add_config(uint8_t kind, const action_target_t *target, uint32_t delay, uint32_t period, int32_t at);
+void action_sweep_config(void);
+
+int action_submit_write(const action_target_t *target, uint16_t interlock);
+
+#endif // __ACTION_H
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bitset.h"
+
+//
+// Fixed size bitsets of Modbus coils and inputs. Whole word operations are used
+// where the range allows it, comparison of states is plain XOR over words which
+// the compiler turns into vector code where the target has it.
+//
+
+// Mask of bits from .. to - 1 inside one word
+static uint32_t bitset_mask(int from, int to)
+{
+   uint32_t hi = (to >= BITSET_WORD_BITS) ? 0xFFFFFFFFUL : (1UL << to) - 1;
+
+   return hi & ~((1UL << from) - 1);
+}
+
+void bitset_clear(bitset_t *b)
+{
+   memset(b, 0, sizeof(bitset_t));
+}
+
+void bitset_fill(bitset_t *b, int start, int count, int value)
+{
+   int ix, end = start + count;
+
+   for (ix = start; ix < end; )
+   {
+      int w = ix / BITSET_WORD_BITS;
+      int to = (end - w * BITSET_WORD_BITS < BITSET_WORD_BITS) ? end - w * BITSET_WORD_BITS : BITSET_WORD_BITS;
+      uint32_t mask = bitset_mask(ix % BITSET_WORD_BITS, to);
+
+      if (value)
+         b->words[w] |= mask;
+      else
+         b->words[w] &= ~mask;
+
+      ix = (w + 1) * BITSET_WORD_BITS;
+   }
+}
+
+// Modbus packing, first point is LSB of first byte
+void bitset_from_bytes(bitset_t *b, const uint8_t *bytes, int count)
+{
+   int ix, nbytes = (count + 7) / 8;
+
+   bitset_clear(b);
+   for (ix = 0; ix < nbytes; ix++)
+      b->words[ix / 4] |= (uint32_t)bytes[ix] << ((ix % 4) * 8);
+
+   bitset_fill(b, count, nbytes * 8 - count, 0);
+}
+
+// Returns number of bytes
+int bitset_to_bytes(const bitset_t *b, int start, int count, uint8_t *bytes)
+{
+   int ix, nbytes = (count + 7) / 8;
+
+   if (start % 8 == 0)
+   {
+      for (ix = 0; ix < nbytes; ix++)
+      {
+         int pos = start / 8 + ix;
+         bytes[ix] = b->words[pos / 4] >> ((pos % 4) * 8);
+      }
+   }
+   else
+   {
+      memset(bytes, 0, nbytes);
+      for (ix = 0; ix < count; ix++)
+      {
+         if (bitset_get(b, start + ix))
+            bytes[ix / 8] |= 1 << (ix % 8);
+      }
+   }
+
+   // Unused bits of last byte are zero
+   if (count % 8)
+      bytes[nbytes - 1] &= (1 << (count % 8)) - 1;
+
+   return nbytes;
+}
+
+void bitset_copy(bitset_t *dst, int dst_start, const bitset_t *src, int src_start, int count)
+{
+   int ix;
+
+   if (dst_start % BITSET_WORD_BITS == 0 && src_start % BITSET_WORD_BITS == 0)
+   {
+      int words = count / BITSET_WORD_BITS;
+
+      memcpy(&dst->words[dst_start / BITSET_WORD_BITS], &src->words[src_start / BITSET_WORD_BITS], words * sizeof(uint32_t));
+      ix = words * BITSET_WORD_BITS;
+   }
+   else
+   {
+      ix = 0;
+   }
+
+   for (; ix < count; ix++)
+      bitset_put(dst, dst_start + ix, bitset_get(src, src_start + ix));
+}
+
+// All bits of range set
+int bitset_all(const bitset_t *b, int start, int count)
+{
+   int ix, end = start + count;
+
+   for (ix = start; ix < end; )
+   {
+      int w = ix / BITSET_WORD_BITS;
+      int to = (end - w * BITSET_WORD_BITS < BITSET_WORD_BITS) ? end - w * BITSET_WORD_BITS : BITSET_WORD_BITS;
+      uint32_t mask = bitset_mask(ix % BITSET_WORD_BITS, to);
+
+      if ((b->words[w] & mask) != mask)
+         return 0;
+
+      ix = (w + 1) * BITSET_WORD_BITS;
+   }
+
+   return 1;
+}
+
+// Number of set bits of range
+int bitset_count(const bitset_t *b, int start, int count)
+{
+   int ix, end = start + count, n = 0;
+
+   for (ix = start; ix < end; )
+   {
+      int w = ix / BITSET_WORD_BITS;
+      int to = (end - w * BITSET_WORD_BITS < BITSET_WORD_BITS) ? end - w * BITSET_WORD_BITS : BITSET_WORD_BITS;
+
+      n += __builtin_popcount(b->words[w] & bitset_mask(ix % BITSET_WORD_BITS, to));
+      ix = (w + 1) * BITSET_WORD_BITS;
+   }
+
+   return n;
+}
+
+// XOR of first count bits, changed may be NULL. Returns number of differing words.
+int bitset_diff(const bitset_t *a, const bitset_t *b, int count, bitset_t *changed)
+{
+   int ix, words = (count + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS, diff = 0;
+   uint32_t x;
+
+   for (ix = 0; ix < words; ix++)
+   {
+      x = a->words[ix] ^ b->words[ix];
+      if (ix == words - 1 && count % BITSET_WORD_BITS)
+         x &= bitset_mask(0, count % BITSET_WORD_BITS);
+
+      if (changed != NULL)
+         changed->words[ix] = x;
+      diff += (x != 0);
+   }
+
+   return diff;
+}
+
+// Index of last set bit + 1, 0 when empty
+int bitset_length(const bitset_t *b)
+{
+   int ix, bit;
+
+   for (ix = BITSET_WORDS - 1; ix >= 0; ix--)
+   {
+      if (b->words[ix] == 0)
+         continue;
+
+      for (bit = BITSET_WORD_BITS - 1; !(b->words[ix] & (1UL << bit)); bit--);
+
+      return ix * BITSET_WORD_BITS + bit + 1;
+   }
+
+   return 0;
+}
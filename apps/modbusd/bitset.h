@@ -0,0 +1,43 @@
+#ifndef __BITSET_H
+#define __BITSET_H
+
+#include <stdint.h>
+
+#define BITSET_MAX_BITS             2000     // Modbus maximum of coils or inputs of one read
+#define BITSET_WORD_BITS            32
+#define BITSET_WORDS                ((BITSET_MAX_BITS + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS)
+
+// Coils or inputs state, bit 0 is the first point of the range
+typedef struct
+{
+   uint32_t words[BITSET_WORDS];
+
+} bitset_t;
+
+
+static inline int bitset_get(const bitset_t *b, int ix)
+{
+   return (b->words[ix / BITSET_WORD_BITS] >> (ix % BITSET_WORD_BITS)) & 1;
+}
+
+static inline void bitset_put(bitset_t *b, int ix, int value)
+{
+   uint32_t mask = 1UL << (ix % BITSET_WORD_BITS);
+
+   if (value)
+      b->words[ix / BITSET_WORD_BITS] |= mask;
+   else
+      b->words[ix / BITSET_WORD_BITS] &= ~mask;
+}
+
+void bitset_clear(bitset_t *b);
+void bitset_fill(bitset_t *b, int start, int count, int value);
+void bitset_from_bytes(bitset_t *b, const uint8_t *bytes, int count);
+int bitset_to_bytes(const bitset_t *b, int start, int count, uint8_t *bytes);
+void bitset_copy(bitset_t *dst, int dst_start, const bitset_t *src, int src_start, int count);
+int bitset_all(const bitset_t *b, int start, int count);
+int bitset_count(const bitset_t *b, int start, int count);
+int bitset_diff(const bitset_t *a, const bitset_t *b, int count, bitset_t *changed);
+int bitset_length(const bitset_t *b);
+
+#endif // __BITSET_H
@@ -0,0 +1,1336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "trace.h"
+#include "modbus.h"
+#include "server.h"
+#include "profile.h"
+#include "action.h"
+#include "poll.h"
+#include "plan.h"
+#include "rule.h"
+#include "gateway.h"
+#include "virtual.h"
+#include "request.h"
+#include "cycle.h"
+#include "config.h"
+
+//
+// Configuration file, one statement per line, '#' starts comment:
+//
+//   profile <name> [like <profile>] [<profile option>]...
+//   slave <unit> [profile <name> | fix]                  (fix is china-relay profile)
+//   client <ipv4 address> weight <n>
+//   pool <transactions> [<frames>]                       (request pool size, startup only)
+//   budget write|read|background <delay>|off              (queue latency budget, see request.c)
+//   gateway <host>[:<port>] units <first>[-<last>] [remote <first>] [pipeline <n>] [connections <n>]
+//   timer once <delay> <target>
+//   timer every <period> [at <hh:mm[:ss]>] <target>
+//   poll <unit> coils|inputs <start> <count> <period>     (refresh requirement, see plan.c)
+//   rule input <unit> <input> rising|falling|change <rule target> [debounce <delay>] [interlock <coil>]
+//   virtual <unit> register <regaddr> count|any|all|min|max <operand>... [period <delay>]
+//   cycle every <delay> [lead <delay>] <point>...           (time aligned sampling, see cycle.c)
+//
+//   <target>   coil <unit> <coil> on|off|toggle
+//              register <unit> <regaddr> <value>
+//   <rule target> <target> | staircase <delay> coil <unit> <coil>
+//   <delay>    number with optional ms, s, m, h or d suffix (default ms)
+//   <operand>  coils|inputs|holding|input-registers <unit> <start> <count>   (see virtual.h)
+//   <point>    coils|inputs|holding|input-registers <unit> <start> <count>
+//   <profile option> functions <code>[,<code>]... | coils <n> | inputs <n> | cached |
+//              coil-read|input-read range|bitwise|all | offset <n> | on <value> |
+//              read <n> | write-coils <n> | write-registers <n> | turnaround <delay>
+//
+// Profile without like starts from standard profile, slaves without profile are
+// standard devices. Built in profiles are standard and china-relay (see profile.c).
+//
+// The whole file is parsed into staging tables first and applied only when it is
+// valid, so a broken file on reload keeps the running configuration. Apply keeps
+// unchanged slaves, polls and timers with their cached state and timer phase.
+//
+
+#define CFG_CONFIG_MAX_TOKENS       32
+#define CFG_CONFIG_MAX_SLAVES       MAX_SERVERS_COUNT
+#define CFG_CONFIG_MAX_POLLS        64
+#define CFG_CONFIG_MAX_RULES        128
+#define CFG_CONFIG_MAX_TIMERS       ACTION_MAX_CONFIG
+#define CFG_CONFIG_MAX_CLIENTS      16
+#define CFG_CONFIG_MAX_GATEWAYS     GATEWAY_MAX_COUNT
+#define CFG_CONFIG_MAX_PROFILES     16
+#define CFG_CONFIG_MAX_VIRTUALS     64
+
+typedef struct
+{
+   uint8_t unit;
+   char profile_name[PROFILE_NAME_SIZE];
+   profile_t profile;         // resolved at end of file, profiles may follow slaves
+
+} config_slave_t;
+
+typedef struct
+{
+   uint8_t unit;
+   uint8_t func;
+   uint16_t start;
+   uint16_t count;
+   uint32_t period;
+
+} config_poll_t;
+
+typedef struct
+{
+   uint8_t kind;
+   action_target_t target;
+   uint32_t delay;
+   uint32_t period;
+   int32_t at;
+
+} config_timer_t;
+
+typedef struct
+{
+   uint32_t addr;             // network byte order
+   int weight;
+
+} config_client_t;
+
+typedef struct
+{
+   char host[64];
+   int port;
+   uint8_t unit_from;
+   uint8_t unit_to;
+   uint8_t remote_from;
+   int pipeline;
+   int connections;
+
+} config_gateway_t;
+
+typedef struct
+{
+   config_slave_t slaves[CFG_CONFIG_MAX_SLAVES];
+   int slaves_cnt;
+   config_poll_t polls[CFG_CONFIG_MAX_POLLS];
+   int polls_cnt;
+   rule_t rules[CFG_CONFIG_MAX_RULES];
+   int rules_cnt;
+   config_timer_t timers[CFG_CONFIG_MAX_TIMERS];
+   int timers_cnt;
+   config_client_t clients[CFG_CONFIG_MAX_CLIENTS];
+   int clients_cnt;
+   config_gateway_t gateways[CFG_CONFIG_MAX_GATEWAYS];
+   int gateways_cnt;
+   profile_t profiles[CFG_CONFIG_MAX_PROFILES];
+   int profiles_cnt;
+   virtual_register_t virtuals[CFG_CONFIG_MAX_VIRTUALS];
+   int virtuals_cnt;
+   cycle_config_t cycles[CYCLE_MAX_COUNT];
+   int cycles_cnt;
+   int pool_transactions;
+   int pool_frames;
+   int32_t budgets[REQUEST_CLASSES];   // ms, -1 default, 0 off
+
+} config_t;
+
+static config_t staging;
+static config_client_t clients[CFG_CONFIG_MAX_CLIENTS];
+static int clients_cnt = 0;
+static int pool_transactions = -1;
+static int pool_frames = -1;
+static const char *config_filename;
+static char config_path[256];
+static int config_line;
+
+#define CONFIG_ERROR(_format, ...) \
+   TRACE_ERROR("%s:%d: " _format, config_filename, config_line, ## __VA_ARGS__)
+
+
+static int config_parse_duration(const char *s, uint32_t *ms)
+{
+   char *end;
+   unsigned long value = strtoul(s, &end, 10);
+
+   if (end == s)
+      return -1;
+
+   if (*end == 0 || !strcmp(end, "ms"))
+      *ms = value;
+   else if (!strcmp(end, "s"))
+      *ms = value * 1000;
+   else if (!strcmp(end, "m"))
+      *ms = value * 60000;
+   else if (!strcmp(end, "h"))
+      *ms = value * 3600000;
+   else if (!strcmp(end, "d"))
+      *ms = value * 86400000;
+   else
+      return -1;
+
+   return 0;
+}
+
+static int config_parse_time_of_day(const char *s, int32_t *sec)
+{
+   int hh, mm, ss = 0;
+
+   if (sscanf(s, "%d:%d:%d", &hh, &mm, &ss) < 2 || hh > 23 || mm > 59 || ss > 59)
+      return -1;
+
+   *sec = hh * 3600 + mm * 60 + ss;
+
+   return 0;
+}
+
+// Slave address 1 .. MODBUS_MAX_UNIT, broadcast and values not fitting the unit byte are refused
+static int config_parse_unit(const char *s, uint8_t *unit)
+{
+   char *end;
+   long value = strtol(s, &end, 10);
+
+   if (end == s || *end != 0 || value < 1 || value > MODBUS_MAX_UNIT)
+      return -1;
+
+   *unit = value;
+
+   return 0;
+}
+
+// Returns number of tokens consumed
+static int config_parse_target(char **tok, int ntok, action_target_t *target)
+{
+   if (ntok < 4)
+      return -1;
+
+   memset(target, 0, sizeof(action_target_t));
+   if (config_parse_unit(tok[1], &target->unit) < 0)
+      return -1;
+   target->addr = atoi(tok[2]);
+
+   if (!strcmp(tok[0], "coil"))
+   {
+      target->type = MODBUS_FUNC_WRITE_COIL;
+      if (!strcmp(tok[3], "on"))
+         target->value = 1;
+      else if (!strcmp(tok[3], "toggle"))
+         target->op = ACTION_OP_TOGGLE;
+      else if (strcmp(tok[3], "off"))
+         return -1;
+   }
+   else if (!strcmp(tok[0], "register"))
+   {
+      target->type = MODBUS_FUNC_WRITE_SINGLE_REGISTER;
+      target->value = strtoul(tok[3], NULL, 0);
+   }
+   else
+   {
+      return -1;
+   }
+
+   return 4;
+}
+
+static int config_parse_timer(char **tok, int ntok)
+{
+   config_timer_t *timer;
+   action_target_t target;
+   uint32_t duration;
+   int32_t at = -1;
+   int ix = 2;
+
+   if (ntok < 3 || config_parse_duration(tok[2], &duration) < 0)
+   {
+      CONFIG_ERROR("Bad timer duration");
+      return -1;
+   }
+   ix++;
+
+   if (!strcmp(tok[1], "every") && ix + 1 < ntok && !strcmp(tok[ix], "at"))
+   {
+      if (config_parse_time_of_day(tok[ix + 1], &at) < 0)
+      {
+         CONFIG_ERROR("Bad time of day '%s'", tok[ix + 1]);
+         return -1;
+      }
+      ix += 2;
+   }
+
+   if (config_parse_target(&tok[ix], ntok - ix, &target) != ntok - ix)
+   {
+      CONFIG_ERROR("Bad timer target");
+      return -1;
+   }
+
+   if (!strcmp(tok[1], "every") && duration == 0 && at < 0)
+   {
+      CONFIG_ERROR("Timer period must not be zero");
+      return -1;
+   }
+
+   if (staging.timers_cnt == CFG_CONFIG_MAX_TIMERS)
+   {
+      CONFIG_ERROR("Too many timers");
+      return -1;
+   }
+
+   timer = &staging.timers[staging.timers_cnt];
+   memset(timer, 0, sizeof(config_timer_t));
+   timer->target = target;
+   timer->at = at;
+
+   if (!strcmp(tok[1], "once"))
+   {
+      timer->kind = ACTION_ONCE;
+      timer->delay = duration;
+   }
+   else if (!strcmp(tok[1], "every"))
+   {
+      timer->kind = ACTION_PERIODIC;
+      timer->period = duration;
+   }
+   else
+   {
+      CONFIG_ERROR("Unknown timer kind '%s'", tok[1]);
+      return -1;
+   }
+
+   staging.timers_cnt++;
+
+   return 0;
+}
+
+static int config_parse_table(const char *s, uint8_t *func)
+{
+   if (!strcmp(s, "coils"))
+      *func = MODBUS_FUNC_READ_COILS;
+   else if (!strcmp(s, "inputs"))
+      *func = MODBUS_READ_DISCRETE_INPUTS;
+   else
+      return -1;
+
+   return 0;
+}
+
+// Any table read by function codes 1 to 4, they follow the order of tables
+static int config_parse_read_table(const char *s, uint8_t *func)
+{
+   static const char *tables[] = { "coils", "inputs", "holding", "input-registers" };
+   int ix;
+
+   for (ix = 0; ix < (int)(sizeof(tables) / sizeof(tables[0])) && strcmp(s, tables[ix]); ix++);
+   if (ix == (int)(sizeof(tables) / sizeof(tables[0])))
+      return -1;
+
+   *func = MODBUS_FUNC_READ_COILS + ix;
+
+   return 0;
+}
+
+static int config_parse_poll(char **tok, int ntok)
+{
+   config_poll_t *poll;
+   uint32_t period;
+   uint8_t func;
+
+   if (ntok != 6 || config_parse_duration(tok[5], &period) < 0 || period == 0)
+   {
+      CONFIG_ERROR("Bad poll statement");
+      return -1;
+   }
+
+   if (config_parse_table(tok[2], &func) < 0)
+   {
+      CONFIG_ERROR("Unknown poll table '%s'", tok[2]);
+      return -1;
+   }
+
+   if (staging.polls_cnt == CFG_CONFIG_MAX_POLLS)
+   {
+      CONFIG_ERROR("Too many polls");
+      return -1;
+   }
+
+   poll = &staging.polls[staging.polls_cnt++];
+   poll->func = func;
+   poll->start = atoi(tok[3]);
+   poll->count = atoi(tok[4]);
+   poll->period = period;
+
+   if (config_parse_unit(tok[1], &poll->unit) < 0)
+   {
+      CONFIG_ERROR("Bad poll unit %s", tok[1]);
+      return -1;
+   }
+
+   if (poll->count == 0 || poll->count > MODBUS_MAX_READ_BITS)
+   {
+      CONFIG_ERROR("Bad poll count %d", poll->count);
+      return -1;
+   }
+
+   return 0;
+}
+
+static int config_parse_client(char **tok, int ntok)
+{
+   config_client_t *client;
+   struct in_addr addr;
+
+   if (ntok != 4 || strcmp(tok[2], "weight") || inet_pton(AF_INET, tok[1], &addr) != 1 || atoi(tok[3]) <= 0)
+   {
+      CONFIG_ERROR("Bad client statement");
+      return -1;
+   }
+
+   if (staging.clients_cnt == CFG_CONFIG_MAX_CLIENTS)
+   {
+      CONFIG_ERROR("Too many clients");
+      return -1;
+   }
+
+   client = &staging.clients[staging.clients_cnt++];
+   client->addr = addr.s_addr;
+   client->weight = atoi(tok[3]);
+
+   return 0;
+}
+
+static int config_parse_pool(char **tok, int ntok)
+{
+   if (ntok < 2 || ntok > 3 || atoi(tok[1]) <= 0 || (ntok == 3 && atoi(tok[2]) <= 0))
+   {
+      CONFIG_ERROR("Bad pool statement");
+      return -1;
+   }
+
+   staging.pool_transactions = atoi(tok[1]);
+   staging.pool_frames = (ntok == 3) ? atoi(tok[2]) : 0;
+
+   return 0;
+}
+
+static int config_parse_budget(char **tok, int ntok)
+{
+   static const char *names[REQUEST_CLASSES] = {"write", "read", "background"};
+   uint32_t budget = 0;
+   int cls;
+
+   for (cls = 0; cls < REQUEST_CLASSES; cls++)
+   {
+      if (ntok == 3 && !strcmp(tok[1], names[cls]))
+         break;
+   }
+
+   if (ntok != 3 || cls == REQUEST_CLASSES || (strcmp(tok[2], "off") && config_parse_duration(tok[2], &budget) < 0) || budget > INT32_MAX)
+   {
+      CONFIG_ERROR("Bad budget statement");
+      return -1;
+   }
+
+   staging.budgets[cls] = budget;
+
+   return 0;
+}
+
+static int config_parse_gateway(char **tok, int ntok)
+{
+   config_gateway_t *gw;
+   char *p;
+   int ix, from, to, value;
+
+   if (ntok < 4 || strcmp(tok[2], "units"))
+   {
+      CONFIG_ERROR("Bad gateway statement");
+      return -1;
+   }
+
+   if (staging.gateways_cnt == CFG_CONFIG_MAX_GATEWAYS)
+   {
+      CONFIG_ERROR("Too many gateways");
+      return -1;
+   }
+
+   gw = &staging.gateways[staging.gateways_cnt];
+   memset(gw, 0, sizeof(config_gateway_t));
+   gw->port = MODBUS_TCP_PORT;
+   gw->pipeline = 1;
+   gw->connections = 1;
+
+   if ((p = strchr(tok[1], ':')) != NULL)
+   {
+      *p++ = 0;
+      gw->port = atoi(p);
+   }
+   snprintf(gw->host, sizeof(gw->host), "%s", tok[1]);
+
+   from = atoi(tok[3]);
+   to = (p = strchr(tok[3], '-')) != NULL ? atoi(p + 1) : from;
+   if (from < 1 || to > 247 || to < from || gw->port <= 0)
+   {
+      CONFIG_ERROR("Bad gateway units or port");
+      return -1;
+   }
+   gw->unit_from = from;
+   gw->unit_to = to;
+   gw->remote_from = from;
+
+   for (ix = 4; ix + 1 < ntok; ix += 2)
+   {
+      value = atoi(tok[ix + 1]);
+
+      if (!strcmp(tok[ix], "remote") && value >= 0 && value + to - from <= 255)
+         gw->remote_from = value;
+      else if (!strcmp(tok[ix], "pipeline") && value > 0 && value <= GATEWAY_MAX_PIPELINE)
+         gw->pipeline = value;
+      else if (!strcmp(tok[ix], "connections") && value > 0 && value <= GATEWAY_MAX_CONNECTIONS)
+         gw->connections = value;
+      else
+         break;
+   }
+
+   if (ix != ntok)
+   {
+      CONFIG_ERROR("Bad gateway option '%s'", tok[ix]);
+      return -1;
+   }
+
+   // One unit id space, ranges must not overlap
+   for (ix = 0; ix < staging.gateways_cnt; ix++)
+   {
+      if (from <= staging.gateways[ix].unit_to && to >= staging.gateways[ix].unit_from)
+      {
+         CONFIG_ERROR("Gateway units %d-%d overlap", from, to);
+         return -1;
+      }
+   }
+
+   staging.gateways_cnt++;
+
+   return 0;
+}
+
+// Profile defined in file or built in one
+static const profile_t *config_find_profile(const char *name)
+{
+   int ix;
+
+   for (ix = 0; ix < staging.profiles_cnt; ix++)
+   {
+      if (!strcmp(staging.profiles[ix].name, name))
+         return &staging.profiles[ix];
+   }
+
+   return profile_find(name);
+}
+
+static int config_parse_read_mode(const char *s, uint8_t *mode)
+{
+   if (!strcmp(s, "range"))
+      *mode = PROFILE_READ_RANGE;
+   else if (!strcmp(s, "bitwise"))
+      *mode = PROFILE_READ_BITWISE;
+   else if (!strcmp(s, "all"))
+      *mode = PROFILE_READ_ALL;
+   else
+      return -1;
+
+   return 0;
+}
+
+static int config_parse_functions(const char *s, uint32_t *funcs)
+{
+   char *end;
+   unsigned long func;
+
+   *funcs = 0;
+   do
+   {
+      func = strtoul(s, &end, 0);
+      if (end == s || func == 0 || func > 31)
+         return -1;
+      *funcs |= PROFILE_FUNC(func);
+      s = end + 1;
+   }
+   while (*end == ',');
+
+   return (*end == 0) ? 0 : -1;
+}
+
+static int config_parse_profile(char **tok, int ntok)
+{
+   const profile_t *base = profile_default();
+   profile_t profile;
+   uint32_t turnaround;
+   int ix = 2, res = 0;
+
+   if (ntok < 2 || strlen(tok[1]) >= PROFILE_NAME_SIZE)
+   {
+      CONFIG_ERROR("Bad profile statement");
+      return -1;
+   }
+
+   if (config_find_profile(tok[1]) != NULL)
+   {
+      CONFIG_ERROR("Profile '%s' already defined", tok[1]);
+      return -1;
+   }
+
+   if (ntok > 3 && !strcmp(tok[2], "like"))
+   {
+      if ((base = config_find_profile(tok[3])) == NULL)
+      {
+         CONFIG_ERROR("Unknown profile '%s'", tok[3]);
+         return -1;
+      }
+      ix = 4;
+   }
+
+   profile = *base;
+   memset(profile.name, 0, sizeof(profile.name));
+   strcpy(profile.name, tok[1]);
+
+   for (; ix < ntok && res == 0; ix += 2)
+   {
+      if (!strcmp(tok[ix], "cached"))
+      {
+         profile.cached = 1;
+         ix--;
+         continue;
+      }
+
+      if (ix + 1 == ntok)
+         break;
+
+      if (!strcmp(tok[ix], "functions"))
+         res = config_parse_functions(tok[ix + 1], &profile.funcs);
+      else if (!strcmp(tok[ix], "coils"))
+         profile.coils = atoi(tok[ix + 1]);
+      else if (!strcmp(tok[ix], "inputs"))
+         profile.inputs = atoi(tok[ix + 1]);
+      else if (!strcmp(tok[ix], "coil-read"))
+         res = config_parse_read_mode(tok[ix + 1], &profile.coil_read);
+      else if (!strcmp(tok[ix], "input-read"))
+         res = config_parse_read_mode(tok[ix + 1], &profile.input_read);
+      else if (!strcmp(tok[ix], "offset"))
+         profile.coil_offset = atoi(tok[ix + 1]);
+      else if (!strcmp(tok[ix], "on"))
+         profile.coil_on = strtoul(tok[ix + 1], NULL, 0);
+      else if (!strcmp(tok[ix], "read"))
+         profile.max_read = atoi(tok[ix + 1]);
+      else if (!strcmp(tok[ix], "write-coils"))
+         profile.max_write_coils = atoi(tok[ix + 1]);
+      else if (!strcmp(tok[ix], "write-registers"))
+         profile.max_write_registers = atoi(tok[ix + 1]);
+      else if (!strcmp(tok[ix], "turnaround"))
+      {
+         res = config_parse_duration(tok[ix + 1], &turnaround);
+         profile.turnaround = turnaround;
+      }
+      else
+         break;
+   }
+
+   if (res < 0 || ix < ntok)
+   {
+      CONFIG_ERROR("Bad profile option '%s'", tok[ix < ntok ? ix : ntok - 1]);
+      return -1;
+   }
+
+   if (profile.max_read == 0 || profile.max_read > MODBUS_MAX_READ_BITS ||
+       profile.max_write_coils > MODBUS_MAX_WRITE_COILS || profile.max_write_registers > MODBUS_MAX_WRITE_REGISTERS)
+   {
+      CONFIG_ERROR("Profile '%s' batch size out of range", profile.name);
+      return -1;
+   }
+
+   // Whole table is read at once or kept by daemon, its size has to be known
+   if ((profile.cached && profile.coils == 0) ||
+       (profile.coil_read == PROFILE_READ_ALL && profile.coils == 0) ||
+       (profile.input_read == PROFILE_READ_ALL && profile.inputs == 0) ||
+       profile.coils > MODBUS_MAX_READ_BITS || profile.inputs > MODBUS_MAX_READ_BITS)
+   {
+      CONFIG_ERROR("Profile '%s' needs coils and inputs count", profile.name);
+      return -1;
+   }
+
+   if (staging.profiles_cnt == CFG_CONFIG_MAX_PROFILES)
+   {
+      CONFIG_ERROR("Too many profiles");
+      return -1;
+   }
+
+   staging.profiles[staging.profiles_cnt++] = profile;
+
+   return 0;
+}
+
+static int config_parse_slave(char **tok, int ntok)
+{
+   config_slave_t *slave;
+   const char *name = profile_default()->name;
+
+   if (ntok == 3 && !strcmp(tok[2], "fix"))
+      name = "china-relay";
+   else if (ntok == 4 && !strcmp(tok[2], "profile") && strlen(tok[3]) < PROFILE_NAME_SIZE)
+      name = tok[3];
+   else if (ntok != 2)
+   {
+      CONFIG_ERROR("Bad slave statement");
+      return -1;
+   }
+
+   if (staging.slaves_cnt == CFG_CONFIG_MAX_SLAVES)
+   {
+      CONFIG_ERROR("Too many slaves");
+      return -1;
+   }
+
+   slave = &staging.slaves[staging.slaves_cnt];
+   if (config_parse_unit(tok[1], &slave->unit) < 0)
+   {
+      CONFIG_ERROR("Bad slave unit %s", tok[1]);
+      return -1;
+   }
+
+   staging.slaves_cnt++;
+   strcpy(slave->profile_name, name);
+
+   return 0;
+}
+
+// Profiles of slaves are known when whole file is parsed
+static int config_resolve_profiles(void)
+{
+   const profile_t *profile;
+   int ix, res = 0;
+
+   for (ix = 0; ix < staging.slaves_cnt; ix++)
+   {
+      if ((profile = config_find_profile(staging.slaves[ix].profile_name)) == NULL)
+      {
+         TRACE_ERROR("%s: unknown profile '%s' of slave %d", config_filename, staging.slaves[ix].profile_name, staging.slaves[ix].unit);
+         res = -1;
+         continue;
+      }
+
+      staging.slaves[ix].profile = *profile;
+   }
+
+   return res;
+}
+
+static int config_parse_rule(char **tok, int ntok)
+{
+   rule_t rule;
+   int ix = 5, n;
+
+   if (ntok < 6 || strcmp(tok[1], "input"))
+   {
+      CONFIG_ERROR("Bad rule statement");
+      return -1;
+   }
+
+   memset(&rule, 0, sizeof(rule));
+   rule.input = atoi(tok[3]);
+   rule.kind = ACTION_ONCE;
+   rule.interlock = RULE_NO_INTERLOCK;
+
+   if (config_parse_unit(tok[2], &rule.unit) < 0)
+   {
+      CONFIG_ERROR("Bad rule unit %s", tok[2]);
+      return -1;
+   }
+
+   if (!strcmp(tok[4], "rising"))
+      rule.edge = RULE_EDGE_RISING;
+   else if (!strcmp(tok[4], "falling"))
+      rule.edge = RULE_EDGE_FALLING;
+   else if (!strcmp(tok[4], "change"))
+      rule.edge = RULE_EDGE_CHANGE;
+   else
+   {
+      CONFIG_ERROR("Unknown edge '%s'", tok[4]);
+      return -1;
+   }
+
+   if (!strcmp(tok[ix], "staircase"))
+   {
+      if (ix + 4 >= ntok || config_parse_duration(tok[ix + 1], &rule.delay) < 0 || strcmp(tok[ix + 2], "coil") ||
+          config_parse_unit(tok[ix + 3], &rule.target.unit) < 0)
+      {
+         CONFIG_ERROR("Bad staircase target");
+         return -1;
+      }
+
+      rule.kind = ACTION_STAIRCASE;
+      rule.target.type = MODBUS_FUNC_WRITE_COIL;
+      rule.target.addr = atoi(tok[ix + 4]);
+      rule.target.value = 1;
+      ix += 5;
+   }
+   else
+   {
+      if ((n = config_parse_target(&tok[ix], ntok - ix, &rule.target)) < 0 ||
+          rule.target.type != MODBUS_FUNC_WRITE_COIL)
+      {
+         CONFIG_ERROR("Bad rule target");
+         return -1;
+      }
+      ix += n;
+   }
+
+   for (; ix + 1 < ntok; ix += 2)
+   {
+      if (!strcmp(tok[ix], "debounce") && config_parse_duration(tok[ix + 1], &rule.debounce) == 0)
+         continue;
+
+      if (!strcmp(tok[ix], "interlock"))
+      {
+         rule.interlock = atoi(tok[ix + 1]);
+         continue;
+      }
+
+      break;
+   }
+
+   if (ix != ntok)
+   {
+      CONFIG_ERROR("Bad rule option '%s'", tok[ix]);
+      return -1;
+   }
+
+   // Inputs 0 .. input of the unit are polled in one read
+   if (rule.input >= MODBUS_MAX_READ_BITS)
+   {
+      CONFIG_ERROR("Bad rule input %d", rule.input);
+      return -1;
+   }
+
+   if (staging.rules_cnt == CFG_CONFIG_MAX_RULES)
+   {
+      CONFIG_ERROR("Too many rules");
+      return -1;
+   }
+
+   staging.rules[staging.rules_cnt++] = rule;
+
+   return 0;
+}
+
+static int config_parse_virtual(char **tok, int ntok)
+{
+   static const char *ops[] = { "count", "any", "all", "min", "max" };
+   virtual_register_t reg;
+   virtual_operand_t *op;
+   uint8_t func;
+   int ix, max;
+
+   if (ntok < 9 || strcmp(tok[2], "register"))
+   {
+      CONFIG_ERROR("Bad virtual statement");
+      return -1;
+   }
+
+   memset(&reg, 0, sizeof(reg));
+   reg.reg = atoi(tok[3]);
+   reg.period = VIRTUAL_POLL_PERIOD;
+
+   if (config_parse_unit(tok[1], &reg.unit) < 0)
+   {
+      CONFIG_ERROR("Bad virtual unit %s", tok[1]);
+      return -1;
+   }
+
+   for (ix = 0; ix < (int)(sizeof(ops) / sizeof(ops[0])) && strcmp(tok[4], ops[ix]); ix++);
+   if (ix == (int)(sizeof(ops) / sizeof(ops[0])))
+   {
+      CONFIG_ERROR("Unknown virtual register operation '%s'", tok[4]);
+      return -1;
+   }
+   reg.op = ix;
+
+   for (ix = 5; ix + 3 < ntok && config_parse_read_table(tok[ix], &func) == 0; ix += 4)
+   {
+      if (reg.operands_cnt == VIRTUAL_MAX_OPERANDS)
+      {
+         CONFIG_ERROR("Too many operands of virtual register");
+         return -1;
+      }
+
+      op = &reg.operands[reg.operands_cnt++];
+      op->func = func;
+      op->start = atoi(tok[ix + 2]);
+      op->count = atoi(tok[ix + 3]);
+      max = (func <= MODBUS_READ_DISCRETE_INPUTS) ? MODBUS_MAX_READ_BITS : 0x10000;
+
+      if (config_parse_unit(tok[ix + 1], &op->unit) < 0)
+      {
+         CONFIG_ERROR("Bad virtual operand unit %s", tok[ix + 1]);
+         return -1;
+      }
+
+      if (op->count == 0 || op->start + op->count > max ||
+          (func > MODBUS_READ_DISCRETE_INPUTS && op->count > VIRTUAL_MAX_REGISTERS))
+      {
+         CONFIG_ERROR("Bad virtual operand range %d/%d", op->start, op->count);
+         return -1;
+      }
+   }
+
+   if (ix + 2 == ntok && !strcmp(tok[ix], "period") && config_parse_duration(tok[ix + 1], &reg.period) == 0 && reg.period > 0)
+      ix += 2;
+
+   if (ix != ntok || reg.operands_cnt == 0)
+   {
+      CONFIG_ERROR("Bad virtual register operand '%s'", tok[ix < ntok ? ix : ntok - 1]);
+      return -1;
+   }
+
+   if (staging.virtuals_cnt == CFG_CONFIG_MAX_VIRTUALS)
+   {
+      CONFIG_ERROR("Too many virtual registers");
+      return -1;
+   }
+
+   staging.virtuals[staging.virtuals_cnt++] = reg;
+
+   return 0;
+}
+
+static int config_parse_cycle(char **tok, int ntok)
+{
+   cycle_config_t cycle;
+   cycle_point_t *pt;
+   uint8_t func;
+   int ix, max;
+
+   memset(&cycle, 0, sizeof(cycle));
+   cycle.lead = CYCLE_LEAD;
+
+   if (ntok < 7 || strcmp(tok[1], "every") || config_parse_duration(tok[2], &cycle.period) < 0 || cycle.period == 0)
+   {
+      CONFIG_ERROR("Bad cycle statement");
+      return -1;
+   }
+
+   ix = 3;
+   if (!strcmp(tok[ix], "lead"))
+   {
+      if (config_parse_duration(tok[ix + 1], &cycle.lead) < 0)
+      {
+         CONFIG_ERROR("Bad cycle lead '%s'", tok[ix + 1]);
+         return -1;
+      }
+      ix += 2;
+   }
+
+   if (cycle.lead >= cycle.period)
+   {
+      CONFIG_ERROR("Cycle lead must be shorter than period");
+      return -1;
+   }
+
+   for (; ix < ntok; ix += 4)
+   {
+      if (ix + 3 >= ntok || config_parse_read_table(tok[ix], &func) < 0)
+      {
+         CONFIG_ERROR("Bad cycle point '%s'", tok[ix]);
+         return -1;
+      }
+
+      if (cycle.points_cnt == CYCLE_MAX_POINTS)
+      {
+         CONFIG_ERROR("Too many points of cycle");
+         return -1;
+      }
+
+      pt = &cycle.points[cycle.points_cnt++];
+      pt->func = func;
+      pt->unit = atoi(tok[ix + 1]);
+      pt->start = atoi(tok[ix + 2]);
+      pt->count = atoi(tok[ix + 3]);
+      max = (func <= MODBUS_READ_DISCRETE_INPUTS) ? CYCLE_MAX_DATA * 8 : CYCLE_MAX_DATA / 2;
+
+      if (pt->unit < 1 || pt->unit > MODBUS_MAX_UNIT || pt->count == 0 || pt->count > max)
+      {
+         CONFIG_ERROR("Bad cycle point unit %d count %d", pt->unit, pt->count);
+         return -1;
+      }
+   }
+
+   if (cycle.points_cnt == 0)
+   {
+      CONFIG_ERROR("Cycle without points");
+      return -1;
+   }
+
+   if (staging.cycles_cnt == CYCLE_MAX_COUNT)
+   {
+      CONFIG_ERROR("Too many cycles");
+      return -1;
+   }
+
+   staging.cycles[staging.cycles_cnt++] = cycle;
+
+   return 0;
+}
+
+// Virtual slaves own their unit id, operands are real slaves on the bus
+static int config_check_virtuals(void)
+{
+   const virtual_register_t *reg;
+   int ix, jx, kx, res = 0;
+
+   for (ix = 0; ix < staging.virtuals_cnt; ix++)
+   {
+      reg = &staging.virtuals[ix];
+
+      for (jx = 0; jx < ix; jx++)
+      {
+         if (staging.virtuals[jx].unit == reg->unit && staging.virtuals[jx].reg == reg->reg)
+         {
+            TRACE_ERROR("%s: virtual unit %d register %d defined twice", config_filename, reg->unit, reg->reg);
+            res = -1;
+         }
+      }
+
+      for (jx = 0; jx < staging.slaves_cnt; jx++)
+      {
+         if (staging.slaves[jx].unit == reg->unit)
+         {
+            TRACE_ERROR("%s: virtual unit %d is configured as slave", config_filename, reg->unit);
+            res = -1;
+         }
+      }
+
+      for (jx = 0; jx < staging.gateways_cnt; jx++)
+      {
+         if (reg->unit >= staging.gateways[jx].unit_from && reg->unit <= staging.gateways[jx].unit_to)
+         {
+            TRACE_ERROR("%s: virtual unit %d is behind gateway", config_filename, reg->unit);
+            res = -1;
+         }
+      }
+
+      for (jx = 0; jx < reg->operands_cnt; jx++)
+      {
+         for (kx = 0; kx < staging.virtuals_cnt; kx++)
+         {
+            if (staging.virtuals[kx].unit == reg->operands[jx].unit)
+            {
+               TRACE_ERROR("%s: operand of virtual unit %d is virtual unit %d", config_filename, reg->unit, reg->operands[jx].unit);
+               res = -1;
+               break;
+            }
+         }
+      }
+   }
+
+   return res;
+}
+
+// Polls, inputs of rules (one read per unit, see rule_compile()) and operands of
+// virtual registers are refresh requirements of the polling plan
+static int config_check_requirements(void)
+{
+   int ix, jx, cnt = staging.polls_cnt;
+
+   for (ix = 0; ix < staging.rules_cnt; ix++)
+   {
+      for (jx = 0; jx < ix && staging.rules[jx].unit != staging.rules[ix].unit; jx++);
+      cnt += (jx == ix);
+   }
+
+   for (ix = 0; ix < staging.virtuals_cnt; ix++)
+      cnt += staging.virtuals[ix].operands_cnt;
+
+   if (cnt > CFG_PLAN_MAX_READS)
+   {
+      TRACE_ERROR("%s: %d refresh requirements of polls, rules and virtual registers, %d max", config_filename, cnt, CFG_PLAN_MAX_READS);
+      return -1;
+   }
+
+   return 0;
+}
+
+// Slaves given on command line keep their servers
+static int config_check_slaves(void)
+{
+   modbus_server_t *server;
+   int ix, jx, cnt = staging.slaves_cnt;
+
+   for (ix = 0; ix < MAX_SERVERS_COUNT; ix++)
+   {
+      if ((server = server_get(ix)) == NULL || server->config)
+         continue;
+
+      for (jx = 0; jx < staging.slaves_cnt && staging.slaves[jx].unit != server->addr; jx++);
+      cnt += (jx == staging.slaves_cnt);
+   }
+
+   if (cnt > MAX_SERVERS_COUNT)
+   {
+      TRACE_ERROR("%s: %d slaves with command line ones, %d max", config_filename, cnt, MAX_SERVERS_COUNT);
+      return -1;
+   }
+
+   return 0;
+}
+
+static int config_parse(const char *filename)
+{
+   FILE *fp;
+   char line[256], *p, *save;
+   char *tok[CFG_CONFIG_MAX_TOKENS];
+   int ix, ntok, res = 0;
+
+   if ((fp = fopen(filename, "r")) == NULL)
+   {
+      TRACE_ERROR("Open config file %s failed", filename);
+      return -1;
+   }
+
+   memset(&staging, 0, sizeof(staging));
+   for (ix = 0; ix < REQUEST_CLASSES; ix++)
+      staging.budgets[ix] = -1;
+   config_filename = filename;
+   config_line = 0;
+
+   while (fgets(line, sizeof(line), fp) != NULL)
+   {
+      config_line++;
+
+      if ((p = strchr(line, '#')) != NULL)
+         *p = 0;
+
+      ntok = 0;
+      for (p = strtok_r(line, " \t\r\n", &save); p != NULL && ntok < CFG_CONFIG_MAX_TOKENS; p = strtok_r(NULL, " \t\r\n", &save))
+         tok[ntok++] = p;
+
+      if (ntok == 0)
+         continue;
+
+      if (!strcmp(tok[0], "slave"))
+      {
+         if (config_parse_slave(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "profile"))
+      {
+         if (config_parse_profile(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "client"))
+      {
+         if (config_parse_client(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "gateway"))
+      {
+         if (config_parse_gateway(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "pool"))
+      {
+         if (config_parse_pool(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "budget"))
+      {
+         if (config_parse_budget(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "timer"))
+      {
+         if (config_parse_timer(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "poll"))
+      {
+         if (config_parse_poll(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "rule"))
+      {
+         if (config_parse_rule(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "virtual"))
+      {
+         if (config_parse_virtual(tok, ntok) < 0)
+            res = -1;
+      }
+      else if (!strcmp(tok[0], "cycle"))
+      {
+         if (config_parse_cycle(tok, ntok) < 0)
+            res = -1;
+      }
+      else
+      {
+         CONFIG_ERROR("Unknown statement '%s'", tok[0]);
+         res = -1;
+      }
+   }
+
+   fclose(fp);
+
+   if (res == 0 && config_resolve_profiles() < 0)
+      res = -1;
+
+   if (res == 0 && config_check_virtuals() < 0)
+      res = -1;
+
+   if (res == 0 && (config_check_requirements() < 0 || config_check_slaves() < 0))
+      res = -1;
+
+   return res;
+}
+
+// Apply staged configuration, items not present any more are removed before new
+// ones are added. Staging checks leave nothing to fail here, running configuration
+// is never replaced halfway.
+static void config_apply(void)
+{
+   static uint8_t kept[CFG_CONFIG_MAX_TIMERS];    // longest of staged tables
+   const config_slave_t *slave;
+   const config_poll_t *poll;
+   const config_timer_t *timer;
+   const config_gateway_t *gw;
+   int ix;
+
+   server_mark_config();
+   for (ix = 0; ix < staging.slaves_cnt; ix++)
+      kept[ix] = server_keep_config(staging.slaves[ix].unit, &staging.slaves[ix].profile);
+   server_sweep_config();
+   for (ix = 0; ix < staging.slaves_cnt; ix++)
+   {
+      slave = &staging.slaves[ix];
+      if (!kept[ix])
+         server_add_config(slave->unit, &slave->profile);
+   }
+
+   gateway_mark_config();
+   for (ix = 0; ix < staging.gateways_cnt; ix++)
+   {
+      gw = &staging.gateways[ix];
+      kept[ix] = gateway_keep_config(gw->host, gw->port, gw->unit_from, gw->unit_to, gw->remote_from, gw->pipeline, gw->connections);
+   }
+   gateway_sweep_config();
+   for (ix = 0; ix < staging.gateways_cnt; ix++)
+   {
+      gw = &staging.gateways[ix];
+      if (!kept[ix])
+         gateway_add_config(gw->host, gw->port, gw->unit_from, gw->unit_to, gw->remote_from, gw->pipeline, gw->connections);
+   }
+
+   // Polls, rule inputs and virtual register operands are refresh requirements of the polling plan
+   plan_clear();
+   for (ix = 0; ix < staging.polls_cnt; ix++)
+   {
+      poll = &staging.polls[ix];
+      plan_require(poll->unit, poll->func, poll->start, poll->count, poll->period);
+   }
+
+   rule_clear();
+   for (ix = 0; ix < staging.rules_cnt; ix++)
+      rule_add(&staging.rules[ix]);
+   rule_compile();
+
+   virtual_clear();
+   for (ix = 0; ix < staging.virtuals_cnt; ix++)
+      virtual_add(&staging.virtuals[ix]);
+   virtual_compile();
+
+   // Not feasible plan is applied anyway, polling runs with lower rate then
+   plan_build();
+   plan_apply();
+
+   cycle_clear();
+   for (ix = 0; ix < staging.cycles_cnt; ix++)
+      cycle_add(&staging.cycles[ix]);
+
+   action_mark_config();
+   for (ix = 0; ix < staging.timers_cnt; ix++)
+   {
+      timer = &staging.timers[ix];
+      kept[ix] = action_keep_config(timer->kind, &timer->target, timer->delay, timer->period, timer->at);
+   }
+   action_sweep_config();
+   for (ix = 0; ix < staging.timers_cnt; ix++)
+   {
+      timer = &staging.timers[ix];
+      if (!kept[ix])
+         action_add_config(timer->kind, &timer->target, timer->delay, timer->period, timer->at);
+   }
+
+   // Used for new connections
+   memcpy(clients, staging.clients, sizeof(clients));
+   clients_cnt = staging.clients_cnt;
+
+   for (ix = 0; ix < REQUEST_CLASSES; ix++)
+      request_set_budget(ix, staging.budgets[ix]);
+
+   // Request pool is allocated once at startup
+   if (pool_transactions < 0)
+   {
+      pool_transactions = staging.pool_transactions;
+      pool_frames = staging.pool_frames;
+   }
+   else if (staging.pool_transactions != pool_transactions || staging.pool_frames != pool_frames)
+   {
+      TRACE("Request pool size change takes effect after restart");
+   }
+
+   TRACE("Config applied: %d slaves, %d gateways, %d polls, %d rules, %d virtual registers, %d cycles, %d timers", staging.slaves_cnt,
+         staging.gateways_cnt, staging.polls_cnt, staging.rules_cnt, staging.virtuals_cnt, staging.cycles_cnt, staging.timers_cnt);
+}
+
+int config_load(const char *filename)
+{
+   if (filename != config_path)
+      snprintf(config_path, sizeof(config_path), "%s", filename);
+
+   if (config_parse(config_path) < 0)
+   {
+      TRACE_ERROR("Config file %s rejected", config_path);
+      return -1;
+   }
+
+   config_apply();
+
+   return 0;
+}
+
+int config_reload(void)
+{
+   if (config_path[0] == 0)
+      return -1;
+
+   TRACE("Reload config file %s", config_path);
+
+   return config_load(config_path);
+}
+
+// Round robin weight of connection from address (network byte order)
+int config_client_weight(uint32_t addr)
+{
+   int ix;
+
+   for (ix = 0; ix < clients_cnt; ix++)
+   {
+      if (clients[ix].addr == addr)
+         return clients[ix].weight;
+   }
+
+   return 1;
+}
+
+// Request pool size of startup configuration, 0 selects default
+void config_pool_size(int *transactions, int *frames)
+{
+   *transactions = (pool_transactions > 0) ? pool_transactions : 0;
+   *frames = (pool_frames > 0) ? pool_frames : 0;
+}
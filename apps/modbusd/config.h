@@ -0,0 +1,11 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#include <stdint.h>
+
+int config_load(const char *filename);
+int config_reload(void);
+int config_client_weight(uint32_t addr);
+void config_pool_size(int *transactions, int *frames);
+
+#endif // __CONFIG_H
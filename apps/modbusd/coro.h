@@ -0,0 +1,60 @@
+#ifndef __CORO_H
+#define __CORO_H
+
+//
+// Stackless coroutines (protothreads). Coroutine is a function called again
+// with its state until it returns CORO_DONE, every call continues after the
+// await it was suspended at. Local variables do not survive suspension, keep
+// them in the state structure. Body of coroutine must not use switch statement
+// around an await.
+//
+//   int step(job_t *job)
+//   {
+//      CORO_BEGIN(&job->coro);
+//      send(job);
+//      CORO_AWAIT(&job->coro, received(job));
+//      CORO_END(&job->coro);
+//   }
+//
+
+#define CORO_DONE                0
+#define CORO_PENDING             1
+
+typedef struct
+{
+   int line;                  // resume point, 0 start, -1 done
+
+} coro_t;
+
+// Resume point is a case label reached also in sequence
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define CORO_FALLTHROUGH         __attribute__((fallthrough))
+#else
+#define CORO_FALLTHROUGH         do { } while (0)
+#endif
+
+#define CORO_INIT(_c)            ((_c)->line = 0)
+#define CORO_FINISHED(_c)        ((_c)->line < 0)
+
+#define CORO_BEGIN(_c)           switch ((_c)->line) { case 0:
+
+// Suspend until condition is true, it is evaluated again on every call
+#define CORO_AWAIT(_c, _cond)                                           \
+   do {                                                                 \
+      (_c)->line = __LINE__; CORO_FALLTHROUGH; case __LINE__:           \
+      if (!(_cond))                                                     \
+         return CORO_PENDING;                                           \
+   } while (0)
+
+// Run nested coroutine with its own state until it is done
+#define CORO_AWAIT_CALL(_c, _sub, _call)                                \
+   do {                                                                 \
+      CORO_INIT(_sub);                                                  \
+      CORO_AWAIT(_c, (_call) == CORO_DONE);                             \
+   } while (0)
+
+#define CORO_EXIT(_c)            do { (_c)->line = -1; return CORO_DONE; } while (0)
+
+#define CORO_END(_c)             } (_c)->line = -1; return CORO_DONE
+
+#endif // __CORO_H
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "bitset.h"
+#include "timerwheel.h"
+#include "history.h"
+#include "snapshot.h"
+#include "request.h"
+#include "plan.h"
+#include "virtual.h"
+#include "cycle.h"
+
+#if !ENABLE_TRACE_CYCLE
+#include "trace_undef.h"
+#endif
+
+//
+// Sampling cycles read configured point set in one back-to-back burst at wall
+// clock multiples of the period, meters of energy accounting are read as close
+// together as the bus allows. Cycle is one bus job of the highest class queued
+// lead ms before the boundary together with reservation of the bus until the
+// boundary, transaction running then finishes and nothing else starts, so the
+// burst is not delayed by other transactions. Cycles with boundaries closer
+// than their bursts share the earlier reservation. Sample time is the end of request
+// on the wire, when the slave takes its value. Points are read in order of their
+// bus time with the longest last, its response does not add to the skew.
+//
+
+typedef struct
+{
+   uint8_t used;
+   uint8_t queued;            // job waits for the bus or runs
+   uint8_t dropped;           // queued job belongs to removed cycle of this slot
+   cycle_config_t config;
+   cycle_sample_t samples[CYCLE_MAX_POINTS];
+   cycle_stats_t stats;
+   wheel_timer_t timer;
+   int64_t boundary;          // ms since epoch, next cycle
+   int64_t start;             // us monotonic time of next boundary
+   int64_t job_boundary;      // boundary of queued job
+   uint8_t order[CYCLE_MAX_POINTS];    // points of running job in order of reads
+   int pos;                   // point read now
+   int64_t offset;            // us, wall clock to monotonic time
+   int64_t first;             // us, first and last sample of running job
+   int64_t last;
+
+} cycle_t;
+
+static cycle_t cycles[CYCLE_MAX_COUNT];
+static int bus_sd = -1;
+
+
+static int cycle_bits(uint8_t func)
+{
+   return func == MODBUS_FUNC_READ_COILS || func == MODBUS_READ_DISCRETE_INPUTS;
+}
+
+// Bytes of response data
+static int cycle_data_size(const cycle_point_t *p)
+{
+   return cycle_bits(p->func) ? (p->count + 7) / 8 : p->count * 2;
+}
+
+static uint32_t cycle_point_cost(const cycle_point_t *p)
+{
+   return plan_transaction_cost(p->unit, 8, 5 + cycle_data_size(p));
+}
+
+// Next boundary far enough to take the bus before it
+static void cycle_schedule(cycle_t *c)
+{
+   int64_t next, wall = systime_wall_us();
+   uint32_t period = c->config.period;
+
+   // Timer of ms resolution may fire before the boundary it was set for
+   next = (wall / 1000 + c->config.lead) / period * period + period;
+   c->boundary = (next > c->boundary) ? next : c->boundary + period;
+   c->start = systime_us() + (c->boundary * 1000 - wall);
+
+   timer_add(&c->timer, systime_ms() + (c->boundary * 1000 - wall) / 1000 - c->config.lead);
+}
+
+// Sample of point read by completed transaction
+static void cycle_sample(cycle_t *c, int ix, const modbus_txn_t *txn)
+{
+   const cycle_point_t *p = &c->config.points[ix];
+   cycle_sample_t *s = &c->samples[ix];
+   bitset_t state;
+
+   s->valid = 0;
+
+   if (txn->result < 0)
+   {
+      TRACE_ERROR("Cycle read unit 0x%X func 0x%X failed", p->unit, p->func);
+      c->stats.failed++;
+      return;
+   }
+
+   s->valid = 1;
+   s->time = txn->tx_end + c->offset;
+   s->len = cycle_data_size(p);
+   memcpy(s->data, &txn->rsp[MODBUS_RTU_DATA_IDX+1], s->len);
+
+   if (cycle_bits(p->func))
+   {
+      bitset_from_bytes(&state, s->data, p->count);
+      history_record_bits(p->unit, p->func, p->start, p->count, &state);
+      snapshot_store_bits(p->unit, p->func, p->start, p->count, &state);
+   }
+   else
+   {
+      virtual_process_registers(p->unit, p->func, p->start, p->count, s->data);
+   }
+
+   if (c->first == 0)
+      c->first = s->time;
+   c->last = s->time;
+}
+
+static void cycle_finish(cycle_t *c)
+{
+   c->stats.seq++;
+   c->stats.boundary = c->job_boundary;
+   c->stats.lag = 0;
+   c->stats.skew = 0;
+
+   if (c->first != 0)
+   {
+      c->stats.lag = (c->first > c->job_boundary * 1000) ? c->first - c->job_boundary * 1000 : 0;
+      c->stats.skew = c->last - c->first;
+      if (c->stats.lag > c->stats.lag_max)
+         c->stats.lag_max = c->stats.lag;
+      if (c->stats.skew > c->stats.skew_max)
+         c->stats.skew_max = c->stats.skew;
+   }
+
+   TRACE("Cycle %d: %d points, lag %u us, skew %u us", (int)(c - cycles), c->config.points_cnt, c->stats.lag, c->stats.skew);
+}
+
+static int cycle_job(request_t *req, modbus_txn_t *txn)
+{
+   cycle_t *c = req->arg;
+   const cycle_point_t *p;
+   uint32_t cost[CYCLE_MAX_POINTS];
+   int ix, jx;
+
+   CORO_BEGIN(&req->coro);
+
+   // Removed by reload meanwhile, slot may hold new cycle already
+   if (!c->used || c->dropped)
+   {
+      c->queued = 0;
+      c->dropped = 0;
+      CORO_EXIT(&req->coro);
+   }
+
+   // Shortest first, turnaround of devices changes the order
+   for (ix = 0; ix < c->config.points_cnt; ix++)
+   {
+      cost[ix] = cycle_point_cost(&c->config.points[ix]);
+      for (jx = ix; jx > 0 && cost[c->order[jx - 1]] > cost[ix]; jx--)
+         c->order[jx] = c->order[jx - 1];
+      c->order[jx] = ix;
+   }
+
+   c->offset = systime_wall_us() - systime_us();
+   c->first = 0;
+   c->last = 0;
+
+   for (c->pos = 0; c->pos < c->config.points_cnt; c->pos++)
+   {
+      p = &c->config.points[c->order[c->pos]];
+      if (modbus_txn_init(txn, bus_sd, p->unit, p->func, p->start, p->count, NULL, 0, 3 + cycle_data_size(p)) == 0)
+      {
+         MODBUS_TXN_AWAIT(&req->coro, txn);
+      }
+      else
+      {
+         txn->result = -1;
+      }
+
+      // Samples of cycle removed meanwhile are not stored
+      if (c->dropped)
+         break;
+
+      cycle_sample(c, c->order[c->pos], txn);
+   }
+
+   c->queued = 0;
+   if (c->dropped)
+   {
+      c->dropped = 0;
+      CORO_EXIT(&req->coro);
+   }
+
+   cycle_finish(c);
+
+   CORO_END(&req->coro);
+}
+
+static void cycle_timer_cb(wheel_timer_t *timer, void *arg)
+{
+   cycle_t *c = arg;
+   uint32_t cost = 0;
+   int ix;
+
+   (void)timer;
+
+   for (ix = 0; ix < c->config.points_cnt; ix++)
+      cost += cycle_point_cost(&c->config.points[ix]);
+
+   // Previous cycle still waits for the bus or runs, or the bus is overloaded
+   if (c->queued || request_submit_job(REQUEST_CLASS_WRITE, cost, cycle_job, c) < 0)
+   {
+      TRACE_ERROR("Cycle %d boundary %lld missed", (int)(c - cycles), (long long)c->boundary);
+      c->stats.missed++;
+   }
+   else
+   {
+      c->queued = 1;
+      c->job_boundary = c->boundary;
+      request_reserve(c->start);
+   }
+
+   cycle_schedule(c);
+}
+
+int cycle_init(int sd)
+{
+   bus_sd = sd;
+   memset(cycles, 0, sizeof(cycles));
+
+   return 0;
+}
+
+void cycle_clear(void)
+{
+   int ix;
+
+   for (ix = 0; ix < CYCLE_MAX_COUNT; ix++)
+   {
+      if (cycles[ix].used)
+      {
+         timer_del(&cycles[ix].timer);
+         cycles[ix].used = 0;
+      }
+   }
+}
+
+int cycle_add(const cycle_config_t *config)
+{
+   cycle_t *c;
+   uint8_t queued;
+   int ix;
+
+   if (config->period == 0 || config->lead >= config->period || config->points_cnt <= 0 || config->points_cnt > CYCLE_MAX_POINTS)
+   {
+      TRACE_ERROR("Bad cycle period %u lead %u", config->period, config->lead);
+      return -1;
+   }
+
+   for (ix = 0; ix < CYCLE_MAX_COUNT && cycles[ix].used; ix++);
+
+   if (ix == CYCLE_MAX_COUNT)
+   {
+      TRACE_ERROR("Cycles maxnum exceeded");
+      return -1;
+   }
+
+   // Queued job of removed cycle finds its slot taken and does nothing
+   c = &cycles[ix];
+   queued = c->queued;
+   memset(c, 0, sizeof(cycle_t));
+   c->queued = queued;
+   c->dropped = queued;
+   c->used = 1;
+   c->config = *config;
+   timer_init(&c->timer, cycle_timer_cb, c);
+   cycle_schedule(c);
+
+   TRACE("Cycle %d: %d points every %u ms", ix, config->points_cnt, config->period);
+
+   return 0;
+}
+
+// Last completed cycle, samples in configured order of points
+int cycle_get(int ix, const cycle_config_t **config, const cycle_sample_t **samples, const cycle_stats_t **stats)
+{
+   if (ix < 0 || ix >= CYCLE_MAX_COUNT || !cycles[ix].used)
+      return -1;
+
+   *config = &cycles[ix].config;
+   *samples = cycles[ix].samples;
+   *stats = &cycles[ix].stats;
+
+   return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef __CYCLE_H
+#define __CYCLE_H
+
+#include <stdint.h>
+
+#define CYCLE_MAX_COUNT             4
+#define CYCLE_MAX_POINTS            16
+#define CYCLE_MAX_DATA              64       // bytes of one read, 32 registers or 512 bits
+#define CYCLE_LEAD                  50       // ms, default bus reservation ahead of boundary
+
+// Point set read in one sampling cycle
+typedef struct
+{
+   uint8_t unit;
+   uint8_t func;              // MODBUS_FUNC_READ_COILS .. MODBUS_FUNC_READ_INPUT_REGISTERS
+   uint16_t start;
+   uint16_t count;
+
+} cycle_point_t;
+
+typedef struct
+{
+   uint32_t period;           // ms, cycles start at wall clock multiples of period
+   uint32_t lead;             // ms, bus taken before the boundary
+   int points_cnt;
+   cycle_point_t points[CYCLE_MAX_POINTS];
+
+} cycle_config_t;
+
+typedef struct
+{
+   int64_t time;              // us since epoch, end of request on the wire, slave samples then
+   uint8_t valid;
+   uint8_t len;               // bytes of data
+   uint8_t data[CYCLE_MAX_DATA];    // response data as on the wire
+
+} cycle_sample_t;
+
+typedef struct
+{
+   uint32_t seq;              // completed cycles
+   int64_t boundary;          // ms since epoch, aligned start of last cycle
+   uint32_t lag;              // us, first sample after the boundary
+   uint32_t skew;             // us, first to last sample of last cycle
+   uint32_t lag_max;
+   uint32_t skew_max;
+   uint32_t missed;           // boundaries without cycle, bus refused or previous one waits
+   uint32_t failed;           // samples not read
+
+} cycle_stats_t;
+
+
+int cycle_init(int sd);
+void cycle_clear(void);
+int cycle_add(const cycle_config_t *config);
+
+int cycle_get(int ix, const cycle_config_t **config, const cycle_sample_t **samples, const cycle_stats_t **stats);
+
+#endif // __CYCLE_H
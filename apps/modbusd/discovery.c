@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "serial.h"
+#include "modbus.h"
+#include "discovery.h"
+
+#if !ENABLE_TRACE_DISCOVERY
+#include "trace_undef.h"
+#endif
+
+//
+// Bus discovery sweeps addresses 1..247 and fingerprints responding devices.
+// The probe is the fix protocol input read (FC02 with count 0): china relay
+// boards answer it with 8 inputs, standard devices reject it with exception and
+// silent address is empty. Timeouts are derived from baudrate so that empty
+// address costs one request frame plus turnaround. Buses are swept in parallel.
+//
+#define CFG_DISCOVERY_TURNAROUND    30       // ms, slave response delay allowance
+#define CFG_DISCOVERY_RETRY_CNT     2        // attempts when garbage is received
+#define DISCOVERY_FIRST_ADDR        1
+#define DISCOVERY_LAST_ADDR         247
+
+#define DISCOVERY_FEATURE_COILS     0x01
+#define DISCOVERY_FEATURE_INPUTS    0x02
+#define DISCOVERY_FEATURE_REGISTERS 0x04
+
+typedef struct
+{
+   uint8_t addr;
+   uint8_t fix;
+   uint8_t features;
+
+} discovery_device_t;
+
+typedef struct
+{
+   const char *devname;
+   int baud;
+   int sd;
+   pthread_t thread;
+   int timeout_us;            // first byte of response
+   int gap_us;                // t3.5 end of frame silence
+   int64_t elapsed;           // ms
+   int errors;
+   int devices_cnt;
+   discovery_device_t devices[DISCOVERY_LAST_ADDR];
+
+} discovery_bus_t;
+
+static discovery_bus_t buses[DISCOVERY_MAX_BUSES];
+
+
+// Send request, returns function code of valid response (with exception bit), 0 when silent, -1 on garbage
+static int discovery_request(discovery_bus_t *bus, uint8_t addr, uint8_t func, uint16_t regaddr, uint16_t count)
+{
+   uint8_t buf[MODBUS_RTU_MAX_ADU_SIZE];
+   int len;
+
+   serial_flush(bus->sd);
+
+   if (modbus_rtu_write_request(bus->sd, addr, func, regaddr, count) < 0)
+      return -1;
+
+   if ((len = serial_read_frame(bus->sd, buf, sizeof(buf), bus->timeout_us, bus->gap_us)) <= 0)
+      return len;
+
+   if (!modbus_rtu_frame_valid(addr, buf, len) || (buf[1] & 0x7F) != func)
+      return -1;
+
+   return buf[1];
+}
+
+static int discovery_probe(discovery_bus_t *bus, uint8_t addr, uint8_t func, uint16_t regaddr, uint16_t count)
+{
+   int retry, res = 0;
+
+   for (retry = 0; retry < CFG_DISCOVERY_RETRY_CNT; retry++)
+   {
+      if ((res = discovery_request(bus, addr, func, regaddr, count)) >= 0)
+         break;
+
+      bus->errors++;
+   }
+
+   return res;
+}
+
+static void discovery_sweep(discovery_bus_t *bus)
+{
+   discovery_device_t *dev;
+   int64_t start = systime_ms();
+   int addr, res;
+
+   for (addr = DISCOVERY_FIRST_ADDR; addr <= DISCOVERY_LAST_ADDR; addr++)
+   {
+      if ((res = discovery_probe(bus, addr, MODBUS_READ_DISCRETE_INPUTS, 0, 0)) <= 0)
+         continue;
+
+      dev = &bus->devices[bus->devices_cnt++];
+      memset(dev, 0, sizeof(discovery_device_t));
+      dev->addr = addr;
+
+      if (res == MODBUS_READ_DISCRETE_INPUTS)
+      {
+         // Zero count read accepted, china relay board
+         dev->fix = 1;
+         dev->features = DISCOVERY_FEATURE_COILS | DISCOVERY_FEATURE_INPUTS;
+      }
+      else
+      {
+         if (discovery_probe(bus, addr, MODBUS_FUNC_READ_COILS, 0, 8) == MODBUS_FUNC_READ_COILS)
+            dev->features |= DISCOVERY_FEATURE_COILS;
+         if (discovery_probe(bus, addr, MODBUS_READ_DISCRETE_INPUTS, 0, 8) == MODBUS_READ_DISCRETE_INPUTS)
+            dev->features |= DISCOVERY_FEATURE_INPUTS;
+         if (discovery_probe(bus, addr, MODBUS_FUNC_READ_HOLDING_REGISTERS, 0, 1) == MODBUS_FUNC_READ_HOLDING_REGISTERS)
+            dev->features |= DISCOVERY_FEATURE_REGISTERS;
+      }
+
+      // Progress goes to stderr, map on stdout stays clean
+      fprintf(stderr, "%s: found unit %d%s\n", bus->devname, addr, dev->fix ? " (fix protocol)" : "");
+   }
+
+   bus->elapsed = systime_ms() - start;
+}
+
+static void *discovery_thread(void *arg)
+{
+   discovery_sweep(arg);
+
+   return NULL;
+}
+
+static void discovery_write_map(FILE *fp, const discovery_bus_t *bus)
+{
+   const discovery_device_t *dev;
+   int ix;
+
+   fprintf(fp, "# bus %s at %d baud, %d devices, swept in %lld ms, %d garbled responses\n",
+           bus->devname, bus->baud, bus->devices_cnt, (long long)bus->elapsed, bus->errors);
+
+   for (ix = 0; ix < bus->devices_cnt; ix++)
+   {
+      dev = &bus->devices[ix];
+      if (dev->fix)
+      {
+         fprintf(fp, "slave %-3d profile china-relay   # 8 coils, 8 inputs\n", dev->addr);
+      }
+      else
+      {
+         fprintf(fp, "slave %-3d       #%s%s%s\n", dev->addr,
+                 (dev->features & DISCOVERY_FEATURE_COILS) ? " coils" : "",
+                 (dev->features & DISCOVERY_FEATURE_INPUTS) ? " inputs" : "",
+                 (dev->features & DISCOVERY_FEATURE_REGISTERS) ? " registers" : "");
+      }
+   }
+
+   fprintf(fp, "\n");
+}
+
+int discovery_run(const char **devnames, int count, int baud, const char *mapname)
+{
+   discovery_bus_t *bus;
+   FILE *fp = NULL;
+   int ix, speed, char_us, out = -1, res = 0;
+
+   if (count > DISCOVERY_MAX_BUSES || (speed = serial_baudrate(baud)) < 0)
+      return -1;
+
+   // Map written to stdout feeds -c, traces of the sweep are moved to stderr
+   if (!strcmp(mapname, "-"))
+   {
+      fflush(stdout);
+      if ((out = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || (fp = fdopen(out, "w")) == NULL)
+      {
+         TRACE_ERROR("Redirect of traces failed");
+         return -1;
+      }
+   }
+
+   // 11 bit characters, t3.5 is fixed 1.75 ms above 19200 baud
+   char_us = 11000000 / baud;
+
+   for (ix = 0; ix < count; ix++)
+   {
+      bus = &buses[ix];
+      memset(bus, 0, sizeof(discovery_bus_t));
+      bus->devname = devnames[ix];
+      bus->baud = baud;
+      bus->timeout_us = 8 * char_us + CFG_DISCOVERY_TURNAROUND * 1000 + 2 * char_us;
+      bus->gap_us = (baud > 19200) ? 1750 : (7 * char_us) / 2;
+
+      if ((bus->sd = serial_open(bus->devname, speed)) < 0)
+      {
+         TRACE_ERROR("open serial %s failed", bus->devname);
+         res = -1;
+         continue;
+      }
+
+      if (pthread_create(&bus->thread, NULL, discovery_thread, bus) != 0)
+      {
+         TRACE_ERROR("Start discovery of %s failed", bus->devname);
+         serial_close(bus->sd);
+         bus->sd = -1;
+         res = -1;
+      }
+   }
+
+   for (ix = 0; ix < count; ix++)
+   {
+      if (buses[ix].sd >= 0)
+      {
+         pthread_join(buses[ix].thread, NULL);
+         serial_close(buses[ix].sd);
+      }
+   }
+
+   fflush(stdout);
+
+   if (fp == NULL && (fp = fopen(mapname, "w")) == NULL)
+   {
+      TRACE_ERROR("Create device map %s failed", mapname);
+      return -1;
+   }
+
+   fprintf(fp, "# modbusd device map\n");
+   for (ix = 0; ix < count; ix++)
+   {
+      if (buses[ix].sd >= 0)
+         discovery_write_map(fp, &buses[ix]);
+   }
+
+   fclose(fp);
+
+   return res;
+}
@@ -0,0 +1,8 @@
+#ifndef __DISCOVERY_H
+#define __DISCOVERY_H
+
+#define DISCOVERY_MAX_BUSES         8
+
+int discovery_run(const char **devnames, int count, int baud, const char *mapname);
+
+#endif // __DISCOVERY_H
@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "tcp_socket.h"
+#include "timerwheel.h"
+#include "request.h"
+#include "gateway.h"
+
+#if !ENABLE_TRACE_GATEWAY
+#include "trace_undef.h"
+#endif
+
+//
+// Remote Modbus TCP gateways used as additional buses. Range of local unit ids
+// is mapped to unit ids behind the gateway, requests of those units bypass the
+// serial bus queue and are forwarded immediately. Every gateway keeps a small
+// pool of persistent connections, each with up to pipeline requests in flight,
+// matched back by transaction id. Gateways run in parallel, slow one delays only
+// its own units.
+//
+#define CFG_GATEWAY_CONNECT_TIMEOUT 200      // ms, connect blocks the main loop
+#define CFG_GATEWAY_RETRY           5000     // ms, reconnect interval of unreachable gateway
+#define CFG_GATEWAY_TIMEOUT         1000     // ms, response timeout
+#define CFG_GATEWAY_TICK            100      // ms, timeout check period
+#define CFG_GATEWAY_MAX_QUEUE       64       // requests waiting for pipeline slot
+#define CFG_GATEWAY_MAX_TIMEOUTS    3        // consecutive timeouts, connection is reopened
+
+typedef struct
+{
+   int sd;                          // -1 when closed
+   request_t *head;                 // in flight, oldest first
+   request_t *tail;
+   int inflight;
+   int timeouts;                    // consecutive
+   uint16_t tid;
+   int rxlen;
+   uint8_t rx[2 * MODBUS_TCP_MAX_ADU_SIZE];
+
+} gateway_conn_t;
+
+typedef struct
+{
+   wheel_timer_t timer;
+   uint8_t used;
+   uint8_t mark;                    // reload sweep mark
+   char host[64];
+   int port;
+   uint8_t unit_from;
+   uint8_t unit_to;
+   uint8_t remote_from;
+   int pipeline;
+   int connections;
+   gateway_conn_t conns[GATEWAY_MAX_CONNECTIONS];
+   request_t *head;                 // waiting for free pipeline slot
+   request_t *tail;
+   int queued;
+   int64_t retry_at;                // ms, next connect attempt
+   uint32_t forwarded;
+   uint32_t timeouts;
+   uint32_t failures;
+
+} gateway_t;
+
+static gateway_t gateways[GATEWAY_MAX_COUNT];
+
+
+// Answer request by exception of gateway itself
+static void gateway_fail(gateway_t *gw, request_t *req, uint8_t code)
+{
+   req->buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
+   req->buf[MODBUS_TCP_DATA_IDX] = code;
+   req->buf[4] = 0;
+   req->buf[5] = 3;
+   req->rsp = req->buf;
+   req->rsplen = MODBUS_TCP_HEADER_SIZE + 2;
+
+   gw->failures++;
+   request_complete(req);
+}
+
+static void gateway_fail_queue(gateway_t *gw, uint8_t code)
+{
+   request_t *req;
+
+   while ((req = gw->head) != NULL)
+   {
+      gw->head = req->next;
+      gateway_fail(gw, req, code);
+   }
+
+   gw->tail = NULL;
+   gw->queued = 0;
+}
+
+static void gateway_close(gateway_t *gw, gateway_conn_t *conn)
+{
+   request_t *req;
+
+   if (conn->sd >= 0)
+   {
+      TRACE("Gateway %s:%d connection closed", gw->host, gw->port);
+      tcp_socket_close(conn->sd);
+      conn->sd = -1;
+   }
+
+   while ((req = conn->head) != NULL)
+   {
+      conn->head = req->next;
+      gateway_fail(gw, req, MODBUS_EXCEPTION_GATEWAY_TARGET);
+   }
+
+   conn->tail = NULL;
+   conn->inflight = 0;
+   conn->timeouts = 0;
+   conn->rxlen = 0;
+}
+
+static int gateway_connected(const gateway_t *gw)
+{
+   int ix, cnt = 0;
+
+   for (ix = 0; ix < gw->connections; ix++)
+   {
+      if (gw->conns[ix].sd >= 0)
+         cnt++;
+   }
+
+   return cnt;
+}
+
+// Open missing connections, not more often than retry interval when gateway is unreachable
+static void gateway_connect(gateway_t *gw)
+{
+   gateway_conn_t *conn;
+   int ix;
+
+   if (systime_ms() < gw->retry_at)
+      return;
+
+   for (ix = 0; ix < gw->connections; ix++)
+   {
+      conn = &gw->conns[ix];
+      if (conn->sd >= 0)
+         continue;
+
+      if ((conn->sd = tcp_socket_connect_timeout(gw->host, gw->port, CFG_GATEWAY_CONNECT_TIMEOUT)) < 0)
+      {
+         TRACE_ERROR("Gateway %s:%d connect failed", gw->host, gw->port);
+         gw->retry_at = systime_ms() + CFG_GATEWAY_RETRY;
+         return;
+      }
+
+      TRACE("Gateway %s:%d connected", gw->host, gw->port);
+   }
+}
+
+// Least loaded open connection with free pipeline slot
+static gateway_conn_t *gateway_free_conn(gateway_t *gw)
+{
+   gateway_conn_t *conn = NULL;
+   int ix;
+
+   for (ix = 0; ix < gw->connections; ix++)
+   {
+      if (gw->conns[ix].sd >= 0 && gw->conns[ix].inflight < gw->pipeline &&
+          (conn == NULL || gw->conns[ix].inflight < conn->inflight))
+         conn = &gw->conns[ix];
+   }
+
+   return conn;
+}
+
+static void gateway_dispatch(gateway_t *gw)
+{
+   gateway_conn_t *conn;
+   request_t *req;
+   uint8_t frame[MODBUS_TCP_MAX_ADU_SIZE];
+
+   if (gw->head == NULL)
+      return;
+
+   if (gateway_connected(gw) < gw->connections)
+      gateway_connect(gw);
+
+   if (!gateway_connected(gw))
+   {
+      gateway_fail_queue(gw, MODBUS_EXCEPTION_GATEWAY_PATH);
+      return;
+   }
+
+   while (gw->head != NULL && (conn = gateway_free_conn(gw)) != NULL)
+   {
+      req = gw->head;
+      gw->head = req->next;
+      if (gw->head == NULL)
+         gw->tail = NULL;
+      gw->queued--;
+
+      // Own transaction id and remote unit id, client header is restored from req->buf
+      memcpy(frame, req->buf, req->len);
+      req->remote_tid = ++conn->tid;
+      frame[0] = req->remote_tid >> 8;
+      frame[1] = req->remote_tid & 0xFF;
+      frame[MODBUS_TCP_ADDR_IDX] = req->buf[MODBUS_TCP_ADDR_IDX] - gw->unit_from + gw->remote_from;
+
+      req->next = NULL;
+      req->enqueued = systime_ms();
+      if (conn->tail != NULL)
+         conn->tail->next = req;
+      else
+         conn->head = req;
+      conn->tail = req;
+      conn->inflight++;
+      gw->forwarded++;
+
+      if (tcp_socket_send(conn->sd, frame, req->len) != req->len)
+      {
+         TRACE_ERROR("Gateway %s:%d send failed", gw->host, gw->port);
+         gateway_close(gw, conn);
+      }
+   }
+
+   if (!timer_pending(&gw->timer))
+      timer_add(&gw->timer, systime_ms() + CFG_GATEWAY_TICK);
+}
+
+// Response timeouts, dispatch queued requests to reopened connections
+static void gateway_timer_cb(wheel_timer_t *timer, void *arg)
+{
+   gateway_t *gw = arg;
+   gateway_conn_t *conn;
+   request_t *req;
+   int64_t now = systime_ms();
+   int ix, busy = 0;
+
+   for (ix = 0; ix < gw->connections; ix++)
+   {
+      conn = &gw->conns[ix];
+
+      while ((req = conn->head) != NULL && now - req->enqueued >= CFG_GATEWAY_TIMEOUT)
+      {
+         conn->head = req->next;
+         if (conn->head == NULL)
+            conn->tail = NULL;
+         conn->inflight--;
+         conn->timeouts++;
+         gw->timeouts++;
+
+         TRACE_ERROR("Gateway %s:%d unit %d timeout", gw->host, gw->port, req->buf[MODBUS_TCP_ADDR_IDX]);
+         gateway_fail(gw, req, MODBUS_EXCEPTION_GATEWAY_TARGET);
+      }
+
+      // Late responses are dropped by transaction id, dead connection is reopened
+      if (conn->timeouts >= CFG_GATEWAY_MAX_TIMEOUTS)
+         gateway_close(gw, conn);
+
+      busy |= (conn->head != NULL);
+   }
+
+   gateway_dispatch(gw);
+
+   if ((busy || gw->head != NULL) && !timer_pending(timer))
+      timer_add(timer, now + CFG_GATEWAY_TICK);
+}
+
+static void gateway_response(gateway_t *gw, gateway_conn_t *conn, const uint8_t *frame, int len)
+{
+   request_t *req, *prev = NULL;
+   uint16_t tid = (frame[0] << 8) | frame[1];
+
+   for (req = conn->head; req != NULL && req->remote_tid != tid; req = req->next)
+      prev = req;
+
+   if (req == NULL)
+   {
+      TRACE_ERROR("Gateway %s:%d unexpected transaction %d", gw->host, gw->port, tid);
+      return;
+   }
+
+   if (prev != NULL)
+      prev->next = req->next;
+   else
+      conn->head = req->next;
+   if (conn->tail == req)
+      conn->tail = prev;
+   conn->inflight--;
+   conn->timeouts = 0;
+
+   // Client transaction id and unit id, response of gateway
+   memcpy(&req->buf[2], &frame[2], MODBUS_TCP_ADDR_IDX - 2);
+   memcpy(&req->buf[MODBUS_TCP_FUNC_IDX], &frame[MODBUS_TCP_FUNC_IDX], len - MODBUS_TCP_FUNC_IDX);
+   req->rsp = req->buf;
+   req->rsplen = len;
+
+   request_complete(req);
+}
+
+static void gateway_receive(gateway_t *gw, gateway_conn_t *conn)
+{
+   int res, pos, len;
+
+   if ((res = tcp_socket_recv(conn->sd, &conn->rx[conn->rxlen], sizeof(conn->rx) - conn->rxlen)) <= 0)
+   {
+      gateway_close(gw, conn);
+      return;
+   }
+
+   conn->rxlen += res;
+
+   for (pos = 0; pos + MODBUS_TCP_HEADER_SIZE < conn->rxlen; pos += len)
+   {
+      // MBAP length covers unit id and PDU
+      len = 6 + ((conn->rx[pos + 4] << 8) | conn->rx[pos + 5]);
+      if (len <= MODBUS_TCP_HEADER_SIZE || len > MODBUS_TCP_MAX_ADU_SIZE)
+      {
+         TRACE_ERROR("Gateway %s:%d bad frame length %d", gw->host, gw->port, len);
+         gateway_close(gw, conn);
+         return;
+      }
+
+      if (pos + len > conn->rxlen)
+         break;
+
+      gateway_response(gw, conn, &conn->rx[pos], len);
+   }
+
+   conn->rxlen -= pos;
+   memmove(conn->rx, &conn->rx[pos], conn->rxlen);
+}
+
+int gateway_init(void)
+{
+   memset(gateways, 0, sizeof(gateways));
+
+   return 0;
+}
+
+static gateway_t *gateway_add(const char *host, int port, uint8_t unit_from, uint8_t unit_to, uint8_t remote_from,
+                              int pipeline, int connections)
+{
+   gateway_t *gw;
+   int ix;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT && gateways[ix].used; ix++);
+
+   if (ix == GATEWAY_MAX_COUNT)
+   {
+      TRACE_ERROR("Gateways maxnum exceeded");
+      return NULL;
+   }
+
+   gw = &gateways[ix];
+   memset(gw, 0, sizeof(gateway_t));
+   gw->used = 1;
+   snprintf(gw->host, sizeof(gw->host), "%s", host);
+   gw->port = port;
+   gw->unit_from = unit_from;
+   gw->unit_to = unit_to;
+   gw->remote_from = remote_from;
+   gw->pipeline = (pipeline > 0 && pipeline <= GATEWAY_MAX_PIPELINE) ? pipeline : 1;
+   gw->connections = (connections > 0 && connections <= GATEWAY_MAX_CONNECTIONS) ? connections : 1;
+   timer_init(&gw->timer, gateway_timer_cb, gw);
+
+   for (ix = 0; ix < GATEWAY_MAX_CONNECTIONS; ix++)
+      gw->conns[ix].sd = -1;
+
+   TRACE("Gateway %s:%d units %d-%d added", host, port, unit_from, unit_to);
+
+   return gw;
+}
+
+static void gateway_remove(gateway_t *gw)
+{
+   int ix;
+
+   for (ix = 0; ix < GATEWAY_MAX_CONNECTIONS; ix++)
+      gateway_close(gw, &gw->conns[ix]);
+
+   gateway_fail_queue(gw, MODBUS_EXCEPTION_GATEWAY_PATH);
+   timer_del(&gw->timer);
+   gw->used = 0;
+
+   TRACE("Gateway %s:%d removed", gw->host, gw->port);
+}
+
+void gateway_mark_config(void)
+{
+   int ix;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT; ix++)
+      gateways[ix].mark = gateways[ix].used;
+}
+
+// Unchanged gateway keeps its open connections and requests in flight, returns 1 when it is kept
+int gateway_keep_config(const char *host, int port, uint8_t unit_from, uint8_t unit_to, uint8_t remote_from,
+                        int pipeline, int connections)
+{
+   gateway_t *gw;
+   int ix;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT; ix++)
+   {
+      gw = &gateways[ix];
+      if (gw->used && gw->mark && !strcmp(gw->host, host) && gw->port == port && gw->unit_from == unit_from &&
+          gw->unit_to == unit_to && gw->remote_from == remote_from && gw->pipeline == pipeline &&
+          gw->connections == connections)
+      {
+         gw->mark = 0;
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+// New gateway, added after sweep of removed ones
+int gateway_add_config(const char *host, int port, uint8_t unit_from, uint8_t unit_to, uint8_t remote_from,
+                       int pipeline, int connections)
+{
+   return gateway_add(host, port, unit_from, unit_to, remote_from, pipeline, connections) != NULL ? 0 : -1;
+}
+
+void gateway_sweep_config(void)
+{
+   int ix;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT; ix++)
+   {
+      if (gateways[ix].used && gateways[ix].mark)
+         gateway_remove(&gateways[ix]);
+   }
+}
+
+// Take request of unit behind gateway, returns 0 when unit is local
+int gateway_route(request_t *req)
+{
+   uint8_t unit = req->buf[MODBUS_TCP_ADDR_IDX];
+   gateway_t *gw = NULL;
+   int ix;
+
+   // Vendor functions are served by modbusd itself
+   if (req->buf[MODBUS_TCP_FUNC_IDX] >= MODBUS_FUNC_HISTORY_QUERY)
+      return 0;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT && gw == NULL; ix++)
+   {
+      if (gateways[ix].used && unit >= gateways[ix].unit_from && unit <= gateways[ix].unit_to)
+         gw = &gateways[ix];
+   }
+
+   if (gw == NULL)
+      return 0;
+
+   req->next = NULL;
+
+   if (gw->queued >= CFG_GATEWAY_MAX_QUEUE)
+   {
+      gateway_fail(gw, req, MODBUS_EXCEPTION_SERVER_BUSY);
+      return 1;
+   }
+
+   if (gw->tail != NULL)
+      gw->tail->next = req;
+   else
+      gw->head = req;
+   gw->tail = req;
+   gw->queued++;
+
+   gateway_dispatch(gw);
+
+   return 1;
+}
+
+static void gateway_drop_from(request_t *req, int client)
+{
+   for (; req != NULL; req = req->next)
+   {
+      if (req->client == client)
+         req->client = -1;
+   }
+}
+
+// Client disconnected, responses of its requests are dropped
+void gateway_drop_client(int client)
+{
+   int ix, jx;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT; ix++)
+   {
+      if (!gateways[ix].used)
+         continue;
+
+      gateway_drop_from(gateways[ix].head, client);
+      for (jx = 0; jx < GATEWAY_MAX_CONNECTIONS; jx++)
+         gateway_drop_from(gateways[ix].conns[jx].head, client);
+   }
+}
+
+int gateway_fdset(fd_set *fds, int maxfd)
+{
+   int ix, jx, sd;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT; ix++)
+   {
+      for (jx = 0; jx < GATEWAY_MAX_CONNECTIONS && gateways[ix].used; jx++)
+      {
+         if ((sd = gateways[ix].conns[jx].sd) >= 0)
+         {
+            FD_SET(sd, fds);
+            if (sd > maxfd)
+               maxfd = sd;
+         }
+      }
+   }
+
+   return maxfd;
+}
+
+// Receive responses arrived meanwhile, do not wait
+void gateway_poll(void)
+{
+   fd_set read_fds;
+   struct timeval tv;
+   gateway_conn_t *conn;
+   int ix, jx, maxfd;
+
+   FD_ZERO(&read_fds);
+   if ((maxfd = gateway_fdset(&read_fds, -1)) < 0)
+      return;
+
+   tv.tv_sec = 0;
+   tv.tv_usec = 0;
+
+   if (select(maxfd + 1, &read_fds, NULL, NULL, &tv) <= 0)
+      return;
+
+   for (ix = 0; ix < GATEWAY_MAX_COUNT; ix++)
+   {
+      for (jx = 0; jx < GATEWAY_MAX_CONNECTIONS && gateways[ix].used; jx++)
+      {
+         conn = &gateways[ix].conns[jx];
+         if (conn->sd >= 0 && FD_ISSET(conn->sd, &read_fds))
+         {
+            gateway_receive(&gateways[ix], conn);
+            gateway_dispatch(&gateways[ix]);
+         }
+      }
+   }
+}
+
+int gateway_stats(int ix, gateway_stats_t *stats)
+{
+   const gateway_t *gw;
+   int jx;
+
+   if (ix < 0 || ix >= GATEWAY_MAX_COUNT || !gateways[ix].used)
+      return -1;
+
+   gw = &gateways[ix];
+   memset(stats, 0, sizeof(gateway_stats_t));
+   stats->unit_from = gw->unit_from;
+   stats->unit_to = gw->unit_to;
+   stats->queued = gw->queued;
+   stats->forwarded = gw->forwarded;
+   stats->timeouts = gw->timeouts;
+   stats->failures = gw->failures;
+
+   for (jx = 0; jx < gw->connections; jx++)
+   {
+      stats->inflight += gw->conns[jx].inflight;
+      if (gw->conns[jx].sd >= 0)
+         stats->connected++;
+   }
+
+   return 0;
+}
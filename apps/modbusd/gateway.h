@@ -0,0 +1,44 @@
+#ifndef __GATEWAY_H
+#define __GATEWAY_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "request.h"
+
+#define GATEWAY_MAX_COUNT           8
+#define GATEWAY_MAX_CONNECTIONS     4
+#define GATEWAY_MAX_PIPELINE        16
+
+typedef struct
+{
+   uint8_t unit_from;
+   uint8_t unit_to;
+   uint8_t connected;               // open connections
+   uint16_t inflight;
+   uint16_t queued;
+   uint32_t forwarded;
+   uint32_t timeouts;
+   uint32_t failures;               // answered by gateway exception of modbusd
+
+} gateway_stats_t;
+
+
+int gateway_init(void);
+
+void gateway_mark_config(void);
+int gateway_keep_config(const char *host, int port, uint8_t unit_from, uint8_t unit_to, uint8_t remote_from,
+                        int pipeline, int connections);
+int gateway_add_config(const char *host, int port, uint8_t unit_from, uint8_t unit_to, uint8_t remote_from,
+                       int pipeline, int connections);
+void gateway_sweep_config(void);
+
+int gateway_route(request_t *req);
+void gateway_drop_client(int client);
+
+int gateway_fdset(fd_set *fds, int maxfd);
+void gateway_poll(void);
+
+int gateway_stats(int ix, gateway_stats_t *stats);
+
+#endif // __GATEWAY_H
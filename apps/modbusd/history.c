@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "history.h"
+
+#if !ENABLE_TRACE_HISTORY
+#include "trace_undef.h"
+#endif
+
+#define CFG_HISTORY_MAX_POINTS         256
+#define CFG_HISTORY_CAPACITY           65536    // samples per point (1 MB ring file)
+#define CFG_HISTORY_HEARTBEAT          60000    // ms, store unchanged value at least this often
+
+#define HISTORY_HASH_BITS              9
+#define HISTORY_HASH_SIZE              (1 << HISTORY_HASH_BITS)    // twice the points, probes stay short
+#define HISTORY_MAGIC                  0x5348424D  // "MBHS"
+#define HISTORY_VERSION                1
+
+typedef struct
+{
+   uint32_t magic;
+   uint16_t version;
+   uint8_t unit;
+   uint8_t table;
+   uint16_t index;
+   uint16_t reserved;
+   uint32_t capacity;
+   uint32_t head;          // next write position
+   uint32_t count;         // number of valid samples
+   uint8_t padding[36];
+
+} history_header_t;
+
+typedef struct
+{
+   uint8_t unit;
+   uint8_t table;
+   uint16_t index;
+   history_header_t *header;
+   history_sample_t *samples;
+   size_t mapsize;
+
+} history_point_t;
+
+
+static const char *history_dir = NULL;
+static history_point_t points[CFG_HISTORY_MAX_POINTS];
+static int points_cnt = 0;
+static int16_t slots[HISTORY_HASH_SIZE];     // open addressing index of points, -1 free
+static int exhausted = 0;
+
+
+static uint32_t history_hash(uint8_t unit, uint8_t table, uint16_t index)
+{
+   uint32_t key = ((uint32_t)unit << 24) | ((uint32_t)table << 16) | index;
+
+   // Fibonacci hashing, neighbouring points spread over the table
+   return (key * 2654435769u) >> (32 - HISTORY_HASH_BITS);
+}
+
+// Slot of point in the index, free slot where it belongs when it is not open
+static int16_t *history_slot(uint8_t unit, uint8_t table, uint16_t index)
+{
+   uint32_t ix = history_hash(unit, table, index);
+   const history_point_t *point;
+
+   for (;; ix = (ix + 1) & (HISTORY_HASH_SIZE - 1))
+   {
+      if (slots[ix] < 0)
+         return &slots[ix];
+
+      point = &points[slots[ix]];
+      if (point->unit == unit && point->table == table && point->index == index)
+         return &slots[ix];
+   }
+}
+
+// Map ring file of point, new file is created only when create is set
+static int history_map(history_point_t *point, uint8_t unit, uint8_t table, uint16_t index, int create)
+{
+   char path[256];
+   struct stat st;
+   void *map;
+   int fd;
+
+   snprintf(path, sizeof(path), "%s/%u-%u-%u.hist", history_dir, unit, table, index);
+
+   if ((fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644)) < 0)
+   {
+      if (create)
+         TRACE_ERROR("Open history file %s failed - %s", path, strerror(errno));
+      return -1;
+   }
+
+   point->mapsize = sizeof(history_header_t) + (size_t)CFG_HISTORY_CAPACITY * sizeof(history_sample_t);
+
+   if (fstat(fd, &st) < 0 || (st.st_size != (off_t)point->mapsize && ftruncate(fd, point->mapsize) < 0))
+   {
+      TRACE_ERROR("Resize history file %s failed", path);
+      close(fd);
+      return -1;
+   }
+
+   map = mmap(NULL, point->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+   {
+      TRACE_ERROR("mmap history file %s failed", path);
+      return -1;
+   }
+
+   point->unit = unit;
+   point->table = table;
+   point->index = index;
+   point->header = map;
+   point->samples = (history_sample_t *)((uint8_t *)map + sizeof(history_header_t));
+
+   if (point->header->magic != HISTORY_MAGIC || point->header->version != HISTORY_VERSION ||
+       point->header->capacity != CFG_HISTORY_CAPACITY)
+   {
+      // New or incompatible file, start from scratch
+      memset(point->header, 0, sizeof(history_header_t));
+      point->header->magic = HISTORY_MAGIC;
+      point->header->version = HISTORY_VERSION;
+      point->header->unit = unit;
+      point->header->table = table;
+      point->header->index = index;
+      point->header->capacity = CFG_HISTORY_CAPACITY;
+   }
+
+   return 0;
+}
+
+// Point open for recording, its file is created on first record
+static history_point_t *history_open_point(uint8_t unit, uint8_t table, uint16_t index)
+{
+   int16_t *slot = history_slot(unit, table, index);
+   history_point_t *point;
+
+   if (*slot >= 0)
+      return &points[*slot];
+
+   if (points_cnt == CFG_HISTORY_MAX_POINTS)
+   {
+      if (!exhausted)
+         TRACE_ERROR("History points maxnum %d exceeded, unit %u table %u point %u and further ones are not recorded",
+                     CFG_HISTORY_MAX_POINTS, unit, table, index);
+      exhausted = 1;
+      return NULL;
+   }
+
+   point = &points[points_cnt];
+   if (history_map(point, unit, table, index, 1) < 0)
+      return NULL;
+
+   TRACE("History point %u/%u/%u opened, %u samples", unit, table, index, point->header->count);
+
+   *slot = points_cnt++;
+
+   return point;
+}
+
+// Point of query, file not recorded by this run is mapped for the query only.
+// Returns -1 when nothing is recorded, history_release_point() ends the query.
+static int history_query_point(uint8_t unit, uint8_t table, uint16_t index, history_point_t *point)
+{
+   int16_t *slot;
+
+   if (history_dir == NULL)
+      return -1;
+
+   slot = history_slot(unit, table, index);
+   if (*slot >= 0)
+   {
+      *point = points[*slot];
+      point->mapsize = 0;
+      return 0;
+   }
+
+   return history_map(point, unit, table, index, 0);
+}
+
+static void history_release_point(history_point_t *point)
+{
+   if (point->mapsize > 0)
+      munmap(point->header, point->mapsize);
+}
+
+// Sample at logical position (0 = oldest), read directly from the mapping
+static inline const history_sample_t *history_sample(const history_point_t *point, uint32_t pos)
+{
+   const history_header_t *h = point->header;
+
+   return &point->samples[(h->head + h->capacity - h->count + pos) % h->capacity];
+}
+
+// First logical position with time >= t
+static uint32_t history_lower_bound(const history_point_t *point, int64_t t)
+{
+   uint32_t lo = 0, hi = point->header->count, mid;
+
+   while (lo < hi)
+   {
+      mid = lo + (hi - lo) / 2;
+      if (history_sample(point, mid)->time < t)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
+}
+
+int history_init(const char *dirname)
+{
+   if (mkdir(dirname, 0755) < 0 && errno != EEXIST)
+   {
+      TRACE_ERROR("Create history directory %s failed", dirname);
+      return -1;
+   }
+
+   history_dir = dirname;
+   points_cnt = 0;
+   exhausted = 0;
+   memset(slots, -1, sizeof(slots));
+
+   return 0;
+}
+
+void history_close(void)
+{
+   int ix;
+
+   for (ix = 0; ix < points_cnt; ix++)
+      munmap(points[ix].header, points[ix].mapsize);
+
+   points_cnt = 0;
+   memset(slots, -1, sizeof(slots));
+   history_dir = NULL;
+}
+
+int history_record(uint8_t unit, uint8_t table, uint16_t index, int32_t value)
+{
+   history_point_t *point;
+   history_header_t *h;
+   history_sample_t *last = NULL, *s;
+   int64_t now;
+
+   if (history_dir == NULL)
+      return 0;
+
+   if ((point = history_open_point(unit, table, index)) == NULL)
+      return -1;
+
+   h = point->header;
+   now = systime_wall_ms();
+
+   if (h->count > 0)
+   {
+      last = &point->samples[(h->head + h->capacity - 1) % h->capacity];
+
+      // Store changes only, unchanged value once per heartbeat
+      if (last->value == value && now - last->time < CFG_HISTORY_HEARTBEAT)
+         return 0;
+
+      // Keep the ring sorted even if wall clock steps back
+      if (now < last->time)
+         now = last->time;
+   }
+
+   s = &point->samples[h->head];
+   s->time = now;
+   s->value = value;
+   s->flags = 0;
+
+   h->head = (h->head + 1) % h->capacity;
+   if (h->count < h->capacity)
+      h->count++;
+
+   return 0;
+}
+
+int history_record_bits(uint8_t unit, uint8_t table, uint16_t start, int count, const bitset_t *state)
+{
+   int ix, res = 0;
+
+   for (ix = 0; ix < count && ix < BITSET_MAX_BITS; ix++)
+   {
+      if (history_record(unit, table, start + ix, bitset_get(state, ix)) < 0)
+         res = -1;
+   }
+
+   return res;
+}
+
+int history_query_buckets(uint8_t unit, uint8_t table, uint16_t index, int64_t from, int64_t to, history_bucket_t *buckets, int nbuckets)
+{
+   history_point_t query, *point = &query;
+   const history_sample_t *s;
+   uint32_t pos, end;
+   int64_t width, sum = 0;
+   int bucket, cur = -1, cnt = 0, n = 0;
+
+   if (nbuckets <= 0 || to <= from)
+      return 0;
+
+   if (history_query_point(unit, table, index, point) < 0)
+      return 0;
+
+   width = (to - from + nbuckets - 1) / nbuckets;
+   pos = history_lower_bound(point, from);
+   end = history_lower_bound(point, to);
+
+   for (; pos < end; pos++)
+   {
+      s = history_sample(point, pos);
+      bucket = (int)((s->time - from) / width);
+
+      if (bucket != cur)
+      {
+         if (cnt > 0)
+            buckets[n++].avg = (int32_t)(sum / cnt);
+
+         cur = bucket;
+         buckets[n].time = from + bucket * width;
+         buckets[n].min = s->value;
+         buckets[n].max = s->value;
+         sum = 0;
+         cnt = 0;
+      }
+
+      if (s->value < buckets[n].min)
+         buckets[n].min = s->value;
+      if (s->value > buckets[n].max)
+         buckets[n].max = s->value;
+      sum += s->value;
+      cnt++;
+   }
+
+   if (cnt > 0)
+      buckets[n++].avg = (int32_t)(sum / cnt);
+
+   history_release_point(point);
+
+   return n;
+}
+
+// Largest-Triangle-Three-Buckets downsampling (Steinarsson, 2013)
+int history_query_lttb(uint8_t unit, uint8_t table, uint16_t index, int64_t from, int64_t to, history_sample_t *samples, int nsamples)
+{
+   history_point_t query, *point = &query;
+   const history_sample_t *s, *a;
+   uint32_t first, count, ix, bstart, bend, nstart, nend, sel;
+   double every, avg_t, avg_v, area, max_area;
+   int n = 0, bucket;
+
+   if (nsamples <= 0 || to <= from)
+      return 0;
+
+   if (history_query_point(unit, table, index, point) < 0)
+      return 0;
+
+   first = history_lower_bound(point, from);
+   count = history_lower_bound(point, to) - first;
+
+   if (count <= (uint32_t)nsamples || nsamples < 3)
+   {
+      for (ix = 0; ix < count && n < nsamples; ix++)
+         samples[n++] = *history_sample(point, first + ix);
+      history_release_point(point);
+      return n;
+   }
+
+   every = (double)(count - 2) / (nsamples - 2);
+
+   a = history_sample(point, first);
+   samples[n++] = *a;
+
+   for (bucket = 0; bucket < nsamples - 2; bucket++)
+   {
+      // Average of the next bucket is the third triangle vertex
+      nstart = (uint32_t)((bucket + 1) * every) + 1;
+      nend = (uint32_t)((bucket + 2) * every) + 1;
+      if (nend > count)
+         nend = count;
+
+      // Rounding may leave the next bucket empty, its first sample is the vertex
+      if (nend <= nstart)
+         nend = nstart + 1;
+
+      avg_t = 0;
+      avg_v = 0;
+      for (ix = nstart; ix < nend; ix++)
+      {
+         s = history_sample(point, first + ix);
+         avg_t += (double)(s->time - from);
+         avg_v += s->value;
+      }
+      avg_t /= (nend - nstart);
+      avg_v /= (nend - nstart);
+
+      bstart = (uint32_t)(bucket * every) + 1;
+      bend = nstart;
+
+      max_area = -1;
+      sel = bstart;
+      for (ix = bstart; ix < bend; ix++)
+      {
+         s = history_sample(point, first + ix);
+         area = ((double)(a->time - from) - avg_t) * ((double)s->value - a->value) -
+                ((double)(a->time - from) - (double)(s->time - from)) * (avg_v - a->value);
+         if (area < 0)
+            area = -area;
+
+         if (area > max_area)
+         {
+            max_area = area;
+            sel = ix;
+         }
+      }
+
+      a = history_sample(point, first + sel);
+      samples[n++] = *a;
+   }
+
+   samples[n++] = *history_sample(point, first + count - 1);
+
+   history_release_point(point);
+
+   return n;
+}
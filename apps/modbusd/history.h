@@ -0,0 +1,40 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include <stdint.h>
+
+#include "bitset.h"
+
+#define HISTORY_MODE_MINMAXAVG         0
+#define HISTORY_MODE_LTTB              1
+
+#define HISTORY_MAX_QUERY_POINTS       1024
+
+typedef struct
+{
+   int64_t time;        // ms since epoch
+   int32_t value;
+   uint32_t flags;
+
+} history_sample_t;
+
+typedef struct
+{
+   int64_t time;        // bucket start, ms since epoch
+   int32_t min;
+   int32_t max;
+   int32_t avg;
+
+} history_bucket_t;
+
+
+int history_init(const char *dirname);
+void history_close(void);
+
+int history_record(uint8_t unit, uint8_t table, uint16_t index, int32_t value);
+int history_record_bits(uint8_t unit, uint8_t table, uint16_t start, int count, const bitset_t *state);
+
+int history_query_buckets(uint8_t unit, uint8_t table, uint16_t index, int64_t from, int64_t to, history_bucket_t *buckets, int nbuckets);
+int history_query_lttb(uint8_t unit, uint8_t table, uint16_t index, int64_t from, int64_t to, history_sample_t *samples, int nsamples);
+
+#endif // __HISTORY_H
@@ -0,0 +1,785 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "libmodbusd.h"
+
+//
+// Frames of all requests go to output buffer and are sent by one send() on
+// flush, responses are matched to requests by transaction id, so the daemon
+// may answer cached reads before bus transactions queued earlier.
+//
+#define MBD_HEADER_SIZE             7
+#define MBD_OUT_SIZE                16384
+#define MBD_IN_SIZE                 (MBD_HEADER_SIZE + 65536)
+
+#define MBD_FUNC_READ_COILS         0x01
+#define MBD_FUNC_READ_INPUTS        0x02
+#define MBD_FUNC_READ_REGISTERS     0x03
+#define MBD_FUNC_WRITE_COIL         0x05
+#define MBD_FUNC_WRITE_REGISTER     0x06
+#define MBD_FUNC_SCENE              0x42
+#define MBD_FUNC_BULK_STATE         0x46
+
+#define MBD_KIND_PLAIN              0
+#define MBD_KIND_SCENE              1        // batch of writes, callback of every write
+#define MBD_KIND_BULK               2
+#define MBD_KIND_WATCH              3        // bulk state request of watch
+
+typedef struct
+{
+   int id;
+   uint8_t unit;
+   uint8_t type;              // MBD_FUNC_WRITE_COIL or MBD_FUNC_WRITE_REGISTER
+   uint16_t addr;
+   uint16_t value;
+   mbd_callback_t cb;
+   void *arg;
+
+} mbd_write_t;
+
+typedef struct
+{
+   int id;                    // transaction id, 0 when slot is free
+   uint8_t kind;
+   uint8_t unit;
+   uint8_t func;
+   int64_t deadline;          // ms
+   mbd_callback_t cb;
+   mbd_state_callback_t state_cb;
+   void *arg;
+   int writes_cnt;
+   mbd_write_t writes[MBD_MAX_BATCH];
+
+} mbd_pending_t;
+
+struct mbd_client
+{
+   int sd;
+   int timeout;               // ms
+   uint16_t next_id;
+   mbd_pending_t pending[MBD_MAX_INFLIGHT];
+   mbd_write_t batch[MBD_MAX_BATCH];
+   int batch_cnt;
+   uint8_t out[MBD_OUT_SIZE];
+   int outlen;
+   uint8_t in[MBD_IN_SIZE];
+   int inlen;
+
+   // Changed units are asked for every period, since sequence of last response
+   int watch_period;
+   int64_t watch_next;
+   uint32_t watch_seq;
+   int watch_queued;
+   mbd_state_callback_t watch_cb;
+   void *watch_arg;
+};
+
+
+static int64_t mbd_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t mbd_get_u32(const uint8_t *p)
+{
+   return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Transaction id, never 0 and not used by any waiting request
+static int mbd_alloc_id(mbd_client_t *client)
+{
+   int ix;
+
+   do
+   {
+      if (++client->next_id == 0)
+         client->next_id = 1;
+
+      for (ix = 0; ix < MBD_MAX_INFLIGHT && client->pending[ix].id != client->next_id; ix++);
+   }
+   while (ix < MBD_MAX_INFLIGHT);
+
+   return client->next_id;
+}
+
+static mbd_pending_t *mbd_alloc_pending(mbd_client_t *client)
+{
+   int ix;
+
+   for (ix = 0; ix < MBD_MAX_INFLIGHT; ix++)
+   {
+      if (client->pending[ix].id == 0)
+         return &client->pending[ix];
+   }
+
+   return NULL;
+}
+
+static mbd_pending_t *mbd_find_pending(mbd_client_t *client, int id)
+{
+   int ix;
+
+   for (ix = 0; ix < MBD_MAX_INFLIGHT; ix++)
+   {
+      if (client->pending[ix].id == id)
+         return &client->pending[ix];
+   }
+
+   return NULL;
+}
+
+// Send as much of output buffer as socket takes
+static int mbd_send(mbd_client_t *client)
+{
+   int res;
+
+   if (client->sd < 0)
+      return -1;
+
+   while (client->outlen > 0)
+   {
+      if ((res = send(client->sd, client->out, client->outlen, MSG_NOSIGNAL)) < 0)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+
+      memmove(client->out, client->out + res, client->outlen - res);
+      client->outlen -= res;
+   }
+
+   return 0;
+}
+
+// Append frame with MBAP header to output buffer
+static int mbd_frame(mbd_client_t *client, int id, uint8_t unit, uint8_t func, const uint8_t *data, int len)
+{
+   uint8_t *p;
+
+   if (client->outlen + MBD_HEADER_SIZE + 1 + len > MBD_OUT_SIZE && mbd_send(client) < 0)
+      return -1;
+
+   if (client->outlen + MBD_HEADER_SIZE + 1 + len > MBD_OUT_SIZE)
+      return -1;
+
+   p = &client->out[client->outlen];
+   p[0] = id >> 8;
+   p[1] = id & 0xFF;
+   p[2] = 0;
+   p[3] = 0;
+   p[4] = (len + 2) >> 8;
+   p[5] = (len + 2) & 0xFF;
+   p[6] = unit;
+   p[7] = func;
+   memcpy(&p[8], data, len);
+   client->outlen += MBD_HEADER_SIZE + 1 + len;
+
+   return 0;
+}
+
+static mbd_pending_t *mbd_submit(mbd_client_t *client, uint8_t kind, uint8_t unit, uint8_t func, const uint8_t *data, int len)
+{
+   mbd_pending_t *p;
+   int id;
+
+   if (client->sd < 0 || (p = mbd_alloc_pending(client)) == NULL)
+      return NULL;
+
+   id = mbd_alloc_id(client);
+   if (mbd_frame(client, id, unit, func, data, len) < 0)
+      return NULL;
+
+   memset(p, 0, offsetof(mbd_pending_t, writes));
+   p->id = id;
+   p->kind = kind;
+   p->unit = unit;
+   p->func = func;
+   p->deadline = mbd_now() + client->timeout;
+
+   return p;
+}
+
+// Single write goes as plain request, more writes as one scene
+static int mbd_flush_batch(mbd_client_t *client)
+{
+   uint8_t data[1 + MBD_MAX_BATCH * 6], buf[4];
+   const mbd_write_t *w = &client->batch[0];
+   mbd_pending_t *p;
+   int ix;
+
+   if (client->batch_cnt == 0)
+      return 0;
+
+   if (client->batch_cnt == 1)
+   {
+      buf[0] = w->addr >> 8;
+      buf[1] = w->addr & 0xFF;
+      buf[2] = w->value >> 8;
+      buf[3] = w->value & 0xFF;
+      if ((p = mbd_submit(client, MBD_KIND_SCENE, w->unit, w->type, buf, 4)) == NULL)
+         return -1;
+   }
+   else
+   {
+      data[0] = client->batch_cnt;
+      for (ix = 0, w = client->batch; ix < client->batch_cnt; ix++, w++)
+      {
+         data[1 + ix * 6] = w->unit;
+         data[2 + ix * 6] = w->type;
+         data[3 + ix * 6] = w->addr >> 8;
+         data[4 + ix * 6] = w->addr & 0xFF;
+         data[5 + ix * 6] = w->value >> 8;
+         data[6 + ix * 6] = w->value & 0xFF;
+      }
+      if ((p = mbd_submit(client, MBD_KIND_SCENE, 0, MBD_FUNC_SCENE, data, 1 + client->batch_cnt * 6)) == NULL)
+         return -1;
+   }
+
+   memcpy(p->writes, client->batch, client->batch_cnt * sizeof(mbd_write_t));
+   p->writes_cnt = client->batch_cnt;
+   client->batch_cnt = 0;
+
+   return 0;
+}
+
+static void mbd_write_done(mbd_client_t *client, const mbd_write_t *w, int status)
+{
+   mbd_result_t result;
+
+   if (w->cb == NULL)
+      return;
+
+   memset(&result, 0, sizeof(result));
+   result.status = status;
+   result.unit = w->unit;
+   result.func = w->type;
+   w->cb(client, &result, w->arg);
+}
+
+// Complete request without response
+static void mbd_fail(mbd_client_t *client, mbd_pending_t *p, int status)
+{
+   mbd_result_t result;
+   mbd_pending_t done = *p;
+   int ix;
+
+   p->id = 0;
+
+   if (done.kind == MBD_KIND_WATCH)
+   {
+      client->watch_queued = 0;
+      return;
+   }
+
+   if (done.kind == MBD_KIND_SCENE)
+   {
+      for (ix = 0; ix < done.writes_cnt; ix++)
+         mbd_write_done(client, &done.writes[ix], status);
+      return;
+   }
+
+   if (done.cb != NULL)
+   {
+      memset(&result, 0, sizeof(result));
+      result.status = status;
+      result.unit = done.unit;
+      result.func = done.func;
+      done.cb(client, &result, done.arg);
+   }
+}
+
+//
+// Bulk state response: seq(4) more(1) count(2) followed by count units
+//                      unit(1) flags(1) seq(4) time(8) ncoils(2) ninputs(2) coils coils_valid inputs inputs_valid
+// Returns -1 when response is broken.
+//
+static int mbd_parse_bulk(mbd_client_t *client, const uint8_t *data, int len, mbd_state_callback_t cb, void *arg)
+{
+   mbd_unit_state_t st;
+   int ix, count, pos = 7, cbytes, ibytes;
+
+   if (len < 7)
+      return -1;
+
+   count = (data[5] << 8) | data[6];
+
+   for (ix = 0; ix < count; ix++)
+   {
+      if (pos + 18 > len)
+         return -1;
+
+      st.unit = data[pos];
+      st.flags = data[pos + 1];
+      st.seq = mbd_get_u32(&data[pos + 2]);
+      st.time = ((int64_t)mbd_get_u32(&data[pos + 6]) << 32) | mbd_get_u32(&data[pos + 10]);
+      st.ncoils = (data[pos + 14] << 8) | data[pos + 15];
+      st.ninputs = (data[pos + 16] << 8) | data[pos + 17];
+      cbytes = (st.ncoils + 7) / 8;
+      ibytes = (st.ninputs + 7) / 8;
+      pos += 18;
+
+      if (pos + 2 * (cbytes + ibytes) > len)
+         return -1;
+
+      st.coils = &data[pos];
+      st.coils_valid = &data[pos + cbytes];
+      st.inputs = &data[pos + 2 * cbytes];
+      st.inputs_valid = &data[pos + 2 * cbytes + ibytes];
+      pos += 2 * (cbytes + ibytes);
+
+      if (cb != NULL)
+         cb(client, &st, arg);
+   }
+
+   return 0;
+}
+
+static int mbd_watch_request(mbd_client_t *client)
+{
+   uint8_t data[4];
+
+   data[0] = client->watch_seq >> 24;
+   data[1] = (client->watch_seq >> 16) & 0xFF;
+   data[2] = (client->watch_seq >> 8) & 0xFF;
+   data[3] = client->watch_seq & 0xFF;
+
+   if (mbd_submit(client, MBD_KIND_WATCH, 0, MBD_FUNC_BULK_STATE, data, 4) == NULL)
+      return -1;
+
+   client->watch_queued = 1;
+
+   return 0;
+}
+
+static void mbd_dispatch(mbd_client_t *client, const uint8_t *frame, int len)
+{
+   mbd_pending_t *p, done;
+   mbd_result_t result;
+   const uint8_t *data = &frame[MBD_HEADER_SIZE + 1];
+   int ix, status, dlen = len - MBD_HEADER_SIZE - 1;
+
+   // Late response of request already timed out
+   if ((p = mbd_find_pending(client, (frame[0] << 8) | frame[1])) == NULL)
+      return;
+
+   done = *p;
+   p->id = 0;
+
+   status = (frame[MBD_HEADER_SIZE] & 0x80) ? (dlen > 0 ? data[0] : MBD_ERR_CLOSED) : MBD_OK;
+
+   switch (done.kind)
+   {
+      case MBD_KIND_SCENE:
+         for (ix = 0; ix < done.writes_cnt; ix++)
+         {
+            // Scene response: count(1) followed by status of every write
+            if (status == MBD_OK && done.func == MBD_FUNC_SCENE)
+               mbd_write_done(client, &done.writes[ix], (ix + 1 < dlen) ? data[1 + ix] : MBD_ERR_CLOSED);
+            else
+               mbd_write_done(client, &done.writes[ix], status);
+         }
+         return;
+
+      case MBD_KIND_WATCH:
+         client->watch_queued = 0;
+         if (status != MBD_OK || mbd_parse_bulk(client, data, dlen, client->watch_cb, client->watch_arg) < 0)
+            return;
+
+         // Response did not hold all changed units, ask for the rest at once
+         client->watch_seq = mbd_get_u32(data);
+         if (data[4])
+            mbd_watch_request(client);
+         return;
+
+      case MBD_KIND_BULK:
+         if (status == MBD_OK && mbd_parse_bulk(client, data, dlen, done.state_cb, done.arg) < 0)
+            status = MBD_ERR_CLOSED;
+         break;
+   }
+
+   if (done.cb != NULL)
+   {
+      result.status = status;
+      result.unit = frame[MBD_HEADER_SIZE - 1];
+      result.func = frame[MBD_HEADER_SIZE] & 0x7F;
+      result.data = data;
+      result.len = dlen;
+      done.cb(client, &result, done.arg);
+   }
+}
+
+// Connection lost, all waiting requests fail
+static void mbd_disconnect(mbd_client_t *client)
+{
+   int ix;
+
+   if (client->sd >= 0)
+      close(client->sd);
+   client->sd = -1;
+   client->outlen = 0;
+   client->inlen = 0;
+
+   for (ix = 0; ix < MBD_MAX_INFLIGHT; ix++)
+   {
+      if (client->pending[ix].id != 0)
+         mbd_fail(client, &client->pending[ix], MBD_ERR_CLOSED);
+   }
+
+   for (ix = 0; ix < client->batch_cnt; ix++)
+      mbd_write_done(client, &client->batch[ix], MBD_ERR_CLOSED);
+   client->batch_cnt = 0;
+}
+
+static int mbd_receive(mbd_client_t *client)
+{
+   int res, pos, len;
+
+   while (client->sd >= 0)
+   {
+      if ((res = recv(client->sd, client->in + client->inlen, MBD_IN_SIZE - client->inlen, 0)) < 0)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+
+      if (res == 0)
+         return -1;
+
+      client->inlen += res;
+
+      for (pos = 0; pos + MBD_HEADER_SIZE < client->inlen; pos += len)
+      {
+         len = 6 + ((client->in[pos + 4] << 8) | client->in[pos + 5]);
+         if (len <= MBD_HEADER_SIZE)
+            return -1;
+         if (pos + len > client->inlen)
+            break;
+
+         mbd_dispatch(client, &client->in[pos], len);
+      }
+
+      memmove(client->in, client->in + pos, client->inlen - pos);
+      client->inlen -= pos;
+   }
+
+   return 0;
+}
+
+mbd_client_t *mbd_connect(const char *host, int port)
+{
+   struct addrinfo hints, *ai;
+   mbd_client_t *client;
+   char service[16];
+   int sd, one = 1;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   snprintf(service, sizeof(service), "%d", port);
+
+   if (getaddrinfo(host, service, &hints, &ai) != 0)
+      return NULL;
+
+   if ((sd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0 || connect(sd, ai->ai_addr, ai->ai_addrlen) < 0)
+   {
+      if (sd >= 0)
+         close(sd);
+      freeaddrinfo(ai);
+      return NULL;
+   }
+   freeaddrinfo(ai);
+
+   setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+
+   if ((client = calloc(1, sizeof(mbd_client_t))) == NULL)
+   {
+      close(sd);
+      return NULL;
+   }
+
+   client->sd = sd;
+   client->timeout = MBD_TIMEOUT;
+
+   return client;
+}
+
+// Waiting requests complete with MBD_ERR_CLOSED
+void mbd_close(mbd_client_t *client)
+{
+   if (client == NULL)
+      return;
+
+   mbd_disconnect(client);
+   free(client);
+}
+
+void mbd_set_timeout(mbd_client_t *client, int timeout_ms)
+{
+   client->timeout = timeout_ms;
+}
+
+// -1 when connection is lost
+int mbd_fd(const mbd_client_t *client)
+{
+   return client->sd;
+}
+
+int mbd_want_write(const mbd_client_t *client)
+{
+   return client->outlen > 0 || client->batch_cnt > 0;
+}
+
+// ms until mbd_process() has to run for timeouts or watch, -1 when nothing waits
+int mbd_next_timeout(const mbd_client_t *client)
+{
+   int64_t next = -1, now = mbd_now();
+   int ix;
+
+   for (ix = 0; ix < MBD_MAX_INFLIGHT; ix++)
+   {
+      if (client->pending[ix].id != 0 && (next < 0 || client->pending[ix].deadline < next))
+         next = client->pending[ix].deadline;
+   }
+
+   if (client->watch_period > 0 && !client->watch_queued && (next < 0 || client->watch_next < next))
+      next = client->watch_next;
+
+   if (next < 0)
+      return -1;
+
+   return (next > now) ? (int)(next - now) : 0;
+}
+
+// Send batched writes and queued requests
+int mbd_flush(mbd_client_t *client)
+{
+   if (mbd_flush_batch(client) < 0 || mbd_send(client) < 0)
+   {
+      mbd_disconnect(client);
+      return -1;
+   }
+
+   return 0;
+}
+
+// Send, receive and run callbacks without blocking. Returns -1 when connection is lost.
+int mbd_process(mbd_client_t *client)
+{
+   int64_t now;
+   int ix;
+
+   if (client->sd < 0)
+      return -1;
+
+   now = mbd_now();
+   if (client->watch_period > 0 && !client->watch_queued && now >= client->watch_next)
+   {
+      client->watch_next = now + client->watch_period;
+      mbd_watch_request(client);
+   }
+
+   if (mbd_flush(client) < 0)
+      return -1;
+
+   if (mbd_receive(client) < 0)
+   {
+      mbd_disconnect(client);
+      return -1;
+   }
+
+   now = mbd_now();
+   for (ix = 0; ix < MBD_MAX_INFLIGHT; ix++)
+   {
+      if (client->pending[ix].id != 0 && client->pending[ix].deadline <= now)
+         mbd_fail(client, &client->pending[ix], MBD_ERR_TIMEOUT);
+   }
+
+   // Responses may have queued more requests
+   return mbd_flush(client);
+}
+
+static int mbd_waiting(const mbd_client_t *client, int id)
+{
+   int ix, jx;
+
+   for (ix = 0; ix < client->batch_cnt; ix++)
+   {
+      if (client->batch[ix].id == id)
+         return 1;
+   }
+
+   for (ix = 0; ix < MBD_MAX_INFLIGHT; ix++)
+   {
+      if (client->pending[ix].id == 0)
+         continue;
+
+      if (client->pending[ix].id == id && client->pending[ix].kind != MBD_KIND_SCENE)
+         return 1;
+
+      for (jx = 0; jx < client->pending[ix].writes_cnt && client->pending[ix].kind == MBD_KIND_SCENE; jx++)
+      {
+         if (client->pending[ix].writes[jx].id == id)
+            return 1;
+      }
+   }
+
+   return 0;
+}
+
+// Process until request id is completed (its callback has run), 0 when it is, -1 on timeout or lost connection
+int mbd_wait(mbd_client_t *client, int id, int timeout_ms)
+{
+   struct pollfd pfd;
+   int64_t end = mbd_now() + timeout_ms;
+   int wait, next;
+
+   while (mbd_waiting(client, id))
+   {
+      if (mbd_process(client) < 0)
+         return -1;
+
+      if (!mbd_waiting(client, id))
+         break;
+
+      if ((wait = end - mbd_now()) <= 0)
+         return -1;
+
+      if ((next = mbd_next_timeout(client)) >= 0 && next < wait)
+         wait = next;
+
+      pfd.fd = client->sd;
+      pfd.events = POLLIN | (mbd_want_write(client) ? POLLOUT : 0);
+      poll(&pfd, 1, wait);
+   }
+
+   return 0;
+}
+
+// Request with raw PDU data, returns request id or -1 when too many requests wait
+int mbd_request(mbd_client_t *client, uint8_t unit, uint8_t func, const uint8_t *data, int len, mbd_callback_t cb, void *arg)
+{
+   mbd_pending_t *p;
+
+   if (mbd_flush_batch(client) < 0 || (p = mbd_submit(client, MBD_KIND_PLAIN, unit, func, data, len)) == NULL)
+      return -1;
+
+   p->cb = cb;
+   p->arg = arg;
+
+   return p->id;
+}
+
+static int mbd_read(mbd_client_t *client, uint8_t unit, uint8_t func, uint16_t start, uint16_t count, mbd_callback_t cb, void *arg)
+{
+   uint8_t data[4];
+
+   data[0] = start >> 8;
+   data[1] = start & 0xFF;
+   data[2] = count >> 8;
+   data[3] = count & 0xFF;
+
+   return mbd_request(client, unit, func, data, 4, cb, arg);
+}
+
+// Callback gets byte count followed by bits, see mbd_bit(&result->data[1], n)
+int mbd_read_coils(mbd_client_t *client, uint8_t unit, uint16_t start, uint16_t count, mbd_callback_t cb, void *arg)
+{
+   return mbd_read(client, unit, MBD_FUNC_READ_COILS, start, count, cb, arg);
+}
+
+int mbd_read_inputs(mbd_client_t *client, uint8_t unit, uint16_t start, uint16_t count, mbd_callback_t cb, void *arg)
+{
+   return mbd_read(client, unit, MBD_FUNC_READ_INPUTS, start, count, cb, arg);
+}
+
+// Callback gets registers by mbd_register(result, n)
+int mbd_read_registers(mbd_client_t *client, uint8_t unit, uint16_t start, uint16_t count, mbd_callback_t cb, void *arg)
+{
+   return mbd_read(client, unit, MBD_FUNC_READ_REGISTERS, start, count, cb, arg);
+}
+
+// Write waits for flush, writes of one flush go as one batch
+static int mbd_write(mbd_client_t *client, uint8_t unit, uint8_t type, uint16_t addr, uint16_t value, mbd_callback_t cb, void *arg)
+{
+   mbd_write_t *w;
+
+   if (client->sd < 0 || (client->batch_cnt == MBD_MAX_BATCH && mbd_flush_batch(client) < 0))
+      return -1;
+
+   w = &client->batch[client->batch_cnt++];
+   w->id = mbd_alloc_id(client);
+   w->unit = unit;
+   w->type = type;
+   w->addr = addr;
+   w->value = value;
+   w->cb = cb;
+   w->arg = arg;
+
+   return w->id;
+}
+
+int mbd_write_coil(mbd_client_t *client, uint8_t unit, uint16_t coil, int on, mbd_callback_t cb, void *arg)
+{
+   return mbd_write(client, unit, MBD_FUNC_WRITE_COIL, coil, on ? 0xFF00 : 0, cb, arg);
+}
+
+int mbd_write_register(mbd_client_t *client, uint8_t unit, uint16_t reg, uint16_t value, mbd_callback_t cb, void *arg)
+{
+   return mbd_write(client, unit, MBD_FUNC_WRITE_REGISTER, reg, value, cb, arg);
+}
+
+// Units changed since sequence go to state_cb, then cb gets seq(4) more(1) count(2) of response
+int mbd_bulk_state(mbd_client_t *client, uint32_t since, mbd_state_callback_t state_cb, mbd_callback_t cb, void *arg)
+{
+   mbd_pending_t *p;
+   uint8_t data[4];
+
+   data[0] = since >> 24;
+   data[1] = (since >> 16) & 0xFF;
+   data[2] = (since >> 8) & 0xFF;
+   data[3] = since & 0xFF;
+
+   if ((p = mbd_submit(client, MBD_KIND_BULK, 0, MBD_FUNC_BULK_STATE, data, 4)) == NULL)
+      return -1;
+
+   p->cb = cb;
+   p->state_cb = state_cb;
+   p->arg = arg;
+
+   return p->id;
+}
+
+// All known units first, then units changed since previous response every period, 0 stops watching
+int mbd_watch(mbd_client_t *client, int period_ms, mbd_state_callback_t state_cb, void *arg)
+{
+   client->watch_period = period_ms;
+   client->watch_cb = state_cb;
+   client->watch_arg = arg;
+   client->watch_seq = 0;
+   client->watch_next = mbd_now();
+
+   return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef __LIBMODBUSD_H
+#define __LIBMODBUSD_H
+
+//
+// Asynchronous client of modbusd. Requests are pipelined over one connection,
+// every call returns request id at once and the callback runs from
+// mbd_process() or mbd_wait() when the response arrives. Coil and register
+// writes issued before the next flush are sent as one scene request (function
+// 0x42), the daemon groups them to multi-writes per slave.
+//
+//   mbd_client_t *c = mbd_connect("127.0.0.1", MBD_PORT);
+//   int id;
+//
+//   mbd_write_coil(c, 1, 0, 1, NULL, NULL);
+//   mbd_write_coil(c, 1, 1, 1, NULL, NULL);            // same scene as previous one
+//   id = mbd_read_coils(c, 1, 0, 8, on_coils, NULL);
+//   mbd_wait(c, id, 1000);                             // future like wait for one request
+//
+// Event loops wait for mbd_fd() readable (and writable when mbd_want_write()),
+// at most mbd_next_timeout() ms, then call mbd_process(). Callbacks may issue
+// new requests but must not call mbd_wait() or mbd_process(). The library is
+// not thread safe, one connection is used by one thread.
+//
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MBD_PORT                    502
+#define MBD_MAX_INFLIGHT            64       // requests sent and not answered yet
+#define MBD_MAX_BATCH               40       // writes of one scene, SCENE_MAX_TARGETS of daemon
+#define MBD_TIMEOUT                 5000     // ms, default response timeout
+
+// Status of completed request, positive status is Modbus exception code
+#define MBD_OK                      0
+#define MBD_ERR_TIMEOUT             -1
+#define MBD_ERR_CLOSED              -2       // connection lost before response
+
+// Flags of unit state
+#define MBD_STATE_STALE             0x01     // last state known to daemon, slave not read since its start
+
+typedef struct mbd_client mbd_client_t;
+
+typedef struct
+{
+   int status;                // MBD_OK, MBD_ERR_... or exception code
+   uint8_t unit;
+   uint8_t func;
+   const uint8_t *data;       // response PDU after function code, valid in callback only
+   int len;
+
+} mbd_result_t;
+
+// State of unit from bulk state response, bits in Modbus packing (point 0 is LSB of first byte)
+typedef struct
+{
+   uint8_t unit;
+   uint8_t flags;             // MBD_STATE_...
+   uint32_t seq;              // sequence of last change
+   int64_t time;              // last change, ms since epoch
+   uint16_t ncoils;
+   uint16_t ninputs;
+   const uint8_t *coils;
+   const uint8_t *coils_valid;
+   const uint8_t *inputs;
+   const uint8_t *inputs_valid;
+
+} mbd_unit_state_t;
+
+typedef void (*mbd_callback_t)(mbd_client_t *client, const mbd_result_t *result, void *arg);
+typedef void (*mbd_state_callback_t)(mbd_client_t *client, const mbd_unit_state_t *state, void *arg);
+
+
+mbd_client_t *mbd_connect(const char *host, int port);
+void mbd_close(mbd_client_t *client);
+void mbd_set_timeout(mbd_client_t *client, int timeout_ms);
+
+int mbd_fd(const mbd_client_t *client);
+int mbd_want_write(const mbd_client_t *client);
+int mbd_next_timeout(const mbd_client_t *client);
+int mbd_flush(mbd_client_t *client);
+int mbd_process(mbd_client_t *client);
+int mbd_wait(mbd_client_t *client, int id, int timeout_ms);
+
+int mbd_request(mbd_client_t *client, uint8_t unit, uint8_t func, const uint8_t *data, int len, mbd_callback_t cb, void *arg);
+int mbd_read_coils(mbd_client_t *client, uint8_t unit, uint16_t start, uint16_t count, mbd_callback_t cb, void *arg);
+int mbd_read_inputs(mbd_client_t *client, uint8_t unit, uint16_t start, uint16_t count, mbd_callback_t cb, void *arg);
+int mbd_read_registers(mbd_client_t *client, uint8_t unit, uint16_t start, uint16_t count, mbd_callback_t cb, void *arg);
+int mbd_write_coil(mbd_client_t *client, uint8_t unit, uint16_t coil, int on, mbd_callback_t cb, void *arg);
+int mbd_write_register(mbd_client_t *client, uint8_t unit, uint16_t reg, uint16_t value, mbd_callback_t cb, void *arg);
+
+int mbd_bulk_state(mbd_client_t *client, uint32_t since, mbd_state_callback_t state_cb, mbd_callback_t cb, void *arg);
+int mbd_watch(mbd_client_t *client, int period_ms, mbd_state_callback_t state_cb, void *arg);
+
+static inline int mbd_bit(const uint8_t *bytes, int ix)
+{
+   return (bytes[ix / 8] >> (ix % 8)) & 1;
+}
+
+static inline uint16_t mbd_register(const mbd_result_t *result, int ix)
+{
+   return (result->data[1 + ix * 2] << 8) | result->data[2 + ix * 2];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __LIBMODBUSD_H
@@ -9,64 +9,1148 @@
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/select.h>
 
 #include "trace.h"
+#include "systime.h"
 #include "tcp_socket.h"
 #include "serial.h"
 #include "modbus.h"
+#include "history.h"
+#include "snapshot.h"
+#include "server.h"
+#include "profile.h"
+#include "scene.h"
+#include "timerwheel.h"
+#include "action.h"
+#include "config.h"
+#include "poll.h"
+#include "rule.h"
+#include "plan.h"
+#include "discovery.h"
+#include "request.h"
+#include "gateway.h"
+#include "output.h"
+#include "virtual.h"
+#include "shmexport.h"
+#include "modbusd_shm.h"
+#include "cycle.h"
 
-#define MAX_SERVERS_COUNT          8
+#define MAX_CLIENTS_COUNT          REQUEST_MAX_CLIENTS
+#define METRICS_FLAG_RESET_MAX     0x01
+#define CFG_RECV_BUFFER_SIZE       (4 * MODBUS_TCP_MAX_ADU_SIZE)
+#define TIMER_CMD_CANCEL           0xFF
+#define MAX_RESPONSE_SIZE          (MODBUS_TCP_HEADER_SIZE + 4 + HISTORY_MAX_QUERY_POINTS * 20)
+#define CFG_BULK_RESPONSE_MAX      16384    // bytes of bulk state units in one response
+#define BULK_HEADER_SIZE           7
+#define BULK_UNIT_SIZE             18       // unit header before bits
+#define BULK_FLAG_STALE            0x01     // state from snapshot, slave not read since start
+#define BULK_RESPONSE_SIZE         (MODBUS_TCP_DATA_IDX + BULK_HEADER_SIZE + CFG_BULK_RESPONSE_MAX)
+#define CYCLE_HEADER_SIZE          37
+#define CYCLE_POINT_SIZE           12
+#define CYCLE_RESPONSE_SIZE        (MODBUS_TCP_DATA_IDX + CYCLE_HEADER_SIZE + CYCLE_MAX_POINTS * (CYCLE_POINT_SIZE + CYCLE_MAX_DATA))
+#define METRICS_DEVICE_SIZE        25
+#define METRICS_CONNECTION_SIZE    25
+#define METRICS_RESPONSE_SIZE      (MODBUS_TCP_MAX_ADU_SIZE + GATEWAY_MAX_COUNT * 19 + MODBUS_MAX_UNIT * METRICS_DEVICE_SIZE + \
+                                    MAX_CLIENTS_COUNT * METRICS_CONNECTION_SIZE)
 
-#define msleep(ms) usleep(ms * 1000)
+// Received bytes of client connection, partial frame waits for the rest
+typedef struct
+{
+   uint8_t buf[CFG_RECV_BUFFER_SIZE];
+   int len;
 
+} client_rx_t;
+
+// Bus operation of client request, one request is on the bus at a time
 typedef struct
 {
-   uint8_t addr;
-   uint16_t coils_state;
-   
-} modbus_server_t;
+   profile_read_t read;
+   scene_t scene;
+   uint8_t cached;            // read of all coils of cached server
 
+} bus_op_t;
 
 // Options:
-static modbus_server_t servers[MAX_SERVERS_COUNT];
-static int servers_cnt = 0;
 static const char *devname = NULL;
+static const char *devnames[DISCOVERY_MAX_BUSES];
+static int devnames_cnt = 0;
+static int baudrate = 9600;
+static const char *mapname = NULL;
+static const char *cfgname = NULL;
+static const char *shmname = NULL;
+static int sout = -1;
+static int clients[MAX_CLIENTS_COUNT];
+static client_rx_t clients_rx[MAX_CLIENTS_COUNT];
+static uint8_t history_rsp[MAX_RESPONSE_SIZE];
+static uint8_t bulk_rsp[BULK_RESPONSE_SIZE];
+static uint8_t cycle_rsp[CYCLE_RESPONSE_SIZE];
+static uint8_t metrics_rsp[METRICS_RESPONSE_SIZE];
+static uint32_t stale_answers = 0;
+static request_t *bus_req = NULL;         // request on the bus
+static modbus_txn_t bus_txn;              // its current transaction
+static bus_op_t bus_op;
+static volatile sig_atomic_t reload_pending = 0;
+static volatile sig_atomic_t exit_pending = 0;
 
 
 static void usage(void)
 {
    printf("Usage modbusbridge [-options]\n");
    printf("options:\n");
-   printf("   -d <serial device name>        Serial device name\n");
-   printf("   -a <modbus address>            Address of china bug relays board for fix protocol\n");
+   printf("   -d <serial device name>        Serial device name, repeat to discover more buses\n");
+   printf("   -b <baudrate>                  Serial baudrate (default 9600)\n");
+   printf("   -D <map file|->                Discover slaves on buses, write device map and exit\n");
+   printf("   -a <modbus address>            Address of china relay board (china-relay profile)\n");
    printf("   -wr <addr> <regaddr> <regdata> Write single register\n");
+   printf("   -H <directory>                 Store value history in directory\n");
+   printf("   -S <snapshot file>             Persist slaves state, serve it on start until slaves are read\n");
+   printf("   -c <config file>               Configuration file (timers, polling, rules), SIGHUP reloads it\n");
+   printf("   -M [<name>]                    Publish slaves state in shared memory (default %s), see modbusd_shm.h\n", MODBUSD_SHM_NAME);
+}
+
+static void sighup_handler(int sig)
+{
+   (void)sig;
+   reload_pending = 1;
+}
+
+static void sigterm_handler(int sig)
+{
+   (void)sig;
+   exit_pending = 1;
+}
+
+
+static int put_u32(uint8_t *buf, uint32_t value)
+{
+   buf[0] = value >> 24;
+   buf[1] = value >> 16;
+   buf[2] = value >> 8;
+   buf[3] = value;
+
+   return 4;
+}
+
+static int put_u64(uint8_t *buf, uint64_t value)
+{
+   put_u32(buf, value >> 32);
+   put_u32(buf + 4, value & 0xFFFFFFFF);
+
+   return 8;
+}
+
+static int modbus_exception(uint8_t *buf, uint8_t code)
+{
+   buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
+   buf[MODBUS_TCP_DATA_IDX] = code;
+
+   return MODBUS_TCP_HEADER_SIZE + 2;
+}
+
+//
+// History query request:  table(1) index(2) from(4) to(4) points(2) mode(1), times in unix seconds
+// History query response: mode(1) count(2) followed by count entries
+//    HISTORY_MODE_MINMAXAVG: time(8, ms) min(4) max(4) avg(4)
+//    HISTORY_MODE_LTTB:      time(8, ms) value(4)
+//
+static int history_query_request(const uint8_t *req, int reqlen, uint8_t *rsp)
+{
+   static history_bucket_t buckets[HISTORY_MAX_QUERY_POINTS];
+   static history_sample_t samples[HISTORY_MAX_QUERY_POINTS];
+   const uint8_t *data = &req[MODBUS_TCP_DATA_IDX];
+   uint8_t unit, table, mode;
+   uint16_t index, npoints;
+   int64_t from, to;
+   int ix, count, len;
+
+   memcpy(rsp, req, MODBUS_TCP_FUNC_IDX + 1);
+
+   if (reqlen < MODBUS_TCP_DATA_IDX + 14)
+      return modbus_exception(rsp, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   unit = req[MODBUS_TCP_ADDR_IDX];
+   table = data[0];
+   index = (data[1] << 8) | data[2];
+   from = (int64_t)(((uint32_t)data[3] << 24) | (data[4] << 16) | (data[5] << 8) | data[6]) * 1000;
+   to = (int64_t)(((uint32_t)data[7] << 24) | (data[8] << 16) | (data[9] << 8) | data[10]) * 1000;
+   npoints = (data[11] << 8) | data[12];
+   mode = data[13];
+
+   if (npoints == 0 || npoints > HISTORY_MAX_QUERY_POINTS || to <= from)
+      return modbus_exception(rsp, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   len = MODBUS_TCP_DATA_IDX;
+   rsp[len++] = mode;
+   len += 2;
+
+   switch(mode)
+   {
+      case HISTORY_MODE_MINMAXAVG:
+         count = history_query_buckets(unit, table, index, from, to, buckets, npoints);
+         for (ix = 0; ix < count; ix++)
+         {
+            len += put_u64(&rsp[len], buckets[ix].time);
+            len += put_u32(&rsp[len], buckets[ix].min);
+            len += put_u32(&rsp[len], buckets[ix].max);
+            len += put_u32(&rsp[len], buckets[ix].avg);
+         }
+         break;
+
+      case HISTORY_MODE_LTTB:
+         count = history_query_lttb(unit, table, index, from, to, samples, npoints);
+         for (ix = 0; ix < count; ix++)
+         {
+            len += put_u64(&rsp[len], samples[ix].time);
+            len += put_u32(&rsp[len], samples[ix].value);
+         }
+         break;
+
+      default:
+         return modbus_exception(rsp, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+   }
+
+   rsp[MODBUS_TCP_DATA_IDX + 1] = count >> 8;
+   rsp[MODBUS_TCP_DATA_IDX + 2] = count & 0xFF;
+
+   return len;
+}
+
+//
+// Scene request:  count(1) followed by count targets unit(1) type(1) addr(2) value(2),
+//                 type is MODBUS_FUNC_WRITE_COIL or MODBUS_FUNC_WRITE_SINGLE_REGISTER
+// Scene response: count(1) followed by status(1) of each target in request order
+//
+static int scene_request(uint8_t *buf, int reqlen, scene_t *scene)
+{
+   scene_target_t targets[SCENE_MAX_TARGETS];
+   const uint8_t *data = &buf[MODBUS_TCP_DATA_IDX + 1];
+   int ix, count;
+
+   count = (reqlen > MODBUS_TCP_DATA_IDX) ? buf[MODBUS_TCP_DATA_IDX] : 0;
+
+   if (count == 0 || count > SCENE_MAX_TARGETS || reqlen < MODBUS_TCP_DATA_IDX + 1 + count * 6)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   for (ix = 0; ix < count; ix++, data += 6)
+   {
+      targets[ix].unit = data[0];
+      targets[ix].type = data[1];
+      targets[ix].addr = (data[2] << 8) | data[3];
+      targets[ix].value = (data[4] << 8) | data[5];
+      targets[ix].status = MODBUS_EXCEPTION_GATEWAY_TARGET;
+
+      if (targets[ix].type != MODBUS_FUNC_WRITE_COIL && targets[ix].type != MODBUS_FUNC_WRITE_SINGLE_REGISTER)
+         return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+   }
+
+   // Written on the bus, scene_response() follows
+   scene_init(scene, sout, targets, count);
+
+   return 0;
 }
-            
 
-static modbus_server_t *find_modbus_server(int addr)
+static int scene_response(uint8_t *buf, const scene_t *scene)
 {
    int ix;
-   modbus_server_t *server = NULL;
-   
-   for (ix = 0; ix < servers_cnt; ix++)
+
+   for (ix = 0; ix < scene->count; ix++)
+      buf[MODBUS_TCP_DATA_IDX + 1 + ix] = scene->targets[ix].status;
+
+   return MODBUS_TCP_DATA_IDX + 1 + scene->count;
+}
+
+//
+// Timer request:  cmd(1), ACTION_ONCE, ACTION_PERIODIC or ACTION_STAIRCASE followed by
+//                 type(1) op(1) unit(1) addr(2) value(2) delay(4, ms) period(4, ms),
+//                 TIMER_CMD_CANCEL followed by id(2)
+// Timer response: cmd(1) id(2)
+//
+static int timer_request(uint8_t *buf, int reqlen)
+{
+   const uint8_t *data = &buf[MODBUS_TCP_DATA_IDX];
+   action_target_t target;
+   uint32_t delay, period;
+   int id;
+
+   if (reqlen < MODBUS_TCP_DATA_IDX + 3)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   if (data[0] == TIMER_CMD_CANCEL)
+   {
+      id = (data[1] << 8) | data[2];
+      if (action_cancel(id) < 0)
+         return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_ADDRESS);
+   }
+   else
+   {
+      if (reqlen < MODBUS_TCP_DATA_IDX + 16 || data[0] > ACTION_STAIRCASE)
+         return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+      target.type = data[1];
+      target.op = data[2];
+      target.unit = data[3];
+      target.addr = (data[4] << 8) | data[5];
+      target.value = (data[6] << 8) | data[7];
+      delay = ((uint32_t)data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+      period = ((uint32_t)data[12] << 24) | (data[13] << 16) | (data[14] << 8) | data[15];
+
+      if (target.type != MODBUS_FUNC_WRITE_COIL && target.type != MODBUS_FUNC_WRITE_SINGLE_REGISTER)
+         return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+      if ((id = action_add(data[0], &target, delay, period, -1)) < 0)
+         return modbus_exception(buf, MODBUS_EXCEPTION_DEVICE_FAILURE);
+   }
+
+   buf[MODBUS_TCP_DATA_IDX + 1] = id >> 8;
+   buf[MODBUS_TCP_DATA_IDX + 2] = id & 0xFF;
+
+   return MODBUS_TCP_DATA_IDX + 3;
+}
+
+//
+// Reload request:  no data, configuration file is reloaded
+// Reload response: no data, exception when the file was rejected
+//
+static int reload_request(uint8_t *buf)
+{
+   if (cfgname == NULL)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+
+   if (config_reload() < 0)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   return MODBUS_TCP_DATA_IDX;
+}
+
+//
+// Metrics request:  flags(1), METRICS_FLAG_RESET_MAX clears maximal delays after read
+// Metrics response: requests(4) executed(4) shared(4) classes(1), for each class
+//                   served(4) depth(2) avg_delay_us(4) max_delay_us(4), then for
+//                   transaction and frame pool size(2) used(2) peak(2) exhausted(4),
+//                   bus timeouts(4) noise(4) resyncs(4) poll_backoff(1), gateways(1), for each
+//                   gateway unit_from(1) unit_to(1) connected(1) inflight(2) queued(2)
+//                   forwarded(4) timeouts(4) failures(4), devices(1), for each device
+//                   on the bus unit(1) responses(4) timeouts(4) turnaround median_us(4)
+//                   p95_us(4) max_us(4) response_timeout_us(4), connections(1), for each
+//                   client connection client(1) responses(4) writes(4) stalls(4)
+//                   queued(2) peak(2) avg_delay_us(4) max_delay_us(4), admission
+//                   model_scale_permille(4) stale_answers(4) classes(1), for each class
+//                   budget_ms(4) estimated_delay_us(4) refused(4)
+//
+static int put_pool_stats(uint8_t *buf, const request_pool_stats_t *pool)
+{
+   buf[0] = pool->size >> 8;
+   buf[1] = pool->size & 0xFF;
+   buf[2] = pool->used >> 8;
+   buf[3] = pool->used & 0xFF;
+   buf[4] = pool->peak >> 8;
+   buf[5] = pool->peak & 0xFF;
+   put_u32(&buf[6], pool->exhausted);
+
+   return 10;
+}
+
+static int metrics_request(const uint8_t *req, int reqlen, uint8_t *buf)
+{
+   const request_stats_t *stats = request_stats();
+   const modbus_bus_stats_t *bus = modbus_rtu_stats();
+   const request_class_stats_t *cs;
+   gateway_stats_t gs;
+   modbus_turnaround_t ta;
+   output_stats_t os;
+   uint8_t *p = &buf[MODBUS_TCP_DATA_IDX];
+   uint8_t *cnt;
+   int cls, ix;
+
+   memcpy(buf, req, MODBUS_TCP_FUNC_IDX + 1);
+
+   p += put_u32(p, stats->requests);
+   p += put_u32(p, stats->executed);
+   p += put_u32(p, stats->shared);
+   *p++ = REQUEST_CLASSES;
+
+   for (cls = 0; cls < REQUEST_CLASSES; cls++)
+   {
+      cs = &stats->classes[cls];
+      p += put_u32(p, cs->served);
+      *p++ = cs->depth >> 8;
+      *p++ = cs->depth & 0xFF;
+      p += put_u32(p, cs->served ? (uint32_t)(cs->delay_sum / cs->served) : 0);
+      p += put_u32(p, cs->delay_max);
+   }
+
+   p += put_pool_stats(p, &stats->transactions);
+   p += put_pool_stats(p, &stats->frames);
+
+   p += put_u32(p, bus->timeouts);
+   p += put_u32(p, bus->noise);
+   p += put_u32(p, bus->resyncs);
+   *p++ = poll_backoff();
+
+   for (ix = 0, cnt = p++; ix < GATEWAY_MAX_COUNT; ix++)
+   {
+      if (gateway_stats(ix, &gs) < 0)
+         continue;
+
+      (*cnt)++;
+      *p++ = gs.unit_from;
+      *p++ = gs.unit_to;
+      *p++ = gs.connected;
+      *p++ = gs.inflight >> 8;
+      *p++ = gs.inflight & 0xFF;
+      *p++ = gs.queued >> 8;
+      *p++ = gs.queued & 0xFF;
+      p += put_u32(p, gs.forwarded);
+      p += put_u32(p, gs.timeouts);
+      p += put_u32(p, gs.failures);
+   }
+
+   // Turnaround of bus devices, slow firmware stands out here
+   for (ix = 1, cnt = p++; ix <= MODBUS_MAX_UNIT; ix++)
+   {
+      if (modbus_rtu_turnaround(ix, &ta) < 0)
+         continue;
+
+      (*cnt)++;
+      *p++ = ix;
+      p += put_u32(p, ta.samples);
+      p += put_u32(p, ta.timeouts);
+      p += put_u32(p, ta.median);
+      p += put_u32(p, ta.quantile);
+      p += put_u32(p, ta.max);
+      p += put_u32(p, ta.timeout);
+   }
+
+   // Responses per write shows batching, delay is time response waits for the socket
+   for (ix = 0, cnt = p++; ix < MAX_CLIENTS_COUNT; ix++)
+   {
+      if (output_stats(ix, &os) < 0)
+         continue;
+
+      (*cnt)++;
+      *p++ = ix;
+      p += put_u32(p, os.responses);
+      p += put_u32(p, os.writes);
+      p += put_u32(p, os.stalls);
+      *p++ = os.queued >> 8;
+      *p++ = os.queued & 0xFF;
+      *p++ = os.peak >> 8;
+      *p++ = os.peak & 0xFF;
+      p += put_u32(p, os.delay_cnt ? (uint32_t)(os.delay_sum / os.delay_cnt) : 0);
+      p += put_u32(p, os.delay_max);
+   }
+
+   // Estimated delay near budget tells the class is about to be refused
+   p += put_u32(p, stats->scale);
+   p += put_u32(p, stale_answers);
+   *p++ = REQUEST_CLASSES;
+   for (cls = 0; cls < REQUEST_CLASSES; cls++)
    {
-      if (servers[ix].addr == addr)
+      cs = &stats->classes[cls];
+      p += put_u32(p, cs->budget);
+      p += put_u32(p, request_estimate(cls));
+      p += put_u32(p, cs->refused);
+   }
+
+   if (reqlen > MODBUS_TCP_DATA_IDX && (req[MODBUS_TCP_DATA_IDX] & METRICS_FLAG_RESET_MAX))
+   {
+      request_stats_reset_max();
+      output_stats_reset_max();
+   }
+
+   return p - buf;
+}
+
+//
+// Bulk state request:  since(4), sequence of state client already has, 0 for all
+// Bulk state response: seq(4) more(1) count(2) followed by count units changed since
+//                      unit(1) flags(1) seq(4) time(8, ms) ncoils(2) ninputs(2)
+//                      coils((ncoils + 7) / 8) coils_valid(..) inputs((ninputs + 7) / 8) inputs_valid(..)
+// Units go in order of change, ncoils and ninputs cover points up to last known one.
+// Flag BULK_FLAG_STALE marks cached slave served from snapshot before it was read.
+// Response not able to hold all units has more set and seq of last unit included,
+// client asks again since that sequence. Served from cache, costs no bus transaction.
+// Equal sequence returns no units, sequence ahead of daemon (restarted without
+// snapshot file) returns all.
+//
+static int bulk_state_request(const uint8_t *req, int reqlen, uint8_t *rsp)
+{
+   static snapshot_state_t states[SNAPSHOT_UNITS];
+   const uint8_t *data = &req[MODBUS_TCP_DATA_IDX];
+   snapshot_state_t tmp, *st;
+   uint32_t since, seq;
+   int ix, jx, len, ncoils, ninputs, cnt = 0, count = 0, more = 0;
+
+   memcpy(rsp, req, MODBUS_TCP_FUNC_IDX + 1);
+
+   if (reqlen < MODBUS_TCP_DATA_IDX + 4)
+      return modbus_exception(rsp, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   since = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+   seq = snapshot_sequence();
+   if (since > seq)
+      since = 0;
+
+   // Changed units ordered by sequence, truncated response continues where it stopped
+   for (ix = 0; ix < SNAPSHOT_UNITS; ix++)
+   {
+      if (snapshot_get(ix, since, &tmp) < 0)
+         continue;
+
+      for (jx = cnt; jx > 0 && states[jx - 1].seq > tmp.seq; jx--)
+         states[jx] = states[jx - 1];
+      states[jx] = tmp;
+      cnt++;
+   }
+
+   len = MODBUS_TCP_DATA_IDX + BULK_HEADER_SIZE;
+
+   for (ix = 0; ix < cnt; ix++)
+   {
+      st = &states[ix];
+      ncoils = bitset_length(st->coils_valid);
+      ninputs = bitset_length(st->inputs_valid);
+
+      if (len + BULK_UNIT_SIZE + 2 * ((ncoils + 7) / 8 + (ninputs + 7) / 8) > BULK_RESPONSE_SIZE)
       {
-         server = &servers[ix];
+         seq = states[ix - 1].seq;
+         more = 1;
          break;
       }
+
+      rsp[len++] = st->unit;
+      rsp[len++] = st->stale ? BULK_FLAG_STALE : 0;
+      len += put_u32(&rsp[len], st->seq);
+      len += put_u64(&rsp[len], st->time);
+      rsp[len++] = ncoils >> 8;
+      rsp[len++] = ncoils & 0xFF;
+      rsp[len++] = ninputs >> 8;
+      rsp[len++] = ninputs & 0xFF;
+      len += bitset_to_bytes(st->coils, 0, ncoils, &rsp[len]);
+      len += bitset_to_bytes(st->coils_valid, 0, ncoils, &rsp[len]);
+      len += bitset_to_bytes(st->inputs, 0, ninputs, &rsp[len]);
+      len += bitset_to_bytes(st->inputs_valid, 0, ninputs, &rsp[len]);
+      count++;
    }
+
+   put_u32(&rsp[MODBUS_TCP_DATA_IDX], seq);
+   rsp[MODBUS_TCP_DATA_IDX + 4] = more;
+   rsp[MODBUS_TCP_DATA_IDX + 5] = count >> 8;
+   rsp[MODBUS_TCP_DATA_IDX + 6] = count & 0xFF;
+
+   return len;
+}
+
+//
+// Cycle query request:  cycle(1), index of cycle statement
+// Cycle query response: seq(4) boundary(8, ms since epoch) lag_us(4) skew_us(4)
+//                       lag_max_us(4) skew_max_us(4) missed(4) failed(4) points(1),
+//                       for each point in configured order unit(1) func(1) start(2)
+//                       count(2) offset_us(4, signed, sample time from boundary)
+//                       valid(1) len(1) data(len, response data as read from slave)
+// Last completed cycle, seq 0 before the first one. Served from memory.
+//
+static int cycle_query_request(const uint8_t *req, int reqlen, uint8_t *rsp)
+{
+   const cycle_config_t *config;
+   const cycle_sample_t *samples;
+   const cycle_stats_t *stats;
+   const cycle_point_t *pt;
+   int ix, len;
+
+   memcpy(rsp, req, MODBUS_TCP_FUNC_IDX + 1);
+
+   if (reqlen != MODBUS_TCP_DATA_IDX + 1)
+      return modbus_exception(rsp, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   if (cycle_get(req[MODBUS_TCP_DATA_IDX], &config, &samples, &stats) < 0)
+      return modbus_exception(rsp, MODBUS_EXCEPTION_ILLEGAL_ADDRESS);
+
+   len = MODBUS_TCP_DATA_IDX;
+   len += put_u32(&rsp[len], stats->seq);
+   len += put_u64(&rsp[len], stats->boundary);
+   len += put_u32(&rsp[len], stats->lag);
+   len += put_u32(&rsp[len], stats->skew);
+   len += put_u32(&rsp[len], stats->lag_max);
+   len += put_u32(&rsp[len], stats->skew_max);
+   len += put_u32(&rsp[len], stats->missed);
+   len += put_u32(&rsp[len], stats->failed);
+   rsp[len++] = config->points_cnt;
+
+   for (ix = 0; ix < config->points_cnt; ix++)
+   {
+      pt = &config->points[ix];
+      rsp[len++] = pt->unit;
+      rsp[len++] = pt->func;
+      rsp[len++] = pt->start >> 8;
+      rsp[len++] = pt->start & 0xFF;
+      rsp[len++] = pt->count >> 8;
+      rsp[len++] = pt->count & 0xFF;
+      len += put_u32(&rsp[len], (uint32_t)(int32_t)(samples[ix].time - stats->boundary * 1000));
+      rsp[len++] = samples[ix].valid;
+      rsp[len++] = samples[ix].valid ? samples[ix].len : 0;
+      if (samples[ix].valid)
+      {
+         memcpy(&rsp[len], samples[ix].data, samples[ix].len);
+         len += samples[ix].len;
+      }
+   }
+
+   return len;
+}
+
+//
+// Read holding or input registers of virtual slave, values computed by virtual.c
+// from cached points are copied, costs no bus transaction. Register not known
+// yet (operand not read since start) answers device failure.
+//
+static int virtual_request(uint8_t *buf)
+{
+   uint16_t values[MODBUS_MAX_READ_REGISTERS];
+   uint16_t start, count;
+   int ix, res;
+
+   if (buf[MODBUS_TCP_FUNC_IDX] != MODBUS_FUNC_READ_HOLDING_REGISTERS && buf[MODBUS_TCP_FUNC_IDX] != MODBUS_FUNC_READ_INPUT_REGISTERS)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+
+   start = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
+   count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+
+   if (count == 0 || count > MODBUS_MAX_READ_REGISTERS)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   if ((res = virtual_read(buf[MODBUS_TCP_ADDR_IDX], start, count, values)) < 0)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_ADDRESS);
+
+   if (res > 0)
+      return modbus_exception(buf, MODBUS_EXCEPTION_DEVICE_FAILURE);
+
+   buf[MODBUS_TCP_DATA_IDX] = count * 2;
+   for (ix = 0; ix < count; ix++)
+   {
+      buf[MODBUS_TCP_DATA_IDX + 1 + ix * 2] = values[ix] >> 8;
+      buf[MODBUS_TCP_DATA_IDX + 2 + ix * 2] = values[ix] & 0xFF;
+   }
+
+   return MODBUS_TCP_HEADER_SIZE + 2 + count * 2;
+}
+
+// Read coils or inputs response: byte count followed by bits packed from LSB of first byte
+static int read_bits_response(uint8_t *buf, const bitset_t *state, int start, int count)
+{
+   buf[MODBUS_TCP_DATA_IDX] = bitset_to_bytes(state, start, count, &buf[MODBUS_TCP_DATA_IDX+1]);
+
+   return MODBUS_TCP_HEADER_SIZE + 2 + buf[MODBUS_TCP_DATA_IDX];
+}
+
+// Points of device, 0 when the device does not tell
+static int profile_points(const profile_t *profile, uint8_t func)
+{
+   return (func == MODBUS_FUNC_READ_COILS) ? profile->coils : profile->inputs;
+}
+
+// Functions not touching the bus and virtual slaves
+static int modbus_tcp_request(uint8_t *buf, int reqlen, uint8_t **prsp)
+{
+   int rsplen;
+
+   // Set defaul response
+   rsplen = reqlen;
+   *prsp = buf;
+
+   // Vendor functions are served for any unit id
+   if (buf[MODBUS_TCP_FUNC_IDX] < MODBUS_FUNC_HISTORY_QUERY && virtual_unit(buf[MODBUS_TCP_ADDR_IDX]))
+      return virtual_request(buf);
    
-   return server;
+   switch(buf[MODBUS_TCP_FUNC_IDX])
+   {
+      case MODBUS_FUNC_TIMER:
+         rsplen = timer_request(buf, reqlen);
+         break;
+
+      case MODBUS_FUNC_RELOAD:
+         rsplen = reload_request(buf);
+         break;
+
+      case MODBUS_FUNC_METRICS:
+         *prsp = metrics_rsp;
+         rsplen = metrics_request(buf, reqlen, metrics_rsp);
+         break;
+
+      case MODBUS_FUNC_BULK_STATE:
+         *prsp = bulk_rsp;
+         rsplen = bulk_state_request(buf, reqlen, bulk_rsp);
+         break;
+
+      case MODBUS_FUNC_CYCLE_QUERY:
+         *prsp = cycle_rsp;
+         rsplen = cycle_query_request(buf, reqlen, cycle_rsp);
+         break;
+
+      case MODBUS_FUNC_HISTORY_QUERY:
+         *prsp = history_rsp;
+         rsplen = history_query_request(buf, reqlen, history_rsp);
+         break;
+         
+      default:
+         TRACE_ERROR("Not supported modbus func: 0x%X", buf[MODBUS_TCP_FUNC_IDX]);
+         rsplen = modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+   }
+
+   return rsplen;
+}
+
+// Register functions and multiple coils write go to the slave as they are, RTU
+// frame is unit and PDU of the request. Returns 0 when transaction is prepared,
+// otherwise length of exception response.
+static int bus_request_direct(request_t *req, modbus_txn_t *txn)
+{
+   uint8_t *buf = req->buf;
+   uint8_t func = buf[MODBUS_TCP_FUNC_IDX];
+   uint16_t start, count;
+   int size, res;
+
+   if (req->len < MODBUS_TCP_DATA_IDX + 4)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   start = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
+   count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+
+   switch (func)
+   {
+      case MODBUS_FUNC_READ_HOLDING_REGISTERS:
+      case MODBUS_FUNC_READ_INPUT_REGISTERS:
+         if (count == 0 || count > MODBUS_MAX_READ_REGISTERS)
+            return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+         res = modbus_txn_init(txn, sout, buf[MODBUS_TCP_ADDR_IDX], func, start, count, NULL, 0, 3 + 2 * count);
+         break;
+
+      case MODBUS_FUNC_WRITE_SINGLE_REGISTER:
+         res = modbus_txn_write_register(txn, sout, buf[MODBUS_TCP_ADDR_IDX], start, count);
+         break;
+
+      default:
+         // Byte count and values follow
+         size = (func == MODBUS_FUNC_WRITE_MULTIPLE_COILS) ? (count + 7) / 8 : count * 2;
+         if (count == 0 || count > ((func == MODBUS_FUNC_WRITE_MULTIPLE_COILS) ? MODBUS_MAX_WRITE_COILS : MODBUS_MAX_WRITE_REGISTERS) ||
+             req->len != MODBUS_TCP_DATA_IDX + 5 + size || buf[MODBUS_TCP_DATA_IDX+4] != size)
+            return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+         res = modbus_txn_init(txn, sout, buf[MODBUS_TCP_ADDR_IDX], func, start, count, &buf[MODBUS_TCP_DATA_IDX+5], size, 6);
+   }
+
+   if (res < 0)
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+   return 0;
+}
+
+// Response of direct request is the RTU response PDU
+static int bus_request_direct_finish(request_t *req, const modbus_txn_t *txn)
+{
+   uint8_t *buf = req->buf;
+   uint8_t unit = buf[MODBUS_TCP_ADDR_IDX];
+   uint8_t func = buf[MODBUS_TCP_FUNC_IDX];
+   uint16_t start = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
+   uint16_t count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+   bitset_t state;
+   int ix, len = txn->rsplen - 3;
+
+   if (txn->result < 0)
+   {
+      TRACE_ERROR("Request unit 0x%X func 0x%X failed", unit, func);
+      return modbus_exception(buf, MODBUS_EXCEPTION_DEVICE_FAILURE);
+   }
+
+   if (func == MODBUS_FUNC_READ_HOLDING_REGISTERS || func == MODBUS_FUNC_READ_INPUT_REGISTERS)
+      virtual_process_registers(unit, func, start, count, &txn->rsp[MODBUS_RTU_DATA_IDX+1]);
+
+   // Written coils are known, cached servers keep them as well
+   if (func == MODBUS_FUNC_WRITE_MULTIPLE_COILS)
+   {
+      bitset_from_bytes(&state, &buf[MODBUS_TCP_DATA_IDX+5], count);
+      for (ix = 0; ix < count && start + ix < BITSET_MAX_BITS; ix++)
+      {
+         server_coil_written(unit, start + ix, bitset_get(&state, ix));
+         history_record(unit, MODBUS_FUNC_READ_COILS, start + ix, bitset_get(&state, ix));
+      }
+   }
+
+   memcpy(&buf[MODBUS_TCP_FUNC_IDX], &txn->rsp[1], len);
+
+   return MODBUS_TCP_ADDR_IDX + 1 + len;
+}
+
+// Start queued request on the bus, returns length of response when it is answered
+// without the bus
+static int bus_request_start(request_t *req, modbus_txn_t *txn, uint8_t **prsp)
+{
+   uint8_t *buf = req->buf;
+   uint8_t unit = buf[MODBUS_TCP_ADDR_IDX];
+   uint8_t func = buf[MODBUS_TCP_FUNC_IDX];
+   const profile_t *profile = server_profile(unit);
+   modbus_server_t *server = server_find_cached(unit);
+   uint16_t start, count;
+   int res;
+
+   *prsp = buf;
+
+   if (func < MODBUS_FUNC_HISTORY_QUERY && virtual_unit(unit))
+      return modbus_tcp_request(buf, req->len, prsp);
+
+   // Function not known to device costs no bus transaction
+   if (func < MODBUS_FUNC_HISTORY_QUERY && !profile_supports(profile, func))
+      return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+
+   switch (func)
+   {
+      case MODBUS_FUNC_READ_COILS:
+      case MODBUS_READ_DISCRETE_INPUTS:
+         start = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
+         count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+
+         if (count == 0 || count > MODBUS_MAX_READ_BITS)
+            return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_VALUE);
+
+         if (profile_points(profile, func) > 0 && start + count > profile_points(profile, func))
+            return modbus_exception(buf, MODBUS_EXCEPTION_ILLEGAL_ADDRESS);
+
+         // Coils of cached server are served from memory, all of them are read when
+         // the server was added by reload and not read yet
+         bus_op.cached = (func == MODBUS_FUNC_READ_COILS && server != NULL);
+         if (bus_op.cached && server->valid)
+            return read_bits_response(buf, &server->coils_state, start, count);
+
+         if (bus_op.cached)
+            res = profile_read_init(&bus_op.read, sout, profile, unit, func, 0, server->profile.coils);
+         else
+            res = profile_read_init(&bus_op.read, sout, profile, unit, func, start, count);
+
+         if (res < 0)
+         {
+            if (bus_op.cached)
+               return modbus_exception(buf, MODBUS_EXCEPTION_DEVICE_FAILURE);
+
+            TRACE_ERROR("Read of func 0x%X failed", func);
+            buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
+            return req->len;
+         }
+         return 0;
+
+      case MODBUS_FUNC_WRITE_COIL:
+         start = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
+         count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+
+         if (server_txn_write_coil(txn, sout, unit, start, count == 0xFF00) < 0)
+         {
+            TRACE_ERROR("modbus_rtu_write_coil failed");
+            buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
+            return req->len;
+         }
+         return 0;
+
+      case MODBUS_FUNC_READ_HOLDING_REGISTERS:
+      case MODBUS_FUNC_READ_INPUT_REGISTERS:
+      case MODBUS_FUNC_WRITE_SINGLE_REGISTER:
+      case MODBUS_FUNC_WRITE_MULTIPLE_COILS:
+      case MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS:
+         return bus_request_direct(req, txn);
+
+      case MODBUS_FUNC_SCENE:
+         return scene_request(buf, req->len, &bus_op.scene);
+
+      default:
+         return modbus_tcp_request(buf, req->len, prsp);
+   }
+}
+
+static int bus_request_is_direct(uint8_t func)
+{
+   return func == MODBUS_FUNC_READ_HOLDING_REGISTERS || func == MODBUS_FUNC_READ_INPUT_REGISTERS ||
+          func == MODBUS_FUNC_WRITE_SINGLE_REGISTER || func == MODBUS_FUNC_WRITE_MULTIPLE_COILS ||
+          func == MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS;
+}
+
+// Response of request when its bus operation is done
+static int bus_request_finish(request_t *req, const modbus_txn_t *txn)
+{
+   uint8_t *buf = req->buf;
+   uint8_t unit = buf[MODBUS_TCP_ADDR_IDX];
+   uint8_t func = buf[MODBUS_TCP_FUNC_IDX];
+   uint16_t start = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
+   uint16_t count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+   modbus_server_t *server;
+
+   if (func == MODBUS_FUNC_SCENE)
+      return scene_response(buf, &bus_op.scene);
+
+   if (bus_request_is_direct(func))
+      return bus_request_direct_finish(req, txn);
+
+   if (func == MODBUS_FUNC_WRITE_COIL)
+   {
+      // Coil address and value
+      if (txn->result < 0)
+      {
+         TRACE_ERROR("modbus_rtu_write_coil failed");
+         buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
+         return req->len;
+      }
+
+      server_coil_written(unit, start, count == 0xFF00);
+      history_record(unit, MODBUS_FUNC_READ_COILS, start, count == 0xFF00);
+      return req->len;
+   }
+
+   if (bus_op.read.result < 0)
+   {
+      if (bus_op.cached)
+         return modbus_exception(buf, MODBUS_EXCEPTION_DEVICE_FAILURE);
+
+      TRACE_ERROR("Read of func 0x%X failed", func);
+      buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
+      return req->len;
+   }
+
+   if (bus_op.cached)
+   {
+      // Server may be removed by reload meanwhile
+      if ((server = server_find_cached(unit)) != NULL)
+         server_state_read(server, &bus_op.read.state);
+      return read_bits_response(buf, &bus_op.read.state, start, count);
+   }
+
+   history_record_bits(unit, func, start, count, &bus_op.read.state);
+   snapshot_store_bits(unit, func, start, count, &bus_op.read.state);
+
+   return read_bits_response(buf, &bus_op.read.state, 0, count);
+}
+
+// Queued client request, suspended while its bus transactions run
+static int bus_request(request_t *req, modbus_txn_t *txn)
+{
+   uint8_t func = req->buf[MODBUS_TCP_FUNC_IDX];
+   uint8_t *rsp;
+   int rsplen;
+
+   CORO_BEGIN(&req->coro);
+
+   if ((rsplen = bus_request_start(req, txn, &rsp)) > 0)
+   {
+      request_respond(req, rsp, rsplen);
+      CORO_EXIT(&req->coro);
+   }
+
+   if (func == MODBUS_FUNC_SCENE)
+      CORO_AWAIT_CALL(&req->coro, &bus_op.scene.coro, scene_step(&bus_op.scene, txn));
+   else if (func == MODBUS_FUNC_WRITE_COIL || bus_request_is_direct(func))
+      MODBUS_TXN_AWAIT(&req->coro, txn);
+   else
+      CORO_AWAIT_CALL(&req->coro, &bus_op.read.coro, profile_read_step(&bus_op.read, txn));
+
+   request_respond(req, req->buf, bus_request_finish(req, txn));
+
+   CORO_END(&req->coro);
+}
+
+// Bus time of request by the RTU time model, reads of cached servers and
+// functions not touching the bus cost nothing
+static uint32_t request_cost(const uint8_t *buf, int len)
+{
+   uint8_t unit = buf[MODBUS_TCP_ADDR_IDX];
+   uint8_t func = buf[MODBUS_TCP_FUNC_IDX];
+   uint8_t units[256 / 8];
+   uint32_t cost = 0;
+   int ix, count;
+
+   // Refused by profile without the bus
+   if (func < MODBUS_FUNC_HISTORY_QUERY && !profile_supports(server_profile(unit), func))
+      return 0;
+
+   switch (func)
+   {
+      case MODBUS_FUNC_READ_COILS:
+      case MODBUS_READ_DISCRETE_INPUTS:
+         if (len < MODBUS_TCP_DATA_IDX + 4 || (func == MODBUS_FUNC_READ_COILS && server_find_cached(unit) != NULL))
+            return 0;
+         count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+         return (count > 0 && count <= MODBUS_MAX_READ_BITS) ? plan_read_cost(unit, func, count) : 0;
+
+      case MODBUS_FUNC_READ_HOLDING_REGISTERS:
+      case MODBUS_FUNC_READ_INPUT_REGISTERS:
+         if (len < MODBUS_TCP_DATA_IDX + 4)
+            return 0;
+         count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+         return (count > 0 && count <= MODBUS_MAX_READ_REGISTERS) ? plan_read_cost(unit, func, count) : 0;
+
+      case MODBUS_FUNC_WRITE_COIL:
+      case MODBUS_FUNC_WRITE_SINGLE_REGISTER:
+         return plan_transaction_cost(unit, 8, 8);
+
+      // RTU frame is unit and PDU of TCP frame with CRC
+      case MODBUS_FUNC_WRITE_MULTIPLE_COILS:
+      case MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS:
+         return plan_transaction_cost(unit, len - MODBUS_TCP_ADDR_IDX + 2, 8);
+
+      // Targets of one slave are written together
+      case MODBUS_FUNC_SCENE:
+         memset(units, 0, sizeof(units));
+         count = (len > MODBUS_TCP_DATA_IDX) ? buf[MODBUS_TCP_DATA_IDX] : 0;
+         for (ix = 0; ix < count && MODBUS_TCP_DATA_IDX + 7 + ix * 6 <= len; ix++)
+         {
+            unit = buf[MODBUS_TCP_DATA_IDX + 1 + ix * 6];
+            if (!(units[unit / 8] & (1 << (unit % 8))))
+            {
+               units[unit / 8] |= 1 << (unit % 8);
+               cost += plan_transaction_cost(unit, 8, 8);
+            }
+         }
+         return cost;
+
+      default:
+         return 0;
+   }
+}
+
+// Request over latency budget of its class. Read with all points known is
+// answered from snapshot (stale but quick), anything else with server busy.
+static int overload_request(uint8_t *buf, int reqlen, uint8_t **prsp)
+{
+   uint8_t func = buf[MODBUS_TCP_FUNC_IDX];
+   uint16_t start, count;
+   bitset_t state;
+
+   *prsp = buf;
+
+   if ((func == MODBUS_FUNC_READ_COILS || func == MODBUS_READ_DISCRETE_INPUTS) && reqlen >= MODBUS_TCP_DATA_IDX + 4)
+   {
+      start = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
+      count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
+
+      if (count > 0 && count <= MODBUS_MAX_READ_BITS && snapshot_load_bits(buf[MODBUS_TCP_ADDR_IDX], func, start, count, &state, NULL) == 0)
+      {
+         stale_answers++;
+         return read_bits_response(buf, &state, 0, count);
+      }
+   }
+
+   return modbus_exception(buf, MODBUS_EXCEPTION_SERVER_BUSY);
+}
+
+// Queue request for the bus unless it would wait longer than budget of its class
+static void client_submit(request_t *req)
+{
+   req->cost = request_cost(req->buf, req->len);
+
+   if (request_admit(req) < 0)
+      request_serve(req, overload_request);
+   else
+      request_enqueue(req);
+}
+
+// Request pool exhausted, answer immediately without queueing
+static void client_busy(int ix, const uint8_t *req)
+{
+   uint8_t rsp[MODBUS_TCP_HEADER_SIZE + 2];
+   int len;
+
+   memcpy(rsp, req, MODBUS_TCP_HEADER_SIZE + 1);
+   len = modbus_exception(rsp, MODBUS_EXCEPTION_SERVER_BUSY);
+   rsp[4] = 0;
+   rsp[5] = len - 6;
+
+   if (output_send(ix, rsp, len) < 0)
+      TRACE_ERROR("Send busy response failed");
+}
+
+static void client_close(int ix)
+{
+   tcp_socket_close(clients[ix]);
+   output_close(ix);
+   clients[ix] = -1;
+   clients_rx[ix].len = 0;
+   request_drop_client(ix);
+   gateway_drop_client(ix);
+}
+
+// Receive requests of client, one recv may carry several pipelined requests and
+// frames may be split between recvs. Only complete frames are consumed.
+static int client_receive(int ix)
+{
+   client_rx_t *rx = &clients_rx[ix];
+   uint8_t *buf = rx->buf;
+   request_t *req;
+   int res, pos, len;
+
+   if ((res = tcp_socket_recv(clients[ix], &buf[rx->len], sizeof(rx->buf) - rx->len)) <= 0)
+   {
+      if (res == 0)
+         TRACE("Connection closed");
+      else
+         TRACE_ERROR("Recv failed");
+
+      client_close(ix);
+      return -1;
+   }
+
+   rx->len += res;
+
+   // MBAP length covers unit id and PDU
+   for (pos = 0; rx->len - pos >= MODBUS_TCP_HEADER_SIZE - 1; pos += len)
+   {
+      len = 6 + ((buf[pos + 4] << 8) | buf[pos + 5]);
+      if (len <= MODBUS_TCP_HEADER_SIZE || len > REQUEST_FRAME_SIZE)
+      {
+         // Stream lost frame boundaries, nothing after is parsed right
+         TRACE_ERROR("Bad request frame length %d", len);
+         client_close(ix);
+         return -1;
+      }
+
+      if (pos + len > rx->len)
+         break;
+
+      // Cached state, statistics, virtual slaves and units behind remote gateways do not wait for the serial bus
+      if ((req = request_alloc(ix, &buf[pos], len)) == NULL)
+         client_busy(ix, &buf[pos]);
+      else if (req->buf[MODBUS_TCP_FUNC_IDX] == MODBUS_FUNC_BULK_STATE || req->buf[MODBUS_TCP_FUNC_IDX] == MODBUS_FUNC_METRICS ||
+               req->buf[MODBUS_TCP_FUNC_IDX] == MODBUS_FUNC_CYCLE_QUERY ||
+               (req->buf[MODBUS_TCP_FUNC_IDX] < MODBUS_FUNC_HISTORY_QUERY && virtual_unit(req->buf[MODBUS_TCP_ADDR_IDX])))
+         request_serve(req, modbus_tcp_request);
+      else if (!gateway_route(req))
+         client_submit(req);
+   }
+
+   rx->len -= pos;
+   memmove(buf, &buf[pos], rx->len);
+
+   return 0;
+}
+
+// Write responses collected during pass, one writev per client
+static void clients_flush(void)
+{
+   int ix;
+
+   for (ix = 0; ix < MAX_CLIENTS_COUNT; ix++)
+   {
+      if (clients[ix] >= 0 && output_flush(ix) < 0)
+         client_close(ix);
+   }
 }
 
 int main(int argc, char *argv[])
 {
-   int res, ix, rsplen, sout;
+   int res, ix, jx, maxfd;
    int listen_socket, socket;
    struct sockaddr_in remote_addr;
+   struct timespec ts, *pts;
+   sigset_t sigmask, waitmask;
+   fd_set read_fds, write_fds;
+   struct sigaction sa;
    modbus_server_t *server;
-   uint8_t buf[255];
+   int64_t next, wait;
    
    if (argc < 2)
    {
@@ -74,20 +1158,33 @@ int main(int argc, char *argv[])
       return 1;
    }
 
+   timerwheel_init(systime_ms());
+
    for (ix = 1; ix < argc; ix++)
    {
       if (!strcmp(argv[ix], "-d"))
       {
          devname = argv[++ix];
+         if (devnames_cnt < DISCOVERY_MAX_BUSES)
+            devnames[devnames_cnt++] = devname;
       }
-      else if (!strcmp(argv[ix], "-a"))
+      else if (!strcmp(argv[ix], "-b"))
       {
-         if (servers_cnt == MAX_SERVERS_COUNT)
+         baudrate = atoi(argv[++ix]);
+         if (serial_baudrate(baudrate) < 0)
          {
-            TRACE_ERROR("modbus servers maxnum exceeded");
+            TRACE_ERROR("Not supported baudrate %d", baudrate);
             return 1;
          }
-         servers[servers_cnt++].addr = atoi(argv[++ix]);
+      }
+      else if (!strcmp(argv[ix], "-D"))
+      {
+         mapname = argv[++ix];
+      }
+      else if (!strcmp(argv[ix], "-a"))
+      {
+         if (server_add(atoi(argv[++ix]), profile_find("china-relay")) == NULL)
+            return 1;
       }
       else if (!strcmp(argv[ix], "-wr"))
       {
@@ -98,7 +1195,7 @@ int main(int argc, char *argv[])
          value = atoi(argv[++ix]);
          
          // Write single register
-         if ((sout = serial_open(devname, B9600)) < 0)
+         if ((sout = serial_open(devname, serial_baudrate(baudrate))) < 0)
          {
             TRACE_ERROR("open serial %s failed", devname);
             return 1;
@@ -116,6 +1213,24 @@ int main(int argc, char *argv[])
 
          return 0;
       }
+      else if (!strcmp(argv[ix], "-H"))
+      {
+         if (history_init(argv[++ix]) < 0)
+            return 1;
+      }
+      else if (!strcmp(argv[ix], "-S"))
+      {
+         if (snapshot_init(argv[++ix]) < 0)
+            return 1;
+      }
+      else if (!strcmp(argv[ix], "-c"))
+      {
+         cfgname = argv[++ix];
+      }
+      else if (!strcmp(argv[ix], "-M"))
+      {
+         shmname = (ix + 1 < argc && argv[ix + 1][0] == '/') ? argv[++ix] : MODBUSD_SHM_NAME;
+      }
    }
    
    if (devname == NULL)
@@ -123,42 +1238,62 @@ int main(int argc, char *argv[])
       TRACE_ERROR("Not specified serial out device");
       return 1;
    }
-   
 
-   if ((sout = serial_open(devname, B9600)) < 0)
+   if (mapname != NULL)
+      return discovery_run(devnames, devnames_cnt, baudrate, mapname) < 0 ? 1 : 0;
+
+   // Snapshot loaded from file is published at once
+   if (shmname != NULL && shmexport_init(shmname) < 0)
+      return 1;
+
+   if ((sout = serial_open(devname, serial_baudrate(baudrate))) < 0)
    {
       TRACE_ERROR("open serial %s failed", devname);
       return 1;
    }
    TRACE("Open serial port %s", devname);
 
-/*   
-   uint16_t state;
-   while(1)
-   {
-      modbus_rtu_read_inputs(sout, 3, 0, 8, &state);
-      msleep(500);
-   }
-*/
-   while(1)
-   {
-      modbus_rtu_write_coil(sout, 3, 0, 0xFF);
-      msleep(1000);
-      modbus_rtu_write_coil(sout, 3, 0, 0x00);
-      msleep(1000);
-   }
+   modbus_rtu_init(baudrate);
+
+   server_init(sout);
+   action_init(sout);
+   poll_init(sout);
+   plan_init(baudrate);
+   rule_init();
+   virtual_init();
+   cycle_init(sout);
+   gateway_init();
 
-    
-   for (ix = 0; ix < servers_cnt; ix++)
+   if (cfgname != NULL && config_load(cfgname) < 0)
+      return 1;
+
+   config_pool_size(&ix, &jx);
+   if (request_pool_init(ix, jx) < 0)
+      return 1;
+
+   // Read init coil status in background, listener is opened immediately
+   for (ix = 0; ix < MAX_SERVERS_COUNT; ix++)
    {
-      // Read init coil status
-      while(modbus_rtu_read_coils_state_fix(sout, servers[ix].addr, 0, 8, &servers[ix].coils_state) != 0)
-      {
-         usleep(100 * 1000);
-      }
-      
-      TRACE("Modbus fix servers addr: 0x%X  coils_state: 0x%X", servers[ix].addr, servers[ix].coils_state);
+      if ((server = server_get(ix)) != NULL && server->profile.cached && !timer_pending(&server->timer))
+         server_start_refresh(server);
    }
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = sighup_handler;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGHUP, &sa, NULL);
+
+   // Shared memory is withdrawn on exit, readers do not take stale state as live
+   sa.sa_handler = sigterm_handler;
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+
+   // Signals are delivered only while waiting, none is lost before the wait
+   sigemptyset(&sigmask);
+   sigaddset(&sigmask, SIGHUP);
+   sigaddset(&sigmask, SIGTERM);
+   sigaddset(&sigmask, SIGINT);
+   sigprocmask(SIG_BLOCK, &sigmask, &waitmask);
    
    if ((listen_socket = tcp_socket_create(MODBUS_TCP_PORT)) < 0)
    {
@@ -167,165 +1302,135 @@ int main(int argc, char *argv[])
    }
    
    TRACE("Listening for TCP data ...");
+
+   for (ix = 0; ix < MAX_CLIENTS_COUNT; ix++)
+      clients[ix] = -1;
+   output_init();
    
-   while(1)
+   while (!exit_pending)
    {
-      if ((socket = tcp_socket_accept(listen_socket, &remote_addr)) < 0)
+      if (reload_pending)
       {
-         TRACE_ERROR("Accept connection");
-         continue;
+         // Clients stay connected, cached states and running timers are kept
+         reload_pending = 0;
+         if (cfgname != NULL && config_reload() < 0)
+            TRACE_ERROR("Reload config failed, running configuration kept");
       }
-      
-      TRACE("\nNew connection accepted");
-      
-      while(1)
+
+      FD_ZERO(&read_fds);
+      FD_SET(listen_socket, &read_fds);
+      maxfd = listen_socket;
+
+      for (ix = 0; ix < MAX_CLIENTS_COUNT; ix++)
       {
-         if ((res = tcp_socket_recv(socket, buf, sizeof(buf))) == 0)
+         if (clients[ix] >= 0)
          {
-            TRACE("Connection closed");
-            break;
+            FD_SET(clients[ix], &read_fds);
+            if (clients[ix] > maxfd)
+               maxfd = clients[ix];
          }
-         else if (res < 0)
+      }
+      maxfd = gateway_fdset(&read_fds, maxfd);
+      FD_ZERO(&write_fds);
+      maxfd = output_fdset(&write_fds, maxfd);
+
+      // Serial line of transaction on the bus is watched together with the sockets
+      if (bus_req != NULL)
+      {
+         FD_SET(sout, &read_fds);
+         if (sout > maxfd)
+            maxfd = sout;
+      }
+
+      // Wait for request, for end of transaction wait or for nearest timer, only check
+      // sockets when the bus is free and work is queued, or until bus reservation ends
+      wait = -1;
+      if (bus_req != NULL)
+         wait = (bus_txn.deadline > systime_us()) ? bus_txn.deadline - systime_us() : 0;
+      else if (request_pending())
+         wait = request_reserved();
+
+      if ((next = timerwheel_next_expiry()) >= 0)
+      {
+         next = (next > systime_ms()) ? (next - systime_ms()) * 1000 : 0;
+         if (wait < 0 || next < wait)
+            wait = next;
+      }
+
+      pts = NULL;
+      if (wait >= 0)
+      {
+         ts.tv_sec = wait / 1000000;
+         ts.tv_nsec = (wait % 1000000) * 1000;
+         pts = &ts;
+      }
+
+      if ((res = pselect(maxfd + 1, &read_fds, &write_fds, NULL, pts, &waitmask)) < 0)
+      {
+         if (errno != EINTR)
          {
-            TRACE_ERROR("Recv failed");
+            TRACE_ERROR("select failed");
             break;
          }
-         
-         // Set defaul response
-         rsplen = res;
-         
-         // Find modbus server for fix
-         server = find_modbus_server(buf[MODBUS_TCP_ADDR_IDX]);
-         
-         switch(buf[MODBUS_TCP_FUNC_IDX])
+         continue;
+      }
+
+      timerwheel_advance(systime_ms());
+
+      if (res > 0 && FD_ISSET(listen_socket, &read_fds))
+      {
+         if ((socket = tcp_socket_accept(listen_socket, &remote_addr)) < 0)
          {
-            case MODBUS_FUNC_READ_COILS:
-            {
-               uint16_t state = 0;
-               uint16_t start_coil;
-               uint16_t count;
-               
-               start_coil = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
-               count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
-               
-               if (server != NULL)
-               {
-                  state = server->coils_state;
-               }
-               else
-               {
-                  if (modbus_rtu_read_coils_state(sout, buf[MODBUS_TCP_ADDR_IDX], start_coil, count, &state) < 0)
-                  {
-                     TRACE_ERROR("modbus_rtu_read_coils_state failed");
-                     buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
-                  }
-               }
-                              
-               buf[MODBUS_TCP_DATA_IDX] = count / 8;
-               if (count / 8 == 1)
-               {
-                  buf[MODBUS_TCP_DATA_IDX+1] = state;
-               }
-               else
-               {
-                  buf[MODBUS_TCP_DATA_IDX+1] = state >> 8;
-                  buf[MODBUS_TCP_DATA_IDX+2] = state & 0xFF;
-               }
-               
-               rsplen = MODBUS_TCP_HEADER_SIZE + 2 + (count / 8);
-            }
-            break;
-            
-            case MODBUS_FUNC_WRITE_COIL:
+            TRACE_ERROR("Accept connection");
+         }
+         else
+         {
+            for (jx = 0; jx < MAX_CLIENTS_COUNT && clients[jx] >= 0; jx++);
+
+            if (jx == MAX_CLIENTS_COUNT)
             {
-               uint16_t coil, state;
-               
-               coil = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
-               state = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
-
-               if (server != NULL)
-               {
-                  // FIX. china relay board !!!
-                  if (state == 0xFF00)
-                  {
-                     state = 0x100;
-                     server->coils_state |= (1 << coil);
-                  }
-                  else
-                  {
-                     server->coils_state &= ~(1 << coil);
-                  }
-                  
-                  // FIX. china relay board !!!, have to begin from 1
-                  coil++;
-               }
-
-               if (modbus_rtu_write_coil(sout, buf[MODBUS_TCP_ADDR_IDX], coil, state) < 0)
-               {
-                  TRACE_ERROR("modbus_rtu_write_coil failed");
-                  buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
-               }
+               TRACE_ERROR("Too many connections");
+               tcp_socket_close(socket);
             }
-            break;
-            
-            case MODBUS_READ_DISCRETE_INPUTS:
+            else
             {
-               uint16_t start_input, count;
-               uint16_t state = 0;
-               
-               start_input = (buf[MODBUS_TCP_DATA_IDX] << 8) | buf[MODBUS_TCP_DATA_IDX+1];
-               count = (buf[MODBUS_TCP_DATA_IDX+2] << 8) | buf[MODBUS_TCP_DATA_IDX+3];
-
-               if (server != NULL)
-               {
-                  // FIX china relay board !!
-                  start_input = 0;
-                  count = 0;
-               }
-              
-               if (modbus_rtu_read_inputs(sout, buf[MODBUS_TCP_ADDR_IDX], start_input, count, &state) < 0)
-               {
-                  TRACE_ERROR("modbus_rtu_read_inputs failed");
-                  buf[MODBUS_TCP_FUNC_IDX] |= 0x80;
-               }
-
-               if (server != NULL)
-               {
-                  // FIX china relay board !!
-                  start_input = 0;
-                  count = 8;
-               }
-
-               buf[MODBUS_TCP_DATA_IDX] = count / 8;
-               if (count / 8 == 1)
-               {
-                  buf[MODBUS_TCP_DATA_IDX+1] = state;
-               }
+               TRACE("\nNew connection accepted");
+               clients[jx] = socket;
+               if (output_open(jx, socket) < 0)
+                  client_close(jx);
                else
-               {
-                  buf[MODBUS_TCP_DATA_IDX+1] = state >> 8;
-                  buf[MODBUS_TCP_DATA_IDX+2] = state & 0xFF;
-               }
-               
-               rsplen = MODBUS_TCP_HEADER_SIZE + 2 + (count / 8);
+                  request_set_weight(jx, config_client_weight(remote_addr.sin_addr.s_addr));
             }
-            break;
-               
-            default:
-               TRACE_ERROR("Not supported modbus func: 0x%X", buf[MODBUS_TCP_FUNC_IDX]);
-         }
-         
-         // Send response
-         if (tcp_socket_send(socket, buf, rsplen) != rsplen)
-         {
-            TRACE_ERROR("Send response failed");
          }
       }
       
-      tcp_socket_close(socket);
+      for (ix = 0; ix < MAX_CLIENTS_COUNT && res > 0; ix++)
+      {
+         if (clients[ix] >= 0 && FD_ISSET(clients[ix], &read_fds))
+            client_receive(ix);
+      }
+
+      if (res > 0)
+         gateway_poll();
+
+      // One request on the bus at a time, interactive requests first, polling jobs
+      // queued by timers after them. Its transaction is stepped once per pass, clients
+      // are served meanwhile and identical reads attach to it.
+      if (bus_req == NULL && (bus_req = request_dequeue()) != NULL)
+         request_execute(bus_req);
+
+      if (bus_req != NULL && request_step(bus_req, &bus_txn, bus_request) == CORO_DONE)
+      {
+         request_complete(bus_req);
+         bus_req = NULL;
+      }
+
+      clients_flush();
    }
    
    tcp_socket_close(listen_socket);
+   history_close();
+   shmexport_close();
    
    return 0;
 }
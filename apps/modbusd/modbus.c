@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include "trace.h"
+#include "systime.h"
 #include "serial.h"
 #include "modbus.h"
 
@@ -15,8 +16,39 @@
 #include "trace_undef.h"
 #endif
 
-#define CFG_DELAY_AFTER_TX    	      50
 #define CFG_REQUST_RETRY_CNT	         3
+#define CFG_RESYNC_MAX_WAIT            500      // ms, continuously noisy line is flushed anyway
+
+//
+// Turnaround of every device, from end of request frame to first byte of response,
+// is measured with monotonic time. Response is read as soon as it starts, wait for
+// it is limited by quantile of recent turnarounds of the device, so silent device
+// costs little more than its usual response. Timeout doubles the limit of next
+// attempt up to the default used until enough responses are measured.
+//
+#define CFG_RESPONSE_TIMEOUT           250      // ms, device not measured yet or not responding
+#define CFG_RESPONSE_TIMEOUT_MIN       10       // ms
+#define CFG_TURNAROUND_WINDOW          32       // recent turnarounds of device kept
+#define CFG_TURNAROUND_MIN_SAMPLES     8
+#define CFG_TURNAROUND_QUANTILE        95       // percent, base of response timeout
+#define CFG_FRAME_TIMEOUT              250      // ms, silence inside response frame
+
+typedef struct
+{
+   uint32_t window[CFG_TURNAROUND_WINDOW];      // us, ring of recent turnarounds
+   uint32_t samples;
+   uint32_t timeouts;
+   uint32_t max;
+   uint32_t median;
+   uint32_t quantile;
+   uint8_t boost;                               // response timeout shift after timeouts
+
+} modbus_device_t;
+
+static int frame_gap_us = 1750;                 // t3.5 silence of bus baudrate
+static int char_us = 1146;                      // 11 bit character at bus baudrate
+static modbus_bus_stats_t bus_stats;
+static modbus_device_t devices[256];
 
 
 /* Table of CRC values for high-order byte */
@@ -95,189 +127,444 @@ static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
     return (crc_hi << 8 | crc_lo);
 }
 
-int modbus_rtu_read_response(int sd, int rspsize, uint8_t *buf, int bufsize)
+// t3.5 in us, fixed 1750 us above 19200 Bd
+static int modbus_rtu_frame_gap(int baudrate)
 {
-   int length;
-   uint16_t crc_calculated;
-   uint16_t crc_received;
+   return (baudrate > 19200) ? 1750 : (7 * (11000000 / baudrate)) / 2;
+}
 
-   length = rspsize + 2;  // included CRC
+void modbus_rtu_init(int baudrate)
+{
+   frame_gap_us = modbus_rtu_frame_gap(baudrate);
+   char_us = 11000000 / baudrate;
+}
+
+const modbus_bus_stats_t *modbus_rtu_stats(void)
+{
+   return &bus_stats;
+}
+
+// Expected duration of one transaction in us. Request and response frames take
+// 11 bits per byte, device responds after its turnaround, frames are separated
+// by t3.5 silence.
+int modbus_rtu_transaction_time(int baudrate, int reqsize, int rspsize, int turnaround_us)
+{
+   int char_us = 11000000 / baudrate;
+   int t35 = modbus_rtu_frame_gap(baudrate);
 
-   if (serial_read(sd, buf, length) != length)
+   return reqsize * char_us + turnaround_us + rspsize * char_us + t35;
+}
+
+static void modbus_rtu_turnaround_add(modbus_device_t *dev, uint32_t us)
+{
+   uint32_t sorted[CFG_TURNAROUND_WINDOW], tmp;
+   int ix, jx, n;
+
+   dev->window[dev->samples % CFG_TURNAROUND_WINDOW] = us;
+   dev->samples++;
+   dev->boost = 0;
+   if (us > dev->max)
+      dev->max = us;
+
+   n = (dev->samples < CFG_TURNAROUND_WINDOW) ? dev->samples : CFG_TURNAROUND_WINDOW;
+   memcpy(sorted, dev->window, n * sizeof(uint32_t));
+   for (ix = 1; ix < n; ix++)
    {
-      TRACE_ERROR("serial read failed");
-      return -1;
+      tmp = sorted[ix];
+      for (jx = ix; jx > 0 && sorted[jx - 1] > tmp; jx--)
+         sorted[jx] = sorted[jx - 1];
+      sorted[jx] = tmp;
    }
 
-   crc_calculated = crc16(buf, rspsize);
-   crc_received = (buf[length - 2] << 8) | buf[length - 1];
-   
-   if (crc_calculated != crc_received)
+   dev->median = sorted[n / 2];
+   dev->quantile = sorted[(n * CFG_TURNAROUND_QUANTILE - 1) / 100];
+}
+
+// Wait for start of response, twice the usual turnaround of device with t3.5 margin
+static int modbus_rtu_response_timeout(const modbus_device_t *dev)
+{
+   int timeout = CFG_RESPONSE_TIMEOUT * 1000;
+
+   if (dev->samples >= CFG_TURNAROUND_MIN_SAMPLES)
    {
-      TRACE_ERROR("Bad response CRC");
-      return -1;
+      timeout = (2 * dev->quantile + frame_gap_us) << dev->boost;
+      if (timeout < CFG_RESPONSE_TIMEOUT_MIN * 1000)
+         timeout = CFG_RESPONSE_TIMEOUT_MIN * 1000;
+      else if (timeout > CFG_RESPONSE_TIMEOUT * 1000)
+         timeout = CFG_RESPONSE_TIMEOUT * 1000;
    }
-   
-   return rspsize;
+
+   return timeout;
 }
 
-int modbus_rtu_write_request(int sd, int addr, uint8_t func, uint16_t regaddr, uint16_t regdata)
+// Turnaround of device in us, -1 when no request was sent to it yet
+int modbus_rtu_turnaround(int addr, modbus_turnaround_t *stats)
+{
+   const modbus_device_t *dev = &devices[addr & 0xFF];
+
+   if (dev->samples == 0 && dev->timeouts == 0)
+      return -1;
+
+   stats->samples = dev->samples;
+   stats->timeouts = dev->timeouts;
+   stats->median = dev->median;
+   stats->quantile = dev->quantile;
+   stats->max = dev->max;
+   stats->timeout = modbus_rtu_response_timeout(dev);
+
+   return 0;
+}
+
+// Check address and CRC of received RTU frame
+int modbus_rtu_frame_valid(int addr, const uint8_t *buf, int len)
+{
+   if (len < 5 || buf[0] != addr)
+      return 0;
+
+   return crc16((uint8_t *)buf, len - 2) == ((buf[len - 2] << 8) | buf[len - 1]);
+}
+
+// Exception response of 5 bytes with valid CRC
+static int modbus_rtu_exception(const uint8_t *buf, int len)
+{
+   return len == 5 && (buf[MODBUS_RTU_FUNC_IDX] & 0x80) && crc16((uint8_t *)buf, 3) == ((buf[3] << 8) | buf[4]);
+}
+
+// Request frame, count and data of multi-writes follow register address when data is given
+static int modbus_rtu_frame(uint8_t *buf, int addr, uint8_t func, uint16_t regaddr, uint16_t regdata, const uint8_t *data, int datalen)
 {
    int idx = 0;
    uint16_t crc;
-   uint8_t buf[64];
-   
+
    buf[idx++] = addr;
    buf[idx++] = func;
    buf[idx++] = (regaddr >> 8);
    buf[idx++] = regaddr & 0xFF;
    buf[idx++] = (regdata >> 8);
    buf[idx++] = regdata & 0xFF;
-   
+
+   if (data != NULL)
+   {
+      buf[idx++] = datalen;
+      memcpy(&buf[idx], data, datalen);
+      idx += datalen;
+   }
+
    crc = crc16(buf, idx);
    buf[idx++] = crc >> 8;
    buf[idx++] = crc & 0x00FF;
-   
-   return serial_write(sd, buf, idx);
+
+   return idx;
 }
 
+// Send request only, response is read by caller
+int modbus_rtu_write_request(int sd, int addr, uint8_t func, uint16_t regaddr, uint16_t regdata)
+{
+   uint8_t buf[16];
+   int len;
+
+   len = modbus_rtu_frame(buf, addr, func, regaddr, regdata, NULL, 0);
 
-int modbus_rtu_read_coils_state_fix(int sd, int addr, int start_coil, int count, uint16_t *state)
+   return serial_write(sd, buf, len);
+}
+
+// Suspended transaction continues when bytes are received or deadline passes
+static int modbus_txn_ready(modbus_txn_t *txn)
+{
+   return serial_pending(txn->sd) != 0 || systime_us() >= txn->deadline;
+}
+
+// Skip rest of broken frame and bytes of late responses, receiver starts again
+// on the boundary of next frame
+static int modbus_txn_resync(modbus_txn_t *txn)
 {
-   int ix;
    uint8_t buf[64];
-   
-   *state = 0;
-   for (ix = 0; ix < count; ix++)
-   {      
-      // Write request fix request for china relay board (not valid MODBUS !!)
-      if (modbus_rtu_write_request(sd, addr, MODBUS_FUNC_READ_COILS, ix + start_coil, 0x4) < 0)
-         return -1;
-
-      usleep(CFG_DELAY_AFTER_TX * 1000);
-
-      // Read response
-      if (modbus_rtu_read_response(sd, 4, buf, sizeof(buf)) < 0)
-         return -1;
-         
-      if (buf[MODBUS_RTU_DATA_IDX+1])
-         *state |= (1 << ix);
+   int res;
+
+   CORO_BEGIN(&txn->resync);
+
+   txn->discarded = 0;
+   txn->resync_end = systime_us() + CFG_RESYNC_MAX_WAIT * 1000;
+
+   while (systime_us() < txn->resync_end)
+   {
+      // Line silent for t3.5 is frame boundary
+      txn->deadline = systime_us() + frame_gap_us;
+      CORO_AWAIT(&txn->resync, modbus_txn_ready(txn));
+
+      if ((res = serial_read_available(txn->sd, buf, sizeof(buf))) <= 0)
+         break;
+
+      txn->discarded += res;
    }
 
+   serial_flush(txn->sd);
+   bus_stats.resyncs++;
+
+   TRACE_ERROR("Bus resync, %d bytes discarded", txn->discarded);
+
+   CORO_END(&txn->resync);
+}
+
+// Prepare transaction, rspsize is expected response without CRC
+int modbus_txn_init(modbus_txn_t *txn, int sd, int addr, uint8_t func, uint16_t regaddr, uint16_t count, const uint8_t *data, int datalen, int rspsize)
+{
+   if (datalen > MODBUS_RTU_MAX_ADU_SIZE - 9 || rspsize + 2 > MODBUS_RTU_MAX_ADU_SIZE)
+      return -1;
+
+   CORO_INIT(&txn->coro);
+   txn->sd = sd;
+   txn->addr = addr;
+   txn->reqlen = modbus_rtu_frame(txn->req, addr, func, regaddr, count, data, datalen);
+   txn->rsplen = rspsize + 2;
+   txn->received = 0;
+   txn->result = -1;
+
    return 0;
 }
 
-int modbus_rtu_read_coils_state(int sd, int addr, int start_coil, int count, uint16_t *state)
+//
+// Step of transaction does not wait, it suspends on the request on the wire, on
+// the first byte of response within response timeout of the device and on the
+// rest of the frame. Failed attempt is repeated up to retry count. Returns
+// CORO_PENDING while suspended, result is valid when it returns CORO_DONE.
+//
+int modbus_txn_step(modbus_txn_t *txn)
 {
-   int ix, retry, rsplen;
-   uint8_t buf[64];
-   
-   *state = 0;
+   modbus_device_t *dev = &devices[txn->addr];
+   int64_t now;
+   int res;
+
+   CORO_BEGIN(&txn->coro);
 
-   for (retry = 0; retry < CFG_REQUST_RETRY_CNT; retry++)
+   for (txn->retry = 0; txn->retry < CFG_REQUST_RETRY_CNT; txn->retry++)
    {
-      // Write request 
-      if (modbus_rtu_write_request(sd, addr, MODBUS_FUNC_READ_COILS, start_coil, count) < 0)
-         return -1;
+      // Bytes received before request is sent are garbage or late response
+      if (serial_pending(txn->sd) > 0)
+      {
+         bus_stats.noise++;
+         CORO_AWAIT_CALL(&txn->coro, &txn->resync, modbus_txn_resync(txn));
+      }
 
-      usleep(CFG_DELAY_AFTER_TX * 1000);
-         
-      rsplen = 3; // addr + func + size
-      rsplen += count / 8;
+      if (serial_write(txn->sd, txn->req, txn->reqlen) < 0)
+         break;
 
-      // Read response
-      if (modbus_rtu_read_response(sd, rsplen, buf, sizeof(buf)) > 0)
+      // Driver takes frame at once, it is on the wire for its characters time
+      // unless the response already started
+      txn->tx_end = systime_us() + txn->reqlen * char_us;
+      txn->deadline = txn->tx_end;
+      CORO_AWAIT(&txn->coro, modbus_txn_ready(txn));
+
+      txn->deadline = txn->tx_end + modbus_rtu_response_timeout(dev);
+      CORO_AWAIT(&txn->coro, modbus_txn_ready(txn));
+
+      if (serial_pending(txn->sd) == 0)
+      {
+         // Silent slave does not break framing
+         TRACE_ERROR("Unit %d response timeout", txn->addr);
+         bus_stats.timeouts++;
+         dev->timeouts++;
+         if (modbus_rtu_response_timeout(dev) < CFG_RESPONSE_TIMEOUT * 1000)
+            dev->boost++;
+         continue;
+      }
+
+      // First byte is ready when it is received completely
+      now = systime_us() - char_us;
+      modbus_rtu_turnaround_add(dev, (now > txn->tx_end) ? now - txn->tx_end : 0);
+
+      // Rest of frame is read as it comes, exception response ends it early
+      txn->received = 0;
+      while (txn->received < txn->rsplen && !modbus_rtu_exception(txn->rsp, txn->received))
       {
-         *state = buf[MODBUS_RTU_DATA_IDX+1];
-         if (count / 8 == 2)
+         if ((res = serial_read_available(txn->sd, txn->rsp + txn->received, txn->rsplen - txn->received)) < 0)
+            break;
+
+         txn->received += res;
+         if (res == 0)
          {
-            *state <<= 8;
-            *state |= buf[MODBUS_RTU_DATA_IDX+2];
+            txn->deadline = systime_us() + CFG_FRAME_TIMEOUT * 1000;
+            CORO_AWAIT(&txn->coro, modbus_txn_ready(txn));
+
+            if (serial_pending(txn->sd) == 0)
+               break;
          }
-         
-         return 0;
       }
+
+      if (txn->received != txn->rsplen)
+      {
+         // Exception response does not break framing, part of frame does
+         if (modbus_rtu_exception(txn->rsp, txn->received))
+         {
+            TRACE_ERROR("Exception 0x%X response", txn->rsp[MODBUS_RTU_DATA_IDX]);
+         }
+         else
+         {
+            TRACE_ERROR("Response broken, %d of %d bytes", txn->received, txn->rsplen);
+            bus_stats.noise++;
+            CORO_AWAIT_CALL(&txn->coro, &txn->resync, modbus_txn_resync(txn));
+         }
+         continue;
+      }
+
+      if (crc16(txn->rsp, txn->rsplen - 2) != ((txn->rsp[txn->rsplen - 2] << 8) | txn->rsp[txn->rsplen - 1]))
+      {
+         TRACE_ERROR("Bad response CRC");
+         bus_stats.noise++;
+         CORO_AWAIT_CALL(&txn->coro, &txn->resync, modbus_txn_resync(txn));
+         continue;
+      }
+
+      txn->result = 0;
+      CORO_EXIT(&txn->coro);
    }
-        
-   return -1;
+
+   CORO_END(&txn->coro);
 }
 
+// Wait until suspended transaction may continue, blocks the caller
+static void modbus_txn_wait(const modbus_txn_t *txn)
+{
+   int64_t wait;
 
-int modbus_rtu_write_coil(int sd, int addr, int coil, int state)
+   if ((wait = txn->deadline - systime_us()) > 0)
+      serial_wait(txn->sd, wait);
+}
+
+// Drive transaction to its end, waits of the transaction block the caller
+int modbus_txn_run(modbus_txn_t *txn)
 {
-   uint8_t buf[16];
-   int retry;
+   while (modbus_txn_step(txn) == CORO_PENDING)
+      modbus_txn_wait(txn);
 
-   for (retry = 0; retry < CFG_REQUST_RETRY_CNT; retry++)
-   {
-      // Write request fix request 
-      if (modbus_rtu_write_request(sd, addr, MODBUS_FUNC_WRITE_COIL, coil, state) < 0)
-         return -1;
+   return txn->result;
+}
 
-      usleep(CFG_DELAY_AFTER_TX * 1000);
 
-      // Read response
-      if (modbus_rtu_read_response(sd, 6, buf, sizeof(buf)) > 0)
-         return 0;
+// Prepare read of count coils or inputs, reqcount is count field of request, it differs
+// from count only for devices not following the specification (see profile.c)
+int modbus_txn_read_bits(modbus_txn_t *txn, int sd, int addr, uint8_t func, int start, int count, int reqcount)
+{
+   if (count <= 0 || count > MODBUS_MAX_READ_BITS)
+   {
+      TRACE_ERROR("Bad read count %d", count);
+      return -1;
    }
 
-   return -1;
+   // addr + func + size + data
+   return modbus_txn_init(txn, sd, addr, func, start, reqcount, NULL, 0, 3 + (count + 7) / 8);
 }
 
-int modbus_rtu_read_inputs(int sd, int addr, int start_input, int count, uint16_t *state)
+// Points read by completed transaction
+void modbus_txn_get_bits(const modbus_txn_t *txn, int count, bitset_t *state)
 {
-   int retry, rsplen;
-   uint8_t buf[16];
+   bitset_from_bytes(state, &txn->rsp[MODBUS_RTU_DATA_IDX+1], count);
+}
+
+int modbus_txn_write_coil(modbus_txn_t *txn, int sd, int addr, int coil, int state)
+{
+   return modbus_txn_init(txn, sd, addr, MODBUS_FUNC_WRITE_COIL, coil, state, NULL, 0, 6);
+}
+
+int modbus_txn_write_register(modbus_txn_t *txn, int sd, int addr, int regaddr, int value)
+{
+   return modbus_txn_init(txn, sd, addr, MODBUS_FUNC_WRITE_SINGLE_REGISTER, regaddr, value, NULL, 0, 6);
+}
+
+int modbus_txn_write_coils(modbus_txn_t *txn, int sd, int addr, int start_coil, int count, const uint8_t *values)
+{
+   uint8_t data[MODBUS_MAX_WRITE_COILS / 8];
+   int ix;
 
-   for (retry = 0; retry < CFG_REQUST_RETRY_CNT; retry++)
+   if (count <= 0 || count > MODBUS_MAX_WRITE_COILS)
+      return -1;
+
+   memset(data, 0, sizeof(data));
+   for (ix = 0; ix < count; ix++)
    {
-      // Write request fix request 
-      if (modbus_rtu_write_request(sd, addr, MODBUS_READ_DISCRETE_INPUTS, start_input, count) < 0)
-         return -1;
+      if (values[ix])
+         data[ix / 8] |= (1 << (ix % 8));
+   }
 
-      usleep(CFG_DELAY_AFTER_TX * 1000);
-      
-      // fix. bug china reley modules !!!
-      if (count == 0)
-         count = 8;
+   return modbus_txn_init(txn, sd, addr, MODBUS_FUNC_WRITE_MULTIPLE_COILS, start_coil, count, data, (count + 7) / 8, 6);
+}
 
-      rsplen = 3; // addr + func + size
-      rsplen += count / 8;
+int modbus_txn_write_registers(modbus_txn_t *txn, int sd, int addr, int regaddr, int count, const uint16_t *values)
+{
+   uint8_t data[MODBUS_MAX_WRITE_REGISTERS * 2];
+   int ix;
 
-      // Read response
-      if (modbus_rtu_read_response(sd, rsplen, buf, sizeof(buf)) > 0)
-      {
-         *state = buf[MODBUS_RTU_DATA_IDX+1];
-         if (count / 8 == 2)
-         {
-            *state <<= 8;
-            *state |= buf[MODBUS_RTU_DATA_IDX+2];
-         }
-         
-         return 0;
-      }
+   if (count <= 0 || count > MODBUS_MAX_WRITE_REGISTERS)
+      return -1;
+
+   for (ix = 0; ix < count; ix++)
+   {
+      data[ix * 2] = values[ix] >> 8;
+      data[ix * 2 + 1] = values[ix] & 0xFF;
    }
 
-   return -1;
+   return modbus_txn_init(txn, sd, addr, MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS, regaddr, count, data, count * 2, 6);
+}
+
+
+int modbus_rtu_read_bits(int sd, int addr, uint8_t func, int start, int count, int reqcount, bitset_t *state)
+{
+   modbus_txn_t txn;
+
+   if (modbus_txn_read_bits(&txn, sd, addr, func, start, count, reqcount) < 0 || modbus_txn_run(&txn) < 0)
+      return -1;
+
+   modbus_txn_get_bits(&txn, count, state);
+
+   return 0;
+}
+
+int modbus_rtu_read_coils_state(int sd, int addr, int start_coil, int count, bitset_t *state)
+{
+   return modbus_rtu_read_bits(sd, addr, MODBUS_FUNC_READ_COILS, start_coil, count, count, state);
+}
+
+int modbus_rtu_write_coil(int sd, int addr, int coil, int state)
+{
+   modbus_txn_t txn;
+
+   if (modbus_txn_write_coil(&txn, sd, addr, coil, state) < 0)
+      return -1;
+
+   return modbus_txn_run(&txn);
+}
+
+int modbus_rtu_read_inputs(int sd, int addr, int start_input, int count, bitset_t *state)
+{
+   return modbus_rtu_read_bits(sd, addr, MODBUS_READ_DISCRETE_INPUTS, start_input, count, count, state);
 }
 
 int modbus_rtu_write_sigle_register(int sd, int addr, int regaddr, int value)
 {
-   uint8_t buf[16];
-   int retry;
+   modbus_txn_t txn;
 
-   for (retry = 0; retry < CFG_REQUST_RETRY_CNT; retry++)
-   {
-      // Write request fix request 
-      if (modbus_rtu_write_request(sd, addr, MODBUS_FUNC_WRITE_SINGLE_REGISTER, regaddr, value) < 0)
-         return -1;
+   if (modbus_txn_write_register(&txn, sd, addr, regaddr, value) < 0)
+      return -1;
+
+   return modbus_txn_run(&txn);
+}
 
-      usleep(CFG_DELAY_AFTER_TX * 1000);
+int modbus_rtu_write_multiple_coils(int sd, int addr, int start_coil, int count, const uint8_t *values)
+{
+   modbus_txn_t txn;
 
-      // Read response
-      if (modbus_rtu_read_response(sd, 6, buf, sizeof(buf)) > 0)
-         return 0;
-   }
+   if (modbus_txn_write_coils(&txn, sd, addr, start_coil, count, values) < 0)
+      return -1;
+
+   return modbus_txn_run(&txn);
+}
+
+int modbus_rtu_write_multiple_registers(int sd, int addr, int regaddr, int count, const uint16_t *values)
+{
+   modbus_txn_t txn;
+
+   if (modbus_txn_write_registers(&txn, sd, addr, regaddr, count, values) < 0)
+      return -1;
 
-   return -1;
+   return modbus_txn_run(&txn);
 }
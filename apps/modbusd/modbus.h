@@ -2,8 +2,12 @@
 #ifndef _MODBUS_H_
 #define _MODBUS_H_
 
+#include "bitset.h"
+#include "coro.h"
+
 #define MODBUS_TCP_PORT                      502
 #define MODBUS_TCP_HEADER_SIZE               7
+#define MODBUS_TCP_MAX_ADU_SIZE              260
 
 #define MODBUS_TCP_ADDR_IDX                  6
 #define MODBUS_TCP_FUNC_IDX                  7
@@ -13,20 +17,115 @@
 #define MODBUS_RTU_FUNC_IDX                  1
 #define MODBUS_RTU_DATA_IDX                  2
 
+#define MODBUS_RTU_MAX_ADU_SIZE              256
+#define MODBUS_MAX_UNIT                      247
+#define MODBUS_MAX_READ_BITS                 2000
+#define MODBUS_MAX_READ_REGISTERS            125
+#define MODBUS_MAX_WRITE_COILS               1968
+#define MODBUS_MAX_WRITE_REGISTERS           123
+
 #define MODBUS_FUNC_READ_COILS               0x01
 #define MODBUS_READ_DISCRETE_INPUTS          0x02
+#define MODBUS_FUNC_READ_HOLDING_REGISTERS   0x03
+#define MODBUS_FUNC_READ_INPUT_REGISTERS     0x04
 #define MODBUS_FUNC_WRITE_COIL               0x05 
 #define MODBUS_FUNC_WRITE_SINGLE_REGISTER    0x06
+#define MODBUS_FUNC_WRITE_MULTIPLE_COILS     0x0F
+#define MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS 0x10
+
+// Vendor specific functions (user defined function code range)
+#define MODBUS_FUNC_HISTORY_QUERY            0x41
+#define MODBUS_FUNC_SCENE                    0x42
+#define MODBUS_FUNC_TIMER                    0x43
+#define MODBUS_FUNC_RELOAD                   0x44
+#define MODBUS_FUNC_METRICS                  0x45
+#define MODBUS_FUNC_BULK_STATE               0x46
+#define MODBUS_FUNC_CYCLE_QUERY              0x47
+
+#define MODBUS_EXCEPTION_ILLEGAL_FUNCTION    0x01
+#define MODBUS_EXCEPTION_ILLEGAL_ADDRESS     0x02
+#define MODBUS_EXCEPTION_ILLEGAL_VALUE       0x03
+#define MODBUS_EXCEPTION_DEVICE_FAILURE      0x04
+#define MODBUS_EXCEPTION_SERVER_BUSY         0x06
+#define MODBUS_EXCEPTION_GATEWAY_PATH        0x0A
+#define MODBUS_EXCEPTION_GATEWAY_TARGET      0x0B
+
+typedef struct
+{
+   uint32_t timeouts;         // no response
+   uint32_t noise;            // broken frames and unexpected bytes
+   uint32_t resyncs;
+
+} modbus_bus_stats_t;
+
+typedef struct
+{
+   uint32_t samples;          // responses measured
+   uint32_t timeouts;
+   uint32_t median;           // us, turnaround of recent responses
+   uint32_t quantile;         // us, 95th percentile of recent responses
+   uint32_t max;              // us, since start
+   uint32_t timeout;          // us, current wait for response
 
+} modbus_turnaround_t;
+
+//
+// One RTU transaction with its retries, driven by modbus_txn_step() until it
+// returns CORO_DONE. Suspended transaction waits for bytes received on sd or
+// for its deadline, event loop of caller waits for them, modbus_txn_run() is
+// the blocking loop. Transaction is prepared by modbus_txn_init() or by one of
+// modbus_txn_read/write functions, coroutine of caller runs it by
+// MODBUS_TXN_AWAIT().
+//
+typedef struct
+{
+   coro_t coro;               // request, response and retries
+   coro_t resync;             // nested skip of broken frame
+   int sd;
+   uint8_t addr;
+   uint8_t req[MODBUS_RTU_MAX_ADU_SIZE];
+   int reqlen;
+   uint8_t rsp[MODBUS_RTU_MAX_ADU_SIZE];
+   int rsplen;                // expected response with CRC
+   int received;
+   int retry;
+   int discarded;
+   int64_t deadline;          // us, end of current wait
+   int64_t tx_end;            // us, estimated end of request frame on the wire
+   int64_t resync_end;        // us
+   int result;                // 0 response received, -1 failed
+
+} modbus_txn_t;
+
+#define MODBUS_TXN_AWAIT(_c, _txn)  CORO_AWAIT(_c, modbus_txn_step(_txn) == CORO_DONE)
+
+
+void modbus_rtu_init(int baudrate);
+const modbus_bus_stats_t *modbus_rtu_stats(void);
+int modbus_rtu_turnaround(int addr, modbus_turnaround_t *stats);
 
 int modbus_rtu_write_request(int sd, int addr, uint8_t func, uint16_t regaddr, uint16_t regdata);
-int modbus_rtu_read_response(int sd, int rspsize, uint8_t *buf, int bufsize);
+int modbus_rtu_frame_valid(int addr, const uint8_t *buf, int len);
+int modbus_rtu_transaction_time(int baudrate, int reqsize, int rspsize, int turnaround_us);
+
+int modbus_txn_init(modbus_txn_t *txn, int sd, int addr, uint8_t func, uint16_t regaddr, uint16_t count, const uint8_t *data, int datalen, int rspsize);
+int modbus_txn_step(modbus_txn_t *txn);
+int modbus_txn_run(modbus_txn_t *txn);
+
+int modbus_txn_read_bits(modbus_txn_t *txn, int sd, int addr, uint8_t func, int start, int count, int reqcount);
+void modbus_txn_get_bits(const modbus_txn_t *txn, int count, bitset_t *state);
+int modbus_txn_write_coil(modbus_txn_t *txn, int sd, int addr, int coil, int state);
+int modbus_txn_write_register(modbus_txn_t *txn, int sd, int addr, int regaddr, int value);
+int modbus_txn_write_coils(modbus_txn_t *txn, int sd, int addr, int start_coil, int count, const uint8_t *values);
+int modbus_txn_write_registers(modbus_txn_t *txn, int sd, int addr, int regaddr, int count, const uint16_t *values);
 
-int modbus_rtu_read_coils_state_fix(int sd, int addr, int start_coil, int num_coils, uint16_t *state);
-int modbus_rtu_read_coils_state(int sd, int addr, int start_coil, int num_coils, uint16_t *state);
+int modbus_rtu_read_bits(int sd, int addr, uint8_t func, int start, int count, int reqcount, bitset_t *state);
+int modbus_rtu_read_coils_state(int sd, int addr, int start_coil, int num_coils, bitset_t *state);
 int modbus_rtu_write_coil(int sd, int addr, int coil, int state);
-int modbus_rtu_read_inputs(int sout, int addr, int start_input, int count, uint16_t *state);
+int modbus_rtu_read_inputs(int sout, int addr, int start_input, int count, bitset_t *state);
 int modbus_rtu_write_sigle_register(int sd, int addr, int regaddr, int value);
+int modbus_rtu_write_multiple_coils(int sd, int addr, int start_coil, int count, const uint8_t *values);
+int modbus_rtu_write_multiple_registers(int sd, int addr, int regaddr, int count, const uint16_t *values);
 
 
 #endif /* _MODBUS_RTU_H_ */
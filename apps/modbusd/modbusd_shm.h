@@ -0,0 +1,167 @@
+#ifndef __MODBUSD_SHM_H
+#define __MODBUSD_SHM_H
+
+//
+// Coils and inputs state published by modbusd in POSIX shared memory (-M option).
+// Header only reader for local consumers, reads cost no syscall and no bus
+// transaction. Link with -lrt on old glibc.
+//
+// Layout, host byte order, 64 byte aligned blocks:
+//
+//   header   magic(4) version(2) units(2) words(4) pid(4) seq(4) reserved(44)
+//   unit[0..units-1], 1088 bytes each
+//            lock(4) seq(4) time(8, ms since epoch) flags(4) reserved(60)
+//            coils(words * 4) coils_valid(words * 4) inputs(words * 4) inputs_valid(words * 4)
+//
+// Point n of a table is bit n % 32 of word n / 32. Unit block is guarded by
+// seqlock: lock is odd while daemon writes the block, reader copies the block
+// and retries when lock was odd or changed meanwhile. Header seq is sequence of
+// last change of any unit, unit seq is sequence of its last change, 0 when
+// nothing is known about the unit. Flag MODBUSD_SHM_STALE marks state of cached
+// slave kept from previous run of the daemon, not read from the slave yet. Magic is written last on startup and cleared
+// on exit, reader seeing other magic has to open the region again later. Region
+// left by killed daemon keeps its magic, open refuses it and long running reader
+// may test it by modbusd_shm_alive() now and then, it costs a syscall.
+//
+//   const modbusd_shm_t *shm = modbusd_shm_open(MODBUSD_SHM_NAME);
+//   modbusd_shm_unit_t unit;
+//
+//   if (shm != NULL && modbusd_shm_read(shm, 5, &unit) == 0 && modbusd_shm_bit(unit.inputs_valid, 3))
+//      printf("input 3 of unit 5 is %d\n", modbusd_shm_bit(unit.inputs, 3));
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MODBUSD_SHM_NAME            "/modbusd"
+#define MODBUSD_SHM_MAGIC           0x4D53424D  // "MBSM"
+#define MODBUSD_SHM_VERSION         2
+#define MODBUSD_SHM_UNITS           256
+#define MODBUSD_SHM_WORDS           63          // 2000 points of each table
+#define MODBUSD_SHM_RETRIES         1000        // reads of block written meanwhile
+
+// Flags of unit block
+#define MODBUSD_SHM_STALE           0x01        // state from previous run, slave not read yet
+
+typedef struct
+{
+   uint32_t magic;
+   uint16_t version;
+   uint16_t units;
+   uint32_t words;
+   uint32_t pid;              // daemon process
+   uint32_t seq;              // last change of any unit
+   uint8_t reserved[44];
+
+} modbusd_shm_header_t;
+
+typedef struct
+{
+   uint32_t lock;             // seqlock, odd while block is written
+   uint32_t seq;              // sequence of last change, 0 when nothing known
+   int64_t time;              // last change, ms since epoch
+   uint32_t flags;            // MODBUSD_SHM_...
+   uint8_t reserved[60];
+   uint32_t coils[MODBUSD_SHM_WORDS];
+   uint32_t coils_valid[MODBUSD_SHM_WORDS];
+   uint32_t inputs[MODBUSD_SHM_WORDS];
+   uint32_t inputs_valid[MODBUSD_SHM_WORDS];
+
+} modbusd_shm_unit_t;
+
+typedef struct
+{
+   modbusd_shm_header_t header;
+   modbusd_shm_unit_t units[MODBUSD_SHM_UNITS];
+
+} modbusd_shm_t;
+
+
+// Region is valid and its daemon runs
+static inline int modbusd_shm_alive(const modbusd_shm_t *shm)
+{
+   if (__atomic_load_n(&shm->header.magic, __ATOMIC_ACQUIRE) != MODBUSD_SHM_MAGIC)
+      return 0;
+
+   return kill((pid_t)shm->header.pid, 0) == 0 || errno != ESRCH;
+}
+
+// Map published region read only, NULL when daemon does not publish it (yet)
+static inline const modbusd_shm_t *modbusd_shm_open(const char *name)
+{
+   const modbusd_shm_t *shm;
+   void *map;
+   int fd;
+
+   if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+      return NULL;
+
+   map = mmap(NULL, sizeof(modbusd_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+      return NULL;
+
+   shm = (const modbusd_shm_t *)map;
+   if (!modbusd_shm_alive(shm) || shm->header.version != MODBUSD_SHM_VERSION || shm->header.units != MODBUSD_SHM_UNITS ||
+       shm->header.words != MODBUSD_SHM_WORDS)
+   {
+      munmap(map, sizeof(modbusd_shm_t));
+      return NULL;
+   }
+
+   return shm;
+}
+
+static inline void modbusd_shm_close(const modbusd_shm_t *shm)
+{
+   munmap((void *)shm, sizeof(modbusd_shm_t));
+}
+
+// Sequence of last change, cheap test whether anything changed since last read
+static inline uint32_t modbusd_shm_sequence(const modbusd_shm_t *shm)
+{
+   return __atomic_load_n(&shm->header.seq, __ATOMIC_ACQUIRE);
+}
+
+// Consistent copy of unit block. Returns -1 when nothing is known about the unit,
+// -2 when the block did not stay unchanged for any of the retries, -3 when the
+// daemon exited and the region has to be opened again.
+static inline int modbusd_shm_read(const modbusd_shm_t *shm, uint8_t unit, modbusd_shm_unit_t *out)
+{
+   const modbusd_shm_unit_t *u = &shm->units[unit];
+   uint32_t before, after;
+   int retry;
+
+   if (__atomic_load_n(&shm->header.magic, __ATOMIC_ACQUIRE) != MODBUSD_SHM_MAGIC)
+      return -3;
+
+   for (retry = 0; retry < MODBUSD_SHM_RETRIES; retry++)
+   {
+      before = __atomic_load_n(&u->lock, __ATOMIC_ACQUIRE);
+      if (before & 1)
+         continue;
+
+      memcpy(out, (const void *)u, sizeof(modbusd_shm_unit_t));
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&u->lock, __ATOMIC_RELAXED);
+
+      if (before == after)
+         return (out->seq != 0) ? 0 : -1;
+   }
+
+   return -2;
+}
+
+static inline int modbusd_shm_bit(const uint32_t *words, int ix)
+{
+   return (words[ix / 32] >> (ix % 32)) & 1;
+}
+
+#endif // __MODBUSD_SHM_H
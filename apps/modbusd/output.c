@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "request.h"
+#include "output.h"
+
+#if !ENABLE_TRACE_OUTPUT
+#include "trace_undef.h"
+#endif
+
+//
+// Output of client connections. Responses are not sent one by one, they are
+// collected in buffer of connection (user space cork) and written by one writev
+// when the main loop pass is done, so pipelined requests answered in one pass
+// leave in one segment. Sockets are non-blocking with TCP_NODELAY, client not
+// reading its responses stalls only its own connection, overflow of its buffer
+// drops it. Close does not linger, kernel delivers what is left.
+//
+
+typedef struct
+{
+   int sd;                          // -1 when connection is closed
+   int failed;                      // overflow or write error, connection has to be closed
+   int len;                         // bytes waiting in buf
+   int64_t since;                   // us, first waiting response ready
+   output_stats_t stats;
+   uint8_t buf[CFG_OUTPUT_BUFFER_SIZE];
+
+} output_t;
+
+static output_t outputs[REQUEST_MAX_CLIENTS];
+
+
+static output_t *output_get(int client)
+{
+   if (client < 0 || client >= REQUEST_MAX_CLIENTS || outputs[client].sd < 0)
+      return NULL;
+
+   return &outputs[client];
+}
+
+void output_init(void)
+{
+   int ix;
+
+   for (ix = 0; ix < REQUEST_MAX_CLIENTS; ix++)
+      outputs[ix].sd = -1;
+}
+
+// Socket options of accepted connection
+int output_open(int client, int sd)
+{
+   output_t *out;
+   struct linger lin;
+   int one = 1, flags;
+
+   if (client < 0 || client >= REQUEST_MAX_CLIENTS)
+      return -1;
+   out = &outputs[client];
+
+   // Small responses go out at once, batching is done here
+   if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+      TRACE_ERROR("setsockopt TCP_NODELAY failed");
+
+   // Dead peers of long lived connections are found by keepalive
+   if (setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) < 0)
+      TRACE_ERROR("setsockopt SO_KEEPALIVE failed");
+
+   // Close does not block, unsent data is delivered in background
+   lin.l_onoff = 0;
+   lin.l_linger = 0;
+   if (setsockopt(sd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin)) < 0)
+      TRACE_ERROR("setsockopt SO_LINGER failed");
+
+   if ((flags = fcntl(sd, F_GETFL, 0)) < 0 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0)
+   {
+      TRACE_ERROR("Set non-blocking socket failed");
+      return -1;
+   }
+
+   memset(out, 0, sizeof(output_t) - sizeof(out->buf));
+   out->sd = sd;
+
+   return 0;
+}
+
+void output_close(int client)
+{
+   if (client >= 0 && client < REQUEST_MAX_CLIENTS)
+   {
+      outputs[client].sd = -1;
+      outputs[client].len = 0;
+   }
+}
+
+// Write waiting bytes followed by data, not written rest is kept
+static int output_write(output_t *out, const uint8_t *data, int len)
+{
+   struct iovec iov[2];
+   int res, rest, delay;
+
+   iov[0].iov_base = out->buf;
+   iov[0].iov_len = out->len;
+   iov[1].iov_base = (void *)data;
+   iov[1].iov_len = len;
+
+   if ((res = writev(out->sd, iov, 2)) < 0)
+   {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+         TRACE_ERROR("Write to connection failed, errno %d", errno);
+         out->failed = 1;
+         return -1;
+      }
+      res = 0;
+   }
+   out->stats.writes++;
+
+   if (res < out->len)
+   {
+      memmove(out->buf, out->buf + res, out->len - res);
+      out->len -= res;
+      res = 0;
+   }
+   else
+   {
+      res -= out->len;
+      out->len = 0;
+   }
+
+   if ((rest = len - res) > 0)
+   {
+      if (out->len + rest > CFG_OUTPUT_BUFFER_SIZE)
+      {
+         TRACE_ERROR("Connection output overflow, client does not read");
+         out->failed = 1;
+         return -1;
+      }
+
+      memcpy(out->buf + out->len, data + res, rest);
+      out->len += rest;
+      if (out->len > out->stats.peak)
+         out->stats.peak = out->len;
+   }
+
+   if (out->len > 0)
+   {
+      out->stats.stalls++;
+   }
+   else
+   {
+      delay = systime_us() - out->since;
+      out->stats.delay_sum += delay;
+      out->stats.delay_cnt++;
+      if ((uint32_t)delay > out->stats.delay_max)
+         out->stats.delay_max = delay;
+   }
+
+   return 0;
+}
+
+// Queue response, it is written by output_flush() or when buffer is full
+int output_send(int client, const void *buf, int len)
+{
+   output_t *out = output_get(client);
+
+   if (out == NULL || out->failed)
+      return -1;
+
+   if (out->len == 0)
+      out->since = systime_us();
+   out->stats.responses++;
+
+   if (out->len + len > CFG_OUTPUT_BUFFER_SIZE)
+      return output_write(out, buf, len);
+
+   memcpy(out->buf + out->len, buf, len);
+   out->len += len;
+   if (out->len > out->stats.peak)
+      out->stats.peak = out->len;
+
+   return 0;
+}
+
+// Write all waiting responses at once, -1 when connection has to be closed
+int output_flush(int client)
+{
+   output_t *out = output_get(client);
+
+   if (out == NULL)
+      return 0;
+
+   if (out->failed)
+      return -1;
+
+   if (out->len == 0)
+      return 0;
+
+   return output_write(out, NULL, 0);
+}
+
+// Connections with stalled output wait for socket write readiness
+int output_fdset(fd_set *write_fds, int maxfd)
+{
+   int ix;
+
+   for (ix = 0; ix < REQUEST_MAX_CLIENTS; ix++)
+   {
+      if (outputs[ix].sd >= 0 && outputs[ix].len > 0)
+      {
+         FD_SET(outputs[ix].sd, write_fds);
+         if (outputs[ix].sd > maxfd)
+            maxfd = outputs[ix].sd;
+      }
+   }
+
+   return maxfd;
+}
+
+int output_stats(int client, output_stats_t *stats)
+{
+   output_t *out = output_get(client);
+
+   if (out == NULL)
+      return -1;
+
+   *stats = out->stats;
+   stats->queued = out->len;
+
+   return 0;
+}
+
+void output_stats_reset_max(void)
+{
+   int ix;
+
+   for (ix = 0; ix < REQUEST_MAX_CLIENTS; ix++)
+   {
+      outputs[ix].stats.peak = outputs[ix].len;
+      outputs[ix].stats.delay_max = 0;
+   }
+}
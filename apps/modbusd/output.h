@@ -0,0 +1,33 @@
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#define CFG_OUTPUT_BUFFER_SIZE      32768    // bytes of responses waiting for one connection, fits uint16_t
+
+typedef struct
+{
+   uint32_t responses;
+   uint32_t writes;                 // writev calls, responses / writes is batching
+   uint32_t stalls;                 // socket did not take all, rest waits for POLLOUT
+   uint16_t queued;                 // bytes waiting now
+   uint16_t peak;                   // bytes waiting at most, since last reset
+   uint64_t delay_sum;              // us, response ready to written to socket
+   uint32_t delay_cnt;
+   uint32_t delay_max;              // us, since last reset
+
+} output_stats_t;
+
+
+void output_init(void);
+int output_open(int client, int sd);
+void output_close(int client);
+int output_send(int client, const void *buf, int len);
+int output_flush(int client);
+int output_fdset(fd_set *write_fds, int maxfd);
+
+int output_stats(int client, output_stats_t *stats);
+void output_stats_reset_max(void);
+
+#endif // __OUTPUT_H
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "modbus.h"
+#include "server.h"
+#include "poll.h"
+#include "plan.h"
+
+#if !ENABLE_TRACE_PLAN
+#include "trace_undef.h"
+#endif
+
+//
+// Static polling plan built from refresh requirements (point ranges with
+// required period). Requirements of one slave table are merged into single read
+// when it lowers bus load, reads are ordered rate monotonic (shorter period
+// first) and checked by response time analysis of non-preemptive fixed priority
+// scheduling. Transaction cost comes from the RTU time model of the bus, access
+// pattern of device profile and measured turnaround of device (profile one until
+// it responds).
+//
+#define CFG_PLAN_RESERVE            200      // permille of bus time kept for interactive requests
+
+// Points read by one poll item
+#define PLAN_MAX_SPAN(_func)        (plan_registers(_func) ? MODBUS_MAX_READ_REGISTERS : MODBUS_MAX_READ_BITS)
+
+static plan_read_t reqs[CFG_PLAN_MAX_READS];
+static int reqs_cnt = 0;
+static plan_read_t reads[CFG_PLAN_MAX_READS];
+static int reads_cnt = 0;
+static plan_report_t report;
+static int baud = 9600;
+
+
+static int plan_registers(uint8_t func)
+{
+   return func == MODBUS_FUNC_READ_HOLDING_REGISTERS || func == MODBUS_FUNC_READ_INPUT_REGISTERS;
+}
+
+// Turnaround of device in us, measured one is better than the profile one
+static int plan_turnaround(uint8_t unit)
+{
+   modbus_turnaround_t ta;
+
+   if (modbus_rtu_turnaround(unit, &ta) == 0 && ta.samples > 0)
+      return ta.quantile;
+
+   return server_profile(unit)->turnaround * 1000;
+}
+
+// Bus time of one transaction with device in us, frame sizes include address and CRC
+uint32_t plan_transaction_cost(uint8_t unit, int reqsize, int rspsize)
+{
+   return modbus_rtu_transaction_time(baud, reqsize, rspsize, plan_turnaround(unit));
+}
+
+// Bus time of read in us, all transactions of the read in access pattern of device
+uint32_t plan_read_cost(uint8_t unit, uint8_t func, uint16_t count)
+{
+   int n, points;
+
+   // Registers are read in one standard transaction, access patterns are of bits
+   if (plan_registers(func))
+      return plan_transaction_cost(unit, 8, 5 + 2 * count);
+
+   n = profile_read_transactions(server_profile(unit), func, count, &points);
+
+   return n * plan_transaction_cost(unit, 8, 5 + (points + 7) / 8);
+}
+
+static uint32_t plan_cost(const plan_read_t *r)
+{
+   return plan_read_cost(r->unit, r->func, r->count);
+}
+
+// Fraction of bus time used by the read
+static double plan_load(const plan_read_t *r)
+{
+   return (double)r->cost / (r->period * 1000.0);
+}
+
+static int plan_cmp_range(const plan_read_t *a, const plan_read_t *b)
+{
+   if (a->unit != b->unit)
+      return a->unit - b->unit;
+   if (a->func != b->func)
+      return a->func - b->func;
+
+   return a->start - b->start;
+}
+
+static int plan_cmp_period(const plan_read_t *a, const plan_read_t *b)
+{
+   return (a->period > b->period) - (a->period < b->period);
+}
+
+// Stable insertion sort, tables are small
+static void plan_sort(plan_read_t *r, int count, int (*cmp)(const plan_read_t *, const plan_read_t *))
+{
+   plan_read_t tmp;
+   int ix, jx;
+
+   for (ix = 1; ix < count; ix++)
+   {
+      tmp = r[ix];
+      for (jx = ix; jx > 0 && cmp(&r[jx - 1], &tmp) > 0; jx--)
+         r[jx] = r[jx - 1];
+      r[jx] = tmp;
+   }
+}
+
+static void plan_merge(void)
+{
+   plan_read_t *last, merged;
+   int ix, end;
+
+   plan_sort(reqs, reqs_cnt, plan_cmp_range);
+
+   reads_cnt = 0;
+   for (ix = 0; ix < reqs_cnt; ix++)
+   {
+      reqs[ix].cost = plan_cost(&reqs[ix]);
+
+      if (reads_cnt > 0)
+      {
+         last = &reads[reads_cnt - 1];
+         if (last->unit == reqs[ix].unit && last->func == reqs[ix].func)
+         {
+            merged = *last;
+            end = last->start + last->count;
+            if (reqs[ix].start + reqs[ix].count > end)
+               end = reqs[ix].start + reqs[ix].count;
+            merged.count = end - merged.start;
+            if (reqs[ix].period < merged.period)
+               merged.period = reqs[ix].period;
+
+            if (merged.count <= PLAN_MAX_SPAN(merged.func))
+            {
+               merged.cost = plan_cost(&merged);
+               if (plan_load(&merged) <= plan_load(last) + plan_load(&reqs[ix]))
+               {
+                  *last = merged;
+                  continue;
+               }
+            }
+         }
+      }
+
+      reads[reads_cnt++] = reqs[ix];
+   }
+}
+
+// Worst case response time of read ix, blocked by one lower priority transaction
+static uint32_t plan_response_time(int ix)
+{
+   uint64_t blocking = 0, w, next;
+   int jx, iter;
+
+   for (jx = ix + 1; jx < reads_cnt; jx++)
+   {
+      if (reads[jx].cost > blocking)
+         blocking = reads[jx].cost;
+   }
+
+   w = blocking;
+   for (iter = 0; iter < 100; iter++)
+   {
+      next = blocking;
+      for (jx = 0; jx < ix; jx++)
+         next += (w / (reads[jx].period * 1000ULL) + 1) * reads[jx].cost;
+
+      if (next == w || next > reads[ix].period * 1000ULL)
+      {
+         w = next;
+         break;
+      }
+      w = next;
+   }
+
+   return (uint32_t)(w + reads[ix].cost);
+}
+
+void plan_init(int baudrate)
+{
+   baud = baudrate;
+}
+
+void plan_clear(void)
+{
+   reqs_cnt = 0;
+}
+
+int plan_require(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, uint32_t period)
+{
+   plan_read_t *r;
+
+   if (count == 0 || count > PLAN_MAX_SPAN(func) || period == 0)
+   {
+      TRACE_ERROR("Bad poll range %d/%d or period %d", start, count, period);
+      return -1;
+   }
+
+   if (reqs_cnt == CFG_PLAN_MAX_READS)
+   {
+      TRACE_ERROR("Poll requirements maxnum exceeded");
+      return -1;
+   }
+
+   r = &reqs[reqs_cnt++];
+   memset(r, 0, sizeof(plan_read_t));
+   r->unit = unit;
+   r->func = func;
+   r->start = start;
+   r->count = count;
+   r->period = period;
+
+   return 0;
+}
+
+// Returns -1 when the plan is not feasible, it is built anyway
+int plan_build(void)
+{
+   double load = 0;
+   uint32_t offset = 0;
+   int ix;
+
+   plan_merge();
+   plan_sort(reads, reads_cnt, plan_cmp_period);
+
+   memset(&report, 0, sizeof(report));
+   report.reads_cnt = reads_cnt;
+   report.requirements_cnt = reqs_cnt;
+   report.feasible = 1;
+
+   for (ix = 0; ix < reads_cnt; ix++)
+   {
+      load += plan_load(&reads[ix]);
+
+      // Stagger first releases so that reads do not start at once
+      reads[ix].phase = (offset / 1000) % reads[ix].period;
+      offset += reads[ix].cost;
+
+      reads[ix].response = plan_response_time(ix);
+      if (reads[ix].response > reads[ix].period * 1000)
+         report.feasible = 0;
+
+      TRACE("Plan: unit 0x%X func 0x%X %d/%d every %u ms, cost %u us, phase %u ms, response %u us",
+            reads[ix].unit, reads[ix].func, reads[ix].start, reads[ix].count, reads[ix].period,
+            reads[ix].cost, reads[ix].phase, reads[ix].response);
+   }
+
+   report.utilization = (uint32_t)(load * 1000 + 0.5);
+   report.spare = (report.utilization < 1000) ? 1000 - report.utilization : 0;
+   if (report.utilization > 1000 - CFG_PLAN_RESERVE)
+      report.feasible = 0;
+
+   TRACE("Plan: %d requirements in %d reads, bus utilization %u.%u %%, spare %u.%u %%, %s",
+         reqs_cnt, reads_cnt, report.utilization / 10, report.utilization % 10,
+         report.spare / 10, report.spare % 10, report.feasible ? "feasible" : "NOT feasible");
+
+   if (!report.feasible)
+   {
+      TRACE_ERROR("Polling plan is not feasible, bus utilization %u permille", report.utilization);
+      return -1;
+   }
+
+   return 0;
+}
+
+// Polls of the plan replace running ones, removed polls are swept before new
+// ones are added, unchanged polls keep their state and phase
+int plan_apply(void)
+{
+   int ix, res = 0;
+
+   poll_mark();
+   for (ix = 0; ix < reads_cnt; ix++)
+      poll_keep(reads[ix].unit, reads[ix].func, reads[ix].start, reads[ix].count);
+   poll_sweep();
+
+   for (ix = 0; ix < reads_cnt; ix++)
+   {
+      if (poll_add(reads[ix].unit, reads[ix].func, reads[ix].start, reads[ix].count, reads[ix].period, reads[ix].phase) < 0)
+         res = -1;
+   }
+
+   return res;
+}
+
+const plan_report_t *plan_report(void)
+{
+   return &report;
+}
+
+const plan_read_t *plan_get(int ix)
+{
+   return (ix >= 0 && ix < reads_cnt) ? &reads[ix] : NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef __PLAN_H
+#define __PLAN_H
+
+#include <stdint.h>
+
+#define CFG_PLAN_MAX_READS          64
+
+typedef struct
+{
+   uint8_t unit;
+   uint8_t func;              // MODBUS_FUNC_READ_COILS .. MODBUS_FUNC_READ_INPUT_REGISTERS
+   uint16_t start;
+   uint16_t count;
+   uint32_t period;           // ms, shortest period of merged requirements
+   uint32_t cost;             // us, all transactions of the read in access pattern of device
+   uint32_t phase;            // ms, first release offset
+   uint32_t response;         // us, worst case response time
+
+} plan_read_t;
+
+typedef struct
+{
+   int reads_cnt;
+   int requirements_cnt;
+   uint32_t utilization;      // permille of bus time used by polling
+   uint32_t spare;            // permille of bus time left for interactive requests
+   int feasible;
+
+} plan_report_t;
+
+
+void plan_init(int baudrate);
+void plan_clear(void);
+int plan_require(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, uint32_t period);
+int plan_build(void);
+int plan_apply(void);
+
+uint32_t plan_transaction_cost(uint8_t unit, int reqsize, int rspsize);
+uint32_t plan_read_cost(uint8_t unit, uint8_t func, uint16_t count);
+
+const plan_report_t *plan_report(void);
+const plan_read_t *plan_get(int ix);
+
+#endif // __PLAN_H
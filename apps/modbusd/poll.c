@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "server.h"
+#include "history.h"
+#include "snapshot.h"
+#include "rule.h"
+#include "virtual.h"
+#include "request.h"
+#include "poll.h"
+#include "plan.h"
+
+#if !ENABLE_TRACE_POLL
+#include "trace_undef.h"
+#endif
+
+#define CFG_POLL_NOISE_BACKOFF_MAX  8        // max period multiplier on noisy bus
+#define CFG_POLL_NOISE_QUIET        10000    // ms without noise halves the multiplier
+
+static poll_item_t items[CFG_POLL_MAX_ITEMS];
+static profile_read_t poll_op;         // read of executing job, one job runs at a time
+static int bus_sd = -1;
+static int backoff = 1;
+static uint32_t last_noise = 0;
+static int64_t quiet_since = 0;
+
+
+// Noise on the bus doubles poll periods so retries and resyncs do not cascade,
+// quiet bus returns to planned rate step by step
+static void poll_update_backoff(void)
+{
+   const modbus_bus_stats_t *bus = modbus_rtu_stats();
+   int64_t now = systime_ms();
+
+   if (bus->noise != last_noise)
+   {
+      last_noise = bus->noise;
+      quiet_since = now;
+      if (backoff < CFG_POLL_NOISE_BACKOFF_MAX)
+      {
+         backoff *= 2;
+         TRACE_ERROR("Noisy bus, poll periods x%d", backoff);
+      }
+   }
+   else if (backoff > 1 && now - quiet_since >= CFG_POLL_NOISE_QUIET)
+   {
+      backoff /= 2;
+      quiet_since = now;
+      TRACE("Bus quiet, poll periods x%d", backoff);
+   }
+}
+
+
+static int poll_registers(uint8_t func)
+{
+   return func == MODBUS_FUNC_READ_HOLDING_REGISTERS || func == MODBUS_FUNC_READ_INPUT_REGISTERS;
+}
+
+// Background bus job, interactive requests are served first. Registers are
+// operands of virtual slaves only, they are not kept in the snapshot.
+static int poll_job(request_t *req, modbus_txn_t *txn)
+{
+   poll_item_t *item = req->arg;
+
+   CORO_BEGIN(&req->coro);
+
+   // Removed by reload meanwhile, slot may hold new item already
+   if (!item->used || item->dropped)
+   {
+      item->queued = 0;
+      item->dropped = 0;
+      CORO_EXIT(&req->coro);
+   }
+
+   if (poll_registers(item->func))
+   {
+      poll_op.result = -1;
+      if (modbus_txn_init(txn, bus_sd, item->unit, item->func, item->start, item->count, NULL, 0, 3 + 2 * item->count) == 0)
+      {
+         MODBUS_TXN_AWAIT(&req->coro, txn);
+         poll_op.result = txn->result;
+      }
+   }
+   else if (profile_read_init(&poll_op, bus_sd, server_profile(item->unit), item->unit, item->func, item->start, item->count) == 0)
+   {
+      CORO_AWAIT_CALL(&req->coro, &poll_op.coro, profile_read_step(&poll_op, txn));
+   }
+
+   item->queued = 0;
+   poll_update_backoff();
+
+   if (item->dropped)
+   {
+      item->dropped = 0;
+      CORO_EXIT(&req->coro);
+   }
+
+   if (poll_op.result < 0)
+   {
+      TRACE_ERROR("Poll unit 0x%X func 0x%X failed", item->unit, item->func);
+      item->errors++;
+      CORO_EXIT(&req->coro);
+   }
+
+   if (poll_registers(item->func))
+   {
+      item->valid = 1;
+      virtual_process_registers(item->unit, item->func, item->start, item->count, &txn->rsp[MODBUS_RTU_DATA_IDX + 1]);
+      CORO_EXIT(&req->coro);
+   }
+
+   if (!item->valid || bitset_diff(&poll_op.state, &item->state, item->count, NULL) > 0)
+   {
+      TRACE("Poll unit 0x%X func 0x%X state 0x%X", item->unit, item->func, poll_op.state.words[0]);
+   }
+
+   item->state = poll_op.state;
+   item->valid = 1;
+
+   history_record_bits(item->unit, item->func, item->start, item->count, &poll_op.state);
+   snapshot_store_bits(item->unit, item->func, item->start, item->count, &poll_op.state);
+   rule_process(item->unit, item->func, item->start, item->count, &poll_op.state);
+
+   CORO_END(&req->coro);
+}
+
+static void poll_timer_cb(wheel_timer_t *timer, void *arg)
+{
+   poll_item_t *item = arg;
+   uint32_t period = item->period * backoff;
+
+   // Drift free period, skip missed periods after long bus transactions
+   timer_add(timer, timer->expires + period);
+   if (timer->expires <= systime_ms())
+      timer_add(timer, systime_ms() + period);
+
+   // Previous read still waits for the bus or runs
+   if (item->queued)
+   {
+      item->overruns++;
+      return;
+   }
+
+   // Refused over budget of background class, skips the period as well
+   if (request_submit_job(REQUEST_CLASS_BACKGROUND, plan_read_cost(item->unit, item->func, item->count), poll_job, item) == 0)
+      item->queued = 1;
+   else
+      item->overruns++;
+}
+
+int poll_init(int sd)
+{
+   bus_sd = sd;
+   memset(items, 0, sizeof(items));
+
+   return 0;
+}
+
+// Current period multiplier, 1 on quiet bus
+int poll_backoff(void)
+{
+   return backoff;
+}
+
+static poll_item_t *poll_find(uint8_t unit, uint8_t func, uint16_t start, uint16_t count)
+{
+   int ix;
+
+   for (ix = 0; ix < CFG_POLL_MAX_ITEMS; ix++)
+   {
+      if (items[ix].used && items[ix].unit == unit && items[ix].func == func &&
+          items[ix].start == start && items[ix].count == count)
+         return &items[ix];
+   }
+
+   return NULL;
+}
+
+// Add poll item of the plan, unchanged item keeps its state and phase
+int poll_add(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, uint32_t period, uint32_t phase)
+{
+   poll_item_t *item;
+   uint8_t queued;
+   int ix;
+
+   if (count == 0 || count > MODBUS_MAX_READ_BITS || period == 0)
+   {
+      TRACE_ERROR("Bad poll range %d/%d or period %d", start, count, period);
+      return -1;
+   }
+
+   if ((item = poll_find(unit, func, start, count)) != NULL)
+   {
+      item->mark = 0;
+      if (item->period == period)
+         return 0;
+   }
+   else
+   {
+      for (ix = 0; ix < CFG_POLL_MAX_ITEMS && items[ix].used; ix++);
+
+      if (ix == CFG_POLL_MAX_ITEMS)
+      {
+         TRACE_ERROR("Poll items maxnum exceeded");
+         return -1;
+      }
+
+      // Queued job of removed item finds its slot taken and does nothing
+      item = &items[ix];
+      queued = item->queued;
+      memset(item, 0, sizeof(poll_item_t));
+      item->queued = queued;
+      item->dropped = queued;
+      item->used = 1;
+      item->unit = unit;
+      item->func = func;
+      item->start = start;
+      item->count = count;
+      timer_init(&item->timer, poll_timer_cb, item);
+   }
+
+   item->period = period;
+
+   timer_add(&item->timer, systime_ms() + phase);
+
+   return 0;
+}
+
+void poll_mark(void)
+{
+   int ix;
+
+   for (ix = 0; ix < CFG_POLL_MAX_ITEMS; ix++)
+      items[ix].mark = items[ix].used;
+}
+
+// Unchanged item of the new plan is not swept
+void poll_keep(uint8_t unit, uint8_t func, uint16_t start, uint16_t count)
+{
+   poll_item_t *item;
+
+   if ((item = poll_find(unit, func, start, count)) != NULL)
+      item->mark = 0;
+}
+
+void poll_sweep(void)
+{
+   int ix;
+
+   for (ix = 0; ix < CFG_POLL_MAX_ITEMS; ix++)
+   {
+      if (items[ix].used && items[ix].mark)
+      {
+         TRACE("Poll unit 0x%X func 0x%X removed", items[ix].unit, items[ix].func);
+         timer_del(&items[ix].timer);
+         items[ix].used = 0;
+      }
+   }
+}
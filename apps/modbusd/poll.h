@@ -0,0 +1,38 @@
+#ifndef __POLL_H
+#define __POLL_H
+
+#include <stdint.h>
+
+#include "timerwheel.h"
+#include "bitset.h"
+
+#define CFG_POLL_MAX_ITEMS          64
+
+typedef struct
+{
+   wheel_timer_t timer;
+   uint8_t used;
+   uint8_t mark;              // reload sweep mark
+   uint8_t unit;
+   uint8_t func;              // MODBUS_FUNC_READ_COILS .. MODBUS_FUNC_READ_INPUT_REGISTERS
+   uint16_t start;
+   uint16_t count;
+   uint32_t period;           // ms
+   bitset_t state;            // coils or inputs, registers are passed to virtual slaves
+   uint8_t valid;
+   uint8_t queued;            // read job waits for the bus or runs
+   uint8_t dropped;           // queued job belongs to removed item of this slot
+   uint32_t errors;
+   uint32_t overruns;         // periods skipped, previous read not done yet or refused
+
+} poll_item_t;
+
+
+int poll_init(int sd);
+int poll_backoff(void);
+int poll_add(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, uint32_t period, uint32_t phase);
+void poll_mark(void);
+void poll_keep(uint8_t unit, uint8_t func, uint16_t start, uint16_t count);
+void poll_sweep(void);
+
+#endif // __POLL_H
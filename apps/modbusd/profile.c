@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "modbus.h"
+#include "profile.h"
+
+#if !ENABLE_TRACE_PROFILE
+#include "trace_undef.h"
+#endif
+
+//
+// Device profiles describe how a device model deviates from the Modbus
+// specification: address offsets, supported functions, batch sizes and
+// response timing. Every bus access of a slave goes through its profile, so
+// quirks of a model are in one table entry instead of branches over the code.
+// Configuration may define more profiles based on the built in ones.
+//
+#define PROFILE_STANDARD_FUNCS      (PROFILE_FUNC(MODBUS_FUNC_READ_COILS) | PROFILE_FUNC(MODBUS_READ_DISCRETE_INPUTS) | \
+                                     PROFILE_FUNC(MODBUS_FUNC_READ_HOLDING_REGISTERS) | PROFILE_FUNC(0x04) | \
+                                     PROFILE_FUNC(MODBUS_FUNC_WRITE_COIL) | PROFILE_FUNC(MODBUS_FUNC_WRITE_SINGLE_REGISTER) | \
+                                     PROFILE_FUNC(MODBUS_FUNC_WRITE_MULTIPLE_COILS) | PROFILE_FUNC(MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS))
+#define PROFILE_BITWISE_COUNT       4        // count field of bitwise read request
+
+static const profile_t profiles[] =
+{
+   {
+      .name = "standard",
+      .funcs = PROFILE_STANDARD_FUNCS,
+      .coil_read = PROFILE_READ_RANGE,
+      .input_read = PROFILE_READ_RANGE,
+      .coil_on = 0xFF00,
+      .max_read = MODBUS_MAX_READ_BITS,
+      .max_write_coils = MODBUS_MAX_WRITE_COILS,
+      .max_write_registers = MODBUS_MAX_WRITE_REGISTERS,
+      .turnaround = 10,
+   },
+   {
+      // China relay board, coils are numbered from 1 and read one by one,
+      // zero count input read returns all 8 inputs
+      .name = "china-relay",
+      .funcs = PROFILE_FUNC(MODBUS_FUNC_READ_COILS) | PROFILE_FUNC(MODBUS_READ_DISCRETE_INPUTS) |
+               PROFILE_FUNC(MODBUS_FUNC_WRITE_COIL) | PROFILE_FUNC(MODBUS_FUNC_WRITE_SINGLE_REGISTER),
+      .coil_read = PROFILE_READ_BITWISE,
+      .input_read = PROFILE_READ_ALL,
+      .cached = 1,
+      .coils = 8,
+      .inputs = 8,
+      .coil_offset = 1,
+      .coil_on = 0x100,
+      .max_read = 8,
+      .turnaround = 10,
+   },
+};
+
+#define PROFILES_COUNT              (int)(sizeof(profiles) / sizeof(profiles[0]))
+
+
+const profile_t *profile_default(void)
+{
+   return &profiles[0];
+}
+
+const profile_t *profile_find(const char *name)
+{
+   int ix;
+
+   for (ix = 0; ix < PROFILES_COUNT; ix++)
+   {
+      if (!strcmp(profiles[ix].name, name))
+         return &profiles[ix];
+   }
+
+   return NULL;
+}
+
+int profile_supports(const profile_t *profile, uint8_t func)
+{
+   return func < 32 && (profile->funcs & PROFILE_FUNC(func)) != 0;
+}
+
+// Number of bus transactions reading count points, points of one response
+int profile_read_transactions(const profile_t *profile, uint8_t func, int count, int *points)
+{
+   uint8_t mode = (func == MODBUS_FUNC_READ_COILS) ? profile->coil_read : profile->input_read;
+   int n;
+
+   switch (mode)
+   {
+      case PROFILE_READ_BITWISE:
+         *points = PROFILE_BITWISE_COUNT;
+         return count;
+
+      case PROFILE_READ_ALL:
+         *points = (func == MODBUS_FUNC_READ_COILS) ? profile->coils : profile->inputs;
+         return 1;
+
+      default:
+         n = (count + profile->max_read - 1) / profile->max_read;
+         *points = (count + n - 1) / n;
+         return n;
+   }
+}
+
+// Prepare read of count coils or inputs from start in access pattern of device
+int profile_read_init(profile_read_t *op, int sd, const profile_t *profile, int addr, uint8_t func, int start, int count)
+{
+   int limit = (func == MODBUS_FUNC_READ_COILS) ? profile->coils : profile->inputs;
+
+   op->result = -1;
+
+   if (count <= 0 || count > MODBUS_MAX_READ_BITS || (limit > 0 && start + count > limit))
+   {
+      TRACE_ERROR("Read %d/%d out of range of unit 0x%X (%s)", start, count, addr, profile->name);
+      return -1;
+   }
+
+   // Profile of slave may be replaced by reload while the read runs
+   CORO_INIT(&op->coro);
+   op->sd = sd;
+   op->profile = *profile;
+   op->addr = addr;
+   op->func = func;
+   op->start = start;
+   op->count = count;
+
+   return 0;
+}
+
+// Read takes one or more transactions run in txn, op->state is valid when op->result is 0
+int profile_read_step(profile_read_t *op, modbus_txn_t *txn)
+{
+   uint8_t mode = (op->func == MODBUS_FUNC_READ_COILS) ? op->profile.coil_read : op->profile.input_read;
+   int limit = (op->func == MODBUS_FUNC_READ_COILS) ? op->profile.coils : op->profile.inputs;
+   bitset_t part;
+
+   CORO_BEGIN(&op->coro);
+
+   if (mode == PROFILE_READ_BITWISE)
+   {
+      bitset_clear(&op->state);
+      for (op->ix = 0; op->ix < op->count; op->ix++)
+      {
+         // Not valid Modbus, state of one coil comes in whole response byte
+         modbus_txn_read_bits(txn, op->sd, op->addr, op->func, op->start + op->ix, PROFILE_BITWISE_COUNT, PROFILE_BITWISE_COUNT);
+         MODBUS_TXN_AWAIT(&op->coro, txn);
+         if (txn->result < 0)
+            CORO_EXIT(&op->coro);
+
+         modbus_txn_get_bits(txn, PROFILE_BITWISE_COUNT, &part);
+         bitset_put(&op->state, op->ix, (part.words[0] & 0xFF) != 0);
+      }
+   }
+   else if (mode == PROFILE_READ_ALL)
+   {
+      if (modbus_txn_read_bits(txn, op->sd, op->addr, op->func, 0, limit, 0) < 0)
+         CORO_EXIT(&op->coro);
+      MODBUS_TXN_AWAIT(&op->coro, txn);
+      if (txn->result < 0)
+         CORO_EXIT(&op->coro);
+
+      modbus_txn_get_bits(txn, limit, &part);
+      bitset_clear(&op->state);
+      bitset_copy(&op->state, 0, &part, op->start, op->count);
+   }
+   else
+   {
+      for (op->ix = 0; op->ix < op->count; op->ix += op->n)
+      {
+         op->n = (op->count - op->ix < op->profile.max_read) ? op->count - op->ix : op->profile.max_read;
+         modbus_txn_read_bits(txn, op->sd, op->addr, op->func, op->start + op->ix, op->n, op->n);
+         MODBUS_TXN_AWAIT(&op->coro, txn);
+         if (txn->result < 0)
+            CORO_EXIT(&op->coro);
+
+         modbus_txn_get_bits(txn, op->n, &part);
+         if (op->ix == 0)
+            op->state = part;
+         else
+            bitset_copy(&op->state, op->ix, &part, 0, op->n);
+      }
+   }
+
+   op->result = 0;
+
+   CORO_END(&op->coro);
+}
+
+int profile_txn_write_coil(modbus_txn_t *txn, int sd, const profile_t *profile, int addr, int coil, int on)
+{
+   if (profile->coils > 0 && coil >= profile->coils)
+   {
+      TRACE_ERROR("Coil %d out of range of unit 0x%X (%s)", coil, addr, profile->name);
+      return -1;
+   }
+
+   return modbus_txn_write_coil(txn, sd, addr, coil + profile->coil_offset, on ? profile->coil_on : 0);
+}
+
+// Returns -1 without bus access when device is not able to write count coils at once
+int profile_txn_write_coils(modbus_txn_t *txn, int sd, const profile_t *profile, int addr, int start, int count, const uint8_t *values)
+{
+   if (count > profile->max_write_coils || (profile->coils > 0 && start + count > profile->coils))
+      return -1;
+
+   return modbus_txn_write_coils(txn, sd, addr, start + profile->coil_offset, count, values);
+}
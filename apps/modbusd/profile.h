@@ -0,0 +1,67 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdint.h>
+
+#include "bitset.h"
+#include "modbus.h"
+
+#define PROFILE_NAME_SIZE           16
+
+// How coils or inputs of device are read
+#define PROFILE_READ_RANGE          0        // standard read of requested range, max_read points at most
+#define PROFILE_READ_BITWISE        1        // one point per request, any bit of response byte set means on
+#define PROFILE_READ_ALL            2        // zero count read returns all points of device
+
+#define PROFILE_FUNC(_func)         (1UL << (_func))
+
+// Quirks of device model, copied to every slave using it
+typedef struct
+{
+   char name[PROFILE_NAME_SIZE];
+   uint32_t funcs;            // mask of supported function codes
+   uint8_t coil_read;         // PROFILE_READ_...
+   uint8_t input_read;
+   uint8_t cached;            // coils state is kept by daemon, device is read in background
+   uint16_t coils;            // coils of device, 0 when not known
+   uint16_t inputs;           // inputs of device, 0 when not known
+   uint16_t coil_offset;      // added to coil address of write requests
+   uint16_t coil_on;          // FC05 value of switched on coil
+   uint16_t max_read;         // points of one FC01/FC02 read
+   uint16_t max_write_coils;  // points of one FC0F write
+   uint16_t max_write_registers;
+   uint16_t turnaround;       // ms, response delay assumed until device is measured
+
+} profile_t;
+
+// Read of coils or inputs in access pattern of device, coroutine
+typedef struct
+{
+   coro_t coro;
+   int sd;
+   profile_t profile;
+   int addr;
+   uint8_t func;
+   int start;
+   int count;
+   int ix;                    // points read
+   int n;                     // points of current transaction
+   int result;                // 0 state is read, -1 failed
+   bitset_t state;
+
+} profile_read_t;
+
+
+const profile_t *profile_default(void);
+const profile_t *profile_find(const char *name);
+
+int profile_supports(const profile_t *profile, uint8_t func);
+int profile_read_transactions(const profile_t *profile, uint8_t func, int count, int *points);
+
+int profile_read_init(profile_read_t *op, int sd, const profile_t *profile, int addr, uint8_t func, int start, int count);
+int profile_read_step(profile_read_t *op, modbus_txn_t *txn);
+
+int profile_txn_write_coil(modbus_txn_t *txn, int sd, const profile_t *profile, int addr, int coil, int on);
+int profile_txn_write_coils(modbus_txn_t *txn, int sd, const profile_t *profile, int addr, int start, int count, const uint8_t *values);
+
+#endif // __PROFILE_H
@@ -0,0 +1,631 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "request.h"
+#include "output.h"
+
+#if !ENABLE_TRACE_REQUEST
+#include "trace_undef.h"
+#endif
+
+//
+// Queue of work waiting for the bus. Every class has FIFO per client connection
+// (internal jobs use the extra last one). Classes are served by strict priority,
+// lower class is served anyway when its oldest entry waits longer than the class
+// aging limit, so background polling is delayed but never starved. Inside class
+// the connections are served weighted round robin.
+//
+// Identical reads (same unit, function and range) are single flight: a read
+// arriving while an identical one is queued or executing attaches to it as
+// follower and gets a copy of its response, so bus load follows distinct data,
+// not number of clients.
+//
+// Transactions and their frames come from fixed pools allocated once at startup,
+// nothing is allocated per request. Exhausted pool refuses new work, the caller
+// answers client with server busy exception and polling skips its period.
+//
+// Admission control keeps queue delay within latency budget of the class. Every
+// request carries its bus time from the RTU time model, queue delay of new work
+// is the model time queued in its own and higher classes, scaled by measured
+// ratio of real bus time to the model (retries and silent devices). Work which
+// would not meet the budget is refused the same way as on exhausted pool, so
+// overload shows up as quick busy answers instead of timeouts at the client.
+//
+// Bus may be reserved for time aligned work: no request is dequeued before the
+// reservation ends, request running meanwhile finishes, so the work queued for
+// it starts on a free bus without anybody waiting on the bus itself.
+//
+#define CFG_REQUEST_READ_AGING      500      // ms
+#define CFG_REQUEST_BACKGROUND_AGING 2000    // ms
+#define CFG_REQUEST_POOL_TRANSACTIONS 128    // default, pool statement of config overrides
+#define CFG_REQUEST_POOL_FRAMES     64
+#define CFG_REQUEST_WRITE_BUDGET    300      // ms, defaults, budget statement of config overrides
+#define CFG_REQUEST_READ_BUDGET     1000
+#define CFG_REQUEST_BACKGROUND_BUDGET 0      // polling skips periods by itself
+#define CFG_REQUEST_SCALE_MIN       250      // permille
+#define CFG_REQUEST_SCALE_MAX       16000
+
+#define REQUEST_QUEUES              (REQUEST_MAX_CLIENTS + 1)
+#define REQUEST_INTERNAL            REQUEST_MAX_CLIENTS
+
+typedef struct
+{
+   request_t *head;
+   request_t *tail;
+
+} request_queue_t;
+
+typedef struct
+{
+   request_queue_t queues[REQUEST_QUEUES];
+   int current;                     // round robin position
+   int credit;                      // requests left for current queue
+
+} request_class_t;
+
+static request_class_t classes[REQUEST_CLASSES];
+static int weights[REQUEST_QUEUES] = {1, 1, 1, 1, 1, 1, 1, 1, 1};
+static const int aging[REQUEST_CLASSES] = {0, CFG_REQUEST_READ_AGING, CFG_REQUEST_BACKGROUND_AGING};
+static const uint32_t default_budgets[REQUEST_CLASSES] = {CFG_REQUEST_WRITE_BUDGET, CFG_REQUEST_READ_BUDGET, CFG_REQUEST_BACKGROUND_BUDGET};
+static request_t *executing = NULL;
+static int64_t executing_start;     // us
+static int64_t reserved_until = 0;  // us, no request is dequeued before
+static request_stats_t stats = {.scale = 1000, .classes = {{.budget = CFG_REQUEST_WRITE_BUDGET}, {.budget = CFG_REQUEST_READ_BUDGET}, {.budget = CFG_REQUEST_BACKGROUND_BUDGET}}};
+static request_t *free_transactions = NULL;
+static request_frame_t *free_frames = NULL;
+
+
+static uint8_t request_class_of(uint8_t func)
+{
+   switch (func)
+   {
+      case MODBUS_FUNC_WRITE_COIL:
+      case MODBUS_FUNC_WRITE_SINGLE_REGISTER:
+      case MODBUS_FUNC_WRITE_MULTIPLE_COILS:
+      case MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS:
+      case MODBUS_FUNC_SCENE:
+      case MODBUS_FUNC_TIMER:
+      case MODBUS_FUNC_RELOAD:
+         return REQUEST_CLASS_WRITE;
+
+      default:
+         return REQUEST_CLASS_READ;
+   }
+}
+
+static int request_shareable(const request_t *req)
+{
+   uint8_t func = req->buf[MODBUS_TCP_FUNC_IDX];
+
+   return req->len == MODBUS_TCP_DATA_IDX + 4 &&
+          (func == MODBUS_FUNC_READ_COILS || func == MODBUS_READ_DISCRETE_INPUTS);
+}
+
+// Same unit, function and range
+static int request_same_read(const request_t *a, const request_t *b)
+{
+   return a->shareable && b->shareable && !memcmp(a->key, b->key, REQUEST_KEY_SIZE);
+}
+
+static request_t *request_find_leader(const request_t *req)
+{
+   request_t *r;
+   int cls, q;
+
+   if (executing != NULL && request_same_read(executing, req))
+      return executing;
+
+   for (cls = 0; cls < REQUEST_CLASSES; cls++)
+   {
+      for (q = 0; q < REQUEST_QUEUES; q++)
+      {
+         for (r = classes[cls].queues[q].head; r != NULL; r = r->next)
+         {
+            if (request_same_read(r, req))
+               return r;
+         }
+      }
+   }
+
+   return NULL;
+}
+
+static void request_pool_take(request_pool_stats_t *pool)
+{
+   if (++pool->used > pool->peak)
+      pool->peak = pool->used;
+}
+
+static request_t *request_get(int frame)
+{
+   request_t *req = free_transactions;
+   request_frame_t *f = free_frames;
+
+   if (req == NULL || (frame && f == NULL))
+   {
+      if (req == NULL)
+         stats.transactions.exhausted++;
+      else
+         stats.frames.exhausted++;
+      return NULL;
+   }
+
+   free_transactions = req->next;
+   memset(req, 0, sizeof(request_t));
+   request_pool_take(&stats.transactions);
+
+   if (frame)
+   {
+      free_frames = f->next;
+      req->buf = f->buf;
+      request_pool_take(&stats.frames);
+   }
+
+   return req;
+}
+
+static void request_free(request_t *req)
+{
+   request_frame_t *f;
+
+   if (req->buf != NULL)
+   {
+      f = (request_frame_t *)req->buf;
+      f->next = free_frames;
+      free_frames = f;
+      stats.frames.used--;
+   }
+
+   req->next = free_transactions;
+   free_transactions = req;
+   stats.transactions.used--;
+}
+
+// Allocate pools, sizes <= 0 select defaults. Called once, pools are never resized.
+int request_pool_init(int transactions, int frames)
+{
+   request_t *reqs;
+   request_frame_t *slab;
+   int ix;
+
+   if (stats.transactions.size > 0)
+      return 0;
+
+   if (transactions <= 0)
+      transactions = CFG_REQUEST_POOL_TRANSACTIONS;
+   if (frames <= 0)
+      frames = CFG_REQUEST_POOL_FRAMES;
+   if (transactions > 0xFFFF)
+      transactions = 0xFFFF;
+   if (frames > transactions)
+      frames = transactions;
+
+   if ((reqs = calloc(transactions, sizeof(request_t))) == NULL ||
+       (slab = calloc(frames, sizeof(request_frame_t))) == NULL)
+   {
+      TRACE_ERROR("Alloc request pool failed");
+      free(reqs);
+      return -1;
+   }
+
+   for (ix = transactions - 1; ix >= 0; ix--)
+   {
+      reqs[ix].next = free_transactions;
+      free_transactions = &reqs[ix];
+   }
+
+   for (ix = frames - 1; ix >= 0; ix--)
+   {
+      slab[ix].next = free_frames;
+      free_frames = &slab[ix];
+   }
+
+   stats.transactions.size = transactions;
+   stats.frames.size = frames;
+
+   TRACE("Request pool %d transactions, %d frames", transactions, frames);
+
+   return 0;
+}
+
+request_t *request_alloc(int client, const uint8_t *buf, int len)
+{
+   request_t *req;
+
+   if (len < MODBUS_TCP_HEADER_SIZE + 1 || len > REQUEST_FRAME_SIZE)
+      return NULL;
+
+   if ((req = request_get(1)) == NULL)
+   {
+      TRACE("Request pool exhausted");
+      return NULL;
+   }
+
+   req->client = client;
+   req->len = len;
+   memcpy(req->buf, buf, len);
+   req->cls = request_class_of(req->buf[MODBUS_TCP_FUNC_IDX]);
+
+   if ((req->shareable = request_shareable(req)) != 0)
+      memcpy(req->key, &req->buf[MODBUS_TCP_ADDR_IDX], REQUEST_KEY_SIZE);
+
+   return req;
+}
+
+// Estimated queue delay of new request of the class in us. Strict priority
+// serves queued work of higher classes and of the own class first.
+uint32_t request_estimate(int cls)
+{
+   uint64_t work = 0;
+   int ix;
+
+   for (ix = 0; ix <= cls && ix < REQUEST_CLASSES; ix++)
+      work += stats.classes[ix].work;
+
+   work = work * stats.scale / 1000 + request_reserved();
+
+   return (work > UINT32_MAX) ? UINT32_MAX : (uint32_t)work;
+}
+
+static int request_over_budget(uint8_t cls, uint32_t cost)
+{
+   request_class_stats_t *cs = &stats.classes[cls];
+
+   if (cs->budget == 0 || request_estimate(cls) + (uint64_t)cost * stats.scale / 1000 <= (uint64_t)cs->budget * 1000)
+      return 0;
+
+   cs->refused++;
+   TRACE("Class %d over budget %u ms, queued %u us", cls, cs->budget, request_estimate(cls));
+
+   return 1;
+}
+
+// Returns -1 when request would wait longer than budget of its class
+int request_admit(request_t *req)
+{
+   // Attached to identical read, costs no bus time
+   if (req->shareable && request_find_leader(req) != NULL)
+      return 0;
+
+   return request_over_budget(req->cls, req->cost) ? -1 : 0;
+}
+
+int request_submit_job(uint8_t cls, uint32_t cost, request_step_t job, void *arg)
+{
+   request_t *req;
+
+   if (cls >= REQUEST_CLASSES || request_over_budget(cls, cost) || (req = request_get(0)) == NULL)
+      return -1;
+
+   req->client = -1;
+   req->cls = cls;
+   req->cost = cost;
+   req->job = job;
+   req->arg = arg;
+   request_enqueue(req);
+
+   return 0;
+}
+
+void request_enqueue(request_t *req)
+{
+   request_queue_t *queue;
+   request_t *leader;
+
+   req->enqueued = systime_us();
+   req->next = NULL;
+
+   if (req->job == NULL)
+   {
+      stats.requests++;
+
+      if (req->shareable && (leader = request_find_leader(req)) != NULL)
+      {
+         TRACE("Request unit 0x%X func 0x%X attached to in flight read", req->buf[MODBUS_TCP_ADDR_IDX], req->buf[MODBUS_TCP_FUNC_IDX]);
+         req->next = leader->followers;
+         leader->followers = req;
+         stats.shared++;
+         return;
+      }
+   }
+
+   queue = &classes[req->cls].queues[req->job != NULL || req->client < 0 ? REQUEST_INTERNAL : req->client];
+   if (queue->tail != NULL)
+      queue->tail->next = req;
+   else
+      queue->head = req;
+   queue->tail = req;
+
+   stats.classes[req->cls].depth++;
+   stats.classes[req->cls].work += req->cost;
+}
+
+static request_t *request_pop(request_queue_t *queue)
+{
+   request_t *req = queue->head;
+
+   queue->head = req->next;
+   if (queue->head == NULL)
+      queue->tail = NULL;
+   req->next = NULL;
+
+   return req;
+}
+
+// Oldest head of the class queues, 0 when class is empty
+static int64_t request_class_oldest(const request_class_t *c)
+{
+   int64_t oldest = 0;
+   int q;
+
+   for (q = 0; q < REQUEST_QUEUES; q++)
+   {
+      if (c->queues[q].head != NULL && (oldest == 0 || c->queues[q].head->enqueued < oldest))
+         oldest = c->queues[q].head->enqueued;
+   }
+
+   return oldest;
+}
+
+// Weighted round robin over class queues
+static request_t *request_class_next(request_class_t *c)
+{
+   int ix;
+
+   if (c->credit > 0 && c->queues[c->current].head != NULL)
+   {
+      c->credit--;
+      return request_pop(&c->queues[c->current]);
+   }
+
+   for (ix = 1; ix <= REQUEST_QUEUES; ix++)
+   {
+      int q = (c->current + ix) % REQUEST_QUEUES;
+
+      if (c->queues[q].head != NULL)
+      {
+         c->current = q;
+         c->credit = weights[q] - 1;
+         return request_pop(&c->queues[q]);
+      }
+   }
+
+   return NULL;
+}
+
+request_t *request_dequeue(void)
+{
+   request_class_stats_t *cs;
+   request_t *req = NULL;
+   int64_t now, oldest, delay;
+   int cls, pick = -1;
+
+   if (request_reserved() > 0)
+      return NULL;
+
+   now = systime_us();
+
+   // Aged lower class first, otherwise strict priority
+   for (cls = REQUEST_CLASSES - 1; cls > 0 && pick < 0; cls--)
+   {
+      oldest = request_class_oldest(&classes[cls]);
+      if (oldest != 0 && now - oldest > (int64_t)aging[cls] * 1000)
+         pick = cls;
+   }
+
+   for (cls = 0; cls < REQUEST_CLASSES && pick < 0; cls++)
+   {
+      if (request_class_oldest(&classes[cls]) != 0)
+         pick = cls;
+   }
+
+   if (pick < 0 || (req = request_class_next(&classes[pick])) == NULL)
+      return NULL;
+
+   cs = &stats.classes[pick];
+   cs->depth--;
+   cs->work -= req->cost;
+
+   // Nobody waits for the result
+   if (req->job == NULL && req->client < 0 && req->followers == NULL)
+   {
+      request_free(req);
+      return request_dequeue();
+   }
+
+   delay = now - req->enqueued;
+   cs->served++;
+   cs->delay_sum += delay;
+   if (delay > cs->delay_max)
+      cs->delay_max = delay;
+
+   return req;
+}
+
+int request_pending(void)
+{
+   int cls;
+
+   for (cls = 0; cls < REQUEST_CLASSES; cls++)
+   {
+      if (stats.classes[cls].depth > 0)
+         return 1;
+   }
+
+   return 0;
+}
+
+// Bus takes no request before until (us, monotonic time), reservation ending
+// earlier is kept
+void request_reserve(int64_t until)
+{
+   if (reserved_until <= systime_us() || until < reserved_until)
+      reserved_until = until;
+}
+
+// Time in us until the bus takes requests again, 0 when it is not reserved
+int64_t request_reserved(void)
+{
+   int64_t left = reserved_until - systime_us();
+
+   return (left > 0) ? left : 0;
+}
+
+// Response of client request, large responses stay in static buffer of handler
+// until request_complete()
+void request_respond(request_t *req, uint8_t *rsp, int rsplen)
+{
+   // MBAP length covers unit id and PDU
+   rsp[4] = (rsplen - 6) >> 8;
+   rsp[5] = (rsplen - 6) & 0xFF;
+
+   req->rsp = rsp;
+   req->rsplen = rsplen;
+}
+
+// Request takes the bus, followers may still attach until request_complete()
+void request_execute(request_t *req)
+{
+   executing = req;
+   executing_start = systime_us();
+   stats.executed++;
+   CORO_INIT(&req->coro);
+}
+
+// Continue executing request, client request is run by handler, internal job by
+// itself. Returns CORO_DONE when the request is ready for request_complete().
+int request_step(request_t *req, modbus_txn_t *txn, request_step_t handler)
+{
+   return (req->job != NULL) ? req->job(req, txn) : handler(req, txn);
+}
+
+static void request_send(const request_t *req)
+{
+   if (req->client < 0)
+      return;
+
+   // Written when main loop pass is done, together with other responses of the client
+   if (output_send(req->client, req->rsp, req->rsplen) < 0)
+      TRACE_ERROR("Send response failed");
+}
+
+// Send response to client and followers, free the requests
+void request_complete(request_t *req)
+{
+   request_t *f, *next;
+   uint64_t ratio;
+
+   if (executing == req)
+   {
+      executing = NULL;
+
+      // Model is corrected by bus time really spent
+      if (req->cost > 0)
+      {
+         ratio = (uint64_t)(systime_us() - executing_start) * 1000 / req->cost;
+         if (ratio < CFG_REQUEST_SCALE_MIN)
+            ratio = CFG_REQUEST_SCALE_MIN;
+         else if (ratio > CFG_REQUEST_SCALE_MAX)
+            ratio = CFG_REQUEST_SCALE_MAX;
+         stats.scale = (stats.scale * 7 + ratio) / 8;
+      }
+   }
+
+   request_send(req);
+
+   for (f = req->followers; f != NULL; f = next)
+   {
+      next = f->next;
+
+      // Shared response with own transaction id, shared reads fit the frame
+      if (req->rsplen <= REQUEST_FRAME_SIZE)
+      {
+         memcpy(&f->buf[2], &req->rsp[2], req->rsplen - 2);
+         f->rsp = f->buf;
+         f->rsplen = req->rsplen;
+         request_send(f);
+      }
+      request_free(f);
+   }
+
+   request_free(req);
+}
+
+// Serve request not touching the bus (cached state, statistics) at once, bypass the queues
+void request_serve(request_t *req, request_handler_t handler)
+{
+   uint8_t *rsp;
+   int rsplen;
+
+   rsplen = handler(req->buf, req->len, &rsp);
+   request_respond(req, rsp, rsplen);
+   request_send(req);
+   request_free(req);
+}
+
+void request_set_weight(int client, int weight)
+{
+   if (client >= 0 && client < REQUEST_MAX_CLIENTS)
+      weights[client] = (weight > 0) ? weight : 1;
+}
+
+// Latency budget of class, negative selects default, 0 admits everything
+void request_set_budget(int cls, int32_t budget_ms)
+{
+   if (cls >= 0 && cls < REQUEST_CLASSES)
+      stats.classes[cls].budget = (budget_ms < 0) ? default_budgets[cls] : (uint32_t)budget_ms;
+}
+
+static void request_drop_from(request_t *req, int client)
+{
+   request_t *f;
+
+   if (req->client == client)
+      req->client = -1;
+
+   for (f = req->followers; f != NULL; f = f->next)
+   {
+      if (f->client == client)
+         f->client = -1;
+   }
+}
+
+// Client disconnected, its requests are not answered
+void request_drop_client(int client)
+{
+   request_t *r;
+   int cls, q;
+
+   for (cls = 0; cls < REQUEST_CLASSES; cls++)
+   {
+      for (q = 0; q < REQUEST_QUEUES; q++)
+      {
+         for (r = classes[cls].queues[q].head; r != NULL; r = r->next)
+            request_drop_from(r, client);
+      }
+   }
+
+   if (executing != NULL)
+      request_drop_from(executing, client);
+}
+
+const request_stats_t *request_stats(void)
+{
+   return &stats;
+}
+
+void request_stats_reset_max(void)
+{
+   int cls;
+
+   for (cls = 0; cls < REQUEST_CLASSES; cls++)
+      stats.classes[cls].delay_max = 0;
+
+   stats.transactions.peak = stats.transactions.used;
+   stats.frames.peak = stats.frames.used;
+}
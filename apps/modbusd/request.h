@@ -0,0 +1,112 @@
+#ifndef __REQUEST_H
+#define __REQUEST_H
+
+#include <stdint.h>
+
+#include "modbus.h"
+
+#define REQUEST_MAX_CLIENTS         8
+#define REQUEST_KEY_SIZE            6        // unit, function, start and count of read
+#define REQUEST_FRAME_SIZE          MODBUS_TCP_MAX_ADU_SIZE
+
+// Bus scheduling classes, lower value is served first
+#define REQUEST_CLASS_WRITE         0        // interactive writes and commands
+#define REQUEST_CLASS_READ          1        // interactive reads
+#define REQUEST_CLASS_BACKGROUND    2        // polling
+#define REQUEST_CLASSES             3
+
+typedef struct request_s request_t;
+
+// Bus coroutine of request, CORO_PENDING while its transactions run in txn
+typedef int (*request_step_t)(request_t *req, modbus_txn_t *txn);
+
+struct request_s
+{
+   struct request_s *next;          // queue link
+   struct request_s *followers;     // requests sharing result of this one (single flight)
+   int client;                      // client index, -1 when client disconnected or internal job
+   uint8_t cls;
+   uint8_t shareable;
+   uint8_t key[REQUEST_KEY_SIZE];   // kept when buf is replaced by response
+   int64_t enqueued;                // us, queue delay measurement, gateway forward time
+   uint32_t cost;                   // us, bus time estimated by the RTU time model
+   uint16_t remote_tid;             // transaction id on gateway connection
+   request_step_t job;              // internal job instead of client request
+   void *arg;
+   coro_t coro;                     // execution on the bus
+   int len;
+   uint8_t *buf;                    // frame slab, NULL for internal job
+   const uint8_t *rsp;              // response, frame or static buffer of handler
+   int rsplen;
+
+};
+
+// Frame slab, free frames are linked through their first bytes
+typedef union request_frame_u
+{
+   union request_frame_u *next;
+   uint8_t buf[REQUEST_FRAME_SIZE];
+
+} request_frame_t;
+
+typedef struct
+{
+   uint16_t size;
+   uint16_t used;
+   uint16_t peak;                   // since last reset
+   uint32_t exhausted;              // allocations refused
+
+} request_pool_stats_t;
+
+typedef struct
+{
+   uint32_t served;
+   uint32_t depth;                  // currently queued
+   uint64_t delay_sum;              // us
+   uint32_t delay_max;              // us, since last reset
+   uint32_t work;                   // us, model bus time of queued requests
+   uint32_t budget;                 // ms, latency budget, 0 unlimited
+   uint32_t refused;                // not admitted over budget
+
+} request_class_stats_t;
+
+typedef struct
+{
+   uint32_t requests;
+   uint32_t executed;
+   uint32_t shared;                 // served by result of identical request
+   uint32_t scale;                  // permille, measured bus time to model cost
+   request_class_stats_t classes[REQUEST_CLASSES];
+   request_pool_stats_t transactions;
+   request_pool_stats_t frames;
+
+} request_stats_t;
+
+typedef int (*request_handler_t)(uint8_t *buf, int reqlen, uint8_t **prsp);
+
+
+int request_pool_init(int transactions, int frames);
+request_t *request_alloc(int client, const uint8_t *buf, int len);
+int request_submit_job(uint8_t cls, uint32_t cost, request_step_t job, void *arg);
+int request_admit(request_t *req);
+void request_enqueue(request_t *req);
+request_t *request_dequeue(void);
+int request_pending(void);
+void request_reserve(int64_t until);
+int64_t request_reserved(void);
+
+void request_execute(request_t *req);
+int request_step(request_t *req, modbus_txn_t *txn, request_step_t handler);
+void request_respond(request_t *req, uint8_t *rsp, int rsplen);
+void request_complete(request_t *req);
+void request_serve(request_t *req, request_handler_t handler);
+
+void request_set_weight(int client, int weight);
+void request_set_budget(int cls, int32_t budget_ms);
+uint32_t request_estimate(int cls);
+void request_drop_client(int client);
+
+const request_stats_t *request_stats(void);
+void request_stats_reset_max(void);
+
+#endif // __REQUEST_H
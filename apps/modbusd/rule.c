@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "action.h"
+#include "plan.h"
+#include "rule.h"
+
+#if !ENABLE_TRACE_RULE
+#include "trace_undef.h"
+#endif
+
+#define CFG_RULE_MAX                128
+#define CFG_RULE_POLL_PERIOD        50       // ms, default input poll period of rule sources
+#define CFG_RULE_RETRY              100      // ms, rule write refused by the bus queue
+
+// Compiled state of one input referenced by rules
+typedef struct
+{
+   uint8_t unit;
+   uint16_t input;
+   uint8_t valid;
+   uint8_t state;             // debounced state
+   uint8_t pending;           // candidate state waiting for debounce
+   int64_t pending_since;
+   uint32_t debounce;
+   uint16_t first_rule;
+   uint16_t rules_cnt;
+
+} rule_input_t;
+
+static rule_t rules[CFG_RULE_MAX];
+static int rules_cnt = 0;
+static rule_input_t inputs[CFG_RULE_MAX];
+static int inputs_cnt = 0;
+static uint8_t retry[CFG_RULE_MAX];    // fired rules whose write was refused
+static int retry_cnt = 0;
+static wheel_timer_t retry_timer;
+
+
+// Stable sort by source input, rules of one input keep configuration order
+static void rule_sort(void)
+{
+   rule_t tmp;
+   int ix, jx;
+
+   for (ix = 1; ix < rules_cnt; ix++)
+   {
+      tmp = rules[ix];
+      for (jx = ix; jx > 0 && (rules[jx - 1].unit > tmp.unit ||
+           (rules[jx - 1].unit == tmp.unit && rules[jx - 1].input > tmp.input)); jx--)
+         rules[jx] = rules[jx - 1];
+      rules[jx] = tmp;
+   }
+}
+
+// Writes are bus jobs of the write class, toggle and interlock are resolved when the job runs
+static int rule_fire(const rule_t *rule)
+{
+   action_target_t target = rule->target;
+
+   TRACE("Rule unit 0x%X input %d -> coil 0x%X/%d", rule->unit, rule->input, target.unit, target.addr);
+
+   if (rule->kind == ACTION_STAIRCASE)
+   {
+      target.op = ACTION_OP_SET;
+      target.value = 1;
+      return (action_add_staircase(&target, rule->delay, rule->interlock) < 0) ? -1 : 0;
+   }
+
+   return action_submit_write(&target, rule->interlock);
+}
+
+// Refused rules are fired again in configuration order, the first refusal ends the round
+static void rule_retry_cb(wheel_timer_t *timer, void *arg)
+{
+   int ix;
+
+   (void)arg;
+
+   for (ix = 0; ix < rules_cnt && retry_cnt > 0; ix++)
+   {
+      if (!retry[ix])
+         continue;
+
+      if (rule_fire(&rules[ix]) < 0)
+         break;
+
+      retry[ix] = 0;
+      retry_cnt--;
+   }
+
+   if (retry_cnt > 0)
+      timer_add(timer, systime_ms() + CFG_RULE_RETRY);
+}
+
+static void rule_fire_retry(int ix)
+{
+   if (rule_fire(&rules[ix]) == 0)
+      return;
+
+   if (!retry[ix])
+   {
+      retry[ix] = 1;
+      retry_cnt++;
+   }
+
+   if (!timer_pending(&retry_timer))
+      timer_add(&retry_timer, systime_ms() + CFG_RULE_RETRY);
+}
+
+int rule_init(void)
+{
+   rules_cnt = 0;
+   inputs_cnt = 0;
+   retry_cnt = 0;
+   memset(retry, 0, sizeof(retry));
+   timer_init(&retry_timer, rule_retry_cb, NULL);
+
+   return 0;
+}
+
+int rule_add(const rule_t *rule)
+{
+   if (rules_cnt == CFG_RULE_MAX)
+   {
+      TRACE_ERROR("Rules maxnum exceeded");
+      return -1;
+   }
+
+   rules[rules_cnt++] = *rule;
+
+   return 0;
+}
+
+// Sort rules by source input and build input table, require polling of source slaves.
+// Inputs present in previous table keep their debounced state, reload does not fire edges.
+int rule_compile(void)
+{
+   static rule_input_t old_inputs[CFG_RULE_MAX];
+   rule_input_t *in = NULL;
+   uint16_t max_input;
+   int ix, jx, old_cnt;
+
+   memcpy(old_inputs, inputs, inputs_cnt * sizeof(rule_input_t));
+   old_cnt = inputs_cnt;
+
+   rule_sort();
+
+   inputs_cnt = 0;
+   for (ix = 0; ix < rules_cnt; ix++)
+   {
+      if (in == NULL || in->unit != rules[ix].unit || in->input != rules[ix].input)
+      {
+         in = &inputs[inputs_cnt++];
+         memset(in, 0, sizeof(rule_input_t));
+         in->unit = rules[ix].unit;
+         in->input = rules[ix].input;
+         in->first_rule = ix;
+      }
+
+      in->rules_cnt++;
+      if (rules[ix].debounce > in->debounce)
+         in->debounce = rules[ix].debounce;
+   }
+
+   for (ix = 0; ix < inputs_cnt; ix++)
+   {
+      for (jx = 0; jx < old_cnt; jx++)
+      {
+         if (old_inputs[jx].unit == inputs[ix].unit && old_inputs[jx].input == inputs[ix].input)
+         {
+            inputs[ix].valid = old_inputs[jx].valid;
+            inputs[ix].state = old_inputs[jx].state;
+            inputs[ix].pending = old_inputs[jx].pending;
+            inputs[ix].pending_since = old_inputs[jx].pending_since;
+            break;
+         }
+      }
+   }
+
+   for (ix = 0; ix < inputs_cnt; ix = jx)
+   {
+      max_input = 0;
+      for (jx = ix; jx < inputs_cnt && inputs[jx].unit == inputs[ix].unit; jx++)
+         max_input = inputs[jx].input;
+
+      if (plan_require(inputs[ix].unit, MODBUS_READ_DISCRETE_INPUTS, 0, (max_input / 8 + 1) * 8, CFG_RULE_POLL_PERIOD) < 0)
+         return -1;
+   }
+
+   TRACE("Compiled %d rules on %d inputs", rules_cnt, inputs_cnt);
+
+   return 0;
+}
+
+// Remove rules and their pending retries, input states are kept for following rule_compile()
+void rule_clear(void)
+{
+   timer_del(&retry_timer);
+   memset(retry, 0, sizeof(retry));
+   retry_cnt = 0;
+   rules_cnt = 0;
+}
+
+void rule_process(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, const bitset_t *state)
+{
+   rule_input_t *in;
+   int64_t now;
+   int ix, jx, lo, hi, mid, bit;
+
+   if (func != MODBUS_READ_DISCRETE_INPUTS || inputs_cnt == 0)
+      return;
+
+   // First input of unit
+   lo = 0;
+   hi = inputs_cnt;
+   while (lo < hi)
+   {
+      mid = (lo + hi) / 2;
+      if (inputs[mid].unit < unit)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   now = systime_ms();
+
+   for (ix = lo; ix < inputs_cnt && inputs[ix].unit == unit; ix++)
+   {
+      in = &inputs[ix];
+      if (in->input < start || in->input >= start + count)
+         continue;
+
+      bit = bitset_get(state, in->input - start);
+
+      if (!in->valid)
+      {
+         in->state = bit;
+         in->pending = bit;
+         in->valid = 1;
+         continue;
+      }
+
+      if (bit == in->state)
+      {
+         in->pending = bit;
+         continue;
+      }
+
+      if (in->debounce > 0)
+      {
+         if (in->pending != bit)
+         {
+            in->pending = bit;
+            in->pending_since = now;
+            continue;
+         }
+
+         if (now - in->pending_since < in->debounce)
+            continue;
+      }
+
+      in->state = bit;
+      in->pending = bit;
+
+      for (jx = in->first_rule; jx < in->first_rule + in->rules_cnt; jx++)
+      {
+         if (rules[jx].edge & (bit ? RULE_EDGE_RISING : RULE_EDGE_FALLING))
+            rule_fire_retry(jx);
+      }
+   }
+}
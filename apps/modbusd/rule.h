@@ -0,0 +1,36 @@
+#ifndef __RULE_H
+#define __RULE_H
+
+#include <stdint.h>
+
+#include "action.h"
+#include "bitset.h"
+
+#define RULE_EDGE_RISING            0x01
+#define RULE_EDGE_FALLING           0x02
+#define RULE_EDGE_CHANGE            (RULE_EDGE_RISING | RULE_EDGE_FALLING)
+
+#define RULE_NO_INTERLOCK           ACTION_NO_INTERLOCK
+
+typedef struct
+{
+   uint8_t unit;              // input slave
+   uint16_t input;
+   uint8_t edge;
+   uint8_t kind;              // ACTION_ONCE (immediate write) or ACTION_STAIRCASE
+   action_target_t target;
+   uint32_t delay;            // staircase off delay, ms
+   uint32_t debounce;         // ms
+   uint16_t interlock;        // coil on target slave switched off before target is switched on
+
+} rule_t;
+
+
+int rule_init(void);
+int rule_add(const rule_t *rule);
+int rule_compile(void);
+void rule_clear(void);
+
+void rule_process(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, const bitset_t *state);
+
+#endif // __RULE_H
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "modbus.h"
+#include "server.h"
+#include "history.h"
+#include "scene.h"
+
+#if !ENABLE_TRACE_SCENE
+#include "trace_undef.h"
+#endif
+
+
+// Order targets by slave, type and address, keep request order for equal keys
+static void scene_sort(const scene_target_t *targets, int *order, int count)
+{
+   int ix, jx, tmp;
+
+   for (ix = 0; ix < count; ix++)
+      order[ix] = ix;
+
+   for (ix = 1; ix < count; ix++)
+   {
+      for (jx = ix; jx > 0; jx--)
+      {
+         const scene_target_t *a = &targets[order[jx - 1]];
+         const scene_target_t *b = &targets[order[jx]];
+
+         if (a->unit < b->unit || (a->unit == b->unit && (a->type < b->type || 
+             (a->type == b->type && a->addr <= b->addr))))
+            break;
+
+         tmp = order[jx - 1];
+         order[jx - 1] = order[jx];
+         order[jx] = tmp;
+      }
+   }
+}
+
+static int scene_txn_write_single(modbus_txn_t *txn, int sd, const scene_target_t *t)
+{
+   if (t->type == MODBUS_FUNC_WRITE_COIL)
+      return server_txn_write_coil(txn, sd, t->unit, t->addr, t->value != 0);
+
+   return modbus_txn_write_register(txn, sd, t->unit, t->addr, t->value);
+}
+
+static void scene_single_written(scene_target_t *t, int res)
+{
+   if (res == 0 && t->type == MODBUS_FUNC_WRITE_COIL)
+   {
+      server_coil_written(t->unit, t->addr, t->value != 0);
+      history_record(t->unit, MODBUS_FUNC_READ_COILS, t->addr, t->value != 0);
+   }
+
+   t->status = (res == 0) ? 0 : MODBUS_EXCEPTION_GATEWAY_TARGET;
+}
+
+// Write run of consecutive addresses on one slave with single multi-write request
+static int scene_txn_write_run(modbus_txn_t *txn, const scene_t *scene)
+{
+   uint8_t coils[SCENE_MAX_TARGETS];
+   uint16_t regs[SCENE_MAX_TARGETS];
+   const int *order = &scene->order[scene->ix];
+   const scene_target_t *first = &scene->targets[order[0]];
+   int ix;
+
+   if (first->type == MODBUS_FUNC_WRITE_COIL)
+   {
+      for (ix = 0; ix < scene->run; ix++)
+         coils[ix] = scene->targets[order[ix]].value != 0;
+      return profile_txn_write_coils(txn, scene->sd, server_profile(first->unit), first->unit, first->addr, scene->run, coils);
+   }
+
+   for (ix = 0; ix < scene->run; ix++)
+      regs[ix] = scene->targets[order[ix]].value;
+
+   return modbus_txn_write_registers(txn, scene->sd, first->unit, first->addr, scene->run, regs);
+}
+
+static void scene_run_written(scene_t *scene)
+{
+   int ix;
+
+   // Coils of run are written as by single writes, cached servers keep them
+   for (ix = 0; ix < scene->run; ix++)
+      scene_single_written(&scene->targets[scene->order[scene->ix + ix]], 0);
+}
+
+// Longest multi-write of device, 1 when the function is not supported
+static int scene_max_run(const profile_t *profile, uint8_t type)
+{
+   if (type == MODBUS_FUNC_WRITE_COIL)
+      return profile_supports(profile, MODBUS_FUNC_WRITE_MULTIPLE_COILS) ? profile->max_write_coils : 1;
+
+   return profile_supports(profile, MODBUS_FUNC_WRITE_MULTIPLE_REGISTERS) ? profile->max_write_registers : 1;
+}
+
+// Run of consecutive addresses of same type on same slave from ix, as long as device takes at once
+static int scene_find_run(const scene_t *scene, int ix)
+{
+   const scene_target_t *t = &scene->targets[scene->order[ix]];
+   const scene_target_t *n;
+   int run, max_run = scene_max_run(server_profile(t->unit), t->type);
+
+   for (run = 1; ix + run < scene->count && run < max_run; run++)
+   {
+      n = &scene->targets[scene->order[ix + run]];
+      if (n->unit != t->unit || n->type != t->type || n->addr != t->addr + run)
+         break;
+   }
+
+   TRACE("Scene slave 0x%X func 0x%X addr %d count %d", t->unit, t->type, t->addr, run);
+
+   return run;
+}
+
+int scene_init(scene_t *scene, int sd, const scene_target_t *targets, int count)
+{
+   if (count > SCENE_MAX_TARGETS)
+      return -1;
+
+   CORO_INIT(&scene->coro);
+   scene->sd = sd;
+   scene->count = count;
+   scene->failed = 0;
+   memcpy(scene->targets, targets, count * sizeof(scene_target_t));
+   scene_sort(scene->targets, scene->order, count);
+
+   return 0;
+}
+
+// Targets are written run by run in txn, status of each target is set when it returns CORO_DONE
+int scene_step(scene_t *scene, modbus_txn_t *txn)
+{
+   CORO_BEGIN(&scene->coro);
+
+   for (scene->ix = 0; scene->ix < scene->count; scene->ix += scene->run)
+   {
+      scene->run = scene_find_run(scene, scene->ix);
+
+      if (scene->run > 1 && scene_txn_write_run(txn, scene) == 0)
+      {
+         MODBUS_TXN_AWAIT(&scene->coro, txn);
+         if (txn->result == 0)
+         {
+            scene_run_written(scene);
+            continue;
+         }
+      }
+
+      // Multi-write refused by device, targets one by one
+      for (scene->jx = 0; scene->jx < scene->run; scene->jx++)
+      {
+         if ((scene->res = scene_txn_write_single(txn, scene->sd, &scene->targets[scene->order[scene->ix + scene->jx]])) == 0)
+         {
+            MODBUS_TXN_AWAIT(&scene->coro, txn);
+            scene->res = txn->result;
+         }
+
+         scene_single_written(&scene->targets[scene->order[scene->ix + scene->jx]], scene->res);
+         if (scene->res < 0)
+            scene->failed++;
+      }
+   }
+
+   CORO_END(&scene->coro);
+}
@@ -0,0 +1,40 @@
+#ifndef __SCENE_H
+#define __SCENE_H
+
+#include <stdint.h>
+
+#include "modbus.h"
+
+#define SCENE_MAX_TARGETS          40
+
+typedef struct
+{
+   uint8_t unit;
+   uint8_t type;              // MODBUS_FUNC_WRITE_COIL or MODBUS_FUNC_WRITE_SINGLE_REGISTER
+   uint16_t addr;
+   uint16_t value;
+   uint8_t status;            // 0 = done, otherwise modbus exception code
+
+} scene_target_t;
+
+// Scene written on the bus, coroutine
+typedef struct
+{
+   coro_t coro;
+   int sd;
+   int count;
+   scene_target_t targets[SCENE_MAX_TARGETS];
+   int order[SCENE_MAX_TARGETS];    // targets sorted by slave, type and address
+   int ix;                    // first target of current run
+   int run;                   // targets of current run
+   int jx;                    // target of run written alone
+   int res;
+   int failed;
+
+} scene_t;
+
+
+int scene_init(scene_t *scene, int sd, const scene_target_t *targets, int count);
+int scene_step(scene_t *scene, modbus_txn_t *txn);
+
+#endif // __SCENE_H
@@ -17,7 +17,15 @@
 #include "trace_undef.h"
 #endif
 
-#define CFG_READ_TIMEOUT	250
+static const struct
+{
+   int baud;
+   speed_t speed;
+
+} serial_speeds[] = {
+   {1200, B1200}, {2400, B2400}, {4800, B4800}, {9600, B9600}, {19200, B19200},
+   {38400, B38400}, {57600, B57600}, {115200, B115200}
+};
 
 
 int serial_open(const char *name, int baudrate)
@@ -83,48 +91,98 @@ int serial_write(int sd, void *buf, int count)
    return write(sd, buf, count);
 }
 
-int serial_read(int sd, void *buf, int count)
+// Number of received bytes waiting in input buffer
+int serial_pending(int sd)
+{
+   int count = 0;
+
+   if (ioctl(sd, FIONREAD, &count) < 0)
+      return -1;
+
+   return count;
+}
+
+// Read bytes already received, at most size, never waits.
+// Returns number of bytes read, 0 when nothing is pending.
+int serial_read_available(int sd, void *buf, int size)
+{
+   int ix, res, count;
+
+   if ((count = serial_pending(sd)) <= 0)
+      return count;
+
+   if ((res = read(sd, buf, (count < size) ? count : size)) < 0)
+   {
+      TRACE_ERROR("Read failed");
+      return -1;
+   }
+
+   TRACE_PRINTFF("Serial RX: ");
+   for (ix = 0; ix < res; ix++)
+      TRACE_PRINTF("%2.2X ", ((uint8_t *)buf)[ix]);
+   TRACE_PRINTF("\n");
+
+   return res;
+}
+
+// Wait for first received byte, returns 1 when data is ready, 0 on timeout
+int serial_wait(int sd, int timeout_us)
+{
+   fd_set read_fds;
+   struct timeval tv;
+
+   FD_ZERO(&read_fds);
+   FD_SET(sd, &read_fds);
+   tv.tv_sec = timeout_us / 1000000;
+   tv.tv_usec = timeout_us % 1000000;
+
+   return select(sd+1, &read_fds, NULL, NULL, &tv);
+}
+
+// Termios speed of baudrate, -1 when not supported
+int serial_baudrate(int baud)
+{
+   unsigned int ix;
+
+   for (ix = 0; ix < sizeof(serial_speeds) / sizeof(serial_speeds[0]); ix++)
+   {
+      if (serial_speeds[ix].baud == baud)
+         return serial_speeds[ix].speed;
+   }
+
+   return -1;
+}
+
+// Read one frame, wait timeout for its first byte, frame ends by line silence of gap.
+// Returns number of bytes read, 0 when nothing was received.
+int serial_read_frame(int sd, void *buf, int size, int timeout_us, int gap_us)
 {
-   int ix, res, total = 0;
+   int res, total = 0;
    fd_set read_fds;
    struct timeval tv;
 
-   while(count > 0)
+   while (total < size)
    {
-      // wait for data
       FD_ZERO(&read_fds);
       FD_SET(sd, &read_fds);
       tv.tv_sec = 0;
-      tv.tv_usec = CFG_READ_TIMEOUT * 1000;
-
-      if ((res = select(sd+1, &read_fds, NULL, NULL,  &tv)) == 0)
+      tv.tv_usec = (total == 0) ? timeout_us : gap_us;
+      while (tv.tv_usec >= 1000000)
       {
-         // timeout
-         TRACE_ERROR("Read serial timeout,  remain: %d   read: %d", count, total);
-         return -2;
+         tv.tv_sec++;
+         tv.tv_usec -= 1000000;
       }
+
+      if ((res = select(sd+1, &read_fds, NULL, NULL, &tv)) == 0)
+         break;
       else if (res < 0)
-      {
-         TRACE_ERROR("select() failed");
          return -1;
-      }
 
-      res = read(sd, buf, count);
-      if (res < 0)
-      {
-         TRACE_ERROR("Read failed");
+      if ((res = read(sd, (uint8_t *)buf + total, size - total)) <= 0)
          return -1;
-      }
 
-      count -= res;
       total += res;
    }
 
-   TRACE_PRINTFF("Serial RX: ");
-   for (ix = 0; ix < total; ix++)
-       TRACE_PRINTF("%2.2X ", ((uint8_t *)buf)[ix]);
-   TRACE_PRINTF("\n");
- 
    return total;
 }
-
@@ -8,7 +8,11 @@ int serial_open(const char *name, int baudrate);
 int serial_close(int sd);
 int serial_flush(int sd);
 int serial_write(int sd, void *buf, int count);
-int serial_read(int sd, void *buf, int count);
+int serial_pending(int sd);
+int serial_read_available(int sd, void *buf, int size);
+int serial_wait(int sd, int timeout_us);
+int serial_read_frame(int sd, void *buf, int size, int timeout_us, int gap_us);
+int serial_baudrate(int baud);
 
 #endif // __SERIAL_H
 
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "history.h"
+#include "snapshot.h"
+#include "request.h"
+#include "plan.h"
+#include "server.h"
+
+#define CFG_SERVER_REFRESH_RETRY    100      // ms
+
+// Known modbus servers (slaves), devices of cached profile (china relay boards) are
+// not able to read coils at once, their state is kept here and read in background
+static modbus_server_t servers[MAX_SERVERS_COUNT];
+static profile_read_t refresh_op;
+static int bus_sd = -1;
+
+
+// Coils state read from device
+void server_state_read(modbus_server_t *server, const bitset_t *state)
+{
+   server->coils_state = *state;
+   server->valid = 1;
+   server->stale = 0;
+   timer_del(&server->timer);
+
+   TRACE("Modbus cached servers addr: 0x%X  coils_state: 0x%X", server->addr, server->coils_state.words[0]);
+   history_record_bits(server->addr, MODBUS_FUNC_READ_COILS, 0, server->profile.coils, &server->coils_state);
+   snapshot_store_bits(server->addr, MODBUS_FUNC_READ_COILS, 0, server->profile.coils, &server->coils_state);
+   snapshot_set_stale(server->addr, 0);
+}
+
+// Cached server is read bit by bit, one coil per background job so that clients are served in between
+static int server_refresh_job(request_t *req, modbus_txn_t *txn)
+{
+   modbus_server_t *server = req->arg;
+
+   CORO_BEGIN(&req->coro);
+
+   // Removed by reload meanwhile, slot may hold new server already
+   if (!server->used || server->dropped)
+   {
+      server->queued = 0;
+      server->dropped = 0;
+      CORO_EXIT(&req->coro);
+   }
+
+   if (profile_read_init(&refresh_op, bus_sd, &server->profile, server->addr, MODBUS_FUNC_READ_COILS, server->refresh_coil, 1) == 0)
+      CORO_AWAIT_CALL(&req->coro, &refresh_op.coro, profile_read_step(&refresh_op, txn));
+
+   server->queued = 0;
+
+   if (!server->used || server->dropped)
+   {
+      server->dropped = 0;
+      CORO_EXIT(&req->coro);
+   }
+
+   if (refresh_op.result < 0)
+   {
+      server->refresh_coil = 0;
+      bitset_clear(&server->refresh_state);
+      timer_add(&server->timer, systime_ms() + CFG_SERVER_REFRESH_RETRY);
+      CORO_EXIT(&req->coro);
+   }
+
+   // Refresh started again meanwhile continues from its own coil
+   if (refresh_op.start != server->refresh_coil)
+   {
+      timer_add(&server->timer, systime_ms());
+      CORO_EXIT(&req->coro);
+   }
+
+   bitset_put(&server->refresh_state, server->refresh_coil, bitset_get(&refresh_op.state, 0));
+
+   if (++server->refresh_coil < server->profile.coils)
+      timer_add(&server->timer, systime_ms());
+   else
+      server_state_read(server, &server->refresh_state);
+
+   CORO_END(&req->coro);
+}
+
+static void server_refresh_cb(wheel_timer_t *timer, void *arg)
+{
+   modbus_server_t *server = arg;
+
+   // Job waiting for the bus or running continues the refresh
+   if (server->queued)
+      return;
+
+   if (request_submit_job(REQUEST_CLASS_BACKGROUND, plan_read_cost(server->addr, MODBUS_FUNC_READ_COILS, 1), server_refresh_job, server) == 0)
+      server->queued = 1;
+   else
+      timer_add(timer, systime_ms() + CFG_SERVER_REFRESH_RETRY);
+}
+
+int server_init(int sd)
+{
+   bus_sd = sd;
+
+   return 0;
+}
+
+modbus_server_t *server_add(int addr, const profile_t *profile)
+{
+   modbus_server_t *server;
+   uint8_t queued;
+   int ix;
+
+   if ((server = server_find(addr)) != NULL)
+   {
+      server->profile = *profile;
+      return server;
+   }
+
+   for (ix = 0; ix < MAX_SERVERS_COUNT && servers[ix].used; ix++);
+
+   if (ix == MAX_SERVERS_COUNT)
+   {
+      TRACE_ERROR("modbus servers maxnum exceeded");
+      return NULL;
+   }
+
+   // Queued refresh of removed server finds its slot taken and does nothing
+   server = &servers[ix];
+   queued = server->queued;
+   memset(server, 0, sizeof(modbus_server_t));
+   server->queued = queued;
+   server->dropped = queued;
+   server->used = 1;
+   server->addr = addr;
+   server->profile = *profile;
+   timer_init(&server->timer, server_refresh_cb, server);
+   
+   return server;
+}
+
+void server_remove(modbus_server_t *server)
+{
+   timer_del(&server->timer);
+   server->used = 0;
+
+   // Nobody reads the state any more
+   if (server->stale)
+      snapshot_set_stale(server->addr, 0);
+}
+
+modbus_server_t *server_find(int addr)
+{
+   int ix;
+   
+   for (ix = 0; ix < MAX_SERVERS_COUNT; ix++)
+   {
+      if (servers[ix].used && servers[ix].addr == addr)
+         return &servers[ix];
+   }
+   
+   return NULL;
+}
+
+modbus_server_t *server_find_cached(int addr)
+{
+   modbus_server_t *server = server_find(addr);
+
+   return (server != NULL && server->profile.cached) ? server : NULL;
+}
+
+// Profile of slave, units not configured are standard devices
+const profile_t *server_profile(int addr)
+{
+   modbus_server_t *server = server_find(addr);
+
+   return (server != NULL) ? &server->profile : profile_default();
+}
+
+modbus_server_t *server_get(int ix)
+{
+   return (ix >= 0 && ix < MAX_SERVERS_COUNT && servers[ix].used) ? &servers[ix] : NULL;
+}
+
+void server_mark_config(void)
+{
+   int ix;
+
+   for (ix = 0; ix < MAX_SERVERS_COUNT; ix++)
+      servers[ix].mark = servers[ix].used && servers[ix].config;
+}
+
+// Server with unchanged profile keeps its cached state, returns 1 when it is kept
+int server_keep_config(int addr, const profile_t *profile)
+{
+   modbus_server_t *server = server_find(addr);
+
+   if (server == NULL || memcmp(&server->profile, profile, sizeof(profile_t)))
+      return 0;
+
+   server->mark = 0;
+   server->config = 1;
+
+   return 1;
+}
+
+// Add new server or reset server of changed profile, after sweep of removed ones
+int server_add_config(int addr, const profile_t *profile)
+{
+   modbus_server_t *server = server_find(addr);
+
+   if (server != NULL)
+      server_remove(server);
+
+   if ((server = server_add(addr, profile)) == NULL)
+      return -1;
+
+   server->config = 1;
+   TRACE("Modbus server 0x%X added (%s)", addr, profile->name);
+
+   if (server->profile.cached && bus_sd >= 0)
+      server_start_refresh(server);
+
+   return 0;
+}
+
+void server_sweep_config(void)
+{
+   int ix;
+
+   for (ix = 0; ix < MAX_SERVERS_COUNT; ix++)
+   {
+      if (servers[ix].used && servers[ix].mark)
+      {
+         TRACE("Modbus server 0x%X removed", servers[ix].addr);
+         server_remove(&servers[ix]);
+      }
+   }
+}
+
+// Servers not defined in configuration file (command line), they keep their slots on reload
+int server_count_unconfigured(void)
+{
+   int ix, cnt = 0;
+
+   for (ix = 0; ix < MAX_SERVERS_COUNT; ix++)
+      cnt += servers[ix].used && !servers[ix].config;
+
+   return cnt;
+}
+
+// Read state in background, last snapshot state is served as stale meanwhile
+void server_start_refresh(modbus_server_t *server)
+{
+   if (!server->valid && snapshot_load_bits(server->addr, MODBUS_FUNC_READ_COILS, 0, server->profile.coils, &server->coils_state, NULL) == 0)
+   {
+      TRACE("Modbus cached servers addr: 0x%X  stale coils_state: 0x%X", server->addr, server->coils_state.words[0]);
+      server->valid = 1;
+      server->stale = 1;
+      snapshot_set_stale(server->addr, 1);
+   }
+
+   server->refresh_coil = 0;
+   bitset_clear(&server->refresh_state);
+   timer_add(&server->timer, systime_ms());
+}
+
+// Prepare write of coil in transaction, server_coil_written() updates state when it is done
+int server_txn_write_coil(modbus_txn_t *txn, int sd, int addr, int coil, int on)
+{
+   return profile_txn_write_coil(txn, sd, server_profile(addr), addr, coil, on);
+}
+
+void server_coil_written(int addr, int coil, int on)
+{
+   modbus_server_t *server = server_find(addr);
+
+   if (server != NULL && server->profile.cached && coil < BITSET_MAX_BITS)
+   {
+      bitset_put(&server->coils_state, coil, on);
+      bitset_put(&server->refresh_state, coil, on);
+   }
+
+   snapshot_store_bit(addr, MODBUS_FUNC_READ_COILS, coil, on);
+}
@@ -0,0 +1,53 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include <stdint.h>
+
+#include "timerwheel.h"
+#include "bitset.h"
+#include "profile.h"
+#include "modbus.h"
+
+#define MAX_SERVERS_COUNT          64
+
+typedef struct
+{
+   uint8_t used;
+   uint8_t addr;
+   uint8_t config;            // defined in configuration file, subject of reload
+   uint8_t mark;              // reload sweep mark
+   profile_t profile;         // device model quirks
+   uint8_t valid;             // coils_state is known
+   uint8_t stale;             // coils_state comes from snapshot, not read from device yet
+   bitset_t coils_state;
+   uint8_t refresh_coil;      // next coil of background read
+   bitset_t refresh_state;
+   wheel_timer_t timer;       // background state read of cached profile, one coil per job
+   uint8_t queued;            // refresh job waits for the bus or runs
+   uint8_t dropped;           // queued job belongs to removed server of this slot
+   
+} modbus_server_t;
+
+
+int server_init(int sd);
+
+modbus_server_t *server_add(int addr, const profile_t *profile);
+void server_remove(modbus_server_t *server);
+modbus_server_t *server_find(int addr);
+modbus_server_t *server_find_cached(int addr);
+const profile_t *server_profile(int addr);
+modbus_server_t *server_get(int ix);
+
+void server_mark_config(void);
+int server_keep_config(int addr, const profile_t *profile);
+int server_add_config(int addr, const profile_t *profile);
+void server_sweep_config(void);
+int server_count_unconfigured(void);
+
+void server_state_read(modbus_server_t *server, const bitset_t *state);
+void server_start_refresh(modbus_server_t *server);
+
+int server_txn_write_coil(modbus_txn_t *txn, int sd, int addr, int coil, int on);
+void server_coil_written(int addr, int coil, int on);
+
+#endif // __SERVER_H
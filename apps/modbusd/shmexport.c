@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+#include "bitset.h"
+#include "snapshot.h"
+#include "modbusd_shm.h"
+#include "shmexport.h"
+
+#if !ENABLE_TRACE_SHMEXPORT
+#include "trace_undef.h"
+#endif
+
+//
+// Snapshot published in POSIX shared memory for local readers, layout and
+// reader are in modbusd_shm.h. Unit block is rewritten under its seqlock
+// when snapshot of the unit changes, the daemon is the only writer.
+//
+
+typedef char shmexport_words_check[(BITSET_WORDS == MODBUSD_SHM_WORDS && SNAPSHOT_UNITS == MODBUSD_SHM_UNITS) ? 1 : -1];
+typedef char shmexport_align_check[(sizeof(modbusd_shm_unit_t) % 64 == 0) ? 1 : -1];
+
+static modbusd_shm_t *shm = NULL;
+static char shm_name[64];
+
+
+int shmexport_init(const char *name)
+{
+   void *map;
+   int fd, ix;
+
+   snprintf(shm_name, sizeof(shm_name), "%s", name);
+
+   if ((fd = shm_open(shm_name, O_RDWR | O_CREAT, 0644)) < 0)
+   {
+      TRACE_ERROR("Open shared memory %s failed - %s", shm_name, strerror(errno));
+      return -1;
+   }
+
+   if (ftruncate(fd, sizeof(modbusd_shm_t)) < 0)
+   {
+      TRACE_ERROR("Resize shared memory %s failed", shm_name);
+      close(fd);
+      return -1;
+   }
+
+   map = mmap(NULL, sizeof(modbusd_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+   {
+      TRACE_ERROR("mmap shared memory %s failed", shm_name);
+      return -1;
+   }
+
+   shm = map;
+
+   // Readers of previous daemon see the region invalid until it is filled again
+   __atomic_store_n(&shm->header.magic, 0, __ATOMIC_RELEASE);
+   memset(shm, 0, sizeof(modbusd_shm_t));
+   shm->header.version = MODBUSD_SHM_VERSION;
+   shm->header.units = MODBUSD_SHM_UNITS;
+   shm->header.words = MODBUSD_SHM_WORDS;
+   shm->header.pid = getpid();
+
+   for (ix = 0; ix < MODBUSD_SHM_UNITS; ix++)
+      shmexport_unit(ix);
+
+   // Units are copied in address order, not in order of their changes
+   shm->header.seq = snapshot_sequence();
+
+   __atomic_store_n(&shm->header.magic, MODBUSD_SHM_MAGIC, __ATOMIC_RELEASE);
+
+   TRACE("Shared memory %s published", shm_name);
+
+   return 0;
+}
+
+void shmexport_close(void)
+{
+   if (shm == NULL)
+      return;
+
+   // Readers keeping the region mapped see it invalid
+   __atomic_store_n(&shm->header.magic, 0, __ATOMIC_RELEASE);
+   munmap(shm, sizeof(modbusd_shm_t));
+   shm_unlink(shm_name);
+   shm = NULL;
+}
+
+// Copy snapshot of unit to its block
+void shmexport_unit(uint8_t unit)
+{
+   modbusd_shm_unit_t *u;
+   snapshot_state_t st;
+   uint32_t lock;
+
+   if (shm == NULL || snapshot_get(unit, 0, &st) < 0)
+      return;
+
+   u = &shm->units[unit];
+   lock = u->lock;
+
+   // Odd lock is visible before any word of the block changes
+   __atomic_store_n(&u->lock, lock + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   u->seq = st.seq;
+   u->time = st.time;
+   u->flags = st.stale ? MODBUSD_SHM_STALE : 0;
+   memcpy(u->coils, st.coils->words, sizeof(u->coils));
+   memcpy(u->coils_valid, st.coils_valid->words, sizeof(u->coils_valid));
+   memcpy(u->inputs, st.inputs->words, sizeof(u->inputs));
+   memcpy(u->inputs_valid, st.inputs_valid->words, sizeof(u->inputs_valid));
+
+   __atomic_store_n(&u->lock, lock + 2, __ATOMIC_RELEASE);
+   __atomic_store_n(&shm->header.seq, st.seq, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,10 @@
+#ifndef __SHMEXPORT_H
+#define __SHMEXPORT_H
+
+#include <stdint.h>
+
+int shmexport_init(const char *name);
+void shmexport_close(void);
+void shmexport_unit(uint8_t unit);
+
+#endif // __SHMEXPORT_H
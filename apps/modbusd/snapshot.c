@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "systime.h"
+#include "modbus.h"
+#include "snapshot.h"
+#include "virtual.h"
+#include "shmexport.h"
+
+#if !ENABLE_TRACE_SNAPSHOT
+#include "trace_undef.h"
+#endif
+
+//
+// Last known coils and inputs state of every slave in mmap'd file. The file is
+// updated in place on every change, so it survives restart and crash of the
+// daemon and the state can be served before slaves are read again. Without
+// file the table is kept in memory only.
+//
+// Every change increments the sequence number and stamps the entry with it,
+// clients ask for entries changed since the sequence they already have. Change
+// is found by XOR of stored and new words, unchanged state does not touch the file.
+// Stale mark of unit (state served from the file, not read from the slave since
+// start yet) is kept in memory only, its change is a change of the unit too.
+//
+#define SNAPSHOT_MAGIC                 0x4E53424D  // "MBSN"
+#define SNAPSHOT_VERSION               3
+
+typedef struct
+{
+   uint32_t magic;
+   uint16_t version;
+   uint16_t units;
+   uint32_t seq;              // last change sequence
+   uint8_t padding[52];
+
+} snapshot_header_t;
+
+typedef struct
+{
+   int64_t time;              // last change, ms since epoch
+   uint32_t seq;              // sequence of last change, 0 when nothing known
+   bitset_t coils;
+   bitset_t coils_valid;      // coils known
+   bitset_t inputs;
+   bitset_t inputs_valid;     // inputs known
+
+} snapshot_entry_t;
+
+typedef struct
+{
+   snapshot_header_t header;
+   snapshot_entry_t entries[SNAPSHOT_UNITS];
+
+} snapshot_file_t;
+
+
+static snapshot_file_t memory;
+static snapshot_file_t *snapshot = &memory;
+static uint8_t stale[SNAPSHOT_UNITS];
+
+
+static void snapshot_table(snapshot_entry_t *e, uint8_t table, bitset_t **bits, bitset_t **valid)
+{
+   if (table == MODBUS_FUNC_READ_COILS)
+   {
+      *bits = &e->coils;
+      *valid = &e->coils_valid;
+   }
+   else
+   {
+      *bits = &e->inputs;
+      *valid = &e->inputs_valid;
+   }
+}
+
+int snapshot_init(const char *filename)
+{
+   struct stat st;
+   void *map;
+   int fd;
+
+   if ((fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0)
+   {
+      TRACE_ERROR("Open snapshot file %s failed - %s", filename, strerror(errno));
+      return -1;
+   }
+
+   if (fstat(fd, &st) < 0 || (st.st_size != sizeof(snapshot_file_t) && ftruncate(fd, sizeof(snapshot_file_t)) < 0))
+   {
+      TRACE_ERROR("Resize snapshot file %s failed", filename);
+      close(fd);
+      return -1;
+   }
+
+   map = mmap(NULL, sizeof(snapshot_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+   {
+      TRACE_ERROR("mmap snapshot file %s failed", filename);
+      return -1;
+   }
+
+   snapshot = map;
+
+   if (snapshot->header.magic != SNAPSHOT_MAGIC || snapshot->header.version != SNAPSHOT_VERSION ||
+       snapshot->header.units != SNAPSHOT_UNITS)
+   {
+      // New or incompatible file, nothing is known
+      memset(snapshot, 0, sizeof(snapshot_file_t));
+      snapshot->header.magic = SNAPSHOT_MAGIC;
+      snapshot->header.version = SNAPSHOT_VERSION;
+      snapshot->header.units = SNAPSHOT_UNITS;
+   }
+
+   TRACE("Snapshot file %s opened", filename);
+
+   return 0;
+}
+
+void snapshot_close(void)
+{
+   if (snapshot == &memory)
+      return;
+
+   memcpy(&memory, snapshot, sizeof(snapshot_file_t));
+   munmap(snapshot, sizeof(snapshot_file_t));
+   snapshot = &memory;
+}
+
+// Store count bits of state to points start .., only first SNAPSHOT_BITS points are kept
+void snapshot_store_bits(uint8_t unit, uint8_t table, uint16_t start, int count, const bitset_t *state)
+{
+   static bitset_t merged;
+   snapshot_entry_t *e;
+   bitset_t *bits, *valid;
+
+   if (count <= 0 || start + count > SNAPSHOT_BITS)
+      return;
+
+   e = &snapshot->entries[unit];
+   snapshot_table(e, table, &bits, &valid);
+
+   merged = *bits;
+   bitset_copy(&merged, start, state, 0, count);
+
+   // Touch the mapping only on change
+   if (bitset_all(valid, start, count) && bitset_diff(&merged, bits, SNAPSHOT_BITS, NULL) == 0)
+      return;
+
+   *bits = merged;
+   bitset_fill(valid, start, count, 1);
+   e->time = systime_wall_ms();
+   e->seq = ++snapshot->header.seq;
+
+   TRACE("Snapshot unit 0x%X table 0x%X points %d..%d changed", unit, table, start, start + count - 1);
+
+   virtual_process(unit, table, start, count);
+   shmexport_unit(unit);
+}
+
+void snapshot_store_bit(uint8_t unit, uint8_t table, uint16_t index, int value)
+{
+   bitset_t state;
+
+   bitset_clear(&state);
+   bitset_put(&state, 0, value);
+   snapshot_store_bits(unit, table, index, 1, &state);
+}
+
+// Returns -1 when some of requested bits are not known
+int snapshot_load_bits(uint8_t unit, uint8_t table, uint16_t start, int count, bitset_t *state, int64_t *time)
+{
+   snapshot_entry_t *e;
+   bitset_t *bits, *valid;
+
+   if (count <= 0 || start + count > SNAPSHOT_BITS)
+      return -1;
+
+   e = &snapshot->entries[unit];
+   snapshot_table(e, table, &bits, &valid);
+
+   if (!bitset_all(valid, start, count))
+      return -1;
+
+   bitset_clear(state);
+   bitset_copy(state, 0, bits, start, count);
+   if (time != NULL)
+      *time = e->time;
+
+   return 0;
+}
+
+void snapshot_set_stale(uint8_t unit, int value)
+{
+   snapshot_entry_t *e = &snapshot->entries[unit];
+
+   if (stale[unit] == !!value)
+      return;
+
+   stale[unit] = !!value;
+   e->seq = ++snapshot->header.seq;
+
+   TRACE("Snapshot unit 0x%X %s", unit, value ? "stale" : "read");
+
+   shmexport_unit(unit);
+}
+
+uint32_t snapshot_sequence(void)
+{
+   return snapshot->header.seq;
+}
+
+// Returns -1 when unit did not change since sequence or nothing is known about it
+int snapshot_get(uint8_t unit, uint32_t since, snapshot_state_t *state)
+{
+   const snapshot_entry_t *e = &snapshot->entries[unit];
+
+   if (e->seq == 0 || e->seq <= since)
+      return -1;
+
+   state->unit = unit;
+   state->seq = e->seq;
+   state->time = e->time;
+   state->stale = stale[unit];
+   state->coils = &e->coils;
+   state->coils_valid = &e->coils_valid;
+   state->inputs = &e->inputs;
+   state->inputs_valid = &e->inputs_valid;
+
+   return 0;
+}
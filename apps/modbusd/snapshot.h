@@ -0,0 +1,37 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "bitset.h"
+
+#define SNAPSHOT_UNITS              256
+#define SNAPSHOT_BITS               BITSET_MAX_BITS      // coils and inputs kept of every unit
+
+typedef struct
+{
+   uint8_t unit;
+   uint32_t seq;              // sequence of last change
+   int64_t time;              // last change, ms since epoch
+   uint8_t stale;             // state comes from snapshot, not read from slave yet
+   const bitset_t *coils;
+   const bitset_t *coils_valid;
+   const bitset_t *inputs;
+   const bitset_t *inputs_valid;
+
+} snapshot_state_t;
+
+
+int snapshot_init(const char *filename);
+void snapshot_close(void);
+
+void snapshot_store_bits(uint8_t unit, uint8_t table, uint16_t start, int count, const bitset_t *state);
+void snapshot_store_bit(uint8_t unit, uint8_t table, uint16_t index, int value);
+int snapshot_load_bits(uint8_t unit, uint8_t table, uint16_t start, int count, bitset_t *state, int64_t *time);
+
+void snapshot_set_stale(uint8_t unit, int value);
+
+uint32_t snapshot_sequence(void);
+int snapshot_get(uint8_t unit, uint32_t since, snapshot_state_t *state);
+
+#endif // __SNAPSHOT_H
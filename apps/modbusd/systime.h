@@ -0,0 +1,47 @@
+#ifndef __SYSTIME_H
+#define __SYSTIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic time in ms, used for all timeouts and timers
+static inline int64_t systime_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic time in us, used for bus timing measurements
+static inline int64_t systime_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Wall clock time in ms since epoch
+static inline int64_t systime_wall_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+
+   return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wall clock time in us since epoch, timestamps of samples
+static inline int64_t systime_wall_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif // __SYSTIME_H
@@ -7,7 +7,10 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "trace.h"
 
@@ -85,6 +88,62 @@ int tcp_socket_connect(const char *host, int port)
    return sd;
 }
 
+// Connect with timeout, the socket is blocking again and without Nagle delay,
+// pipelined requests are not held back until previous one is acknowledged
+int tcp_socket_connect_timeout(const char *host, int port, int timeout_ms)
+{
+   int sd, flags, err = 0, one = 1;
+   socklen_t errlen = sizeof(err);
+   struct sockaddr_in server_addr;
+   struct hostent *server_host;
+   fd_set write_fds;
+   struct timeval tv;
+
+   if ((server_host = gethostbyname(host)) == NULL)
+   {
+      TRACE_ERROR("gethostbyname '%s'", host);
+      return -1;
+   }
+
+   memset(&server_addr, 0, sizeof(server_addr));
+   memcpy(&server_addr.sin_addr, server_host->h_addr, server_host->h_length);
+   server_addr.sin_family = AF_INET;
+   server_addr.sin_port = htons(port);
+
+   if ((sd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) < 0)
+   {
+      TRACE_ERROR("socket failed");
+      return -1;
+   }
+
+   flags = fcntl(sd, F_GETFL, 0);
+   fcntl(sd, F_SETFL, flags | O_NONBLOCK);
+
+   if (connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+   {
+      if (errno != EINPROGRESS)
+         goto fail;
+
+      FD_ZERO(&write_fds);
+      FD_SET(sd, &write_fds);
+      tv.tv_sec = timeout_ms / 1000;
+      tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+      if (select(sd + 1, NULL, &write_fds, NULL, &tv) <= 0 ||
+          getsockopt(sd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0)
+         goto fail;
+   }
+
+   fcntl(sd, F_SETFL, flags);
+   setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+   return sd;
+
+fail:
+   close(sd);
+   return -1;
+}
+
 int tcp_socket_close(int sd)
 {
    return close(sd);
@@ -96,7 +155,6 @@ int tcp_socket_accept(int sd, struct sockaddr_in *remote_addr)
    int newsd;
    fd_set read_fds;   
    socklen_t addrlen = sizeof(struct sockaddr_in);
-   struct linger lin;
    
    FD_ZERO(&read_fds);
    FD_SET(sd, &read_fds);
@@ -128,14 +186,7 @@ int tcp_socket_accept(int sd, struct sockaddr_in *remote_addr)
       return -1;
    }
 
-   lin.l_onoff=1; 
-   lin.l_linger=5;
-   if (setsockopt(newsd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin)) < 0)
-   {
-      TRACE_ERROR("setsockopt SO_LINGER failed\n");
-      return -1;
-   }
-   
+   // Options of client connection are set by output layer
    return newsd;
 }
 
@@ -6,6 +6,7 @@
 
 int tcp_socket_create(int port);
 int tcp_socket_connect(const char *host, int port);
+int tcp_socket_connect_timeout(const char *host, int port, int timeout_ms);
 int tcp_socket_close(int sd);
 int tcp_socket_accept(int sd, struct sockaddr_in *remote_addr);
 int tcp_socket_send(int sd, const void *buf, int count);
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "timerwheel.h"
+
+#if !ENABLE_TRACE_TIMERWHEEL
+#include "trace_undef.h"
+#endif
+
+//
+// Hierarchical timer wheel with 1 ms tick. Level 0 slots hold timers expiring
+// within the current 64 ms window, each higher level covers 64 times longer
+// range and is cascaded down when the lower levels wrap. Add and delete are O(1).
+//
+#define WHEEL_LEVELS             5           // 2^30 ms (~12 days) range
+#define WHEEL_BITS               6
+#define WHEEL_SLOTS              (1 << WHEEL_BITS)
+#define WHEEL_MASK               (WHEEL_SLOTS - 1)
+
+static wheel_timer_t wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static int64_t wheel_now;
+static int timers_cnt = 0;
+
+
+static inline int wheel_index(int level, int64_t t)
+{
+   return (int)((t >> (level * WHEEL_BITS)) & WHEEL_MASK);
+}
+
+static inline int wheel_slot_empty(int level, int slot)
+{
+   return wheel[level][slot].next == &wheel[level][slot];
+}
+
+static void wheel_insert(wheel_timer_t *timer)
+{
+   wheel_timer_t *head;
+   uint64_t diff;
+   int level = 0, slot;
+
+   // Level is given by the highest 6-bit group where expiry differs from now
+   diff = (uint64_t)(timer->expires ^ wheel_now);
+   while (level < WHEEL_LEVELS - 1 && (diff >> ((level + 1) * WHEEL_BITS)) != 0)
+      level++;
+
+   if (timer->expires - wheel_now >= ((int64_t)1 << (WHEEL_LEVELS * WHEEL_BITS)))
+   {
+      // Out of range, park in the top level slot visited last and insert again then
+      slot = (wheel_index(level, wheel_now) + WHEEL_MASK) & WHEEL_MASK;
+   }
+   else
+   {
+      slot = wheel_index(level, timer->expires);
+   }
+
+   head = &wheel[level][slot];
+   timer->next = head;
+   timer->prev = head->prev;
+   head->prev->next = timer;
+   head->prev = timer;
+}
+
+static void wheel_unlink(wheel_timer_t *timer)
+{
+   timer->prev->next = timer->next;
+   timer->next->prev = timer->prev;
+   timer->next = NULL;
+   timer->prev = NULL;
+}
+
+// Move timers of one slot to the list given, the slot becomes empty
+static void wheel_take_slot(int level, int slot, wheel_timer_t *list)
+{
+   wheel_timer_t *head = &wheel[level][slot];
+
+   list->next = list;
+   list->prev = list;
+
+   if (wheel_slot_empty(level, slot))
+      return;
+
+   list->next = head->next;
+   list->prev = head->prev;
+   list->next->prev = list;
+   list->prev->next = list;
+
+   head->next = head;
+   head->prev = head;
+}
+
+// Process one tick at wheel_now
+static void wheel_tick(void)
+{
+   wheel_timer_t list, *timer;
+   int level;
+
+   // Cascade from top, timers moved from higher level may land in lower slot cascaded next
+   for (level = WHEEL_LEVELS - 1; level > 0; level--)
+   {
+      if ((wheel_now & (((int64_t)1 << (level * WHEEL_BITS)) - 1)) != 0)
+         continue;
+
+      wheel_take_slot(level, wheel_index(level, wheel_now), &list);
+      while (list.next != &list)
+      {
+         timer = list.next;
+         wheel_unlink(timer);
+         wheel_insert(timer);
+      }
+   }
+
+   wheel_take_slot(0, wheel_index(0, wheel_now), &list);
+   while (list.next != &list)
+   {
+      timer = list.next;
+      wheel_unlink(timer);
+      timers_cnt--;
+
+      // Callback may add the timer again
+      timer->callback(timer, timer->arg);
+   }
+}
+
+void timerwheel_init(int64_t now)
+{
+   int level, slot;
+
+   for (level = 0; level < WHEEL_LEVELS; level++)
+   {
+      for (slot = 0; slot < WHEEL_SLOTS; slot++)
+      {
+         wheel[level][slot].next = &wheel[level][slot];
+         wheel[level][slot].prev = &wheel[level][slot];
+      }
+   }
+
+   wheel_now = now;
+   timers_cnt = 0;
+}
+
+void timer_init(wheel_timer_t *timer, wheel_timer_cb_t callback, void *arg)
+{
+   memset(timer, 0, sizeof(wheel_timer_t));
+   timer->callback = callback;
+   timer->arg = arg;
+}
+
+void timer_add(wheel_timer_t *timer, int64_t expires)
+{
+   if (timer_pending(timer))
+      timer_del(timer);
+
+   // Current tick is already processed
+   if (expires <= wheel_now)
+      expires = wheel_now + 1;
+
+   timer->expires = expires;
+   wheel_insert(timer);
+   timers_cnt++;
+}
+
+void timer_del(wheel_timer_t *timer)
+{
+   if (!timer_pending(timer))
+      return;
+
+   wheel_unlink(timer);
+   timers_cnt--;
+}
+
+int timer_pending(const wheel_timer_t *timer)
+{
+   return timer->next != NULL;
+}
+
+int timerwheel_count(void)
+{
+   return timers_cnt;
+}
+
+// Nearest tick when a non-empty slot is expired or cascaded, -1 when no timer is pending
+int64_t timerwheel_next_expiry(void)
+{
+   int64_t next = -1, t, span, base;
+   int level, slot, k;
+
+   if (timers_cnt == 0)
+      return -1;
+
+   for (level = 0; level < WHEEL_LEVELS; level++)
+   {
+      span = (int64_t)1 << (level * WHEEL_BITS);
+      base = wheel_now & ~((span << WHEEL_BITS) - 1);
+
+      for (k = 1; k <= WHEEL_SLOTS; k++)
+      {
+         slot = (wheel_index(level, wheel_now) + k) & WHEEL_MASK;
+         if (wheel_slot_empty(level, slot))
+            continue;
+
+         t = base + slot * span;
+         if (t <= wheel_now)
+            t += span << WHEEL_BITS;
+
+         if (next < 0 || t < next)
+            next = t;
+         break;
+      }
+   }
+
+   return next;
+}
+
+void timerwheel_advance(int64_t now)
+{
+   int64_t next;
+
+   while (wheel_now < now)
+   {
+      // Skip idle ticks
+      next = timerwheel_next_expiry();
+      if (next < 0 || next > now)
+      {
+         wheel_now = now;
+         break;
+      }
+
+      wheel_now = next;
+      wheel_tick();
+   }
+}
@@ -0,0 +1,32 @@
+#ifndef __TIMERWHEEL_H
+#define __TIMERWHEEL_H
+
+#include <stdint.h>
+
+struct wheel_timer;
+
+typedef void (*wheel_timer_cb_t)(struct wheel_timer *timer, void *arg);
+
+typedef struct wheel_timer
+{
+   struct wheel_timer *next;
+   struct wheel_timer *prev;
+   int64_t expires;              // monotonic ms
+   wheel_timer_cb_t callback;
+   void *arg;
+
+} wheel_timer_t;
+
+
+void timerwheel_init(int64_t now);
+
+void timer_init(wheel_timer_t *timer, wheel_timer_cb_t callback, void *arg);
+void timer_add(wheel_timer_t *timer, int64_t expires);
+void timer_del(wheel_timer_t *timer);
+int timer_pending(const wheel_timer_t *timer);
+
+int64_t timerwheel_next_expiry(void);
+void timerwheel_advance(int64_t now);
+int timerwheel_count(void);
+
+#endif // __TIMERWHEEL_H
@@ -0,0 +1,470 @@
+/*
+ * MODBUS TCP load generator and latency benchmark.
+ *
+ * Usage: modbusbench [-options]
+ *   -H <host>            Server host (default 127.0.0.1)
+ *   -c <connections>     Number of connections (default 1)
+ *   -t <seconds>         Test duration (default 10)
+ *   -r <rate>            Target rate of all connections in requests/s, 0 = closed loop (default)
+ *   -m <mix>             Function mix func:weight,... (default 1:1), functions 1, 2, 3, 5, 16
+ *   -u <unit>            Slave address (default 1)
+ *   -a <addr> -q <count> Start address and count of reads (default 0, 8)
+ *   -S <sim args>        Start PTY slave simulator and modbusd from the same directory first
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MODBUS_TCP_PORT          502
+#define MAX_CONNECTIONS          64
+#define MAX_MIX                  8
+#define MAX_SAMPLES              (1 << 20)
+
+typedef struct
+{
+   uint8_t func;
+   int weight;
+
+} bench_mix_t;
+
+typedef struct
+{
+   pthread_t thread;
+   int id;
+   int sd;
+   uint16_t tid;
+   unsigned int seed;
+   uint32_t *latency;         // us
+   int samples;
+   int requests;
+   int exceptions;
+   int errors;
+
+} bench_conn_t;
+
+static const char *host = "127.0.0.1";
+static int connections = 1;
+static int duration = 10;
+static double rate = 0;
+static bench_mix_t mix[MAX_MIX] = {{1, 1}};
+static int mix_cnt = 1;
+static int mix_total = 1;
+static int unit = 1;
+static int start_addr = 0;
+static int quantity = 8;
+static bench_conn_t conns[MAX_CONNECTIONS];
+static int64_t end_time;
+
+
+static int64_t now_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(int64_t t)
+{
+   struct timespec ts;
+
+   ts.tv_sec = t / 1000000;
+   ts.tv_nsec = (t % 1000000) * 1000;
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int parse_mix(char *s)
+{
+   char *p, *save;
+
+   mix_cnt = 0;
+   mix_total = 0;
+
+   for (p = strtok_r(s, ",", &save); p != NULL && mix_cnt < MAX_MIX; p = strtok_r(NULL, ",", &save))
+   {
+      mix[mix_cnt].func = atoi(p);
+      mix[mix_cnt].weight = strchr(p, ':') ? atoi(strchr(p, ':') + 1) : 1;
+
+      switch (mix[mix_cnt].func)
+      {
+         case 1: case 2: case 3: case 5: case 16:
+            break;
+         default:
+            fprintf(stderr, "Not supported function %d\n", mix[mix_cnt].func);
+            return -1;
+      }
+
+      mix_total += mix[mix_cnt].weight;
+      mix_cnt++;
+   }
+
+   return mix_total > 0 ? 0 : -1;
+}
+
+static int bench_connect(void)
+{
+   struct sockaddr_in addr;
+   struct hostent *he;
+   int sd, one = 1;
+
+   if ((he = gethostbyname(host)) == NULL)
+      return -1;
+
+   if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      return -1;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(MODBUS_TCP_PORT);
+   memcpy(&addr.sin_addr, he->h_addr, he->h_length);
+
+   if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+   {
+      close(sd);
+      return -1;
+   }
+
+   setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+   return sd;
+}
+
+// Request PDU of function picked by mix weights
+static int bench_build(bench_conn_t *c, uint8_t *buf)
+{
+   int ix, w = rand_r(&c->seed) % mix_total, len = 7;
+   uint8_t func = mix[0].func;
+
+   for (ix = 0; ix < mix_cnt; ix++)
+   {
+      if (w < mix[ix].weight)
+      {
+         func = mix[ix].func;
+         break;
+      }
+      w -= mix[ix].weight;
+   }
+
+   c->tid++;
+   buf[0] = c->tid >> 8;
+   buf[1] = c->tid & 0xFF;
+   buf[2] = 0;
+   buf[3] = 0;
+   buf[6] = unit;
+   buf[len++] = func;
+   buf[len++] = start_addr >> 8;
+   buf[len++] = start_addr & 0xFF;
+
+   switch (func)
+   {
+      case 5:
+         buf[len++] = (rand_r(&c->seed) & 1) ? 0xFF : 0x00;
+         buf[len++] = 0;
+         break;
+
+      case 16:
+         buf[len++] = 0;
+         buf[len++] = 2;
+         buf[len++] = 4;
+         for (ix = 0; ix < 4; ix++)
+            buf[len++] = rand_r(&c->seed);
+         break;
+
+      default:
+         buf[len++] = quantity >> 8;
+         buf[len++] = quantity & 0xFF;
+   }
+
+   buf[4] = (len - 6) >> 8;
+   buf[5] = (len - 6) & 0xFF;
+
+   return len;
+}
+
+static int recv_all(int sd, uint8_t *buf, int len)
+{
+   int res, total = 0;
+
+   while (total < len)
+   {
+      if ((res = recv(sd, buf + total, len - total, 0)) <= 0)
+         return -1;
+      total += res;
+   }
+
+   return total;
+}
+
+// One request, returns 0 on response, 1 on exception, -1 on error
+static int bench_transaction(bench_conn_t *c)
+{
+   uint8_t req[32], rsp[300];
+   int len, rsplen;
+
+   len = bench_build(c, req);
+
+   if (send(c->sd, req, len, 0) != len)
+      return -1;
+
+   if (recv_all(c->sd, rsp, 7) < 0)
+      return -1;
+
+   rsplen = (rsp[4] << 8) | rsp[5];
+   if (rsplen < 2 || rsplen > 254 || recv_all(c->sd, rsp + 7, rsplen - 1) < 0)
+      return -1;
+
+   if (rsp[0] != req[0] || rsp[1] != req[1])
+      return -1;
+
+   return (rsp[7] & 0x80) ? 1 : 0;
+}
+
+static void *bench_thread(void *arg)
+{
+   bench_conn_t *c = arg;
+   int64_t next, start, interval = 0;
+   int res;
+
+   if (rate > 0)
+      interval = (int64_t)(1000000.0 * connections / rate);
+
+   // Spread open loop connections over the interval
+   next = now_us() + (interval * c->id) / connections;
+
+   while (now_us() < end_time && c->samples < MAX_SAMPLES)
+   {
+      if (interval > 0)
+      {
+         sleep_until(next);
+         start = next;           // latency from intended send time, no coordinated omission
+         next += interval;
+      }
+      else
+      {
+         start = now_us();
+      }
+
+      res = bench_transaction(c);
+      c->requests++;
+
+      if (res < 0)
+      {
+         c->errors++;
+         break;
+      }
+
+      if (res > 0)
+         c->exceptions++;
+
+      c->latency[c->samples++] = (uint32_t)(now_us() - start);
+   }
+
+   return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+   return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *v, int n, double p)
+{
+   int ix = (int)(p * (n - 1) + 0.5);
+
+   return n > 0 ? v[ix] : 0;
+}
+
+static pid_t spawn(char *const argv[])
+{
+   pid_t pid = fork();
+
+   if (pid == 0)
+   {
+      int fd = open("/dev/null", O_WRONLY);
+      dup2(fd, STDOUT_FILENO);
+      execv(argv[0], argv);
+      _exit(127);
+   }
+
+   return pid;
+}
+
+// Start modbussim on PTY and modbusd on it, both from directory of this binary
+static int start_sim(const char *self, char *simargs, pid_t *pids)
+{
+   static char sim[300], daemon[300], link[64];
+   char *argv[32], *p, *save, dir[256];
+   int argc = 0;
+
+   snprintf(dir, sizeof(dir), "%s", self);
+   snprintf(sim, sizeof(sim), "%s/modbussim", dirname(dir));
+   snprintf(daemon, sizeof(daemon), "%s/modbusd", dir);
+   snprintf(link, sizeof(link), "/tmp/modbusbench-%d", getpid());
+
+   argv[argc++] = sim;
+   argv[argc++] = "-l";
+   argv[argc++] = link;
+   for (p = strtok_r(simargs, " ", &save); p != NULL && argc < 30; p = strtok_r(NULL, " ", &save))
+      argv[argc++] = p;
+   argv[argc] = NULL;
+
+   if ((pids[0] = spawn(argv)) < 0)
+      return -1;
+   usleep(300000);
+
+   argv[0] = daemon;
+   argv[1] = "-d";
+   argv[2] = link;
+   argv[3] = NULL;
+
+   if ((pids[1] = spawn(argv)) < 0)
+      return -1;
+   usleep(500000);
+
+   return 0;
+}
+
+static void usage(void)
+{
+   printf("Usage modbusbench [-options]\n");
+   printf("options:\n");
+   printf("   -H <host>                      Server host (default 127.0.0.1)\n");
+   printf("   -c <connections>               Number of connections (default 1)\n");
+   printf("   -t <seconds>                   Test duration (default 10)\n");
+   printf("   -r <rate>                      Total target rate in requests/s, 0 = closed loop\n");
+   printf("   -m <func:weight,...>           Function mix of 1, 2, 3, 5, 16 (default 1:1)\n");
+   printf("   -u <unit>                      Slave address (default 1)\n");
+   printf("   -a <addr> -q <count>           Start address and count of reads (default 0, 8)\n");
+   printf("   -S \"<simulator args>\"          Run against PTY slave simulator, e.g. \"-s 1 -t 5\"\n");
+}
+
+int main(int argc, char *argv[])
+{
+   uint32_t *all;
+   int64_t t0, elapsed;
+   pid_t pids[2] = {-1, -1};
+   char *simargs = NULL;
+   int ix, total = 0, requests = 0, exceptions = 0, errors = 0;
+
+   for (ix = 1; ix < argc; ix++)
+   {
+      if (!strcmp(argv[ix], "-H") && ix + 1 < argc)
+         host = argv[++ix];
+      else if (!strcmp(argv[ix], "-c") && ix + 1 < argc)
+         connections = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-t") && ix + 1 < argc)
+         duration = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-r") && ix + 1 < argc)
+         rate = atof(argv[++ix]);
+      else if (!strcmp(argv[ix], "-m") && ix + 1 < argc)
+      {
+         if (parse_mix(argv[++ix]) < 0)
+            return 1;
+      }
+      else if (!strcmp(argv[ix], "-u") && ix + 1 < argc)
+         unit = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-a") && ix + 1 < argc)
+         start_addr = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-q") && ix + 1 < argc)
+         quantity = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-S") && ix + 1 < argc)
+         simargs = argv[++ix];
+      else
+      {
+         usage();
+         return 1;
+      }
+   }
+
+   if (connections < 1 || connections > MAX_CONNECTIONS)
+   {
+      fprintf(stderr, "Connections must be 1 .. %d\n", MAX_CONNECTIONS);
+      return 1;
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   if (simargs != NULL && start_sim(argv[0], simargs, pids) < 0)
+   {
+      fprintf(stderr, "Start simulator failed\n");
+      return 1;
+   }
+
+   for (ix = 0; ix < connections; ix++)
+   {
+      conns[ix].id = ix;
+      conns[ix].seed = ix + 1;
+      if ((conns[ix].latency = malloc(MAX_SAMPLES * sizeof(uint32_t))) == NULL ||
+          (conns[ix].sd = bench_connect()) < 0)
+      {
+         fprintf(stderr, "Connect to %s failed\n", host);
+         return 1;
+      }
+   }
+
+   t0 = now_us();
+   end_time = t0 + (int64_t)duration * 1000000;
+
+   for (ix = 0; ix < connections; ix++)
+      pthread_create(&conns[ix].thread, NULL, bench_thread, &conns[ix]);
+
+   for (ix = 0; ix < connections; ix++)
+   {
+      pthread_join(conns[ix].thread, NULL);
+      close(conns[ix].sd);
+      total += conns[ix].samples;
+      requests += conns[ix].requests;
+      exceptions += conns[ix].exceptions;
+      errors += conns[ix].errors;
+   }
+
+   elapsed = now_us() - t0;
+
+   if ((all = malloc((total + 1) * sizeof(uint32_t))) == NULL)
+      return 1;
+
+   for (ix = 0, total = 0; ix < connections; ix++)
+   {
+      memcpy(&all[total], conns[ix].latency, conns[ix].samples * sizeof(uint32_t));
+      total += conns[ix].samples;
+   }
+
+   qsort(all, total, sizeof(uint32_t), cmp_u32);
+
+   printf("connections %d, %s, %.1f s\n", connections, rate > 0 ? "open loop" : "closed loop", elapsed / 1e6);
+   printf("requests %d, exceptions %d, errors %d\n", requests, exceptions, errors);
+   printf("throughput %.1f req/s\n", total * 1e6 / elapsed);
+   printf("latency ms: p50 %.2f  p99 %.2f  p999 %.2f  max %.2f\n",
+          percentile(all, total, 0.50) / 1000.0, percentile(all, total, 0.99) / 1000.0,
+          percentile(all, total, 0.999) / 1000.0, total ? all[total - 1] / 1000.0 : 0);
+
+   for (ix = 1; ix >= 0; ix--)
+   {
+      if (pids[ix] > 0)
+      {
+         kill(pids[ix], SIGTERM);
+         waitpid(pids[ix], NULL, 0);
+      }
+   }
+
+   return errors ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Reader of slaves state published by modbusd in shared memory (modbusd -M).
+ *
+ * Usage: modbusshm [-options] [unit]...
+ *   -n <name>            Shared memory name (default /modbusd)
+ *   -w                   Watch, print units again when they change
+ *   -b                   Benchmark consistent reads of all units
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../modbusd_shm.h"
+
+#define WATCH_PERIOD_US          10000
+#define BENCH_ROUNDS             10000
+
+static int64_t now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_table(const char *name, const uint32_t *bits, const uint32_t *valid)
+{
+   int ix, last = -1;
+
+   for (ix = 0; ix < MODBUSD_SHM_WORDS * 32; ix++)
+   {
+      if (modbusd_shm_bit(valid, ix))
+         last = ix;
+   }
+
+   if (last < 0)
+      return;
+
+   printf("  %-6s ", name);
+   for (ix = 0; ix <= last; ix++)
+      putchar(!modbusd_shm_bit(valid, ix) ? '?' : modbusd_shm_bit(bits, ix) ? '1' : '0');
+   putchar('\n');
+}
+
+static void print_unit(const modbusd_shm_t *shm, int unit)
+{
+   modbusd_shm_unit_t u;
+   int res;
+
+   if ((res = modbusd_shm_read(shm, unit, &u)) < 0)
+   {
+      if (res == -2)
+         printf("unit %d busy\n", unit);
+      return;
+   }
+
+   printf("unit %d seq %u time %lld%s\n", unit, u.seq, (long long)u.time, (u.flags & MODBUSD_SHM_STALE) ? " stale" : "");
+   print_table("coils", u.coils, u.coils_valid);
+   print_table("inputs", u.inputs, u.inputs_valid);
+}
+
+int main(int argc, char *argv[])
+{
+   const modbusd_shm_t *shm;
+   const char *name = MODBUSD_SHM_NAME;
+   modbusd_shm_unit_t u;
+   uint8_t units[MODBUSD_SHM_UNITS];
+   uint32_t seq, last = 0;
+   int64_t t;
+   int ix, jx, opt, watch = 0, bench = 0, all = 1;
+
+   memset(units, 0, sizeof(units));
+
+   while ((opt = getopt(argc, argv, "n:wb")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n': name = optarg; break;
+         case 'w': watch = 1; break;
+         case 'b': bench = 1; break;
+         default:
+            fprintf(stderr, "Usage: %s [-n name] [-w] [-b] [unit]...\n", argv[0]);
+            return 1;
+      }
+   }
+
+   for (ix = optind; ix < argc; ix++)
+   {
+      units[atoi(argv[ix]) & 0xFF] = 1;
+      all = 0;
+   }
+
+   if ((shm = modbusd_shm_open(name)) == NULL)
+   {
+      fprintf(stderr, "Shared memory %s not published\n", name);
+      return 1;
+   }
+
+   printf("modbusd pid %u seq %u\n", shm->header.pid, modbusd_shm_sequence(shm));
+
+   if (bench)
+   {
+      t = now_ns();
+      for (ix = 0; ix < BENCH_ROUNDS; ix++)
+      {
+         for (jx = 0; jx < MODBUSD_SHM_UNITS; jx++)
+            modbusd_shm_read(shm, jx, &u);
+      }
+      t = now_ns() - t;
+      printf("%d unit reads, %.1f ns per unit\n", BENCH_ROUNDS * MODBUSD_SHM_UNITS, (double)t / (BENCH_ROUNDS * MODBUSD_SHM_UNITS));
+   }
+
+   do
+   {
+      if (!modbusd_shm_alive(shm))
+      {
+         fprintf(stderr, "modbusd exited\n");
+         break;
+      }
+
+      // Nothing changed, no unit block is read
+      if ((seq = modbusd_shm_sequence(shm)) != last || last == 0)
+      {
+         for (ix = 0; ix < MODBUSD_SHM_UNITS; ix++)
+         {
+            if ((all || units[ix]) && (last == 0 || shm->units[ix].seq > last))
+               print_unit(shm, ix);
+         }
+         last = seq ? seq : 1;
+         fflush(stdout);
+      }
+
+      if (watch)
+         usleep(WATCH_PERIOD_US);
+   }
+   while (watch);
+
+   modbusd_shm_close(shm);
+
+   return 0;
+}
@@ -0,0 +1,386 @@
+/*
+ * MODBUS RTU slave simulator on a pseudo terminal.
+ *
+ * Usage: modbussim [-b <baudrate>] [-l <link>] [-t <turnaround ms>] [-n <noise permille>] [-i <ms>] -s <addr>[:china] ...
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pty.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#define MAX_SLAVES         32
+#define NUM_BITS           64
+#define NUM_REGS           64
+
+typedef struct
+{
+   uint8_t addr;
+   int china;
+   uint8_t coils[NUM_BITS];
+   uint8_t inputs[NUM_BITS];
+   uint16_t regs[NUM_REGS];
+
+} sim_slave_t;
+
+static sim_slave_t slaves[MAX_SLAVES];
+static int slaves_cnt = 0;
+static int turnaround_ms = 5;
+static int noise_permille = 0;
+static int inputs_toggle_ms = 0;
+static int frame_gap_us = 4000;
+
+static uint16_t crc16(const uint8_t *buf, int len)
+{
+   uint16_t crc = 0xFFFF;
+   int ix, bit;
+
+   for (ix = 0; ix < len; ix++)
+   {
+      crc ^= buf[ix];
+      for (bit = 0; bit < 8; bit++)
+         crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+   }
+
+   // Transmitted low byte first, same as the (hi << 8 | lo) table variant in modbus.c
+   return (uint16_t)((crc & 0xFF) << 8 | crc >> 8);
+}
+
+static sim_slave_t *find_slave(int addr)
+{
+   int ix;
+
+   for (ix = 0; ix < slaves_cnt; ix++)
+   {
+      if (slaves[ix].addr == addr)
+         return &slaves[ix];
+   }
+
+   return NULL;
+}
+
+static void send_frame(int fd, uint8_t *buf, int len)
+{
+   uint16_t crc = crc16(buf, len);
+
+   buf[len++] = crc >> 8;
+   buf[len++] = crc & 0xFF;
+
+   usleep(turnaround_ms * 1000);
+
+   if (noise_permille > 0 && rand() % 1000 < noise_permille)
+   {
+      uint8_t garbage[8];
+      int ix, n = 1 + rand() % sizeof(garbage);
+
+      for (ix = 0; ix < n; ix++)
+         garbage[ix] = rand();
+      if (write(fd, garbage, n) < 0)
+         return;
+   }
+
+   if (write(fd, buf, len) < 0)
+      perror("write");
+}
+
+static int pack_bits(const uint8_t *bits, int start, int count, uint8_t *out)
+{
+   int ix, nbytes = (count + 7) / 8;
+
+   memset(out, 0, nbytes);
+   for (ix = 0; ix < count; ix++)
+   {
+      if (start + ix < NUM_BITS && bits[start + ix])
+         out[ix / 8] |= 1 << (ix % 8);
+   }
+
+   return nbytes;
+}
+
+static void exception(int fd, uint8_t addr, uint8_t func, uint8_t code)
+{
+   uint8_t rsp[8];
+
+   rsp[0] = addr;
+   rsp[1] = func | 0x80;
+   rsp[2] = code;
+   send_frame(fd, rsp, 3);
+}
+
+static void handle_frame(int fd, uint8_t *req, int len)
+{
+   sim_slave_t *s;
+   uint8_t rsp[300];
+   uint16_t a, v;
+   int ix, n;
+
+   if (len < 4 || crc16(req, len - 2) != ((req[len - 2] << 8) | req[len - 1]))
+   {
+      fprintf(stderr, "sim: bad frame (%d bytes)\n", len);
+      return;
+   }
+
+   if ((s = find_slave(req[0])) == NULL)
+      return;
+
+   a = (req[2] << 8) | req[3];
+   v = (req[4] << 8) | req[5];
+   rsp[0] = req[0];
+   rsp[1] = req[1];
+
+   switch (req[1])
+   {
+      case 0x01:
+      case 0x02:
+      {
+         const uint8_t *bits = (req[1] == 0x01) ? s->coils : s->inputs;
+
+         if (s->china && req[1] == 0x01)
+         {
+            // bit by bit read: regaddr = coil index, response carries 2 data bytes
+            rsp[2] = 1;
+            rsp[3] = (a < NUM_BITS) ? s->coils[a] : 0;
+            send_frame(fd, rsp, 4);
+            break;
+         }
+
+         if (s->china && req[1] == 0x02)
+            v = 8;
+
+         if (v == 0 || v > 2000)
+         {
+            exception(fd, req[0], req[1], 0x03);
+            break;
+         }
+
+         n = pack_bits(bits, a, v, &rsp[3]);
+         rsp[2] = n;
+         send_frame(fd, rsp, 3 + n);
+      }
+      break;
+
+      case 0x03:
+      case 0x04:
+      {
+         if (v == 0 || v > 125 || a + v > NUM_REGS)
+         {
+            exception(fd, req[0], req[1], 0x02);
+            break;
+         }
+
+         rsp[2] = v * 2;
+         for (ix = 0; ix < v; ix++)
+         {
+            rsp[3 + ix * 2] = s->regs[a + ix] >> 8;
+            rsp[4 + ix * 2] = s->regs[a + ix] & 0xFF;
+         }
+         send_frame(fd, rsp, 3 + v * 2);
+      }
+      break;
+
+      case 0x05:
+      {
+         if (s->china)
+         {
+            if (a == 0 || a > NUM_BITS)
+               return;
+            s->coils[a - 1] = (v == 0x100);
+         }
+         else
+         {
+            if (a >= NUM_BITS)
+            {
+               exception(fd, req[0], req[1], 0x02);
+               break;
+            }
+            s->coils[a] = (v == 0xFF00);
+         }
+
+         memcpy(rsp, req, 6);
+         send_frame(fd, rsp, 6);
+      }
+      break;
+
+      case 0x06:
+      {
+         if (a < NUM_REGS)
+            s->regs[a] = v;
+
+         // Last register drives discrete inputs, used by tests
+         if (a == NUM_REGS - 1)
+         {
+            for (ix = 0; ix < 16; ix++)
+               s->inputs[ix] = (v >> ix) & 1;
+         }
+
+         memcpy(rsp, req, 6);
+         send_frame(fd, rsp, 6);
+      }
+      break;
+
+      case 0x0F:
+      {
+         if (s->china)
+            return;
+
+         for (ix = 0; ix < v && a + ix < NUM_BITS; ix++)
+            s->coils[a + ix] = (req[7 + ix / 8] >> (ix % 8)) & 1;
+
+         memcpy(rsp, req, 6);
+         send_frame(fd, rsp, 6);
+      }
+      break;
+
+      case 0x10:
+      {
+         if (s->china)
+            return;
+
+         for (ix = 0; ix < v && a + ix < NUM_REGS; ix++)
+            s->regs[a + ix] = (req[7 + ix * 2] << 8) | req[8 + ix * 2];
+
+         memcpy(rsp, req, 6);
+         send_frame(fd, rsp, 6);
+      }
+      break;
+
+      default:
+         if (!s->china)
+            exception(fd, req[0], req[1], 0x01);
+   }
+}
+
+static void toggle_inputs(void)
+{
+   int ix;
+
+   for (ix = 0; ix < slaves_cnt; ix++)
+   {
+      slaves[ix].inputs[rand() % 8] ^= 1;
+      slaves[ix].regs[0] += 1 + rand() % 10;
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   int master, slave, ix, len = 0;
+   int baudrate = 9600;
+   const char *link = NULL;
+   char name[128];
+   uint8_t frame[512];
+   struct termios tio;
+   struct timeval next_toggle, now;
+
+   for (ix = 1; ix < argc; ix++)
+   {
+      if (!strcmp(argv[ix], "-b"))
+         baudrate = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-l"))
+         link = argv[++ix];
+      else if (!strcmp(argv[ix], "-t"))
+         turnaround_ms = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-n"))
+         noise_permille = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-i"))
+         inputs_toggle_ms = atoi(argv[++ix]);
+      else if (!strcmp(argv[ix], "-s") && slaves_cnt < MAX_SLAVES)
+      {
+         char *p = argv[++ix];
+
+         memset(&slaves[slaves_cnt], 0, sizeof(sim_slave_t));
+         slaves[slaves_cnt].addr = atoi(p);
+         slaves[slaves_cnt].china = (strstr(p, ":china") != NULL);
+         slaves_cnt++;
+      }
+      else
+      {
+         fprintf(stderr, "Usage: modbussim [-b baud] [-l link] [-t ms] [-n permille] [-i ms] -s addr[:china] ...\n");
+         return 1;
+      }
+   }
+
+   // t3.5 at the simulated baudrate, at least 2 ms to tolerate scheduling jitter
+   frame_gap_us = 35 * 1000000 / baudrate;
+   if (frame_gap_us < 2000)
+      frame_gap_us = 2000;
+
+   if (openpty(&master, &slave, name, NULL, NULL) < 0)
+   {
+      perror("openpty");
+      return 1;
+   }
+
+   tcgetattr(slave, &tio);
+   cfmakeraw(&tio);
+   tcsetattr(slave, TCSANOW, &tio);
+   tcgetattr(master, &tio);
+   cfmakeraw(&tio);
+   tcsetattr(master, TCSANOW, &tio);
+
+   if (link != NULL)
+   {
+      unlink(link);
+      if (symlink(name, link) < 0)
+         perror("symlink");
+   }
+
+   printf("%s\n", name);
+   fflush(stdout);
+
+   gettimeofday(&next_toggle, NULL);
+   srand(1);
+
+   while (1)
+   {
+      fd_set fds;
+      struct timeval tv;
+      int res;
+
+      FD_ZERO(&fds);
+      FD_SET(master, &fds);
+      tv.tv_sec = 0;
+      tv.tv_usec = len > 0 ? frame_gap_us : 100000;
+
+      res = select(master + 1, &fds, NULL, NULL, &tv);
+      if (res < 0 && errno != EINTR)
+         break;
+
+      if (res > 0)
+      {
+         int n = read(master, &frame[len], sizeof(frame) - len);
+         if (n > 0)
+            len += n;
+         if (len == (int)sizeof(frame))
+            len = 0;
+      }
+      else if (len > 0)
+      {
+         handle_frame(master, frame, len);
+         len = 0;
+      }
+
+      if (inputs_toggle_ms > 0)
+      {
+         gettimeofday(&now, NULL);
+         if (timercmp(&now, &next_toggle, >))
+         {
+            toggle_inputs();
+            next_toggle = now;
+            next_toggle.tv_usec += inputs_toggle_ms * 1000;
+            next_toggle.tv_sec += next_toggle.tv_usec / 1000000;
+            next_toggle.tv_usec %= 1000000;
+         }
+      }
+   }
+
+   return 0;
+}
@@ -9,6 +9,22 @@
 #define ENABLE_TRACE_MODBUS            0
 #define ENABLE_TRACE_TCP_SOCKET        0
 #define ENABLE_TRACE_SERIAL            1
+#define ENABLE_TRACE_HISTORY           0
+#define ENABLE_TRACE_SCENE             0
+#define ENABLE_TRACE_TIMERWHEEL        0
+#define ENABLE_TRACE_ACTION            0
+#define ENABLE_TRACE_POLL              0
+#define ENABLE_TRACE_RULE              0
+#define ENABLE_TRACE_SNAPSHOT          0
+#define ENABLE_TRACE_DISCOVERY         0
+#define ENABLE_TRACE_REQUEST           0
+#define ENABLE_TRACE_PLAN              0
+#define ENABLE_TRACE_GATEWAY           0
+#define ENABLE_TRACE_PROFILE           0
+#define ENABLE_TRACE_OUTPUT            0
+#define ENABLE_TRACE_VIRTUAL           0
+#define ENABLE_TRACE_SHMEXPORT         0
+#define ENABLE_TRACE_CYCLE             0
 
 
 
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+#include "modbus.h"
+#include "bitset.h"
+#include "snapshot.h"
+#include "plan.h"
+#include "virtual.h"
+
+#if !ENABLE_TRACE_VIRTUAL
+#include "trace_undef.h"
+#endif
+
+//
+// Virtual slaves, their holding registers are computed from cached coils and
+// inputs of real slaves (relays on, any window open, ...) and from registers
+// read by polls and sampling cycles (sum of meter phases, highest temperature).
+// Values are updated when snapshot of a bit operand changes or when a read
+// covers a register operand, read request only copies them and costs no bus
+// transaction. Operands are refresh requirements of the polling plan. Registers
+// are not in the snapshot, register operands are unknown after start and reload
+// until they are read.
+//
+#define CFG_VIRTUAL_MAX             64
+
+typedef struct
+{
+   virtual_register_t def;
+   uint32_t values[VIRTUAL_MAX_OPERANDS]; // points on or sum of registers of operand
+   uint16_t regs[VIRTUAL_MAX_OPERANDS][VIRTUAL_MAX_REGISTERS];
+   uint8_t regs_known[VIRTUAL_MAX_OPERANDS];    // mask of registers read
+   uint8_t known;                         // mask of operands with all points cached or read
+   uint8_t full;                          // mask of operands with all points on or all registers not 0
+   uint16_t value;
+
+} virtual_entry_t;
+
+// Operand of register, sorted by slave for lookup on snapshot change
+typedef struct
+{
+   uint8_t unit;
+   uint8_t func;
+   uint16_t start;
+   uint16_t count;
+   uint16_t entry;
+   uint8_t operand;
+
+} virtual_source_t;
+
+static virtual_entry_t entries[CFG_VIRTUAL_MAX];
+static int entries_cnt = 0;
+static virtual_source_t sources[CFG_VIRTUAL_MAX * VIRTUAL_MAX_OPERANDS];
+static int sources_cnt = 0;
+static uint8_t units[256];
+
+
+static int virtual_registers(uint8_t func)
+{
+   return func == MODBUS_FUNC_READ_HOLDING_REGISTERS || func == MODBUS_FUNC_READ_INPUT_REGISTERS;
+}
+
+static int virtual_valid(const virtual_entry_t *e)
+{
+   return e->known == (1 << e->def.operands_cnt) - 1;
+}
+
+static void virtual_evaluate(virtual_entry_t *e)
+{
+   const virtual_register_t *def = &e->def;
+   uint32_t value = 0;
+   int ix;
+
+   if (!virtual_valid(e))
+      return;
+
+   for (ix = 0; ix < def->operands_cnt; ix++)
+   {
+      switch (def->op)
+      {
+         case VIRTUAL_OP_ANY:
+            value |= (e->values[ix] > 0);
+            break;
+
+         case VIRTUAL_OP_ALL:
+            value += (e->full >> ix) & 1;
+            break;
+
+         case VIRTUAL_OP_MIN:
+            if (ix == 0 || e->values[ix] < value)
+               value = e->values[ix];
+            break;
+
+         case VIRTUAL_OP_MAX:
+            if (e->values[ix] > value)
+               value = e->values[ix];
+            break;
+
+         default:
+            value += e->values[ix];
+      }
+   }
+
+   if (def->op == VIRTUAL_OP_ALL)
+      value = (value == def->operands_cnt);
+   if (value > 0xFFFF)
+      value = 0xFFFF;
+
+   if (value != e->value)
+   {
+      TRACE("Virtual unit 0x%X register %d = %u", def->unit, def->reg, value);
+   }
+
+   e->value = value;
+}
+
+// Count points on of operand in snapshot
+static void virtual_update(const virtual_source_t *src)
+{
+   virtual_entry_t *e = &entries[src->entry];
+   bitset_t state;
+
+   if (snapshot_load_bits(src->unit, src->func, src->start, src->count, &state, NULL) < 0)
+   {
+      e->known &= ~(1 << src->operand);
+      return;
+   }
+
+   e->values[src->operand] = bitset_count(&state, 0, src->count);
+   e->known |= 1 << src->operand;
+
+   if (e->values[src->operand] == src->count)
+      e->full |= 1 << src->operand;
+   else
+      e->full &= ~(1 << src->operand);
+}
+
+// Store registers of operand read from start, data as on the wire
+static void virtual_update_registers(const virtual_source_t *src, uint16_t start, uint16_t count, const uint8_t *data)
+{
+   virtual_entry_t *e = &entries[src->entry];
+   uint16_t *regs = e->regs[src->operand];
+   uint32_t sum = 0;
+   int ix, from, to, full = 1;
+
+   from = (src->start > start) ? src->start : start;
+   to = (src->start + src->count < start + count) ? src->start + src->count : start + count;
+
+   for (ix = from; ix < to; ix++)
+   {
+      regs[ix - src->start] = (data[2 * (ix - start)] << 8) | data[2 * (ix - start) + 1];
+      e->regs_known[src->operand] |= 1 << (ix - src->start);
+   }
+
+   // Operand spread over more reads is known when all of them are done
+   if (e->regs_known[src->operand] != (1 << src->count) - 1)
+      return;
+
+   for (ix = 0; ix < src->count; ix++)
+   {
+      sum += regs[ix];
+      full &= (regs[ix] != 0);
+   }
+
+   e->values[src->operand] = sum;
+   e->known |= 1 << src->operand;
+
+   if (full)
+      e->full |= 1 << src->operand;
+   else
+      e->full &= ~(1 << src->operand);
+}
+
+static int virtual_compare(const virtual_register_t *a, const virtual_register_t *b)
+{
+   if (a->unit != b->unit)
+      return a->unit - b->unit;
+
+   return a->reg - b->reg;
+}
+
+static virtual_entry_t *virtual_find(uint8_t unit, uint16_t reg)
+{
+   virtual_register_t key;
+   int lo = 0, hi = entries_cnt, mid, res;
+
+   key.unit = unit;
+   key.reg = reg;
+
+   while (lo < hi)
+   {
+      mid = (lo + hi) / 2;
+      if ((res = virtual_compare(&entries[mid].def, &key)) == 0)
+         return &entries[mid];
+
+      if (res < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return NULL;
+}
+
+int virtual_init(void)
+{
+   entries_cnt = 0;
+   sources_cnt = 0;
+   memset(units, 0, sizeof(units));
+
+   return 0;
+}
+
+int virtual_add(const virtual_register_t *reg)
+{
+   if (entries_cnt == CFG_VIRTUAL_MAX)
+   {
+      TRACE_ERROR("Virtual registers maxnum exceeded");
+      return -1;
+   }
+
+   memset(&entries[entries_cnt], 0, sizeof(virtual_entry_t));
+   entries[entries_cnt++].def = *reg;
+
+   return 0;
+}
+
+// Sort registers and their operands, evaluate them from snapshot and require polling of operands
+int virtual_compile(void)
+{
+   virtual_entry_t tmp;
+   virtual_source_t stmp, *src;
+   const virtual_operand_t *op;
+   int ix, jx, res = 0;
+
+   for (ix = 1; ix < entries_cnt; ix++)
+   {
+      tmp = entries[ix];
+      for (jx = ix; jx > 0 && virtual_compare(&entries[jx - 1].def, &tmp.def) > 0; jx--)
+         entries[jx] = entries[jx - 1];
+      entries[jx] = tmp;
+   }
+
+   memset(units, 0, sizeof(units));
+   sources_cnt = 0;
+
+   for (ix = 0; ix < entries_cnt; ix++)
+   {
+      if (ix > 0 && virtual_compare(&entries[ix - 1].def, &entries[ix].def) == 0)
+      {
+         TRACE_ERROR("Virtual unit 0x%X register %d defined twice", entries[ix].def.unit, entries[ix].def.reg);
+         res = -1;
+      }
+
+      units[entries[ix].def.unit] = 1;
+
+      for (jx = 0; jx < entries[ix].def.operands_cnt; jx++)
+      {
+         op = &entries[ix].def.operands[jx];
+         src = &sources[sources_cnt++];
+         src->unit = op->unit;
+         src->func = op->func;
+         src->start = op->start;
+         src->count = op->count;
+         src->entry = ix;
+         src->operand = jx;
+
+         if (!virtual_registers(op->func))
+            virtual_update(src);
+
+         if (plan_require(op->unit, op->func, op->start, op->count, entries[ix].def.period) < 0)
+            res = -1;
+      }
+
+      virtual_evaluate(&entries[ix]);
+   }
+
+   for (ix = 1; ix < sources_cnt; ix++)
+   {
+      stmp = sources[ix];
+      for (jx = ix; jx > 0 && sources[jx - 1].unit > stmp.unit; jx--)
+         sources[jx] = sources[jx - 1];
+      sources[jx] = stmp;
+   }
+
+   TRACE("Compiled %d virtual registers on %d operands", entries_cnt, sources_cnt);
+
+   return res;
+}
+
+// Remove registers, following virtual_compile() evaluates new ones from snapshot
+void virtual_clear(void)
+{
+   entries_cnt = 0;
+}
+
+int virtual_unit(uint8_t unit)
+{
+   return units[unit];
+}
+
+// Returns -1 when some of registers is not defined, otherwise number of registers not known yet
+int virtual_read(uint8_t unit, uint16_t start, uint16_t count, uint16_t *values)
+{
+   const virtual_entry_t *e;
+   int ix, unknown = 0;
+
+   for (ix = 0; ix < count; ix++)
+   {
+      if ((e = virtual_find(unit, start + ix)) == NULL)
+         return -1;
+
+      unknown += !virtual_valid(e);
+      values[ix] = e->value;
+   }
+
+   return unknown;
+}
+
+// First operand of slave
+static int virtual_first_source(uint8_t unit)
+{
+   int lo = 0, hi = sources_cnt, mid;
+
+   while (lo < hi)
+   {
+      mid = (lo + hi) / 2;
+      if (sources[mid].unit < unit)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
+}
+
+static int virtual_overlap(const virtual_source_t *src, uint8_t func, uint16_t start, uint16_t count)
+{
+   return src->func == func && src->start < start + count && src->start + src->count > start;
+}
+
+// Snapshot of points start .. start + count - 1 changed, update registers using them
+void virtual_process(uint8_t unit, uint8_t func, uint16_t start, uint16_t count)
+{
+   const virtual_source_t *src;
+   int ix;
+
+   for (ix = virtual_first_source(unit); ix < sources_cnt && sources[ix].unit == unit; ix++)
+   {
+      src = &sources[ix];
+      if (!virtual_overlap(src, func, start, count))
+         continue;
+
+      virtual_update(src);
+      virtual_evaluate(&entries[src->entry]);
+   }
+}
+
+// Registers start .. start + count - 1 of slave were read, data as in response
+void virtual_process_registers(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, const uint8_t *data)
+{
+   const virtual_source_t *src;
+   int ix;
+
+   for (ix = virtual_first_source(unit); ix < sources_cnt && sources[ix].unit == unit; ix++)
+   {
+      src = &sources[ix];
+      if (!virtual_overlap(src, func, start, count))
+         continue;
+
+      virtual_update_registers(src, start, count, data);
+      virtual_evaluate(&entries[src->entry]);
+   }
+}
@@ -0,0 +1,51 @@
+#ifndef __VIRTUAL_H
+#define __VIRTUAL_H
+
+#include <stdint.h>
+
+#define VIRTUAL_MAX_OPERANDS        6
+#define VIRTUAL_MAX_REGISTERS       8        // registers of one operand
+#define VIRTUAL_POLL_PERIOD         1000     // ms, default refresh period of operands
+
+// Value of virtual register computed from values of its operands, value of bit
+// operand is number of points on, value of register operand is sum of its registers
+// (unsigned). Results above 0xFFFF are saturated.
+#define VIRTUAL_OP_COUNT            0        // sum of operand values
+#define VIRTUAL_OP_ANY              1        // 1 when some operand value is not 0
+#define VIRTUAL_OP_ALL              2        // 1 when all points are on and all registers are not 0
+#define VIRTUAL_OP_MIN              3        // lowest operand value
+#define VIRTUAL_OP_MAX              4        // highest operand value
+
+// Range of coils, inputs or registers of real slave
+typedef struct
+{
+   uint8_t unit;
+   uint8_t func;              // MODBUS_FUNC_READ_COILS .. MODBUS_FUNC_READ_INPUT_REGISTERS
+   uint16_t start;
+   uint16_t count;
+
+} virtual_operand_t;
+
+typedef struct
+{
+   uint8_t unit;              // virtual slave
+   uint16_t reg;
+   uint8_t op;                // VIRTUAL_OP_...
+   uint8_t operands_cnt;
+   virtual_operand_t operands[VIRTUAL_MAX_OPERANDS];
+   uint32_t period;           // ms, refresh requirement of operands
+
+} virtual_register_t;
+
+
+int virtual_init(void);
+int virtual_add(const virtual_register_t *reg);
+int virtual_compile(void);
+void virtual_clear(void);
+
+int virtual_unit(uint8_t unit);
+int virtual_read(uint8_t unit, uint16_t start, uint16_t count, uint16_t *values);
+void virtual_process(uint8_t unit, uint8_t func, uint16_t start, uint16_t count);
+void virtual_process_registers(uint8_t unit, uint8_t func, uint16_t start, uint16_t count, const uint8_t *data);
+
+#endif // __VIRTUAL_H